@@ -0,0 +1,114 @@
+#include "AllocStats.h"
+#include "ThreadCache.h"
+#include "CentralCache.h"
+#include "PageCache.h"
+#include "CacheArena.h"
+
+void ConcurrentAllocStats(ConcurrentStats* stats)
+{
+	*stats = ConcurrentStats();
+	for (size_t i = 0; i < NLISTS; ++i)
+		stats->_classes[i]._size = SizeClass::Size(i);
+
+	// 先读CentralCache和PageCache，最后读线程的计数
+	PageCacheStats page;
+	stats->_narena = ArenaCreated();
+	for (size_t i = 0; i < stats->_narena; ++i)
+	{
+		ArenaCentralCache(i)->CollectStats(stats->_classes);
+		ArenaPageCache(i)->CollectStats(&page);
+	}
+	stats->_threads = ThreadCache::CollectStats(stats->_classes);
+
+	for (size_t i = 0; i < NLISTS; ++i)
+	{
+		AllocClassStats& c = stats->_classes[i];
+		c._inuse = c._alloc > c._free ? (size_t)(c._alloc - c._free) : 0;
+		stats->_smallinuse += c._inuse * c._size;
+		stats->_threadcached += c._threadcached * c._size;
+		stats->_centralfree += c._centralfree * c._size;
+	}
+	stats->_biginuse = page._bigbytes;
+	stats->_inuse = stats->_smallinuse + stats->_biginuse;
+	stats->_pagefree = page._freepages << PAGE_SHIFT;
+	stats->_mapped = page._mappedpages << PAGE_SHIFT;
+	stats->_released = page._releasedpages << PAGE_SHIFT;
+	stats->_spans = page._spans;
+	stats->_bigobjs = page._bigobjs;
+	for (size_t i = 0; i < NPAGES; ++i)
+		stats->_freespans[i] = page._freespans[i];
+
+	// arena对象用 SystemAlloc 按页申请
+	size_t arenabytes = SizeClass::_Roundup(sizeof(CacheArena), PAGE_SHIFT);
+	stats->_metadata = page._metadata + ThreadCache::PoolBytes() + CentralCache::BatchPoolBytes()
+		+ (stats->_narena - 1) * arenabytes;
+}
+
+void ConcurrentAllocStatsPrint(FILE* out)
+{
+	ConcurrentStats stats;
+	ConcurrentAllocStats(&stats);
+
+	const double MB = 1024.0 * 1024.0;
+	fprintf(out, "in use         %12.2f MB  (small %.2f MB, big %.2f MB in %zu objects)\n",
+		stats._inuse / MB, stats._smallinuse / MB, stats._biginuse / MB, stats._bigobjs);
+	fprintf(out, "thread caches  %12.2f MB  (%zu threads)\n", stats._threadcached / MB, stats._threads);
+	fprintf(out, "central free   %12.2f MB\n", stats._centralfree / MB);
+	fprintf(out, "page free      %12.2f MB\n", stats._pagefree / MB);
+	fprintf(out, "mapped         %12.2f MB\n", stats._mapped / MB);
+	fprintf(out, "released       %12.2f MB\n", stats._released / MB);
+	fprintf(out, "metadata       %12.2f MB  (%zu spans, %zu arenas)\n", stats._metadata / MB, stats._spans, stats._narena);
+
+	fprintf(out, "%8s %12s %12s %10s %10s %10s %8s\n", "size", "alloc", "free", "inuse", "cached", "central", "spans");
+	for (size_t i = 0; i < NLISTS; ++i)
+	{
+		const AllocClassStats& c = stats._classes[i];
+		if (c._alloc == 0 && c._spans == 0)
+			continue;
+		fprintf(out, "%8zu %12llu %12llu %10zu %10zu %10zu %8zu\n", c._size,
+			(unsigned long long)c._alloc, (unsigned long long)c._free, c._inuse, c._threadcached, c._centralfree, c._spans);
+	}
+
+	fprintf(out, "free spans (pages:count)");
+	for (size_t i = 1; i < NPAGES; ++i)
+	{
+		if (stats._freespans[i] != 0)
+			fprintf(out, " %zu:%zu", i, stats._freespans[i]);
+	}
+	fprintf(out, "\n");
+}
+
+void ConcurrentAllocStatsPrintJson(FILE* out)
+{
+	ConcurrentStats stats;
+	ConcurrentAllocStats(&stats);
+
+	fprintf(out, "{\"inuse\":%zu,\"small_inuse\":%zu,\"big_inuse\":%zu,\"thread_cached\":%zu,"
+		"\"central_free\":%zu,\"page_free\":%zu,\"mapped\":%zu,\"released\":%zu,\"metadata\":%zu,"
+		"\"arenas\":%zu,\"threads\":%zu,\"spans\":%zu,\"big_objects\":%zu,\"classes\":[",
+		stats._inuse, stats._smallinuse, stats._biginuse, stats._threadcached,
+		stats._centralfree, stats._pagefree, stats._mapped, stats._released, stats._metadata,
+		stats._narena, stats._threads, stats._spans, stats._bigobjs);
+	bool first = true;
+	for (size_t i = 0; i < NLISTS; ++i)
+	{
+		const AllocClassStats& c = stats._classes[i];
+		if (c._alloc == 0 && c._spans == 0)
+			continue;
+		fprintf(out, "%s{\"size\":%zu,\"alloc\":%llu,\"free\":%llu,\"inuse\":%zu,\"thread_cached\":%zu,"
+			"\"central_free\":%zu,\"spans\":%zu,\"span_pages\":%zu}", first ? "" : ",", c._size,
+			(unsigned long long)c._alloc, (unsigned long long)c._free, c._inuse, c._threadcached,
+			c._centralfree, c._spans, c._spanpages);
+		first = false;
+	}
+	fprintf(out, "],\"free_spans\":{");
+	first = true;
+	for (size_t i = 1; i < NPAGES; ++i)
+	{
+		if (stats._freespans[i] == 0)
+			continue;
+		fprintf(out, "%s\"%zu\":%zu", first ? "" : ",", i, stats._freespans[i]);
+		first = false;
+	}
+	fprintf(out, "}}\n");
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "Common.h"
+
+#include <atomic>
+#include <cstdio>
+
+// 运行时统计：全局内存池(所有arena，不包括私有堆)持有多少内存、在哪一层
+//     ConcurrentStats stats;
+//     ConcurrentAllocStats(&stats);
+//     ConcurrentAllocStatsPrint(stdout);      // 文本
+//     ConcurrentAllocStatsPrintJson(stdout);  // JSON
+// 申请/释放的计数在每个线程的ThreadCache中，只有本线程修改，读取统计时才把所有线程的计数加起来
+// CentralCache 和 PageCache 的空闲内存在读取统计时加锁遍历链表得到，快速路径上没有额外的开销
+// 各层的数字不是在同一时刻得到的，有其他线程在申请释放时只是近似值
+
+// 只有一个线程写、别的线程可以随时读的计数器，写的时候不需要原子的读-改-写(加锁的指令)
+class StatCounter
+{
+public:
+	constexpr StatCounter() {}
+
+	void Add(uint64_t n)
+	{
+		_value.store(_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	uint64_t Get() const
+	{
+		return _value.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<uint64_t> _value{ 0 };
+};
+
+// 一个ThreadCache的计数，都是对象个数，按大小类(SizeClass::Index)
+// ThreadCache中缓存的对象个数 = _fetch + _free - _alloc - _release
+struct ThreadCacheStats
+{
+	StatCounter _alloc[NLISTS];//申请
+	StatCounter _free[NLISTS];//释放
+	StatCounter _fetch[NLISTS];//从CentralCache取
+	StatCounter _release[NLISTS];//还给CentralCache
+};
+
+// 一个大小类
+struct AllocClassStats
+{
+	size_t _size = 0;//对象大小
+	uint64_t _alloc = 0;//累计申请的次数
+	uint64_t _free = 0;//累计释放的次数
+	size_t _inuse = 0;//正在使用的对象个数
+	size_t _threadcached = 0;//所有ThreadCache中缓存的对象个数
+	size_t _centralfree = 0;//CentralCache的span中(包括无锁栈中)空闲的对象个数
+	size_t _spans = 0;//CentralCache中的span个数
+	size_t _spanpages = 0;//这些span的页数
+};
+
+// 字节数都是当前的值，_released 是累计值
+struct ConcurrentStats
+{
+	size_t _inuse = 0;//正在使用的字节数，小对象按大小类的大小计算
+	size_t _smallinuse = 0;
+	size_t _biginuse = 0;//大对象，按页取整
+	size_t _threadcached = 0;//ThreadCache中缓存的
+	size_t _centralfree = 0;//CentralCache中空闲的
+	size_t _pagefree = 0;//PageCache中空闲的页
+	size_t _mapped = 0;//向系统申请、还没有归还的(USE_SEGMENT 时不包括段头)
+	size_t _released = 0;//累计还给系统的
+	size_t _metadata = 0;//元数据(Span、ThreadCache、批量描述符、arena)向系统申请的，不包括页号映射
+
+	size_t _narena = 0;//已经创建的arena个数
+	size_t _threads = 0;//现有的ThreadCache个数
+	size_t _spans = 0;//正在使用的Span对象个数(包括PageCache中空闲的span)
+	size_t _bigobjs = 0;//正在使用的大对象个数
+
+	AllocClassStats _classes[NLISTS];
+	size_t _freespans[NPAGES] = {};//PageCache中每种页数的空闲span个数
+};
+
+void ConcurrentAllocStats(ConcurrentStats* stats);
+// 输出合计、有申请过的大小类和PageCache中的空闲span
+void ConcurrentAllocStatsPrint(FILE* out);
+void ConcurrentAllocStatsPrintJson(FILE* out);
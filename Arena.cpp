@@ -0,0 +1,76 @@
+#include "Arena.h"
+
+void* Arena::AllocSlow(size_t size, size_t align)
+{
+	// 当前span放不下，获取一个新的span；超过一个标准span大小的申请单独获取一个span
+	size_t need = size + (align > ((size_t)1 << PAGE_SHIFT) ? align : 0);
+	size_t npage = SizeClass::_Roundup(need == 0 ? 1 : need, PAGE_SHIFT) >> PAGE_SHIFT;
+	Span* span = GetSpan(npage > _npage ? npage : _npage);
+
+	span->_next = _spans;
+	_spans = span;
+	++_nspans;
+
+	_cur = (char*)(span->_pageid << PAGE_SHIFT);
+	_end = SpanEnd(span);
+
+	char* ptr = (char*)(((size_t)_cur + align - 1) & ~(align - 1));
+	assert(ptr + size <= _end);
+	_cur = ptr + size;
+	return ptr;
+}
+
+void Arena::Rewind(const Mark& mark)
+{
+	while (_spans != mark._span)
+	{
+		assert(_spans != nullptr);
+		Span* span = _spans;
+		_spans = span->_next;
+		--_nspans;
+		ReleaseSpan(span);
+	}
+
+	if (_spans == nullptr)
+	{
+		_cur = _end = nullptr;
+	}
+	else
+	{
+		_cur = mark._cur;
+		_end = SpanEnd(_spans);
+	}
+}
+
+Span* Arena::GetSpan(size_t npage)
+{
+	if (npage == ARENA_SPAN_PAGES)
+	{
+		if (tlslist == nullptr)
+			tlslist = ThreadCache::Create();
+		Span* span = tlslist->PopArenaSpan();
+		if (span != nullptr)
+			return span;
+	}
+
+	Span* span;
+	if (npage < NPAGES)
+		span = PageCache::GetInstence()->NewSpan(npage);
+	else
+		span = PageCache::GetInstence()->AllocBigPageObj(npage << PAGE_SHIFT);
+	// Arena的内存不能用ConcurrentFree释放
+	span->_objsize = 0;
+	return span;
+}
+
+void Arena::ReleaseSpan(Span* span)
+{
+	span->_next = nullptr;
+	if (span->_npage == ARENA_SPAN_PAGES && tlslist != nullptr && tlslist->PushArenaSpan(span))
+		return;
+
+	if (span->_npage < NPAGES)
+		PageCache::GetInstence()->ReleaseSpanToPageCache(span);
+	else
+		PageCache::GetInstence()->FreeBigPageObj((void*)(span->_pageid << PAGE_SHIFT), span);
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "Common.h"
+#include "ThreadCache.h"
+#include "PageCache.h"
+
+#include <utility>
+
+// 每个Arena span的页数，这个大小的span释放时缓存在ThreadCache中
+const size_t ARENA_SPAN_PAGES = 16;
+
+// 区域分配器：直接从PageCache获取span，在span内部移动指针分配内存
+// 分配出去的内存不能单独释放，Reset或析构时把所有span一次性还回去，代价只和span的个数有关
+// 适合一次请求内申请大量小对象、请求结束时一起释放的场景：
+//     Arena arena;
+//     Request* req = arena.New<Request>(...);
+//     Arena::Mark mark = arena.GetMark();
+//     ... 临时对象 ...
+//     arena.Rewind(mark);   // 释放mark之后申请的内存
+// 注意：Arena不会调用对象的析构函数；Arena本身不是线程安全的
+class Arena
+{
+public:
+	// 记录某一时刻的分配位置，Rewind时回到这个位置
+	struct Mark
+	{
+		Span* _span;
+		char* _cur;
+	};
+
+	explicit Arena(size_t npage = ARENA_SPAN_PAGES) : _npage(npage)
+	{
+		assert(npage > 0 && npage < NPAGES);
+	}
+
+	~Arena()
+	{
+		Reset();
+	}
+
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+
+	// align 必须是2的幂
+	void* Alloc(size_t size, size_t align = sizeof(void*))
+	{
+		char* ptr = (char*)(((size_t)_cur + align - 1) & ~(align - 1));
+		if (LIKELY(ptr + size <= _end && _cur != nullptr))
+		{
+			_cur = ptr + size;
+			return ptr;
+		}
+		return AllocSlow(size, align);
+	}
+
+	template<class T, class... Args>
+	T* New(Args&&... args)
+	{
+		return new (Alloc(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+	}
+
+	Mark GetMark() const
+	{
+		return Mark{ _spans, _cur };
+	}
+
+	// 释放mark之后申请的内存，mark之后获取的span全部归还
+	void Rewind(const Mark& mark);
+
+	// 释放所有内存
+	void Reset()
+	{
+		Rewind(Mark{ nullptr, nullptr });
+	}
+
+	// 当前持有的span个数
+	size_t SpanCount() const
+	{
+		return _nspans;
+	}
+
+private:
+	void* AllocSlow(size_t size, size_t align);
+
+	// 获取一个至少npage页的span，标准大小的span优先从ThreadCache的缓存中取
+	Span* GetSpan(size_t npage);
+	void ReleaseSpan(Span* span);
+
+	static char* SpanEnd(Span* span)
+	{
+		return (char*)((span->_pageid + span->_npage) << PAGE_SHIFT);
+	}
+
+private:
+	size_t _npage;
+	Span* _spans = nullptr; // 用Span::_next链起来，最新获取的在最前面
+	size_t _nspans = 0;
+	char* _cur = nullptr; // 当前span中下一个可用的地址
+	char* _end = nullptr;
+};
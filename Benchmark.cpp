@@ -1,142 +1,632 @@
 #include "Common.h"
 #include "ConcurrentAlloc.h"
+#include "LatencyStats.h"
+#include "PerfCounters.h"
 
-// #define SHOWTIME
+#include <chrono>
+#include <cstring>
 
-#define SHOWMESSAGE do {\
-	printf("%lu threads concurrent execute %lu rounds, concurrent alloc %lu times per round: cost:%lu ms\n", nworks, rounds, ntimes, malloc_costtime);\
-	printf("%lu threads %lu rounds, concurrent dealloc %lu times per round : cost: %lu ms\n",nworks, rounds, ntimes, free_costtime);\
-	printf("%lu threads concurrent alloc&dealloc %lu times, cost total: %lu ms\n",nworks, nworks*rounds*ntimes, malloc_costtime + free_costtime);\
-} while(0)
+#ifdef _WIN32
+#include <intrin.h>
+#else
+#include <dlfcn.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#endif
+
+// 多种负载下对比内存池和其他分配器的吞吐量和每次申请/释放的耗时分位数
+//     larson     Larson：每个线程随机替换自己槽位中的小对象，每轮换一批新线程接手上一轮别的线程的槽位
+//     prodcons   生产者-消费者：一半线程申请，通过队列交给另一半线程释放(跨线程释放)
+//     random     随机大小：按偏向小对象的分布申请，随机替换一个窗口中的对象
+//     realloc    realloc 增长：几个缓冲区轮流按 1.5 倍 realloc 到 256KB 再释放
+//     fragment   长时间运行的碎片化负载：交替增长和收缩活跃对象集合，每个阶段换一种大小范围
+// 用法：test [负载名|all] [最多的线程数，默认是核数] [每个线程的操作次数，默认200000] [perf]
+// 线程数从1开始每次翻倍(prodcons 从2开始)；对比的分配器有内存池、glibc malloc，以及本机装有的 jemalloc、tcmalloc(dlopen 加载)
+// 每次操作单独计时(x86 上用 rdtsc，按 steady_clock 校准)，计时的开销对所有分配器相同，吞吐量里也包含它
+// 每个线程记录到自己的直方图(见 LatencyStats.h)，跑完之后再合并，线程之间不共享计数
+// 加上 perf 时每次运行后再输出一行硬件计数器(见 PerfCounters.h)：每对申请/释放的指令数、周期数、L1d/LLC/dTLB 读缺失和分支预测失败，
+// 只计用户态，包含计时和负载本身的开销，用于分配器之间对比；计数器打不开时显示 -，打不开任何一个时只提示一次
+
+#ifdef USE_RADIX_TREE
+// 基数树映射下大对象很慢，只测到 32KB
+const size_t BENCH_MAX_SIZE = 32 * 1024;
+#else
+const size_t BENCH_MAX_SIZE = 256 * 1024;
+#endif
 
-static std::pair<size_t, size_t> BenchmarkMalloc(size_t ntimes, size_t nworks, size_t rounds,size_t mem_size)
+// 计时：rdtsc 的周期数乘以校准得到的每周期纳秒数
+static double bench_ns_per_tick = 1.0;
+
+static inline uint64_t BenchNow()
 {
-	std::vector<std::thread> vthread(nworks);
-	size_t malloc_costtime = 0;
-	size_t free_costtime = 0;
-	for (size_t k = 0; k < nworks; ++k)
+#if defined(_WIN32) || defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return LatencyNow();
+#endif
+}
+
+static void CalibrateClock()
+{
+#if defined(_WIN32) || defined(__x86_64__) || defined(__i386__)
+	auto begin = std::chrono::steady_clock::now();
+	uint64_t t0 = BenchNow();
+	while (std::chrono::steady_clock::now() - begin < std::chrono::milliseconds(50))
+		;
+	uint64_t t1 = BenchNow();
+	double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+	bench_ns_per_tick = ns / (double)(t1 - t0);
+#endif
+}
+
+static inline uint64_t TicksToNs(uint64_t ticks)
+{
+	return (uint64_t)(ticks * bench_ns_per_tick);
+}
+
+// 每个线程的随机数，所有分配器使用相同的种子
+class BenchRandom
+{
+public:
+	explicit BenchRandom(uint64_t seed) : _state(seed * 0x9E3779B97F4A7C15ull + 1) {}
+
+	uint64_t Next()
 	{
-		vthread[k] = std::thread([&, k]() {
-			std::vector<void*> v;
-			v.reserve(ntimes);
-			for (size_t j = 0; j < rounds; ++j)
+		_state ^= _state << 13;
+		_state ^= _state >> 7;
+		_state ^= _state << 17;
+		return _state;
+	}
+
+	// [low, high]
+	size_t Range(size_t low, size_t high)
+	{
+		return low + (size_t)(Next() % (high - low + 1));
+	}
+
+private:
+	uint64_t _state;
+};
+
+// 被测的分配器，realloc 传入原来的大小，内存池不需要查找
+struct Allocator
+{
+	const char* _name;
+	void* (*_alloc)(size_t size);
+	void (*_free)(void* ptr);
+	void* (*_realloc)(void* ptr, size_t oldsize, size_t size);
+};
+
+static void* PoolAlloc(size_t size)
+{
+	return ConcurrentAlloc(size);
+}
+
+static void PoolFree(void* ptr)
+{
+	ConcurrentFree(ptr);
+}
+
+// 和 MallocOverride.cpp 中的 realloc 相同：原来的空间够用而且不浪费一半以上时原地返回
+static void* PoolRealloc(void* ptr, size_t oldsize, size_t size)
+{
+	size_t usable = ConcurrentUsableSize(ptr);
+	if (size <= usable && size >= usable / 2)
+		return ptr;
+	void* newptr = ConcurrentAlloc(size);
+	memcpy(newptr, ptr, oldsize < size ? oldsize : size);
+	ConcurrentFree(ptr);
+	return newptr;
+}
+
+static void* LibcAlloc(size_t size)
+{
+	return malloc(size);
+}
+
+static void LibcFree(void* ptr)
+{
+	free(ptr);
+}
+
+static void* LibcRealloc(void* ptr, size_t, size_t size)
+{
+	return realloc(ptr, size);
+}
+
+// dlopen 加载的分配器，用各自带前缀的接口，不影响进程自己的 malloc
+#ifndef _WIN32
+static void* (*je_mallocx)(size_t, int);
+static void (*je_dallocx)(void*, int);
+static void* (*je_rallocx)(void*, size_t, int);
+
+static void* JeAlloc(size_t size)
+{
+	return je_mallocx(size, 0);
+}
+
+static void JeFree(void* ptr)
+{
+	je_dallocx(ptr, 0);
+}
+
+static void* JeRealloc(void* ptr, size_t, size_t size)
+{
+	return je_rallocx(ptr, size, 0);
+}
+
+static void* (*tc_malloc_fn)(size_t);
+static void (*tc_free_fn)(void*);
+static void* (*tc_realloc_fn)(void*, size_t);
+
+static void* TcAlloc(size_t size)
+{
+	return tc_malloc_fn(size);
+}
+
+static void TcFree(void* ptr)
+{
+	tc_free_fn(ptr);
+}
+
+static void* TcRealloc(void* ptr, size_t, size_t size)
+{
+	return tc_realloc_fn(ptr, size);
+}
+
+static void* OpenLibrary(const char* const* names)
+{
+	for (; *names != nullptr; ++names)
+	{
+		if (void* handle = dlopen(*names, RTLD_NOW | RTLD_LOCAL))
+			return handle;
+	}
+	return nullptr;
+}
+#endif
+
+static std::vector<Allocator> FindAllocators()
+{
+	std::vector<Allocator> allocators;
+	allocators.push_back({ "concurrent", PoolAlloc, PoolFree, PoolRealloc });
+	allocators.push_back({ "glibc", LibcAlloc, LibcFree, LibcRealloc });
+#ifndef _WIN32
+	static const char* const jemalloc_names[] = { "libjemalloc.so.2", "libjemalloc.so", nullptr };
+	if (void* je = OpenLibrary(jemalloc_names))
+	{
+		je_mallocx = (void* (*)(size_t, int))dlsym(je, "mallocx");
+		je_dallocx = (void (*)(void*, int))dlsym(je, "dallocx");
+		je_rallocx = (void* (*)(void*, size_t, int))dlsym(je, "rallocx");
+		if (je_mallocx && je_dallocx && je_rallocx)
+			allocators.push_back({ "jemalloc", JeAlloc, JeFree, JeRealloc });
+	}
+	static const char* const tcmalloc_names[] = { "libtcmalloc_minimal.so.4", "libtcmalloc.so.4",
+		"libtcmalloc_minimal.so", "libtcmalloc.so", nullptr };
+	if (void* tc = OpenLibrary(tcmalloc_names))
+	{
+		tc_malloc_fn = (void* (*)(size_t))dlsym(tc, "tc_malloc");
+		tc_free_fn = (void (*)(void*))dlsym(tc, "tc_free");
+		tc_realloc_fn = (void* (*)(void*, size_t))dlsym(tc, "tc_realloc");
+		if (tc_malloc_fn && tc_free_fn && tc_realloc_fn)
+			allocators.push_back({ "tcmalloc", TcAlloc, TcFree, TcRealloc });
+	}
+#endif
+	return allocators;
+}
+
+// 一个线程的结果，只有这个线程写
+struct ThreadResult
+{
+	uint64_t _ops = 0;//申请和释放(realloc)的次数
+	LatencyHistogram _alloc;//申请和 realloc
+	LatencyHistogram _free;
+};
+
+// 计时执行一次申请/释放，写一个字节，避免只测到没有碰过的地址
+static inline void* TimedAlloc(const Allocator& a, size_t size, ThreadResult& r)
+{
+	uint64_t begin = BenchNow();
+	void* ptr = a._alloc(size);
+	r._alloc.Record(TicksToNs(BenchNow() - begin));
+	++r._ops;
+	*(char*)ptr = 1;
+	return ptr;
+}
+
+static inline void TimedFree(const Allocator& a, void* ptr, ThreadResult& r)
+{
+	uint64_t begin = BenchNow();
+	a._free(ptr);
+	r._free.Record(TicksToNs(BenchNow() - begin));
+	++r._ops;
+}
+
+// 所有线程准备好之后同时开始
+class StartGate
+{
+public:
+	void Wait()
+	{
+		while (!_open.load(std::memory_order_acquire))
+			std::this_thread::yield();
+	}
+
+	void Open()
+	{
+		_open.store(true, std::memory_order_release);
+	}
+
+private:
+	std::atomic<bool> _open{ false };
+};
+
+// 负载：nthreads 个线程，每个线程大约 ops 次操作，结果写到 results[线程]，返回实际使用的线程数
+// (prodcons 的线程数向下取偶数)
+typedef size_t (*Workload)(const Allocator& a, size_t nthreads, size_t ops, ThreadResult* results);
+
+static size_t Larson(const Allocator& a, size_t nthreads, size_t ops, ThreadResult* results)
+{
+	const size_t SLOTS = 1000, ROUNDS = 10;
+	std::vector<std::vector<void*>> slots(nthreads, std::vector<void*>(SLOTS));
+	BenchRandom init(12345);
+	for (auto& v : slots)
+	{
+		for (void*& ptr : v)
+			ptr = a._alloc(init.Range(8, 512));
+	}
+
+	// 每轮的新线程接手另一个线程的槽位，释放的对象大多是别的线程申请的
+	for (size_t round = 0; round < ROUNDS; ++round)
+	{
+		std::vector<std::thread> threads;
+		for (size_t k = 0; k < nthreads; ++k)
+		{
+			threads.emplace_back([&, k]() {
+				std::vector<void*>& v = slots[(k + round) % nthreads];
+				BenchRandom rng(k * ROUNDS + round);
+				ThreadResult& r = results[k];
+				for (size_t i = 0; i < ops / 2 / ROUNDS; ++i)
+				{
+					size_t idx = rng.Range(0, SLOTS - 1);
+					TimedFree(a, v[idx], r);
+					v[idx] = TimedAlloc(a, rng.Range(8, 512), r);
+				}
+			});
+		}
+		for (auto& t : threads)
+			t.join();
+	}
+
+	for (auto& v : slots)
+	{
+		for (void* ptr : v)
+			a._free(ptr);
+	}
+	return nthreads;
+}
+
+// 单生产者单消费者的环形队列
+class BenchQueue
+{
+public:
+	bool Push(void* ptr)
+	{
+		size_t tail = _tail.load(std::memory_order_relaxed);
+		if (tail - _head.load(std::memory_order_acquire) == CAPACITY)
+			return false;
+		_slots[tail % CAPACITY] = ptr;
+		_tail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	void* Pop()
+	{
+		size_t head = _head.load(std::memory_order_relaxed);
+		if (head == _tail.load(std::memory_order_acquire))
+			return nullptr;
+		void* ptr = _slots[head % CAPACITY];
+		_head.store(head + 1, std::memory_order_release);
+		return ptr;
+	}
+
+private:
+	static const size_t CAPACITY = 1024;
+	void* _slots[CAPACITY];
+	alignas(64) std::atomic<size_t> _head{ 0 };
+	alignas(64) std::atomic<size_t> _tail{ 0 };
+};
+
+static size_t ProducerConsumer(const Allocator& a, size_t nthreads, size_t ops, ThreadResult* results)
+{
+	size_t npairs = nthreads / 2 > 0 ? nthreads / 2 : 1;
+	std::vector<BenchQueue> queues(npairs);
+	StartGate gate;
+	std::vector<std::thread> threads;
+	for (size_t p = 0; p < npairs; ++p)
+	{
+		threads.emplace_back([&, p]() {
+			BenchRandom rng(p);
+			ThreadResult& r = results[2 * p];
+			gate.Wait();
+			for (size_t i = 0; i < ops; ++i)
+			{
+				void* ptr = TimedAlloc(a, rng.Range(16, 1024), r);
+				while (!queues[p].Push(ptr))
+					std::this_thread::yield();
+			}
+		});
+		threads.emplace_back([&, p]() {
+			ThreadResult& r = results[2 * p + 1];
+			gate.Wait();
+			for (size_t i = 0; i < ops; ++i)
+			{
+				void* ptr;
+				while ((ptr = queues[p].Pop()) == nullptr)
+					std::this_thread::yield();
+				TimedFree(a, ptr, r);
+			}
+		});
+	}
+	gate.Open();
+	for (auto& t : threads)
+		t.join();
+	return npairs * 2;
+}
+
+// 大多数是小对象：70% 8~128，20% 到 1KB，8% 到 16KB，2% 到 BENCH_MAX_SIZE
+static size_t RandomSize(BenchRandom& rng)
+{
+	size_t r = rng.Range(0, 99);
+	if (r < 70)
+		return rng.Range(8, 128);
+	if (r < 90)
+		return rng.Range(129, 1024);
+	if (r < 98)
+		return rng.Range(1025, 16 * 1024);
+	return rng.Range(16 * 1024 + 1, BENCH_MAX_SIZE);
+}
+
+static size_t RandomSizes(const Allocator& a, size_t nthreads, size_t ops, ThreadResult* results)
+{
+	const size_t WINDOW = 4096;
+	StartGate gate;
+	std::vector<std::thread> threads;
+	for (size_t k = 0; k < nthreads; ++k)
+	{
+		threads.emplace_back([&, k]() {
+			std::vector<void*> v(WINDOW);
+			BenchRandom rng(k);
+			ThreadResult& r = results[k];
+			gate.Wait();
+			for (size_t i = 0; i < ops / 2; ++i)
+			{
+				size_t idx = rng.Range(0, WINDOW - 1);
+				if (v[idx] != nullptr)
+					TimedFree(a, v[idx], r);
+				v[idx] = TimedAlloc(a, RandomSize(rng), r);
+			}
+			for (void* ptr : v)
+			{
+				if (ptr != nullptr)
+					a._free(ptr);
+			}
+		});
+	}
+	gate.Open();
+	for (auto& t : threads)
+		t.join();
+	return nthreads;
+}
+
+static size_t ReallocGrowth(const Allocator& a, size_t nthreads, size_t ops, ThreadResult* results)
+{
+	const size_t NBUF = 4;
+	const size_t MAX_SIZE = BENCH_MAX_SIZE;
+	StartGate gate;
+	std::vector<std::thread> threads;
+	for (size_t k = 0; k < nthreads; ++k)
+	{
+		threads.emplace_back([&, k]() {
+			void* buf[NBUF] = {};
+			size_t size[NBUF] = {};
+			ThreadResult& r = results[k];
+			gate.Wait();
+			for (size_t i = 0; i < ops; ++i)
 			{
-				
-				for (size_t i = 0; i < ntimes; i++)
+				size_t b = i % NBUF;
+				if (buf[b] == nullptr)
 				{
-					clock_t begin1 = clock();
-					void *ptr=malloc(mem_size);
-					clock_t end1 = clock();
-					malloc_costtime+=end1-begin1;
-					v.push_back(ptr);
+					size[b] = 16 + b * 8;
+					buf[b] = TimedAlloc(a, size[b], r);
+					continue;
 				}
-				
-				clock_t begin2 = clock();
-				for (size_t i = 0; i < ntimes; i++)
+				size_t newsize = size[b] + size[b] / 2;
+				if (newsize > MAX_SIZE)
 				{
-					free(v[i]);
+					TimedFree(a, buf[b], r);
+					buf[b] = nullptr;
+					continue;
 				}
-				clock_t end2 = clock();
-				v.clear();
-				free_costtime += end2 - begin2;
+				uint64_t begin = BenchNow();
+				buf[b] = a._realloc(buf[b], size[b], newsize);
+				r._alloc.Record(TicksToNs(BenchNow() - begin));
+				++r._ops;
+				((char*)buf[b])[newsize - 1] = 1;
+				size[b] = newsize;
+			}
+			for (void* ptr : buf)
+			{
+				if (ptr != nullptr)
+					a._free(ptr);
 			}
 		});
 	}
-	for (size_t k = 0; k < nworks; ++k) vthread[k].join();
-
-#ifdef SHOWTIME
-	SHOWMESSAGE;
-#endif // SHOWTIME
-
-	return std::make_pair(malloc_costtime, free_costtime);
+	gate.Open();
+	for (auto& t : threads)
+		t.join();
+	return nthreads;
 }
 
-// 单轮次申请释放次数 线程数 轮次
-static std::pair<size_t,size_t> BenchmarkConcurrentMalloc(size_t ntimes, size_t nworks, size_t rounds, size_t mem_size)
+// 每个阶段 PHASE 次操作，增长阶段 70% 是申请，收缩阶段 30% 是申请，释放的是活跃集合中随机的对象
+// 大小范围按阶段轮换，前一阶段留下的对象把span钉住，后一阶段的对象很难复用它们
+static size_t Fragmentation(const Allocator& a, size_t nthreads, size_t ops, ThreadResult* results)
 {
-	std::vector<std::thread> vthread(nworks);
-	size_t malloc_costtime = 0;
-	size_t free_costtime = 0;
-	
-	void *ptr=ConcurrentAlloc(512*1024);
-	ConcurrentFree(ptr);
-	for (size_t k = 0; k < nworks; ++k)
+	const size_t PHASE = 20000;
+	static const size_t ranges[][2] = { { 16, 64 }, { 1024, 4096 }, { 64, 256 }, { 8192, 32768 }, { 256, 1024 } };
+	const size_t NRANGES = sizeof(ranges) / sizeof(ranges[0]);
+	StartGate gate;
+	std::vector<std::thread> threads;
+	for (size_t k = 0; k < nthreads; ++k)
 	{
-		vthread[k] = std::thread([&]() {
-			std::vector<void*> v;
-			v.reserve(ntimes);
-			for (size_t j = 0; j < rounds; ++j)
+		threads.emplace_back([&, k]() {
+			std::vector<void*> live;
+			BenchRandom rng(k);
+			ThreadResult& r = results[k];
+			gate.Wait();
+			// 长时间运行：操作次数是其他负载的4倍
+			for (size_t i = 0; i < ops * 4; ++i)
 			{
-				for (size_t i = 0; i < ntimes; i++)
+				size_t phase = i / PHASE;
+				size_t allocpct = phase % 2 == 0 ? 70 : 30;
+				const size_t* range = ranges[(phase / 2) % NRANGES];
+				if (live.empty() || rng.Range(0, 99) < allocpct)
 				{
-					clock_t begin1 = clock();
-					void *ptr=ConcurrentAlloc(mem_size);
-					clock_t end1 = clock();
-					malloc_costtime += end1 - begin1;
-					v.push_back(ptr);
+					live.push_back(TimedAlloc(a, rng.Range(range[0], range[1]), r));
 				}
-				
-				clock_t begin2 = clock();
-				for (size_t i = 0; i < ntimes; i++)
+				else
 				{
-					ConcurrentFree(v[i]);
+					size_t idx = rng.Range(0, live.size() - 1);
+					TimedFree(a, live[idx], r);
+					live[idx] = live.back();
+					live.pop_back();
 				}
-				clock_t end2 = clock();
-				v.clear();
-				free_costtime += end2 - begin2;
 			}
+			for (void* ptr : live)
+				a._free(ptr);
 		});
 	}
+	gate.Open();
+	for (auto& t : threads)
+		t.join();
+	return nthreads;
+}
 
-	for (size_t k = 0; k < nworks; ++k) vthread[k].join();
+struct WorkloadEntry
+{
+	const char* _name;
+	Workload _run;
+	size_t _minthreads;//prodcons 至少要一对线程
+};
 
-#ifdef SHOWTIME
-	SHOWMESSAGE;
-#endif // SHOWTIME
+static const WorkloadEntry workloads[] = {
+	{ "larson", Larson, 1 },
+	{ "prodcons", ProducerConsumer, 2 },
+	{ "random", RandomSizes, 1 },
+	{ "realloc", ReallocGrowth, 1 },
+	{ "fragment", Fragmentation, 1 },
+};
 
-	return std::make_pair(malloc_costtime, free_costtime);
-}
+// 在创建任何工作线程之前打开，之后的线程都继承
+static PerfCounters bench_perf;
+static bool bench_perf_on = false;
 
+// 每对申请/释放的硬件计数
+static void PrintPerf(const PerfSnapshot& before, const PerfSnapshot& after, uint64_t total)
+{
+	double pairs = total / 2.0;
+	fprintf(stdout, "%-9s %-11s %3s %9s |", "", "perf/pair", "", "");
+	for (size_t i = 0; i < PERF_EVENTS; ++i)
+	{
+		double value;
+		if (pairs > 0 && after.Delta(before, (PerfEvent)i, &value))
+			fprintf(stdout, " %s %.2f", PerfCounters::Name((PerfEvent)i), value / pairs);
+		else
+			fprintf(stdout, " %s -", PerfCounters::Name((PerfEvent)i));
+	}
+	fprintf(stdout, "\n");
+}
 
-static void test(int ntimes,int nthreads,int rounds,int mem_size)
+static void RunOne(const WorkloadEntry& w, const Allocator& a, size_t nthreads, size_t ops)
 {
-	//cout << "==========================================================" << endl;
-	cout << "memory size " << mem_size << "Byte" << endl;
-	std::pair<size_t, size_t> pm = BenchmarkMalloc(ntimes, nthreads, rounds, mem_size);
-	std::pair<size_t, size_t> pc = BenchmarkConcurrentMalloc(ntimes, nthreads, rounds, mem_size);
+	std::vector<ThreadResult> results(nthreads);
+	PerfSnapshot perfbefore;
+	if (bench_perf_on)
+		perfbefore = bench_perf.Read();
+	auto begin = std::chrono::steady_clock::now();
+	size_t used = w._run(a, nthreads, ops, results.data());
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	PerfSnapshot perfafter;
+	if (bench_perf_on)
+		perfafter = bench_perf.Read();
 
-	cout << "bench rate concurrentalloc/malloc=" << (double)(pm.first +  0.000000000000000001) / (double)(pc.first +  0.000000000000000001) << endl;//加1防止出现除以0
-	cout << "bench rate concurrentdealloc/free=" << (double)(pm.second + 0.000000000000000001) / (double)(pc.second + 0.000000000000000001) << endl;
-	cout << "total bench rate =" << (double)(pm.first + pm.second + 0.000000000000000001) / (double)(pc.first + pc.second + 0.000000000000000001) << endl;
-	//cout << "==========================================================" << endl;
-	cout << endl;
+	// 合并各线程的结果
+	uint64_t total = 0;
+	std::vector<uint64_t> alloc(LATENCY_BUCKETS), freed(LATENCY_BUCKETS);
+	for (size_t k = 0; k < used; ++k)
+	{
+		total += results[k]._ops;
+		results[k]._alloc.AddTo(alloc.data());
+		results[k]._free.AddTo(freed.data());
+	}
+	fprintf(stdout, "%-9s %-11s %3zu %9.2f | %6llu %6llu %7llu %9llu | %6llu %6llu %7llu %9llu\n",
+		w._name, a._name, used, total / seconds / 1e6,
+		(unsigned long long)LatencyPercentile(alloc.data(), 0.5), (unsigned long long)LatencyPercentile(alloc.data(), 0.99),
+		(unsigned long long)LatencyPercentile(alloc.data(), 0.999), (unsigned long long)LatencyPercentile(alloc.data(), 1.0),
+		(unsigned long long)LatencyPercentile(freed.data(), 0.5), (unsigned long long)LatencyPercentile(freed.data(), 0.99),
+		(unsigned long long)LatencyPercentile(freed.data(), 0.999), (unsigned long long)LatencyPercentile(freed.data(), 1.0));
+	if (bench_perf_on)
+		PrintPerf(perfbefore, perfafter, total);
+	fflush(stdout);
 }
 
-int main()
+int main(int argc, char* argv[])
 {
-#ifdef _WIN32
-	system("cls");
-#else
-	system("clear");
-#endif
-	int ntimes = 10;//每个线程申请的次数
-	int nthreads = 5;//线程的个数
-	int rounds = 50;//执行的轮次
-	int mem_size = 16 * 1024;
+	const char* which = argc > 1 ? argv[1] : "all";
+	size_t maxthreads = argc > 2 ? strtoul(argv[2], nullptr, 10) : std::thread::hardware_concurrency();
+	size_t ops = argc > 3 ? strtoul(argv[3], nullptr, 10) : 200000;
+	if (maxthreads == 0)
+		maxthreads = 1;
 
-#ifdef USE_RADIX_TREE
-	// size_t arr[] = {1024*64,1024*32,1024,512,128,64,16,4};
-	// size_t arrR[] = {4,16,64,128,512,1024,1024*32,1024*64};
-	size_t arr[] = {1024*32,1024,512,128,64,16,4};
-	size_t arrR[] = {4,16,64,128,512,1024,1024*32};
-#else
-	size_t arr[] = {1024*512,1024*128,1024*64,1024*32,1024,512,128,64,16,4};
-	size_t arrR[] = {4,16,64,128,512,1024,1024*32,1024*64,1024*128,1024*512};
-#endif
-	
-	for (size_t val : arrR)
+	bool found = strcmp(which, "all") == 0;
+	for (const WorkloadEntry& w : workloads)
+		found = found || strcmp(which, w._name) == 0;
+	if (!found)
+	{
+		fprintf(stderr, "unknown workload %s\n", which);
+		return 1;
+	}
+
+	if (argc > 4 && strcmp(argv[4], "perf") == 0)
 	{
-		test(ntimes, nthreads, rounds, val);
+		bench_perf_on = bench_perf.Open();
+		if (!bench_perf_on)
+			fprintf(stderr, "perf counters unavailable (errno %d), running without them\n", bench_perf.Error());
+	}
+
+	CalibrateClock();
+	std::vector<Allocator> allocators = FindAllocators();
+	printf("ops/thread: %zu  clock: %.3f ns/tick  allocators:", ops, bench_ns_per_tick);
+	for (const Allocator& a : allocators)
+		printf(" %s", a._name);
+	printf("\n%-9s %-11s %3s %9s | %-32s | %-32s\n", "workload", "allocator", "thr", "Mops/s",
+		"alloc(ns) p50 p99 p99.9 max", "free(ns) p50 p99 p99.9 max");
+
+	for (const WorkloadEntry& w : workloads)
+	{
+		if (strcmp(which, "all") != 0 && strcmp(which, w._name) != 0)
+			continue;
+		// 1(或者最少的线程数), 2, 4 ... 直到最多的线程数
+		size_t limit = maxthreads > w._minthreads ? maxthreads : w._minthreads;
+		for (size_t nthreads = w._minthreads; ; nthreads *= 2)
+		{
+			if (nthreads > limit)
+				nthreads = limit;
+			for (const Allocator& a : allocators)
+				RunOne(w, a, nthreads, ops);
+			if (nthreads == limit)
+				break;
+		}
 	}
 	return 0;
-}
\ No newline at end of file
+}
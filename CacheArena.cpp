@@ -0,0 +1,248 @@
+#include "CacheArena.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <sched.h>
+#endif
+
+std::atomic<CacheArena*> cache_arenas[MAX_ARENAS];
+
+// 下面的状态都是常量初始化的，第一次 malloc 时就可以使用
+static std::mutex arena_mutex;//创建arena、修改设置
+static std::atomic<size_t> arena_count{ 1 };
+static std::atomic<ArenaPolicy> arena_policy{ ArenaPolicy::RoundRobin };
+static std::atomic<size_t> arena_threads[MAX_ARENAS];//每个arena的线程数
+static std::atomic<size_t> arena_cursor{ 0 };//线程数相同时从这里开始找，轮流分配
+
+static size_t CurrentCpu()
+{
+#ifdef _WIN32
+	return GetCurrentProcessorNumber();
+#elif defined(__linux__)
+	int cpu = sched_getcpu();
+	return cpu < 0 ? 0 : (size_t)cpu;
+#else
+	return 0;
+#endif
+}
+
+// 前 n 个arena中线程最少的
+static size_t LeastLoaded(size_t n)
+{
+	size_t start = arena_cursor.fetch_add(1, std::memory_order_relaxed) % n;
+	size_t best = start;
+	size_t bestload = arena_threads[start].load(std::memory_order_relaxed);
+	for (size_t k = 1; k < n; ++k)
+	{
+		size_t i = (start + k) % n;
+		size_t load = arena_threads[i].load(std::memory_order_relaxed);
+		if (load < bestload)
+		{
+			best = i;
+			bestload = load;
+		}
+	}
+	return best;
+}
+
+static size_t ChooseArena(size_t n)
+{
+	if (n == 1)
+		return 0;
+	if (arena_policy.load(std::memory_order_relaxed) == ArenaPolicy::Cpu)
+		return CurrentCpu() % n;
+	return LeastLoaded(n);
+}
+
+size_t ConcurrentAllocSetArenas(size_t n, ArenaPolicy policy)
+{
+#if (defined(USE_RADIX_TREE) && !defined(USE_INTEGER_KEY)) || defined(USE_UNORDERED_MAP)
+	// 这两种映射在多个PageCache同时写时不安全(整数键的基数树是并发的，见 concurrent_radix_tree.hpp)
+	n = 1;
+#endif
+	if (n < 1)
+		n = 1;
+	if (n > MAX_ARENAS)
+		n = MAX_ARENAS;
+
+	std::unique_lock<std::mutex> lock(arena_mutex);
+	for (size_t i = 1; i < n; ++i)
+	{
+		if (cache_arenas[i].load(std::memory_order_relaxed) != nullptr)
+			continue;
+		// 不能用 new，替换 malloc 之后 new 会调用到内存池自己
+		void* mem = SystemAlloc(sizeof(CacheArena));
+		if (mem == nullptr)
+			throw std::bad_alloc();
+		cache_arenas[i].store(new (mem) CacheArena((uint8_t)i), std::memory_order_release);
+	}
+	arena_policy.store(policy, std::memory_order_relaxed);
+	arena_count.store(n, std::memory_order_release);
+	return n;
+}
+
+size_t ConcurrentAllocArenas()
+{
+	return arena_count.load(std::memory_order_acquire);
+}
+
+CentralCache* ArenaAttach()
+{
+	size_t index = ChooseArena(arena_count.load(std::memory_order_acquire));
+	arena_threads[index].fetch_add(1, std::memory_order_relaxed);
+	return ArenaCentralCache(index);
+}
+
+void ArenaDetach(CentralCache* central)
+{
+	arena_threads[central->GetPageCache()->ArenaIndex()].fetch_sub(1, std::memory_order_relaxed);
+}
+
+CentralCache* ArenaRebalance(CentralCache* central)
+{
+	size_t n = arena_count.load(std::memory_order_acquire);
+	size_t cur = central->GetPageCache()->ArenaIndex();
+	if (n == 1 && cur == 0)
+		return central;
+
+	size_t target = cur;
+	if (cur >= n)
+	{
+		// arena的个数变少了
+		target = ChooseArena(n);
+	}
+	else if (arena_policy.load(std::memory_order_relaxed) == ArenaPolicy::Cpu)
+	{
+		target = CurrentCpu() % n;
+	}
+	else
+	{
+		// 移走一个线程之后两边的差距至少缩小2，不会来回移动
+		size_t least = LeastLoaded(n);
+		if (arena_threads[cur].load(std::memory_order_relaxed) > arena_threads[least].load(std::memory_order_relaxed) + 1)
+			target = least;
+	}
+	if (target == cur)
+		return central;
+
+	// ThreadCache中已有的对象不用归还，以后释放时会按span还给原来的arena
+	arena_threads[cur].fetch_sub(1, std::memory_order_relaxed);
+	arena_threads[target].fetch_add(1, std::memory_order_relaxed);
+	return ArenaCentralCache(target);
+}
+
+size_t ArenaCreated()
+{
+	size_t n = 1;
+	for (size_t i = 1; i < MAX_ARENAS; ++i)
+	{
+		if (cache_arenas[i].load(std::memory_order_acquire) != nullptr)
+			n = i + 1;
+	}
+	return n;
+}
+
+void ConcurrentAllocLockStats(ConcurrentLockStats* stats)
+{
+	*stats = ConcurrentLockStats();
+	stats->_narena = ArenaCreated();
+	for (size_t i = 0; i < stats->_narena; ++i)
+	{
+		LockStats classes[NLISTS];
+		ArenaCentralCache(i)->CollectLockStats(classes);
+		for (size_t c = 0; c < NLISTS; ++c)
+		{
+			stats->_classes[c].Add(classes[c]);
+			stats->_arenacentral[i].Add(classes[c]);
+		}
+		stats->_arenapage[i] = ArenaPageCache(i)->GetLockStats();
+		stats->_central.Add(stats->_arenacentral[i]);
+		stats->_page.Add(stats->_arenapage[i]);
+	}
+}
+
+void ConcurrentAllocLockStatsReset()
+{
+	size_t n = ArenaCreated();
+	for (size_t i = 0; i < n; ++i)
+	{
+		ArenaCentralCache(i)->ResetLockStats();
+		ArenaPageCache(i)->ResetLockStats();
+	}
+}
+
+static void PrintLockStats(FILE* out, const char* name, const LockStats& s)
+{
+	fprintf(out, "%-16s %12llu %12llu %7.2f%% %14.1f %10.1f\n", name,
+		(unsigned long long)s._acquire, (unsigned long long)s._contended,
+		s._acquire == 0 ? 0.0 : s._contended * 100.0 / s._acquire, s._waitns / 1000.0,
+		s._contended == 0 ? 0.0 : (double)s._waitns / s._contended);
+}
+
+void ConcurrentAllocLockStatsPrint(FILE* out)
+{
+	ConcurrentLockStats stats;
+	ConcurrentAllocLockStats(&stats);
+	fprintf(out, "%-16s %12s %12s %8s %14s %10s\n", "lock", "acquire", "contended", "rate", "wait(us)", "avg(ns)");
+	PrintLockStats(out, "central", stats._central);
+	PrintLockStats(out, "page", stats._page);
+	char name[32];
+	for (size_t i = 0; i < stats._narena; ++i)
+	{
+		snprintf(name, sizeof(name), "central[%zu]", i);
+		PrintLockStats(out, name, stats._arenacentral[i]);
+		snprintf(name, sizeof(name), "page[%zu]", i);
+		PrintLockStats(out, name, stats._arenapage[i]);
+	}
+
+	// 等待时间最长的几个大小类
+	const size_t TOP = 8;
+	size_t top[TOP];
+	size_t ntop = 0;
+	for (size_t c = 0; c < NLISTS; ++c)
+	{
+		if (stats._classes[c]._contended == 0)
+			continue;
+		size_t pos = ntop < TOP ? ntop++ : TOP;
+		while (pos > 0 && stats._classes[top[pos - 1]]._waitns < stats._classes[c]._waitns)
+		{
+			if (pos < TOP)
+				top[pos] = top[pos - 1];
+			--pos;
+		}
+		if (pos < TOP)
+			top[pos] = c;
+	}
+	for (size_t k = 0; k < ntop; ++k)
+	{
+		snprintf(name, sizeof(name), "class %zu", SizeClass::Size(top[k]));
+		PrintLockStats(out, name, stats._classes[top[k]]);
+	}
+}
+
+void ArenaLockAll()
+{
+	arena_mutex.lock();
+	for (size_t i = 0; i < MAX_ARENAS; ++i)
+	{
+		if (i != 0 && cache_arenas[i].load(std::memory_order_relaxed) == nullptr)
+			continue;
+		ArenaCentralCache(i)->LockAll();
+		ArenaPageCache(i)->Lock();
+	}
+	CentralCache::LockBatchPool();
+}
+
+void ArenaUnlockAll()
+{
+	CentralCache::UnlockBatchPool();
+	for (size_t i = MAX_ARENAS; i-- > 0;)
+	{
+		if (i != 0 && cache_arenas[i].load(std::memory_order_relaxed) == nullptr)
+			continue;
+		ArenaPageCache(i)->Unlock();
+		ArenaCentralCache(i)->UnlockAll();
+	}
+	arena_mutex.unlock();
+}
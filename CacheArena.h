@@ -0,0 +1,92 @@
+#pragma once
+
+#include "Common.h"
+#include "CentralCache.h"
+#include "PageCache.h"
+
+#include <atomic>
+#include <cstdio>
+
+// 多arena：全局内存池分成几个独立的 CentralCache + PageCache，各自有自己的桶锁和页锁
+// 0号arena就是 CentralCache::Getinstence() / PageCache::GetInstence()，其余的按需创建，创建之后不再销毁
+// 每个线程的ThreadCache属于一个arena，缓存没命中时只和同一arena的线程竞争锁
+//
+// 所有arena共用全局PageCache的映射，释放时查到的span记录了所属的arena(Span::_arena)：
+//     小对象先放进释放线程自己的ThreadCache，归还CentralCache时按span所属的arena分开，分别加对应arena的锁
+//     大对象直接还给所属arena的PageCache
+// 相邻的内存可能属于不同的arena，PageCache合并时不会越过arena
+//
+// 定义 USE_RADIX_TREE(没有定义 USE_INTEGER_KEY)或 USE_UNORDERED_MAP 时映射不支持并发写，只有一个arena
+
+const size_t MAX_ARENAS = 64;
+// ThreadCache 每到CentralCache取这么多次检查一次是否要换arena
+const size_t ARENA_CHECK_INTERVAL = 256;
+
+// 线程分配到哪个arena
+enum class ArenaPolicy
+{
+	RoundRobin,//新线程分给线程最少的arena(线程数相同时轮流)，某个arena的线程比最少的多2个以上时把线程移走
+	Cpu,//按线程当前所在的CPU选择，检查时CPU变了就跟着换
+};
+
+struct CacheArena
+{
+	PageCache _pagecache;
+	CentralCache _central;
+
+	explicit CacheArena(uint8_t index) : _pagecache(false, index), _central(&_pagecache) {}
+};
+
+// 编号 1 ~ MAX_ARENAS-1 的arena，没有创建的为空
+extern std::atomic<CacheArena*> cache_arenas[MAX_ARENAS];
+
+inline CentralCache* ArenaCentralCache(size_t index)
+{
+	return index == 0 ? CentralCache::Getinstence() : &cache_arenas[index].load(std::memory_order_acquire)->_central;
+}
+
+inline PageCache* ArenaPageCache(size_t index)
+{
+	return index == 0 ? PageCache::GetInstence() : &cache_arenas[index].load(std::memory_order_acquire)->_pagecache;
+}
+
+// span所属的PageCache；只用于全局内存池中的span
+inline PageCache* SpanPageCache(Span* span)
+{
+	return ArenaPageCache(span->_arena.load(std::memory_order_relaxed));
+}
+
+// 设置arena的个数(1 ~ MAX_ARENAS)和分配策略，返回实际的个数
+// 之后创建的ThreadCache按新的设置分配，已有的线程在下一次检查时移动
+size_t ConcurrentAllocSetArenas(size_t n, ArenaPolicy policy = ArenaPolicy::RoundRobin);
+size_t ConcurrentAllocArenas();
+
+// 以下由ThreadCache调用
+// 为新线程选择一个arena
+CentralCache* ArenaAttach();
+// 线程退出
+void ArenaDetach(CentralCache* central);
+// 定期检查，返回线程应该使用的CentralCache(可能不变)
+CentralCache* ArenaRebalance(CentralCache* central);
+
+// 已经创建的arena的编号上限(不含)，统计时遍历到这里
+size_t ArenaCreated();
+
+// 锁的统计，所有arena(不包括私有堆)；没有定义 LOCK_STATS 时都是0(见 Lock.h)
+struct ConcurrentLockStats
+{
+	LockStats _central;//所有桶锁合计
+	LockStats _page;//所有页锁合计
+	LockStats _classes[NLISTS];//每个大小类的桶锁，所有arena合计
+	LockStats _arenacentral[MAX_ARENAS];//每个arena的桶锁合计
+	LockStats _arenapage[MAX_ARENAS];//每个arena的页锁
+	size_t _narena = 0;//已经创建的arena个数
+};
+void ConcurrentAllocLockStats(ConcurrentLockStats* stats);
+void ConcurrentAllocLockStatsReset();
+// 输出合计、各arena和竞争最多的大小类
+void ConcurrentAllocLockStatsPrint(FILE* out);
+
+// fork 前后调用，锁住/解锁所有arena(包括0号)
+void ArenaLockAll();
+void ArenaUnlockAll();
@@ -1,9 +1,40 @@
 #include "CentralCache.h"
 #include "PageCache.h"
+#include "CacheArena.h"
 
-CentralCache CentralCache::_inst;
+#include <cstring>
 
-Span* CentralCache::GetOneSpan(SpanList& spanlist, size_t byte_size)
+// 常量初始化，不依赖全局对象的构造顺序
+CentralCache CentralCache::_inst(PageCache::GetInstence());
+
+// 所有CentralCache共用的批量描述符，空闲的描述符也放在无锁栈中
+static MetaPool<TransferBatch, 1024> batch_pool;
+static BatchStack free_batches;
+
+#ifdef USE_LOCKFREE_CENTRAL
+static TransferBatch* NewBatch()
+{
+	TransferBatch* batch = free_batches.Pop();
+	if (batch == nullptr)
+		batch = batch_pool.getOne();
+	return batch;
+}
+
+// 一个大小类无锁栈中最多的对象个数
+static size_t TransferCapacity(size_t size)
+{
+	size_t num = TRANSFER_MAX_BYTES / size;
+	size_t least = 2 * SizeClass::NumMoveSize(size);
+	return num > least ? num : least;
+}
+#endif
+
+static void DeleteBatch(TransferBatch* batch)
+{
+	free_batches.Push(batch);
+}
+
+Span* CentralCache::GetOneSpan(SpanList& spanlist, size_t byte_size, LifetimeHint hint)
 {
 	Span* span = spanlist.Begin();
 	while (span != spanlist.End())//当前找到一个span
@@ -15,13 +46,27 @@ Span* CentralCache::GetOneSpan(SpanList& spanlist, size_t byte_size)
 	}
 
 	// 走到这儿，说明前面没有获取到span,都是空的，到下一层pagecache获取span
-	Span* newspan = PageCache::GetInstence()->NewSpan(SizeClass::NumMovePage(byte_size));
+	Span* newspan = CarveSpan(byte_size, hint);
+	spanlist.PushFront(newspan);
+
+	return newspan;
+}
+
+Span* CentralCache::CarveSpan(size_t byte_size, LifetimeHint hint)
+{
+	// 长期对象的span不记录大小类，释放时走查找span的路径，放回长期对象的自由链表
+	size_t sizeclass = hint == LifetimeHint::LongLived ? 0 : SizeClass::Index(byte_size) + 1;
+	Span* newspan = _pagecache->NewSpan(SizeClass::NumMovePage(byte_size), sizeclass);
 	// 将span页切分成需要的对象并链接起来
 	char* cur = (char*)(newspan->_pageid << PAGE_SHIFT);
 	char* end = cur + (newspan->_npage << PAGE_SHIFT);
 	newspan->_list = cur;
 	newspan->_objsize = byte_size;
-	while (cur + byte_size < end)
+	newspan->_usecount = 0;//NewSpan返回时为1，这里按切出去的对象个数重新计数
+	newspan->_longlived = hint == LifetimeHint::LongLived;
+	newspan->_nsampled.store(0, std::memory_order_relaxed);
+	newspan->_nheapsampled.store(0, std::memory_order_relaxed);
+	while (cur + 2 * byte_size <= end)//下一个对象必须完整地落在span里面
 	{
 		char* next = cur + byte_size;
 		NEXT_OBJ(cur) = next;
@@ -29,23 +74,67 @@ Span* CentralCache::GetOneSpan(SpanList& spanlist, size_t byte_size)
 	}
 	NEXT_OBJ(cur) = nullptr;//最后设置为nullptr
 
-	spanlist.PushFront(newspan);
-
 	return newspan;
 }
 
+size_t CentralCache::Prefill(size_t byte_size, size_t nobj)
+{
+	SpanList& spanlist = _spanlist[SizeClass::Index(byte_size)];
+	std::unique_lock<PoolLock> lock(spanlist._mutex);
+
+	size_t nfree = 0;
+	for (Span* span = spanlist.Begin(); span != spanlist.End(); span = span->_next)
+		nfree += (span->_npage << PAGE_SHIFT) / span->_objsize - span->_usecount;
+	while (nfree < nobj)
+	{
+		// 新的span放在最前面，GetOneSpan 先从这里取
+		Span* span = CarveSpan(byte_size, LifetimeHint::ShortLived);
+		spanlist.PushFront(span);
+		nfree += (span->_npage << PAGE_SHIFT) / byte_size;
+	}
+	return nfree;
+}
+
 
 //获取一个批量的内存对象
-size_t CentralCache::FetchRangeObj(void*& start, void*& end, size_t n, size_t byte_size)
+size_t CentralCache::FetchRangeObj(void*& start, void*& end, size_t n, size_t byte_size, LifetimeHint hint)
 {
 	size_t index = SizeClass::Index(byte_size);
-	SpanList& spanlist = _spanlist[index];//赋值->拷贝构造
+#ifdef USE_LOCKFREE_CENTRAL
+	if (hint == LifetimeHint::ShortLived)
+	{
+		TransferList& transfer = _transfer[index];
+		if (TransferBatch* batch = transfer._stack.Pop())
+		{
+			// 弹出的批量属于这个线程，比需要的多时切下前 n 个，剩下的压回去
+			start = batch->_head;
+			if (batch->_n <= n)
+			{
+				n = batch->_n;
+				end = batch->_tail;
+				DeleteBatch(batch);
+			}
+			else
+			{
+				end = start;
+				for (size_t i = 1; i < n; ++i)
+					end = NEXT_OBJ(end);
+				batch->_head = NEXT_OBJ(end);
+				batch->_n -= n;
+				transfer._stack.Push(batch);
+			}
+			transfer._nobj.fetch_sub(n, std::memory_order_relaxed);
+			return n;
+		}
+	}
+#endif
+	SpanList& spanlist = hint == LifetimeHint::LongLived ? _longlived[index] : _spanlist[index];
 
 	//记得加锁
-	std::unique_lock<std::mutex> lock(spanlist._mutex);
+	std::unique_lock<PoolLock> lock(spanlist._mutex);
 
 
-	Span* span = GetOneSpan(spanlist, byte_size);
+	Span* span = GetOneSpan(spanlist, byte_size, hint);
 	//到这儿已经获取到一个newspan,从这个span中切出我们需要的内存。
 
 	//从span中获取range对象
@@ -77,40 +166,273 @@ size_t CentralCache::FetchRangeObj(void*& start, void*& end, size_t n, size_t by
 	return batchsize;
 }
 
-void CentralCache::ReleaseListToSpans(void* start, size_t size)
+void CentralCache::ReleaseListToSpans(void* start, size_t size, size_t n, LifetimeHint hint)
 {
 	size_t index = SizeClass::Index(size);
-	SpanList& spanlist = _spanlist[index];
+#ifdef USE_LOCKFREE_CENTRAL
+	TransferList& transfer = _transfer[index];
+	if (n > 0 && hint == LifetimeHint::ShortLived
+		&& transfer._nobj.load(std::memory_order_relaxed) + n <= TransferCapacity(size))
+	{
+		TransferBatch* batch = NewBatch();
+		void* tail = start;
+		for (size_t i = 1; i < n; ++i)
+			tail = NEXT_OBJ(tail);
+		assert(NEXT_OBJ(tail) == nullptr);
+		batch->_head = start;
+		batch->_tail = tail;
+		batch->_n = n;
+		transfer._nobj.fetch_add(n, std::memory_order_relaxed);
+		transfer._stack.Push(batch);
+		return;
+	}
+#else
+	(void)n;
+	(void)hint;
+#endif
+	while (start)
+	{
+		void* objs[RELEASE_BATCH];
+		size_t n = 0;
+		while (start != nullptr && n < RELEASE_BATCH)
+		{
+			objs[n++] = start;
+			start = NEXT_OBJ(start);
+		}
+		ReleaseBatchToSpans(objs, n, index);
+	}
+}
 
-	//将锁放在循环外面
-	// CentralCache:对当前桶进行加锁(桶锁)，减小锁的粒度
-	// PageCache:必须对整个SpanList全局加锁
-	// 因为可能存在多个线程同时去系统申请内存的情况
-	//spanlist.Lock();
-	std::unique_lock<std::mutex> lock(spanlist._mutex);
+// 加锁之前先把对象按span分组，每个span只加锁修改一次
+// span里还有没归还的对象(就是这些对象)，不会被释放，所以查找可以在锁外面做
+// 去重和分组都用小的开放寻址哈希表(页号 -> 页的下标，span -> 组的下标)，比排序便宜
+void CentralCache::ReleaseBatchToSpans(void** objs, size_t n, size_t index)
+{
+	const size_t TABLE_SIZE = RELEASE_BATCH * 2;
+	const uint16_t EMPTY = 0xFFFF;
+	uint16_t table[TABLE_SIZE];
 
-	while (start)
+	// 每个不同的页只查一次，所有页一起查找，查找时可以预取
+	// 同一个span的页号连续，直接用页号的低位作为槽位
+	// 清零让编译器知道传给 getMany 的都有初值(只会读前 npage 个)
+	PageID ids[RELEASE_BATCH] = {};
+	uint16_t pageof[RELEASE_BATCH];
+	size_t npage = 0;
+	memset(table, 0xFF, sizeof(table));
+	for (size_t i = 0; i < n; ++i)
+	{
+		PageID id = (PageID)objs[i] >> PAGE_SHIFT;
+		// 连续的同一页的对象不用查表
+		if (npage != 0 && ids[pageof[i - 1]] == id)
+		{
+			pageof[i] = pageof[i - 1];
+			continue;
+		}
+		size_t slot = id & (TABLE_SIZE - 1);
+		while (table[slot] != EMPTY && ids[table[slot]] != id)
+			slot = (slot + 1) & (TABLE_SIZE - 1);
+		// 新页和重复页随机出现，不用分支
+		bool isnew = table[slot] == EMPTY;
+		ids[npage] = id;
+		table[slot] = isnew ? (uint16_t)npage : table[slot];
+		pageof[i] = table[slot];
+		npage += isnew;
+	}
+	Span* spans[RELEASE_BATCH];
+	_pagecache->MapPagesToSpans(ids, spans, npage);
+
+	// 按span分组：每个页先找到所在的组，组内的对象链接起来
+	Group groups[RELEASE_BATCH];
+	size_t ngroup = 0;
+	uint16_t groupof[RELEASE_BATCH];
+	memset(table, 0xFF, sizeof(table));
+	for (size_t k = 0; k < npage; ++k)
+	{
+		Span* span = spans[k];
+		assert(span != nullptr);
+		size_t slot = ((size_t)span / sizeof(Span)) & (TABLE_SIZE - 1);
+		while (table[slot] != EMPTY && groups[table[slot]]._span != span)
+			slot = (slot + 1) & (TABLE_SIZE - 1);
+		if (table[slot] == EMPTY)
+		{
+			table[slot] = (uint16_t)ngroup;
+			groups[ngroup] = Group{ span, nullptr, nullptr, 0 };
+			// _tail 先指向 _head，第一个对象也通过 NEXT_OBJ(_tail) 链接，不用分支
+			groups[ngroup]._tail = &groups[ngroup]._head;
+			++ngroup;
+		}
+		groupof[k] = table[slot];
+	}
+	for (size_t i = 0; i < n; ++i)
 	{
-		void* next = NEXT_OBJ(start);
+		Group& group = groups[groupof[pageof[i]]];
+		NEXT_OBJ(group._tail) = objs[i];
+		group._tail = objs[i];
+		++group._n;
+	}
 
-		////到时候记得加锁
-		//spanlist.Lock(); // 构成了很多的锁竞争
+	// 别的arena的span交给所属arena的CentralCache(对象可能是别的arena的线程申请的)，本arena的组排在前面
+	uint8_t arena = _pagecache->ArenaIndex();
+	size_t nlocal = 0;
+	for (size_t i = 0; i < ngroup; ++i)
+	{
+		if (LIKELY(groups[i]._span->_arena.load(std::memory_order_relaxed) == arena))
+			std::swap(groups[nlocal++], groups[i]);
+	}
+	ReleaseGroups(groups, nlocal, index);
 
-		Span* span = PageCache::GetInstence()->MapObjectToSpan(start);//获得这个地址开始的内存小单元属于那个span
-		//释放start，也就是将start开始大小为size的小内存单元加入span
-		NEXT_OBJ(start) = span->_list;
-		span->_list = start;
-		//当一个span的对象全部释放回来的时候，将span还给pagecache,并且做页合并
-		if (--span->_usecount == 0)//更新_usecount
+	size_t begin = nlocal;
+	while (begin < ngroup)
+	{
+		uint8_t other = groups[begin]._span->_arena.load(std::memory_order_relaxed);
+		size_t end = begin + 1;
+		for (size_t i = end; i < ngroup; ++i)
 		{
-			spanlist.Erase(span);
-			PageCache::GetInstence()->ReleaseSpanToPageCache(span);
+			if (groups[i]._span->_arena.load(std::memory_order_relaxed) == other)
+				std::swap(groups[end++], groups[i]);
 		}
+		ArenaCentralCache(other)->ReleaseGroups(groups + begin, end - begin, index);
+		begin = end;
+	}
+}
 
-		//spanlist.Unlock();
+void CentralCache::ReleaseGroups(Group* groups, size_t ngroup, size_t index)
+{
+	if (ngroup == 0)
+		return;
+
+	// 对象全部归还的span在解锁之后再还给pagecache，减少持有桶锁的时间
+	Span* freespans[RELEASE_BATCH];
+	size_t nfree = 0;
+	{
+		// CentralCache:对当前桶进行加锁(桶锁)，减小锁的粒度
+		SpanList& spanlist = _spanlist[index];
+		std::unique_lock<PoolLock> lock(spanlist._mutex);
+		// 遇到长期对象的span时才加锁，总是先锁短期链表再锁长期链表，不会死锁
+		SpanList& longlived = _longlived[index];
+		std::unique_lock<PoolLock> longlock(longlived._mutex, std::defer_lock);
+
+		for (size_t i = 0; i < ngroup; ++i)
+		{
+			Group& group = groups[i];
+			Span* span = group._span;
+			SpanList* list = &spanlist;
+			if (UNLIKELY(span->_longlived))
+			{
+				if (!longlock.owns_lock())
+					longlock.lock();
+				list = &longlived;
+			}
+
+			// 整组对象接到span的自由链表前面
+			NEXT_OBJ(group._tail) = span->_list;
+			span->_list = group._head;
+			span->_usecount -= group._n;
+			//当一个span的对象全部释放回来的时候，将span还给pagecache,并且做页合并
+			if (span->_usecount == 0)
+			{
+				list->Erase(span);
+				freespans[nfree++] = span;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < nfree; ++i)
+		_pagecache->ReleaseSpanToPageCache(freespans[i]);
+}
+
+void CentralCache::FlushTransfer()
+{
+	for (size_t i = 0; i < NLISTS; ++i)
+	{
+		while (TransferBatch* batch = _transfer[i]._stack.Pop())
+		{
+			_transfer[i]._nobj.fetch_sub(batch->_n, std::memory_order_relaxed);
+			ReleaseListToSpans(batch->_head, SizeClass::Size(i));
+			DeleteBatch(batch);
+		}
+	}
+}
+
+void CentralCache::DropTransfer()
+{
+	for (size_t i = 0; i < NLISTS; ++i)
+	{
+		while (TransferBatch* batch = _transfer[i]._stack.Pop())
+			DeleteBatch(batch);
+		_transfer[i]._nobj.store(0, std::memory_order_relaxed);
+	}
+}
 
-		start = next;
+void CentralCache::CollectStats(AllocClassStats* classes)
+{
+	for (size_t i = 0; i < NLISTS; ++i)
+	{
+		size_t size = SizeClass::Size(i);
+		SpanList* lists[2] = { &_spanlist[i], &_longlived[i] };
+		for (SpanList* list : lists)
+		{
+			std::unique_lock<PoolLock> lock(list->_mutex);
+			for (Span* span = list->Begin(); span != list->End(); span = span->_next)
+			{
+				// span切出的对象个数见 GetOneSpan
+				size_t nobj = (span->_npage << PAGE_SHIFT) / size;
+				classes[i]._centralfree += nobj - span->_usecount;
+				++classes[i]._spans;
+				classes[i]._spanpages += span->_npage;
+			}
+		}
+		classes[i]._centralfree += _transfer[i]._nobj.load(std::memory_order_relaxed);
 	}
+}
 
-	//spanlist.Unlock();
-}
\ No newline at end of file
+size_t CentralCache::BatchPoolBytes()
+{
+	return batch_pool.reserved();
+}
+
+void CentralCache::CollectLockStats(LockStats* classes) const
+{
+	for (size_t i = 0; i < NLISTS; ++i)
+	{
+		classes[i].Add(_spanlist[i]._mutex.Stats());
+		classes[i].Add(_longlived[i]._mutex.Stats());
+	}
+}
+
+void CentralCache::ResetLockStats()
+{
+	for (size_t i = 0; i < NLISTS; ++i)
+	{
+		_spanlist[i]._mutex.ResetStats();
+		_longlived[i]._mutex.ResetStats();
+	}
+}
+
+void CentralCache::LockBatchPool()
+{
+	batch_pool.Lock();
+}
+
+void CentralCache::UnlockBatchPool()
+{
+	batch_pool.Unlock();
+}
+
+void CentralCache::LockAll()
+{
+	for (size_t i = 0; i < NLISTS; ++i)
+	{
+		_spanlist[i].Lock();
+		_longlived[i].Lock();
+	}
+}
+
+void CentralCache::UnlockAll()
+{
+	for (size_t i = 0; i < NLISTS; ++i)
+	{
+		_longlived[i].Unlock();
+		_spanlist[i].Unlock();
+	}
+}
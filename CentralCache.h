@@ -1,6 +1,86 @@
 #pragma once
 
 #include "Common.h"
+#include "AllocStats.h"
+
+#include <atomic>
+
+class PageCache;
+
+// 归还对象时一次整理的个数，数组都放在栈上
+const size_t RELEASE_BATCH = 128;
+
+// 无锁模式(定义 USE_LOCKFREE_CENTRAL 时使用，见 PageCache.h)
+// 每个大小类有一个对象批量的无锁栈，ThreadCache 归还的一串对象整串压栈，申请时整串弹出，不加桶锁
+// 栈里的对象在span看来还在使用中；栈空或者超过容量时才走加锁的span路径
+// 批量的描述符从全局的 MetaPool 申请，永远不还给系统，弹栈时读到旧的描述符也不会访问到已释放的内存
+
+// 一个大小类最多缓存的字节数(至少两个批量)
+const size_t TRANSFER_MAX_BYTES = 256 * 1024;
+
+struct TransferBatch
+{
+	void* _head = nullptr;
+	void* _tail = nullptr;
+	size_t _n = 0;
+	std::atomic<TransferBatch*> _next{ nullptr };
+};
+
+// 带版本号的指针做栈顶(Treiber 栈)，版本号防止 ABA
+// 64位下指针只用低48位，高16位是版本号；32位下高32位是版本号
+class BatchStack
+{
+public:
+	constexpr BatchStack() {}
+
+	void Push(TransferBatch* batch)
+	{
+		uint64_t top = _top.load(std::memory_order_relaxed);
+		do
+		{
+			batch->_next.store(Ptr(top), std::memory_order_relaxed);
+		} while (!_top.compare_exchange_weak(top, Pack(batch, top), std::memory_order_release, std::memory_order_relaxed));
+	}
+
+	TransferBatch* Pop()
+	{
+		uint64_t top = _top.load(std::memory_order_acquire);
+		while (true)
+		{
+			TransferBatch* batch = Ptr(top);
+			if (batch == nullptr)
+				return nullptr;
+			// batch 可能已经被别的线程弹出并重新使用，读到的 _next 不对时版本号也变了，CAS 会失败
+			TransferBatch* next = batch->_next.load(std::memory_order_relaxed);
+			if (_top.compare_exchange_weak(top, Pack(next, top), std::memory_order_acquire, std::memory_order_acquire))
+				return batch;
+		}
+	}
+
+private:
+	static const int TAG_SHIFT = sizeof(void*) == 8 ? 48 : 32;
+	static const uint64_t PTR_MASK = ((uint64_t)1 << TAG_SHIFT) - 1;
+
+	static TransferBatch* Ptr(uint64_t top)
+	{
+		return (TransferBatch*)(uintptr_t)(top & PTR_MASK);
+	}
+
+	// 新的栈顶，版本号在旧栈顶的基础上加一
+	static uint64_t Pack(TransferBatch* batch, uint64_t old)
+	{
+		return (((old >> TAG_SHIFT) + 1) << TAG_SHIFT) | ((uint64_t)(uintptr_t)batch & PTR_MASK);
+	}
+
+	std::atomic<uint64_t> _top{ 0 };
+};
+
+// 一个大小类的无锁栈
+struct TransferList
+{
+	BatchStack _stack;
+	std::atomic<size_t> _nobj{ 0 };//栈中的对象个数，只用来限制容量，不要求精确
+};
 
 //上面的ThreadCache里面没有的话，要从中心获取
 
@@ -12,7 +92,7 @@
 对于中心缓存来说要加锁
 */
 
-//设计成单例模式
+//设计成单例模式；私有堆(ConcurrentHeap)各自构造自己的CentralCache
 class CentralCache
 {
 public:
@@ -21,21 +101,75 @@ public:
 		return &_inst;
 	}
 
+	// span 从 pagecache 获取、归还到 pagecache
+	constexpr explicit CentralCache(PageCache* pagecache) : _pagecache(pagecache) {}
+
+	PageCache* GetPageCache()
+	{
+		return _pagecache;
+	}
+
 	//从page cache获取一个span
-	Span* GetOneSpan(SpanList& spanlist, size_t byte_size);
+	Span* GetOneSpan(SpanList& spanlist, size_t byte_size, LifetimeHint hint);
+
+	// 预热(见 Reserve.h)：大小类 byte_size 的span中空闲的对象不到 nobj 个时，从page cache取span切好补上
+	// 返回补上之后空闲的对象个数
+	size_t Prefill(size_t byte_size, size_t nobj);
+
+	//从中心缓存获取一定数量的对象给threa cache，长期对象从单独的span链表中获取
+	size_t FetchRangeObj(void*& start, void*& end, size_t n, size_t byte_size, LifetimeHint hint = LifetimeHint::ShortLived);
 
-	//从中心缓存获取一定数量的对象给threa cache
-	size_t FetchRangeObj(void*& start, void*& end, size_t n, size_t byte_size);
+	//将一定数量的对象释放给span跨度，链表中可以同时有长期和短期span中的对象
+	// n 是链表中对象的个数(0 表示不知道)；无锁模式下短期对象的链表直接压到无锁栈中
+	void ReleaseListToSpans(void* start, size_t size, size_t n = 0, LifetimeHint hint = LifetimeHint::ShortLived);
 
-	//将一定数量的对象释放给span跨度
-	void ReleaseListToSpans(void* start, size_t size);
+	//ReleaseListToSpans 每次整理 RELEASE_BATCH 个对象：按span分组之后再加锁归还
+	void ReleaseBatchToSpans(void** objs, size_t n, size_t index);
+
+	// 无锁栈中的对象全部还给span
+	void FlushTransfer();
+	// 只回收无锁栈中的描述符，不访问对象(私有堆销毁时使用)
+	void DropTransfer();
+
+	// 逐个加桶锁遍历span，每个大小类空闲的对象个数和span个数加到 classes[index] 上
+	void CollectStats(AllocClassStats* classes);
+	// 批量描述符池向系统申请的字节数
+	static size_t BatchPoolBytes();
+
+	// fork 前后调用，锁住/解锁所有的桶
+	void LockAll();
+	void UnlockAll();
+	// 每个大小类的桶锁(短期和长期链表合计)的统计加到 classes[index] 上
+	void CollectLockStats(LockStats* classes) const;
+	void ResetLockStats();
+
+	// 所有CentralCache共用的批量描述符池
+	static void LockBatchPool();
+	static void UnlockBatchPool();
 
 private:
-	SpanList _spanlist[NLISTS];
+	// ReleaseBatchToSpans 中同一个span的对象
+	struct Group
+	{
+		Span* _span;
+		void* _head;
+		void* _tail;
+		size_t _n;
+	};
+
+	// 加桶锁把各组对象还给span，span都属于这个CentralCache
+	void ReleaseGroups(Group* groups, size_t ngroup, size_t index);
+
+	// 从page cache获取一个新的span，切分成 byte_size 的对象链接起来，调用者持有桶锁
+	Span* CarveSpan(size_t byte_size, LifetimeHint hint);
 
 private:
-	CentralCache(){}//声明不实现，防止默认构造，自己创建
+	PageCache* _pagecache;
+	SpanList _spanlist[NLISTS];
+	SpanList _longlived[NLISTS];//LifetimeHint::LongLived 的对象单独使用的span
+	TransferList _transfer[NLISTS];//无锁模式下的对象批量，没有定义 USE_LOCKFREE_CENTRAL 时一直是空的
 
+private:
 	CentralCache(CentralCache&) = delete;
 	static CentralCache _inst;
 };
\ No newline at end of file
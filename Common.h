@@ -7,8 +7,11 @@
 #include <vector>
 #include <stdlib.h>
 #include <algorithm>
+#include <new>
 #include <assert.h>
 
+#include "Lock.h"
+
 #ifdef __linux__
 #include <sys/mman.h>
 #include <unistd.h>
@@ -24,11 +27,73 @@ using std::endl;
 	
 #endif
 
+// 直接向系统申请内存(按页对齐，内容为0)，失败返回nullptr
+// 内存池内部的元数据都从这里获取，不能使用new/malloc，否则替换malloc之后会递归调用自己
+inline static void* SystemAlloc(size_t bytes)
+{
+#ifdef _WIN32
+	return VirtualAlloc(0, bytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+	void* ptr = mmap(nullptr, bytes, PROT_WRITE | PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return ptr == MAP_FAILED ? nullptr : ptr;
+#endif
+}
+
+inline static void SystemFree(void* ptr, size_t bytes)
+{
+#ifdef _WIN32
+	VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+	munmap(ptr, bytes);
+#endif
+}
+
+// 预先建立 [ptr, ptr+bytes) 的物理页，之后第一次访问不再缺页；调用者保证这段内存没有别人在用
+inline static void SystemPrefault(void* ptr, size_t bytes)
+{
+#ifdef MADV_POPULATE_WRITE
+	// Linux 5.14 之后不用逐页写，旧内核返回 EINVAL 时退回到逐页写
+	if (madvise(ptr, bytes, MADV_POPULATE_WRITE) == 0)
+		return;
+#endif
+	for (size_t i = 0; i < bytes; i += 4096)
+		((volatile char*)ptr)[i] = 0;
+}
+
+// 锁住 [ptr, ptr+bytes)，不会被换出(同时建立物理页)；超过进程的锁定上限(RLIMIT_MEMLOCK)等失败时返回false
+inline static bool SystemLock(void* ptr, size_t bytes)
+{
+#ifdef _WIN32
+	return VirtualLock(ptr, bytes) != 0;
+#else
+	return mlock(ptr, bytes) == 0;
+#endif
+}
+
 const size_t MAX_BYTES = 64 * 1024; //ThreadCache 申请的最大内存
 const size_t NLISTS = 184; //数组元素总的有多少个，由对齐规则计算得来
 const size_t PAGE_SHIFT = 12;
 const size_t NPAGES = 129;
 
+// 分支预测和预取提示，只用在快速路径上
+#if defined(__GNUC__) || defined(__clang__)
+#define LIKELY(x) __builtin_expect(!!(x), 1)
+#define UNLIKELY(x) __builtin_expect(!!(x), 0)
+#define PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define LIKELY(x) (x)
+#define UNLIKELY(x) (x)
+#define PREFETCH(addr) ((void)(addr))
+#endif
+
+// 对象生命周期的提示：长期存活的对象(缓存、连接状态等)放在单独的span中
+// 避免一个存活的对象让整个装满短期对象的span无法还给PageCache
+enum class LifetimeHint
+{
+	ShortLived,
+	LongLived,
+};
+
 
 inline static void*& NEXT_OBJ(void* obj)//抢取对象头四个或者头八个字节，void*的别名，本省是内存，只能我们自己取
 {
@@ -106,15 +171,15 @@ class SizeClass
 {
 public:
 	//获取Freelist的位置
-	inline static size_t _Index(size_t size, size_t align)
+	static constexpr size_t _Index(size_t size, size_t align)
 	{
-		size_t alignnum = 1 << align;  //库里实现的方法
+		size_t alignnum = (size_t)1 << align;  //库里实现的方法
 		return ((size + alignnum - 1) >> align) - 1;
 	}
 
-	inline static size_t _Roundup(size_t size, size_t align)
+	static constexpr size_t _Roundup(size_t size, size_t align)
 	{
-		size_t alignnum = 1 << align;
+		size_t alignnum = (size_t)1 << align;
 		return (size + alignnum - 1)&~(alignnum - 1);
 	}
 
@@ -124,33 +189,33 @@ public:
 	// [129,1024]			16byte对齐 freelist[16,72)
 	// [1025,8*1024]		128byte对齐 freelist[72,128)
 	// [8*1024+1,64*1024]	1024byte对齐 freelist[128,184)
+	// 这几个函数都是 constexpr 的，大小在编译期已知时(例如 ObjectPool<T>)位置也在编译期算出
 
-	inline static size_t Index(size_t size)
+	static constexpr size_t Index(size_t size)
 	{
 		assert(size <= MAX_BYTES);
 
-		// 每个区间有多少个链
-		static int group_array[4] = { 16, 56, 56, 56 };
+		// 每个区间有多少个链 { 16, 56, 56, 56 }
 		if (size <= 128)
 		{
 			return _Index(size, 3);
 		}
 		else if (size <= 1024)
 		{
-			return _Index(size - 128, 4) + group_array[0];
+			return _Index(size - 128, 4) + 16;
 		}
 		else if (size <= 8192)
 		{
-			return _Index(size - 1024, 7) + group_array[0] + group_array[1];
+			return _Index(size - 1024, 7) + 16 + 56;
 		}
 		else//if (size <= 65536)
 		{
-			return _Index(size - 8 * 1024, 10) + group_array[0] + group_array[1] + group_array[2];
+			return _Index(size - 8 * 1024, 10) + 16 + 56 + 56;
 		}
 	}
 
 	// 对齐大小计算，向上取整
-	static inline size_t Roundup(size_t bytes)
+	static constexpr size_t Roundup(size_t bytes)
 	{
 		assert(bytes <= MAX_BYTES);
 
@@ -168,6 +233,25 @@ public:
 		}
 	}
 
+	// Index的逆运算：由freelist的位置得到该位置对象的大小
+	static constexpr size_t Size(size_t index)
+	{
+		assert(index < NLISTS);
+
+		if (index < 16){
+			return (index + 1) << 3;
+		}
+		else if (index < 72){
+			return 128 + ((index - 16 + 1) << 4);
+		}
+		else if (index < 128){
+			return 1024 + ((index - 72 + 1) << 7);
+		}
+		else {
+			return 8 * 1024 + ((index - 128 + 1) << 10);
+		}
+	}
+
 
 	/* 关于动态计算
 	size		NumMoveSize		NumMovePage
@@ -186,12 +270,12 @@ public:
 	*/
 
 	//动态计算从中心缓存分配多少个size字节大小的内存到ThreadCache中
-	static size_t NumMoveSize(size_t size)
+	static constexpr size_t NumMoveSize(size_t size)
 	{
 		if (size == 0)
 			return 0;
 
-		int num = (int)(MAX_BYTES / size);
+		size_t num = MAX_BYTES / size;
 		if (num < 2)
 			num = 2;
 
@@ -202,7 +286,7 @@ public:
 	}
 
 	// 根据size计算中心缓存要从页缓存获取多大的span对象
-	static size_t NumMovePage(size_t size)
+	static constexpr size_t NumMovePage(size_t size)
 	{
 		size_t num = NumMoveSize(size);
 		size_t npage = num*size;
@@ -219,6 +303,9 @@ public:
 	typedef unsigned long long PageID;
 #endif //_WIN32
 
+// 不属于任何arena的span(还没有交给PageCache)
+const uint8_t NO_ARENA = 0xFF;
+
 //Span是一个跨度，既可以分配内存出去，也是负责将内存回收回来到PageCache合并
 //是一链式结构，定义为结构体就行，避免需要很多的友元
 struct Span
@@ -233,104 +320,165 @@ struct Span
 	size_t _objsize = 0;//对象的大小
 
 	size_t _usecount = 0;//对象使用计数,
+	bool _isuse = false;//是否正在被使用(分配给CentralCache或大对象)，PageCache只合并空闲的span
+	bool _uncoalesced = false;//放回PageCache之后还没有合并，同时在空闲span和 PageCache 的待合并链表中
+	bool _stalemap = false;//空闲span中间的页的映射可能是旧的(合并过，或者刚向系统申请)，分配出去时要重新设置每一页
+	bool _hasclass = false;//空闲span有的页在 _classmap 中不是0，分配出去时要重新设置每一页
+	bool _longlived = false;//在CentralCache中属于长期对象的span链表
+	// 所属arena的编号(见 CacheArena.h)，私有堆的span都是0
+	// 别的arena合并时会不加锁读这个值(所以是原子的，用 relaxed 读写)，span对象重新构造的过程中是 NO_ARENA，不会被当成自己的
+	std::atomic<uint8_t> _arena{ NO_ARENA };
+	// 被生命周期分析器采样、还没有释放的对象个数，在分析器的锁内修改，释放时不加锁读
+	std::atomic<uint32_t> _nsampled{ 0 };
+	// 被堆分析器采样、还没有释放的对象个数，在分析器的锁内修改，释放时不加锁读
+	std::atomic<uint32_t> _nheapsampled{ 0 };
+
+	// 按地址排序的空闲span树中的左右孩子(见 SpanTree)
+	Span* _left = nullptr;
+	Span* _right = nullptr;
+	// PageCache 待合并链表中的前后节点(_uncoalesced 时)
+	Span* _pendprev = nullptr;
+	Span* _pendnext = nullptr;
 };
 
 
 
 #define NUM_OF_SPAN_PER_POOL 1024
 
-// 存放 Span 的池
-// 因为我们使用了 brk/sbrk，所以无法继续使用 new/delete
-// SpanPool 被设计为单例模式
-class SpanPool
+// 存放内存池元数据(Span、ThreadCache等)的对象池
+// 因为我们使用了 brk/sbrk，而且内存池要能替换掉 malloc，所以这里无法继续使用 new/delete
+// 内存直接向系统申请，一次申请 N 个对象，释放的对象挂在自由链表上重复使用
+// 构造函数是 constexpr 的，静态对象在任何代码运行之前就已经初始化好了
+template<class T, size_t N>
+class MetaPool
 {
 public:
-    SpanPool() : _used(0), _capacity(NUM_OF_SPAN_PER_POOL), _pool(1, nullptr)
-    {
-        // 使用 mmap 申请内存
-#ifdef _WIN32
-		_pool[0] = VirtualAlloc(0, sizeof(Span) * NUM_OF_SPAN_PER_POOL, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE); 
-#elif __linux__
-		_pool[0] = mmap(nullptr, sizeof(Span) * NUM_OF_SPAN_PER_POOL, PROT_WRITE | PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
-#endif
-        _curr = static_cast<Span*>(_pool[0]);
-    }
-    ~SpanPool()
-    {
-        for(void *ptr : _pool)
-        {
-#ifdef _WIN32
-			VirtualFree(ptr, 0, MEM_RELEASE);
-#elif __linux__
-            munmap(ptr, sizeof(Span) * NUM_OF_SPAN_PER_POOL);
-#elif _WIN32
+	constexpr MetaPool() {}
 
-#endif
-        }
-    }
-    Span* getOneSpan()
-    {
-        Span *ret = nullptr;
-        if(_used != _capacity)
-        {
-            ++_used;
-            ret = _curr;
-            _curr += 1;
-        }
-        else
-        {
-            // 空间不够，申请新的空间
-            int n = _pool.size();
-            _pool.emplace_back(nullptr);
-#ifdef _WIN32
-			_pool[n] = VirtualAlloc(0, sizeof(Span) * NUM_OF_SPAN_PER_POOL, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
-#elif __linux__
-            _pool[n] = mmap(nullptr, sizeof(Span) * NUM_OF_SPAN_PER_POOL, PROT_WRITE | PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
-#endif
-            _curr = static_cast<Span*>(_pool[n]) + 1;
-            ++_used;
-            _capacity += NUM_OF_SPAN_PER_POOL;
-            ret = static_cast<Span*>(_pool[n]);
-        }
-        return ret;
-    }
-	static SpanPool* GetInstance()
-	{
-		static SpanPool * _instance = new SpanPool;
-		return _instance;
+	MetaPool(const MetaPool&) = delete;
+	MetaPool& operator=(const MetaPool&) = delete;
+
+	T* getOne()
+	{
+		void* obj = nullptr;
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			if (_freelist != nullptr)
+			{
+				obj = _freelist;
+				_freelist = NEXT_OBJ(_freelist);
+			}
+			else
+			{
+				if (_curr == _end)
+				{
+					// 空间不够，申请新的空间，第一个对象的位置用来把所有块链起来
+					T* chunk = static_cast<T*>(SystemAlloc(sizeof(T) * N));
+					if (chunk == nullptr)
+						throw std::bad_alloc();
+					NEXT_OBJ(chunk) = _chunks;
+					_chunks = chunk;
+					++_nchunk;
+					_curr = chunk + 1;
+					_end = chunk + N;
+				}
+				obj = _curr++;
+			}
+			++_used;
+		}
+		return new (obj) T;
+	}
+
+	void release(T* obj)
+	{
+		obj->~T();
+		std::unique_lock<std::mutex> lock(_mutex);
+		NEXT_OBJ(obj) = _freelist;
+		_freelist = obj;
+		--_used;
+	}
+
+	// 不调用析构函数，把所有内存一次性还给系统(私有堆销毁时使用)
+	void releaseAll()
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		while (_chunks != nullptr)
+		{
+			void* next = NEXT_OBJ(_chunks);
+			SystemFree(_chunks, sizeof(T) * N);
+			_chunks = next;
+		}
+		_curr = _end = nullptr;
+		_freelist = nullptr;
+		_used = 0;
+		_nchunk = 0;
+	}
+
+	// 正在使用的对象个数
+	size_t used()
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		return _used;
+	}
+
+	// 向系统申请的字节数
+	size_t reserved()
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		return _nchunk * sizeof(T) * N;
 	}
+
+	void Lock()
+	{
+		_mutex.lock();
+	}
+
+	void Unlock()
+	{
+		_mutex.unlock();
+	}
+
 private:
-    std::vector<void*> _pool;
-    Span* _curr; // 指向当前可用的Span的指针
-    size_t _capacity;
-    size_t _used;
+	std::mutex _mutex;
+	T* _curr = nullptr; // 指向当前可用的对象
+	T* _end = nullptr;
+	void* _freelist = nullptr; // 释放回来的对象
+	void* _chunks = nullptr; // 向系统申请的所有块
+	size_t _used = 0;
+	size_t _nchunk = 0;
 };
 
-//和上面的Freelist一样，各个接口自己实现，双向带头循环的Span链表
-class SpanList
+// 存放 Span 的池，每个 PageCache 有自己的 SpanPool
+class SpanPool : public MetaPool<Span, NUM_OF_SPAN_PER_POOL>
 {
 public:
-	Span* _head;
-	std::mutex _mutex;
-	SpanPool *_spanPool;
+	Span* getOneSpan()
+	{
+		return getOne();
+	}
 
-public:
-	SpanList(): _spanPool(SpanPool::GetInstance())
+	void releaseSpan(Span* span)
 	{
-		_head = _spanPool->getOneSpan();
-		_head->_next = _head;
-		_head->_prev = _head;
+		release(span);
 	}
+};
 
-	~SpanList()//释放链表的每个节点
+// 头节点直接放在SpanList内部，构造函数是constexpr的，
+// 这样CentralCache/PageCache的静态对象不需要动态初始化，第一次malloc时就可以使用
+class SpanList
+{
+public:
+	Span* _head;
+	PoolLock _mutex;//锁的实现见 Lock.h
+
+private:
+	Span _headspan;
+
+public:
+	constexpr SpanList() : _head(&_headspan)
 	{
-		Span * cur = _head->_next;
-		while (cur != _head)
-		{
-			Span* next = cur->_next;
-			cur = next;
-		}
-		_head = nullptr;
+		_headspan._next = &_headspan;
+		_headspan._prev = &_headspan;
 	}
 
 	//防止拷贝构造和赋值构造，将其封死，没有拷贝的必要，不然就自己会实现浅拷贝
@@ -416,3 +564,111 @@ public:
 		_mutex.unlock();
 	}
 };
+
+// 按起始页号排序的空闲span集合，PageCache 的地址优先策略使用(见 PageCache.h 中的 SpanPolicy)
+// treap：按页号是二叉搜索树，按页号的散列值是堆，期望深度 O(log n)；用 Span 的 _left/_right 链接，不另外申请内存
+// 由调用者加锁
+class SpanTree
+{
+public:
+	constexpr SpanTree() {}
+
+	SpanTree(const SpanTree&) = delete;
+	SpanTree& operator=(const SpanTree&) = delete;
+
+	bool Empty() const
+	{
+		return _root == nullptr;
+	}
+
+	size_t Size() const
+	{
+		return _size;
+	}
+
+	// 地址最低的span
+	Span* Lowest() const
+	{
+		Span* span = _root;
+		while (span != nullptr && span->_left != nullptr)
+			span = span->_left;
+		return span;
+	}
+
+	void Insert(Span* span)
+	{
+		// 找到优先级比 span 低的第一个节点，把以它为根的子树按页号分成 span 的左右子树
+		Span** link = &_root;
+		while (*link != nullptr && Priority(*link) >= Priority(span))
+			link = span->_pageid < (*link)->_pageid ? &(*link)->_left : &(*link)->_right;
+		Span* tree = *link;
+		Span** left = &span->_left;
+		Span** right = &span->_right;
+		while (tree != nullptr)
+		{
+			if (tree->_pageid < span->_pageid)
+			{
+				*left = tree;
+				left = &tree->_right;
+				tree = tree->_right;
+			}
+			else
+			{
+				*right = tree;
+				right = &tree->_left;
+				tree = tree->_left;
+			}
+		}
+		*left = nullptr;
+		*right = nullptr;
+		*link = span;
+		++_size;
+	}
+
+	// span 必须在树中
+	void Erase(Span* span)
+	{
+		Span** link = &_root;
+		while (*link != span)
+			link = span->_pageid < (*link)->_pageid ? &(*link)->_left : &(*link)->_right;
+		// 左右子树按优先级合并，接到原来的位置
+		Span* left = span->_left;
+		Span* right = span->_right;
+		while (left != nullptr && right != nullptr)
+		{
+			if (Priority(left) > Priority(right))
+			{
+				*link = left;
+				link = &left->_right;
+				left = left->_right;
+			}
+			else
+			{
+				*link = right;
+				link = &right->_left;
+				right = right->_left;
+			}
+		}
+		*link = left != nullptr ? left : right;
+		span->_left = nullptr;
+		span->_right = nullptr;
+		--_size;
+	}
+
+	Span* PopLowest()
+	{
+		Span* span = Lowest();
+		Erase(span);
+		return span;
+	}
+
+private:
+	static uint64_t Priority(const Span* span)
+	{
+		uint64_t x = (uint64_t)span->_pageid * 0x9E3779B97F4A7C15ull;
+		return x ^ (x >> 29);
+	}
+
+	Span* _root = nullptr;
+	size_t _size = 0;
+};
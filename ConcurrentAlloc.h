@@ -3,15 +3,31 @@
 #include "Common.h"
 #include "ThreadCache.h"
 #include "PageCache.h"
+#include "CacheArena.h"
+#include "TraceRecorder.h"
+
+// 大对象的采样计数也记在ThreadCache中，只在堆分析器运行时调用
+static inline ThreadCache* ThreadCacheForSampling()
+{
+	if (tlslist == nullptr)
+		tlslist = ThreadCache::Create();
+	return tlslist;
+}
 
 //被动调用，哪个线程来了之后，需要内存就调用这个接口
-static inline void* ConcurrentAlloc(size_t size)
+//长期存活的小对象传入 LifetimeHint::LongLived，和短期对象放在不同的span中(大对象忽略hint)
+static inline void* ConcurrentAlloc(size_t size, LifetimeHint hint = LifetimeHint::ShortLived)
 {
 	if (size > MAX_BYTES)//超过一个最大值 64k，认为是大对象，直接向PageCache中获取
 	{
 		//return malloc(size);
-		Span* span = PageCache::GetInstence()->AllocBigPageObj(size);
+		// 有ThreadCache的线程从自己的arena申请
+		PageCache* pagecache = tlslist != nullptr ? tlslist->GetCentralCache()->GetPageCache() : PageCache::GetInstence();
+		Span* span = pagecache->AllocBigPageObj(size);
 		void* ptr = (void*)(span->_pageid << PAGE_SHIFT);
+		if (UNLIKELY(heap_profiling.load(std::memory_order_relaxed)))
+			ThreadCacheForSampling()->SampleBigAllocation(ptr, size);
+		TraceAllocHook(ptr, size);
 		return ptr;
 	}
 	else
@@ -19,24 +35,113 @@ static inline void* ConcurrentAlloc(size_t size)
 		//变量tlslist用来申请工具
 		if (tlslist == nullptr)//第一次来，自己创建，后面来的，就可以直接使用当前创建好的内存池
 		{
-			tlslist = new ThreadCache;
+			tlslist = ThreadCache::Create();
 		}
-		return tlslist->Allocate(size);
+		void* ptr = tlslist->Allocate(size, hint);
+		TraceAllocHook(ptr, size);
+		return ptr;
 	}
 }
 
+// 按 align 对齐申请内存，align 必须是2的幂；定义 USE_SEGMENT 时 align 达到 SEGMENT_SIZE 会抛出 std::bad_alloc
+static inline void* ConcurrentAllocAligned(size_t size, size_t align)
+{
+	if (align <= ((size_t)1 << PAGE_SHIFT))
+	{
+		// span 的起始地址按页对齐，大小是 align 整数倍的对象也都是按 align 对齐的
+		size = (size + align - 1) & ~(align - 1);
+		return ConcurrentAlloc(size);
+	}
 
+	// 超过一页的对齐：多申请一些页，在span内部找到对齐的地址，span的每一页都有映射
+	PageCache* pagecache = tlslist != nullptr ? tlslist->GetCentralCache()->GetPageCache() : PageCache::GetInstence();
+	Span* span = pagecache->AllocBigPageObj(size > MAX_BYTES ? size : MAX_BYTES + 1, align);
+	size_t ptr = (size_t)(span->_pageid << PAGE_SHIFT);
+	ptr = (ptr + align - 1) & ~(align - 1);
+	if (UNLIKELY(heap_profiling.load(std::memory_order_relaxed)))
+		ThreadCacheForSampling()->SampleBigAllocation((void*)ptr, size);
+	TraceAllocHook((void*)ptr, size);
+	return (void*)ptr;
+}
 
-static inline void ConcurrentFree(void* ptr)//最后释放
+// 已经知道ptr所属的span时直接释放，省去一次查找
+static inline void ConcurrentFree(void* ptr, Span* span)
 {
-	Span* span = PageCache::GetInstence()->MapObjectToSpan(ptr);
+	TraceFreeHook(ptr);
 	size_t size = span->_objsize;
+	// Arena的span仍然在映射表中但_objsize为0，不能用ConcurrentFree释放，否则SizeClass::Index(0)会下溢
+	assert(size != 0);
 	if (size > MAX_BYTES)
 	{
-		PageCache::GetInstence()->FreeBigPageObj(ptr, span);
+		if (UNLIKELY(heap_profiling.load(std::memory_order_relaxed)))
+			ThreadCacheForSampling()->ProfileDeallocation(ptr, span);
+		SpanPageCache(span)->FreeBigPageObj(ptr, span);
 	}
 	else
 	{
-		tlslist->Deallocate(ptr, size);
+		//没有申请过内存的线程也可能释放别的线程申请的内存
+		if (tlslist == nullptr)
+		{
+			tlslist = ThreadCache::Create();
+		}
+		tlslist->Deallocate(ptr, size, span->_longlived ? LifetimeHint::LongLived : LifetimeHint::ShortLived);
+	}
+}
+
+// 普通小对象只读每页一个字节的大小类数组，不访问Span，其余的查找span之后释放
+static inline bool ConcurrentFreeSmall(void* ptr)
+{
+	size_t sizeclass = PageCache::GetInstence()->LookupClass(ptr);
+	if (UNLIKELY(sizeclass == 0))
+		return false;
+
+	TraceFreeHook(ptr);
+	if (tlslist == nullptr)
+	{
+		tlslist = ThreadCache::Create();
+	}
+	tlslist->DeallocateIndex(ptr, sizeclass - 1);
+	return true;
+}
+
+static inline void ConcurrentFree(void* ptr)//最后释放
+{
+	if (LIKELY(ConcurrentFreeSmall(ptr)))
+		return;
+	Span* span = PageCache::GetInstence()->MapObjectToSpan(ptr);
+	ConcurrentFree(ptr, span);
+}
+
+// 调用者知道申请时的大小(例如 STL 分配器)时使用，小对象不需要查找span
+// size 必须和申请时传入的大小相同(对齐申请时为按 align 取整之后的大小)
+static inline void ConcurrentFreeSized(void* ptr, size_t size)
+{
+	if (size > MAX_BYTES)
+	{
+		ConcurrentFree(ptr);
+		return;
+	}
+
+	TraceFreeHook(ptr);
+	if (tlslist == nullptr)
+	{
+		tlslist = ThreadCache::Create();
+	}
+	tlslist->Deallocate(ptr, size);
+}
+
+// ptr 实际可以使用的字节数
+static inline size_t ConcurrentUsableSize(void* ptr)
+{
+	size_t sizeclass = PageCache::GetInstence()->LookupClass(ptr);
+	if (sizeclass != 0)
+		return SizeClass::Size(sizeclass - 1);
+
+	Span* span = PageCache::GetInstence()->MapObjectToSpan(ptr);
+	if (span->_objsize > MAX_BYTES)
+	{
+		// 大对象可能是对齐申请的，ptr不一定是起始地址
+		return (span->_pageid << PAGE_SHIFT) + span->_objsize - (size_t)ptr;
 	}
-}
\ No newline at end of file
+	return span->_objsize;
+}
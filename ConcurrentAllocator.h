@@ -0,0 +1,107 @@
+#pragma once
+
+#include "ConcurrentAlloc.h"
+
+#include <limits>
+#include <memory_resource>
+
+// 让 STL 容器直接使用内存池，不需要替换全局的 malloc
+//     std::map<int, int, std::less<int>, ConcurrentAllocator<std::pair<const int, int>>> m;
+//     std::pmr::map<int, int> pm(ConcurrentMemoryResource::GetInstance());
+
+// 对齐要求超过 8 字节时按 align 申请，释放时的大小也要按 align 取整
+static inline size_t ConcurrentAllocatorSize(size_t bytes, size_t align)
+{
+	if (bytes == 0)
+		bytes = 1;
+	if (align > sizeof(void*))
+		bytes = (bytes + align - 1) & ~(align - 1);
+	return bytes;
+}
+
+static inline void* ConcurrentAllocatorAlloc(size_t bytes, size_t align)
+{
+	bytes = ConcurrentAllocatorSize(bytes, align);
+	if (align > sizeof(void*))
+		return ConcurrentAllocAligned(bytes, align);
+	return ConcurrentAlloc(bytes);
+}
+
+static inline void ConcurrentAllocatorFree(void* ptr, size_t bytes, size_t align)
+{
+	if (align > ((size_t)1 << PAGE_SHIFT))
+	{
+		// 超过一页的对齐申请的是大对象，大小和申请时不同，按span释放
+		ConcurrentFree(ptr);
+		return;
+	}
+	ConcurrentFreeSized(ptr, ConcurrentAllocatorSize(bytes, align));
+}
+
+// 满足 Allocator 要求的分配器，所有实例共用同一个内存池
+template<class T>
+class ConcurrentAllocator
+{
+public:
+	typedef T value_type;
+	typedef std::true_type propagate_on_container_move_assignment;
+	typedef std::true_type is_always_equal;
+
+	ConcurrentAllocator() noexcept {}
+
+	template<class U>
+	ConcurrentAllocator(const ConcurrentAllocator<U>&) noexcept {}
+
+	T* allocate(size_t n)
+	{
+		if (n > std::numeric_limits<size_t>::max() / sizeof(T))
+			throw std::bad_array_new_length();
+		return static_cast<T*>(ConcurrentAllocatorAlloc(n * sizeof(T), alignof(T)));
+	}
+
+	// 带大小释放，小对象不需要查找span
+	void deallocate(T* ptr, size_t n) noexcept
+	{
+		ConcurrentAllocatorFree(ptr, n * sizeof(T), alignof(T));
+	}
+};
+
+template<class T, class U>
+inline bool operator==(const ConcurrentAllocator<T>&, const ConcurrentAllocator<U>&) noexcept
+{
+	return true;
+}
+
+template<class T, class U>
+inline bool operator!=(const ConcurrentAllocator<T>&, const ConcurrentAllocator<U>&) noexcept
+{
+	return false;
+}
+
+// std::pmr::memory_resource 适配器，支持任意2的幂的对齐
+class ConcurrentMemoryResource : public std::pmr::memory_resource
+{
+public:
+	static ConcurrentMemoryResource* GetInstance()
+	{
+		static ConcurrentMemoryResource _instance;
+		return &_instance;
+	}
+
+private:
+	void* do_allocate(size_t bytes, size_t align) override
+	{
+		return ConcurrentAllocatorAlloc(bytes, align);
+	}
+
+	void do_deallocate(void* ptr, size_t bytes, size_t align) override
+	{
+		ConcurrentAllocatorFree(ptr, bytes, align);
+	}
+
+	// 所有实例共用同一个内存池，一个实例申请的内存可以由另一个实例释放
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+	{
+		return this == &other || dynamic_cast<const ConcurrentMemoryResource*>(&other) != nullptr;
+	}
+};
@@ -0,0 +1,106 @@
+#include "ConcurrentHeap.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+// 所有私有堆的登记表，线程退出时据此判断自己的ThreadCache所属的堆是否还存在
+static std::mutex heaps_mutex;
+static ConcurrentHeap* heaps[MAX_HEAPS];
+static uint64_t heaps_gen = 0;
+
+static MetaPool<HeapThreadCaches, 16>* HeapThreadCachesPool()
+{
+	static MetaPool<HeapThreadCaches, 16> pool;
+	return &pool;
+}
+
+// 线程退出时，把还存在的堆上的ThreadCache中的对象还给堆的CentralCache
+static void DestroyHeapThreadCaches(HeapThreadCaches* table)
+{
+	{
+		std::unique_lock<std::mutex> lock(heaps_mutex);
+		for (size_t i = 0; i < MAX_HEAPS; ++i)
+		{
+			ConcurrentHeap* heap = heaps[i];
+			if (table->_tc[i] == nullptr || heap == nullptr || heap->_gen != table->_gen[i])
+				continue;
+			table->_tc[i]->ReleaseAll();
+			heap->_tcpool.release(table->_tc[i]);
+		}
+	}
+	if (tlsheaps == table)
+		tlsheaps = nullptr;
+	HeapThreadCachesPool()->release(table);
+}
+
+#ifdef __linux__
+static pthread_key_t heap_key;
+static pthread_once_t heap_key_once = PTHREAD_ONCE_INIT;
+
+static void HeapKeyDestructor(void* table)
+{
+	DestroyHeapThreadCaches(static_cast<HeapThreadCaches*>(table));
+}
+
+static void CreateHeapKey()
+{
+	pthread_key_create(&heap_key, HeapKeyDestructor);
+}
+#endif
+
+ConcurrentHeap* ConcurrentHeapCreate()
+{
+	std::unique_lock<std::mutex> lock(heaps_mutex);
+	size_t slot = 0;
+	while (slot < MAX_HEAPS && heaps[slot] != nullptr)
+		++slot;
+	if (slot == MAX_HEAPS)
+		throw std::bad_alloc();
+
+	// 不能用 new，替换 malloc 之后 new 会调用到全局内存池
+	void* mem = SystemAlloc(sizeof(ConcurrentHeap));
+	if (mem == nullptr)
+		throw std::bad_alloc();
+	ConcurrentHeap* heap = new (mem) ConcurrentHeap(slot, ++heaps_gen);
+	heaps[slot] = heap;
+	return heap;
+}
+
+void ConcurrentHeapDestroy(ConcurrentHeap* heap)
+{
+	{
+		// 从登记表中删除之后，各线程表中的记录都失效了，不再访问这个堆
+		std::unique_lock<std::mutex> lock(heaps_mutex);
+		assert(heaps[heap->_slot] == heap);
+		heaps[heap->_slot] = nullptr;
+	}
+
+	// 不遍历对象和span，所有内存按块还给系统
+	heap->_central.DropTransfer();
+	heap->_pagecache.ReleaseAllMemory();
+	heap->_tcpool.releaseAll();
+	heap->~ConcurrentHeap();
+	SystemFree(heap, sizeof(ConcurrentHeap));
+}
+
+ThreadCache* ConcurrentHeapThreadCacheSlow(ConcurrentHeap* heap)
+{
+	HeapThreadCaches* table = tlsheaps;
+	if (table == nullptr)
+	{
+		table = HeapThreadCachesPool()->getOne();
+		tlsheaps = table;
+#ifdef __linux__
+		pthread_once(&heap_key_once, CreateHeapKey);
+		pthread_setspecific(heap_key, table);
+#endif
+	}
+
+	// 位置上原来的ThreadCache属于已经销毁的堆，它的内存随堆一起释放了，直接覆盖
+	ThreadCache* tc = heap->_tcpool.getOne();
+	tc->SetCentralCache(&heap->_central);
+	table->_tc[heap->_slot] = tc;
+	table->_gen[heap->_slot] = heap->_gen;
+	return tc;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "Common.h"
+#include "ThreadCache.h"
+#include "CentralCache.h"
+#include "PageCache.h"
+
+// 同时存在的私有堆的最大个数
+const size_t MAX_HEAPS = 64;
+
+// 私有堆：拥有自己的CentralCache和PageCache，每个线程在每个堆上有自己的ThreadCache
+// 和全局内存池以及其他私有堆互不干扰，销毁时按向系统申请的内存块整体释放，代价只和内存块的个数有关
+//     ConcurrentHeap* heap = ConcurrentHeapCreate();
+//     void* p = ConcurrentHeapAlloc(heap, 100);
+//     ConcurrentHeapFree(heap, p);          // 可以不释放，销毁时一起回收
+//     ConcurrentHeapDestroy(heap);
+// 注意：私有堆的内存只能用 ConcurrentHeapFree 释放；销毁时不能有其他线程还在使用这个堆
+// (名字带 Concurrent 前缀，避免和 Windows 的 HeapCreate/HeapAlloc 等函数重名)
+struct ConcurrentHeap
+{
+	PageCache _pagecache;
+	CentralCache _central;
+	MetaPool<ThreadCache, 16> _tcpool;//每个线程在这个堆上的ThreadCache
+	size_t _slot;//在全局登记表中的位置
+	uint64_t _gen;//全局唯一的编号，堆销毁之后位置会被复用，用编号区分
+
+	ConcurrentHeap(size_t slot, uint64_t gen)
+		: _pagecache(true)
+		, _central(&_pagecache)
+		, _slot(slot)
+		, _gen(gen)
+	{}
+};
+
+// 每个线程一张表，按堆的位置记录这个线程在各个堆上的ThreadCache
+struct HeapThreadCaches
+{
+	ThreadCache* _tc[MAX_HEAPS] = {};
+	uint64_t _gen[MAX_HEAPS] = {};//_tc[i] 属于哪个堆，和堆的编号不同说明堆已经销毁
+};
+
+inline thread_local HeapThreadCaches* tlsheaps = nullptr;
+
+ConcurrentHeap* ConcurrentHeapCreate();
+void ConcurrentHeapDestroy(ConcurrentHeap* heap);
+
+// 当前线程第一次使用这个堆时，创建ThreadCache
+ThreadCache* ConcurrentHeapThreadCacheSlow(ConcurrentHeap* heap);
+
+static inline ThreadCache* ConcurrentHeapThreadCache(ConcurrentHeap* heap)
+{
+	HeapThreadCaches* table = tlsheaps;
+	if (LIKELY(table != nullptr && table->_gen[heap->_slot] == heap->_gen))
+		return table->_tc[heap->_slot];
+	return ConcurrentHeapThreadCacheSlow(heap);
+}
+
+static inline void* ConcurrentHeapAlloc(ConcurrentHeap* heap, size_t size)
+{
+	if (size > MAX_BYTES)
+	{
+		Span* span = heap->_pagecache.AllocBigPageObj(size);
+		return (void*)(span->_pageid << PAGE_SHIFT);
+	}
+	return ConcurrentHeapThreadCache(heap)->Allocate(size);
+}
+
+static inline void ConcurrentHeapFree(ConcurrentHeap* heap, void* ptr)
+{
+	size_t sizeclass = heap->_pagecache.LookupClass(ptr);
+	if (LIKELY(sizeclass != 0))
+	{
+		ConcurrentHeapThreadCache(heap)->DeallocateIndex(ptr, sizeclass - 1);
+		return;
+	}
+
+	Span* span = heap->_pagecache.MapObjectToSpan(ptr);
+	size_t size = span->_objsize;
+	if (size > MAX_BYTES)
+		heap->_pagecache.FreeBigPageObj(ptr, span);
+	else
+		ConcurrentHeapThreadCache(heap)->Deallocate(ptr, size, span->_longlived ? LifetimeHint::LongLived : LifetimeHint::ShortLived);
+}
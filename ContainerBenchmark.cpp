@@ -0,0 +1,139 @@
+#include "Common.h"
+#include "ConcurrentAllocator.h"
+
+#include <chrono>
+#include <list>
+#include <map>
+#include <unordered_map>
+
+// 比较 STL 容器使用 std::allocator、ConcurrentAllocator 和 pmr 适配器时的耗时
+
+template<class Alloc>
+using Map = std::map<int, int, std::less<int>, typename std::allocator_traits<Alloc>::template rebind_alloc<std::pair<const int, int>>>;
+
+template<class Alloc>
+using HashMap = std::unordered_map<int, int, std::hash<int>, std::equal_to<int>, typename std::allocator_traits<Alloc>::template rebind_alloc<std::pair<const int, int>>>;
+
+template<class Alloc>
+using List = std::list<int, typename std::allocator_traits<Alloc>::template rebind_alloc<int>>;
+
+template<class Alloc>
+using Vector = std::vector<int, typename std::allocator_traits<Alloc>::template rebind_alloc<int>>;
+
+// 每个线程执行 fn，返回所有线程都结束的耗时(ms)
+template<class Fn>
+static double RunThreads(size_t nworks, Fn fn)
+{
+	std::vector<std::thread> vthread(nworks);
+	auto begin = std::chrono::steady_clock::now();
+	for (size_t k = 0; k < nworks; ++k)
+	{
+		vthread[k] = std::thread([&, k]() { fn(k); });
+	}
+	for (size_t k = 0; k < nworks; ++k) vthread[k].join();
+	auto end = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::milli>(end - begin).count();
+}
+
+// map 插入 n 个随机键，再全部删除
+template<class Alloc>
+static double BenchmarkMap(size_t n, size_t nworks, size_t rounds, const Alloc& alloc)
+{
+	return RunThreads(nworks, [&](size_t k) {
+		Map<Alloc> m(alloc);
+		unsigned int seed = (unsigned int)k + 1;
+		for (size_t j = 0; j < rounds; ++j)
+		{
+			for (size_t i = 0; i < n; ++i)
+			{
+				seed = seed * 1103515245 + 12345;
+				m.emplace((int)seed, (int)i);
+			}
+			while (!m.empty())
+				m.erase(m.begin());
+		}
+	});
+}
+
+template<class Alloc>
+static double BenchmarkHashMap(size_t n, size_t nworks, size_t rounds, const Alloc& alloc)
+{
+	return RunThreads(nworks, [&](size_t k) {
+		HashMap<Alloc> m(0, std::hash<int>(), std::equal_to<int>(), alloc);
+		unsigned int seed = (unsigned int)k + 1;
+		for (size_t j = 0; j < rounds; ++j)
+		{
+			for (size_t i = 0; i < n; ++i)
+			{
+				seed = seed * 1103515245 + 12345;
+				m.emplace((int)seed, (int)i);
+			}
+			m.clear();
+		}
+	});
+}
+
+template<class Alloc>
+static double BenchmarkList(size_t n, size_t nworks, size_t rounds, const Alloc& alloc)
+{
+	return RunThreads(nworks, [&](size_t) {
+		List<Alloc> l(alloc);
+		for (size_t j = 0; j < rounds; ++j)
+		{
+			for (size_t i = 0; i < n; ++i)
+				l.push_back((int)i);
+			l.clear();
+		}
+	});
+}
+
+// 大量小 vector 从空开始增长，每次扩容都会申请新内存、释放旧内存
+template<class Alloc>
+static double BenchmarkVector(size_t n, size_t nworks, size_t rounds, const Alloc& alloc)
+{
+	return RunThreads(nworks, [&](size_t) {
+		for (size_t j = 0; j < rounds; ++j)
+		{
+			std::vector<Vector<Alloc>> vv;
+			vv.reserve(n / 64);
+			for (size_t i = 0; i < n / 64; ++i)
+			{
+				vv.emplace_back(alloc);
+				for (int x = 0; x < 64; ++x)
+					vv.back().push_back(x);
+			}
+		}
+	});
+}
+
+#define DEFINE_COMPARE(name, func, label) \
+static void name(size_t n, size_t nworks, size_t rounds) \
+{ \
+	double ts = func(n, nworks, rounds, std::allocator<int>()); \
+	double tc = func(n, nworks, rounds, ConcurrentAllocator<int>()); \
+	double tp = func(n, nworks, rounds, std::pmr::polymorphic_allocator<int>(ConcurrentMemoryResource::GetInstance())); \
+	printf("%-10s %2zu threads  std::allocator: %8.2f ms  ConcurrentAllocator: %8.2f ms  pmr: %8.2f ms  rate: %.3f\n", \
+		label, nworks, ts, tc, tp, ts / tc); \
+}
+
+DEFINE_COMPARE(CompareMap, BenchmarkMap, "map")
+DEFINE_COMPARE(CompareHashMap, BenchmarkHashMap, "hashmap")
+DEFINE_COMPARE(CompareList, BenchmarkList, "list")
+DEFINE_COMPARE(CompareVector, BenchmarkVector, "vector")
+
+int main()
+{
+	size_t n = 100000; // 每轮每个线程的元素个数
+	size_t rounds = 10;
+	size_t arrThreads[] = {1, 4, 8};
+
+	for (size_t nworks : arrThreads)
+	{
+		CompareMap(n, nworks, rounds);
+		CompareHashMap(n, nworks, rounds);
+		CompareList(n, nworks, rounds);
+		CompareVector(n, nworks, rounds);
+		cout << endl;
+	}
+	return 0;
+}
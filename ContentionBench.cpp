@@ -0,0 +1,75 @@
+#include "ConcurrentAlloc.h"
+
+#include <chrono>
+
+// 所有线程反复申请、释放同一个大小类的对象，看中心缓存在竞争下的吞吐量
+// 每轮申请的个数是 ThreadCache 一次批量的几倍，每轮都会到 CentralCache 取、还几次
+// 用法：contention_bench [size] [每个线程的申请次数] [最多的线程数，默认是核数] [arena个数，默认1]
+// contention_bench_lockfree 是同样的程序，CentralCache 使用无锁模式(USE_LOCKFREE_CENTRAL)
+// contention_bench_lockstats 打开锁的统计(LOCK_STATS)，锁的实现用 Lock.h 中的宏切换
+// contention_bench_latency 记录各层申请的耗时(LATENCY_STATS)，看尾部延迟来自哪一层
+// 多arena的对比：contention_bench 4096 1000000 64 1 和 contention_bench 4096 1000000 64 8
+
+static double RunContention(size_t size, size_t nworks, size_t ops)
+{
+	size_t window = 4 * SizeClass::NumMoveSize(SizeClass::Roundup(size));
+	size_t rounds = ops / window + 1;
+	std::vector<std::thread> vthread(nworks);
+	auto begin = std::chrono::steady_clock::now();
+	for (size_t k = 0; k < nworks; ++k)
+	{
+		vthread[k] = std::thread([&]() {
+			std::vector<void*> v(window);
+			for (size_t j = 0; j < rounds; ++j)
+			{
+				for (size_t i = 0; i < window; ++i)
+					v[i] = ConcurrentAlloc(size);
+				for (size_t i = 0; i < window; ++i)
+					ConcurrentFree(v[i]);
+			}
+		});
+	}
+	for (size_t k = 0; k < nworks; ++k) vthread[k].join();
+	auto end = std::chrono::steady_clock::now();
+	double seconds = std::chrono::duration<double>(end - begin).count();
+	return (double)(rounds * window * nworks) / seconds / 1e6;
+}
+
+int main(int argc, char* argv[])
+{
+	size_t size = argc > 1 ? strtoul(argv[1], nullptr, 10) : 4096;
+	size_t ops = argc > 2 ? strtoul(argv[2], nullptr, 10) : 2000000;
+	size_t ncores = argc > 3 ? strtoul(argv[3], nullptr, 10) : std::thread::hardware_concurrency();
+	if (ncores == 0)
+		ncores = 1;
+	size_t narena = ConcurrentAllocSetArenas(argc > 4 ? strtoul(argv[4], nullptr, 10) : 1);
+
+#ifdef USE_LOCKFREE_CENTRAL
+	printf("central: lock-free  arenas: %zu  size: %zu  ops/thread: %zu\n", narena, size, ops);
+#else
+	printf("central: mutex  arenas: %zu  size: %zu  ops/thread: %zu\n", narena, size, ops);
+#endif
+	// 1, 2, 4 ... 直到核数
+	for (size_t nworks = 1; ; nworks *= 2)
+	{
+		if (nworks > ncores)
+			nworks = ncores;
+#ifdef LOCK_STATS
+		ConcurrentAllocLockStatsReset();
+#endif
+#ifdef LATENCY_STATS
+		ConcurrentAllocLatencyReset();
+#endif
+		double mops = RunContention(size, nworks, ops);
+		printf("%3zu threads  %8.2f Mops/s  %8.2f Mops/s/thread\n", nworks, mops, mops / nworks);
+#ifdef LOCK_STATS
+		ConcurrentAllocLockStatsPrint(stdout);
+#endif
+#ifdef LATENCY_STATS
+		ConcurrentAllocLatencyPrint(stdout);
+#endif
+		if (nworks == ncores)
+			break;
+	}
+	return 0;
+}
@@ -0,0 +1,416 @@
+#include "ConcurrentAlloc.h"
+#include "AllocStats.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <unistd.h>
+#endif
+
+// 内存效率的回归测试：按阶段改变负载，定时采样 RSS 和内存池自己的统计，看内存有多少浪费、释放之后多快还给系统
+//     mixed         生命周期混合：每轮申请20000个临时对象，其中穿插20个一直保留的对象，再释放临时对象，
+//                   一共300轮，每轮换一个大小(64~512字节)；保留的对象和后面阶段的对象一起释放
+//     grow-small    申请 16~256 字节的对象，直到活跃的字节数达到目标(默认1GB)
+//     free-90%      随机释放90%
+//     grow-medium   换成 512~2048 字节，再增长到目标
+//     free-90%
+//     grow-large    换成 8KB~32KB，再增长到目标
+//     free-all      全部释放
+//     idle          空闲一段时间，继续采样，看RSS是否下降
+// 用法：fragmentation_bench [concurrent|concurrent-address|concurrent-hint|glibc] [目标MB，默认1024] [线程数，默认1] [采样间隔ms，默认20] [空闲秒数，默认2] [csv文件]
+// 对象平均分给各个线程，阶段之间所有线程同步；活跃字节数按申请时传入的大小计算
+// 每个阶段结束时输出一行，最后输出峰值、稳定状态下 RSS 和活跃字节数之比、空闲期间还给系统的内存
+// 给出 csv 文件时写出完整的采样序列(时间、阶段、活跃、RSS、内存池映射的和空闲的字节数)
+// 两个分配器的对比要分两次运行；RSS 是相对开始时的增量，指针数组在开始之前就申请好并写过
+// concurrent-address 是内存池使用地址优先的最佳适配策略(SpanPolicy::AddressOrdered)，和默认的 LIFO 对比堆的高水位(峰值 mapped)
+// concurrent-hint 在 mixed 阶段用 LifetimeHint::LongLived 申请保留的对象，和 concurrent 对比 mixed 结束时的 RSS
+
+enum class PhaseKind
+{
+	Grow,
+	Free,
+	Idle,
+	Mixed,
+};
+
+struct Phase
+{
+	const char* _name;
+	PhaseKind _kind;
+	size_t _low;//Grow：对象大小范围；Free：释放的百分比；Mixed：每轮的临时对象个数
+	size_t _high;//Mixed：每轮保留的对象个数
+};
+
+static const Phase phases[] = {
+	{ "mixed", PhaseKind::Mixed, 20000, 20 },
+	{ "grow-small", PhaseKind::Grow, 16, 256 },
+	{ "free-90%", PhaseKind::Free, 90, 0 },
+	{ "grow-medium", PhaseKind::Grow, 512, 2048 },
+	{ "free-90%", PhaseKind::Free, 90, 0 },
+	{ "grow-large", PhaseKind::Grow, 8 * 1024, 32 * 1024 },
+	{ "free-all", PhaseKind::Free, 100, 0 },
+	{ "idle", PhaseKind::Idle, 0, 0 },
+};
+const size_t NPHASES = sizeof(phases) / sizeof(phases[0]);
+// mixed 阶段的轮数，每轮的对象大小是 64 + (轮数 % 8) * 64
+const size_t MIXED_ROUNDS = 300;
+
+struct Sample
+{
+	double _time;
+	size_t _phase;
+	size_t _live;
+	size_t _rss;
+	size_t _mapped;//内存池向系统申请、还没有归还的
+	size_t _cached;//内存池中空闲的(ThreadCache + CentralCache + PageCache)
+};
+
+struct Slot
+{
+	void* _ptr = nullptr;
+	size_t _size = 0;
+};
+
+struct BenchAllocator
+{
+	const char* _name;
+	void* (*_alloc)(size_t size);
+	void* (*_alloclong)(size_t size);//mixed 阶段保留的对象
+	void (*_free)(void* ptr);
+	bool _pool;//是否有内存池自己的统计
+};
+
+static void* PoolAlloc(size_t size)
+{
+	return ConcurrentAlloc(size);
+}
+
+static void* PoolAllocLong(size_t size)
+{
+	return ConcurrentAlloc(size, LifetimeHint::LongLived);
+}
+
+static void PoolFree(void* ptr)
+{
+	ConcurrentFree(ptr);
+}
+
+static void* LibcAlloc(size_t size)
+{
+	return malloc(size);
+}
+
+static void LibcFree(void* ptr)
+{
+	free(ptr);
+}
+
+static size_t CurrentRss()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+		return pmc.WorkingSetSize;
+	return 0;
+#else
+	size_t pages = 0, resident = 0;
+	if (FILE* fp = fopen("/proc/self/statm", "r"))
+	{
+		if (fscanf(fp, "%zu %zu", &pages, &resident) != 2)
+			resident = 0;
+		fclose(fp);
+	}
+	return resident * (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+// 所有线程到齐之后一起进入下一阶段
+class PhaseBarrier
+{
+public:
+	explicit PhaseBarrier(size_t n) : _n(n) {}
+
+	void Wait()
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		size_t gen = _gen;
+		if (++_count == _n)
+		{
+			_count = 0;
+			++_gen;
+			_cond.notify_all();
+			return;
+		}
+		_cond.wait(lock, [&]() { return gen != _gen; });
+	}
+
+private:
+	std::mutex _mutex;
+	std::condition_variable _cond;
+	size_t _n;
+	size_t _count = 0;
+	size_t _gen = 0;
+};
+
+// 每个线程的活跃字节数，单独一个缓存行
+struct alignas(64) LiveCounter
+{
+	std::atomic<size_t> _bytes{ 0 };
+};
+
+class BenchRandom
+{
+public:
+	explicit BenchRandom(uint64_t seed) : _state(seed * 0x9E3779B97F4A7C15ull + 1) {}
+
+	size_t Range(size_t low, size_t high)
+	{
+		_state ^= _state << 13;
+		_state ^= _state >> 7;
+		_state ^= _state << 17;
+		return low + (size_t)(_state % (high - low + 1));
+	}
+
+private:
+	uint64_t _state;
+};
+
+int main(int argc, char* argv[])
+{
+	BenchAllocator allocator = { "concurrent", PoolAlloc, PoolAlloc, PoolFree, true };
+	if (argc > 1 && strcmp(argv[1], "glibc") == 0)
+		allocator = { "glibc", LibcAlloc, LibcAlloc, LibcFree, false };
+	else if (argc > 1 && strcmp(argv[1], "concurrent-address") == 0)
+	{
+		allocator = { "concurrent-address", PoolAlloc, PoolAlloc, PoolFree, true };
+		ConcurrentAllocSetSpanPolicy(SpanPolicy::AddressOrdered);
+	}
+	else if (argc > 1 && strcmp(argv[1], "concurrent-hint") == 0)
+		allocator = { "concurrent-hint", PoolAlloc, PoolAllocLong, PoolFree, true };
+	else if (argc > 1 && strcmp(argv[1], "concurrent") != 0)
+	{
+		fprintf(stderr, "unknown allocator %s\n", argv[1]);
+		return 1;
+	}
+	size_t target = (argc > 2 ? strtoul(argv[2], nullptr, 10) : 1024) << 20;
+	size_t nthreads = argc > 3 ? strtoul(argv[3], nullptr, 10) : 1;
+	size_t interval = argc > 4 ? strtoul(argv[4], nullptr, 10) : 20;
+	size_t idle = argc > 5 ? strtoul(argv[5], nullptr, 10) : 2;
+	const char* csv = argc > 6 ? argv[6] : nullptr;
+	if (nthreads == 0)
+		nthreads = 1;
+	if (interval == 0)
+		interval = 1;
+
+	// 对象数组按 grow-small 的平均大小(136字节)多留一些，加上 mixed 阶段保留的对象，先写一遍，不算进 RSS 的增量
+	size_t perthread = target / nthreads;
+	size_t capacity = perthread / 100 + 1024 + MIXED_ROUNDS * phases[0]._high;
+	std::vector<std::vector<Slot>> objects(nthreads);
+	for (auto& v : objects)
+		v.assign(capacity, Slot());
+	std::vector<std::vector<void*>> temps(nthreads);
+	for (auto& t : temps)
+		t.assign(phases[0]._low, nullptr);
+	std::vector<LiveCounter> live(nthreads);
+	std::vector<Sample> samples;
+	samples.reserve(1 << 20);
+	std::atomic<size_t> curphase{ 0 };
+	std::atomic<bool> done{ false };
+	double phaseend[NPHASES] = {};
+	Sample phasesamples[NPHASES] = {};//每个阶段结束时由0号线程采样
+
+	auto sample = [&](double time) {
+		Sample s = {};
+		s._time = time;
+		s._phase = curphase.load(std::memory_order_relaxed);
+		for (auto& c : live)
+			s._live += c._bytes.load(std::memory_order_relaxed);
+		s._rss = CurrentRss();
+		if (allocator._pool)
+		{
+			ConcurrentStats stats;
+			ConcurrentAllocStats(&stats);
+			s._mapped = stats._mapped;
+			s._cached = stats._threadcached + stats._centralfree + stats._pagefree;
+		}
+		return s;
+	};
+
+	size_t baserss = CurrentRss();
+	auto begin = std::chrono::steady_clock::now();
+	auto elapsed = [&]() {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	};
+
+	std::thread sampler([&]() {
+		while (!done.load(std::memory_order_relaxed))
+		{
+			if (samples.size() < samples.capacity())
+				samples.push_back(sample(elapsed()));
+			std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+		}
+	});
+
+	PhaseBarrier barrier(nthreads);
+	std::vector<std::thread> threads;
+	for (size_t k = 0; k < nthreads; ++k)
+	{
+		threads.emplace_back([&, k]() {
+			std::vector<Slot>& v = objects[k];
+			size_t count = 0, bytes = 0;
+			BenchRandom rng(k + 1);
+			for (size_t p = 0; p < NPHASES; ++p)
+			{
+				const Phase& phase = phases[p];
+				if (phase._kind == PhaseKind::Grow)
+				{
+					while (bytes < perthread && count < capacity)
+					{
+						size_t size = rng.Range(phase._low, phase._high);
+						char* ptr = static_cast<char*>(allocator._alloc(size));
+						// 写满对象，RSS 和真实程序一样包括对象占的所有页
+						memset(ptr, 1, size);
+						v[count++] = { ptr, size };
+						bytes += size;
+						live[k]._bytes.store(bytes, std::memory_order_relaxed);
+					}
+				}
+				else if (phase._kind == PhaseKind::Free)
+				{
+					size_t kept = 0;
+					for (size_t i = 0; i < count; ++i)
+					{
+						if (rng.Range(1, 100) <= phase._low)
+						{
+							allocator._free(v[i]._ptr);
+							bytes -= v[i]._size;
+							live[k]._bytes.store(bytes, std::memory_order_relaxed);
+						}
+						else
+						{
+							v[kept++] = v[i];
+						}
+					}
+					count = kept;
+				}
+				else if (phase._kind == PhaseKind::Mixed)
+				{
+					std::vector<void*>& t = temps[k];
+					size_t every = phase._low / phase._high;
+					for (size_t r = 0; r < MIXED_ROUNDS; ++r)
+					{
+						size_t size = 64 + (r % 8) * 64;
+						for (size_t i = 0; i < phase._low; ++i)
+						{
+							t[i] = allocator._alloc(size);
+							memset(t[i], 1, size);
+							if (i % every == 0 && count < capacity)
+							{
+								char* ptr = static_cast<char*>(allocator._alloclong(size));
+								memset(ptr, 1, size);
+								v[count++] = { ptr, size };
+								bytes += size;
+							}
+						}
+						live[k]._bytes.store(bytes + phase._low * size, std::memory_order_relaxed);
+						// 临时对象按随机顺序释放
+						for (size_t i = phase._low - 1; i > 0; --i)
+							std::swap(t[i], t[rng.Range(0, i)]);
+						for (size_t i = 0; i < phase._low; ++i)
+							allocator._free(t[i]);
+						live[k]._bytes.store(bytes, std::memory_order_relaxed);
+					}
+				}
+				else
+				{
+					if (k == 0)
+						std::this_thread::sleep_for(std::chrono::seconds(idle));
+				}
+
+				barrier.Wait();
+				if (k == 0)
+				{
+					phaseend[p] = elapsed();
+					phasesamples[p] = sample(phaseend[p]);
+					curphase.store(p + 1, std::memory_order_relaxed);
+				}
+				barrier.Wait();
+			}
+		});
+	}
+	for (auto& t : threads)
+		t.join();
+	done.store(true);
+	sampler.join();
+
+	const double MB = 1024.0 * 1024.0;
+	printf("allocator: %s  target: %zu MB  threads: %zu  interval: %zu ms  baseline rss: %.1f MB\n",
+		allocator._name, target >> 20, nthreads, interval, baserss / MB);
+	printf("%-12s %8s %10s %10s %11s %11s %9s\n", "phase", "end(s)", "live(MB)", "rss(MB)", "mapped(MB)", "cached(MB)", "rss/live");
+	size_t peakrss = 0, peaklive = 0, peakmapped = 0;
+	for (const Sample& s : samples)
+	{
+		peakrss = s._rss > peakrss ? s._rss : peakrss;
+		peaklive = s._live > peaklive ? s._live : peaklive;
+		peakmapped = s._mapped > peakmapped ? s._mapped : peakmapped;
+	}
+	for (size_t p = 0; p < NPHASES; ++p)
+	{
+		const Sample* last = &phasesamples[p];
+		peakrss = last->_rss > peakrss ? last->_rss : peakrss;
+		peaklive = last->_live > peaklive ? last->_live : peaklive;
+		peakmapped = last->_mapped > peakmapped ? last->_mapped : peakmapped;
+		double rss = last->_rss > baserss ? (double)(last->_rss - baserss) : 0.0;
+		printf("%-12s %8.2f %10.1f %10.1f %11.1f %11.1f %9.2f\n", phases[p]._name, phaseend[p],
+			last->_live / MB, rss / MB, last->_mapped / MB, last->_cached / MB, last->_live == 0 ? 0.0 : rss / last->_live);
+	}
+
+	// 全部释放之后多快还给系统：free-all 结束时的 RSS 增量降到一半用了多久
+	size_t freeall = NPHASES - 2;
+	const Sample* afterfree = nullptr;
+	const Sample* halfway = nullptr;
+	const Sample* lastsample = samples.empty() ? nullptr : &samples.back();
+	for (const Sample& s : samples)
+	{
+		if (s._phase > freeall && afterfree == nullptr)
+			afterfree = &s;
+		if (afterfree != nullptr && halfway == nullptr && s._rss <= baserss + (afterfree->_rss - baserss) / 2)
+			halfway = &s;
+	}
+	printf("peak rss +%.1f MB, peak live %.1f MB, peak rss/live %.2f",
+		peakrss > baserss ? (peakrss - baserss) / MB : 0.0, peaklive / MB,
+		peaklive == 0 ? 0.0 : (double)(peakrss > baserss ? peakrss - baserss : 0) / peaklive);
+	if (allocator._pool)
+		printf(", peak mapped %.1f MB", peakmapped / MB);
+	printf("\n");
+	if (afterfree != nullptr && lastsample != nullptr)
+	{
+		double start = afterfree->_rss > baserss ? (afterfree->_rss - baserss) / MB : 0.0;
+		double end = lastsample->_rss > baserss ? (lastsample->_rss - baserss) / MB : 0.0;
+		printf("after free-all: rss +%.1f MB, after %zu s idle +%.1f MB, ", start, idle, end);
+		if (halfway != nullptr)
+			printf("half returned after %.2f s\n", halfway->_time - phaseend[freeall]);
+		else
+			printf("half not returned\n");
+	}
+
+	if (csv != nullptr)
+	{
+		if (FILE* out = fopen(csv, "w"))
+		{
+			fprintf(out, "time,phase,live,rss,mapped,cached\n");
+			for (const Sample& s : samples)
+			{
+				fprintf(out, "%.3f,%s,%zu,%zu,%zu,%zu\n", s._time, s._phase < NPHASES ? phases[s._phase]._name : "end",
+					s._live, s._rss > baserss ? s._rss - baserss : 0, s._mapped, s._cached);
+			}
+			fclose(out);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,413 @@
+#include "HeapProfiler.h"
+
+#include <cmath>
+#include <cstring>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <unwind.h>
+#endif
+
+namespace
+{
+	struct HeapSample
+	{
+		void* _ptr;
+		size_t _size;//申请时传入的大小
+		uint32_t _stack;//在 stacks 中的下标
+	};
+
+	struct HeapStack
+	{
+		uint64_t _hash;
+		size_t _depth;//0 表示空位
+		void* _frames[HEAP_MAX_DEPTH];//从最内层开始
+		uint64_t _allocs;//累计采样的个数
+		uint64_t _allocbytes;
+	};
+
+	// 输出时在锁内复制出来的一个调用栈
+	struct StackReport
+	{
+		size_t _depth;
+		void* _frames[HEAP_MAX_DEPTH];
+		uint64_t _live;
+		uint64_t _livebytes;
+		uint64_t _allocs;
+		uint64_t _allocbytes;
+		double _estimate;//换算之后的活跃字节数
+	};
+}
+
+// 采样对象表和调用栈表都是开放寻址的哈希表，第一次开始分析时向系统申请，之后一直保留
+// 不能用 new/malloc：记录发生在内存池的申请路径上
+static std::mutex profiler_mutex;
+static std::atomic<size_t> profiler_interval{ HEAP_SAMPLE_INTERVAL };
+static std::atomic<uint32_t> profiler_epoch{ 0 };
+static HeapSample* samples = nullptr;
+static HeapStack* stacks = nullptr;
+static size_t nsamples = 0;
+static size_t nstacks = 0;
+
+static size_t SampleSlot(void* ptr)
+{
+	return (size_t)(((uint64_t)ptr >> 3) * 0x9E3779B97F4A7C15ull >> 32) & (HEAP_MAX_SAMPLES - 1);
+}
+
+static uint64_t HashStack(void* const* frames, size_t depth)
+{
+	uint64_t hash = depth;
+	for (size_t i = 0; i < depth; ++i)
+		hash = (hash ^ (uint64_t)frames[i]) * 0x100000001B3ull;
+	return hash == 0 ? 1 : hash;
+}
+
+#if !defined(_WIN32)
+namespace
+{
+	struct UnwindState
+	{
+		void** _frames;
+		size_t _max;
+		size_t _skip;
+		size_t _depth;
+	};
+}
+
+static _Unwind_Reason_Code UnwindFrame(struct _Unwind_Context* ctx, void* arg)
+{
+	UnwindState* state = static_cast<UnwindState*>(arg);
+	void* ip = (void*)_Unwind_GetIP(ctx);
+	if (ip == nullptr)
+		return _URC_END_OF_STACK;
+	if (state->_skip > 0)
+	{
+		--state->_skip;
+		return _URC_NO_REASON;
+	}
+	state->_frames[state->_depth++] = ip;
+	return state->_depth == state->_max ? _URC_END_OF_STACK : _URC_NO_REASON;
+}
+#endif
+
+// 当前线程的调用栈，跳过最内层的 skip 层(不算这个函数自己)
+// 用 _Unwind_Backtrace 而不是 backtrace()：glibc 的 backtrace 第一次调用时会加载 libgcc_s，其中会调用 malloc
+static size_t CaptureStack(void** frames, size_t max, size_t skip)
+{
+#ifdef _WIN32
+	return CaptureStackBackTrace((DWORD)skip + 1, (DWORD)max, frames, nullptr);
+#else
+	UnwindState state = { frames, max, skip + 1, 0 };
+	_Unwind_Backtrace(UnwindFrame, &state);
+	return state._depth;
+#endif
+}
+
+void HeapProfilerStart(size_t interval)
+{
+	assert(interval > 0);
+	std::unique_lock<std::mutex> lock(profiler_mutex);
+	if (samples == nullptr)
+	{
+		samples = static_cast<HeapSample*>(SystemAlloc(sizeof(HeapSample) * HEAP_MAX_SAMPLES));
+		stacks = static_cast<HeapStack*>(SystemAlloc(sizeof(HeapStack) * HEAP_MAX_STACKS));
+		if (samples == nullptr || stacks == nullptr)
+			throw std::bad_alloc();
+	}
+	memset(samples, 0, sizeof(HeapSample) * HEAP_MAX_SAMPLES);
+	memset(stacks, 0, sizeof(HeapStack) * HEAP_MAX_STACKS);
+	nsamples = 0;
+	nstacks = 0;
+	profiler_interval.store(interval, std::memory_order_relaxed);
+	profiler_epoch.fetch_add(1, std::memory_order_relaxed);
+	heap_profiling.store(true, std::memory_order_relaxed);
+}
+
+void HeapProfilerStop()
+{
+	std::unique_lock<std::mutex> lock(profiler_mutex);
+	heap_profiling.store(false, std::memory_order_relaxed);
+	// span中的_nheapsampled只是一个提示，不去修改，span重新使用时会清零
+	if (samples != nullptr)
+	{
+		memset(samples, 0, sizeof(HeapSample) * HEAP_MAX_SAMPLES);
+		memset(stacks, 0, sizeof(HeapStack) * HEAP_MAX_STACKS);
+	}
+	nsamples = 0;
+	nstacks = 0;
+}
+
+void HeapProfilerLock()
+{
+	profiler_mutex.lock();
+}
+
+void HeapProfilerUnlock()
+{
+	profiler_mutex.unlock();
+}
+
+intptr_t HeapProfilerNextInterval(uint64_t* rng)
+{
+	// xorshift64*，状态为0时用状态的地址做种子
+	uint64_t x = *rng;
+	if (x == 0)
+		x = (uint64_t)(uintptr_t)rng * 0x9E3779B97F4A7C15ull | 1;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*rng = x;
+	// [0,1) 上的均匀分布变换成均值为 interval 的指数分布
+	double u = (double)((x * 0x2545F4914F6CDD1Dull) >> 11) * (1.0 / 9007199254740992.0);
+	double next = -std::log(1.0 - u) * (double)profiler_interval.load(std::memory_order_relaxed);
+	return next < 1.0 ? 1 : (intptr_t)next;
+}
+
+uint32_t HeapProfilerEpoch()
+{
+	return profiler_epoch.load(std::memory_order_relaxed);
+}
+
+void HeapProfilerRecord(void* ptr, size_t size, Span* span)
+{
+	// 在锁外取调用栈，跳过这个函数自己
+	void* frames[HEAP_MAX_DEPTH];
+	size_t depth = CaptureStack(frames, HEAP_MAX_DEPTH, 1);
+	if (depth == 0)
+		return;
+	uint64_t hash = HashStack(frames, depth);
+
+	std::unique_lock<std::mutex> lock(profiler_mutex);
+	// 表最多用到一半(调用栈表四分之三)，保证探测序列足够短
+	if (!heap_profiling.load(std::memory_order_relaxed) || nsamples >= HEAP_MAX_SAMPLES / 2)
+		return;
+
+	size_t s = (size_t)hash & (HEAP_MAX_STACKS - 1);
+	while (stacks[s]._depth != 0)
+	{
+		if (stacks[s]._hash == hash && stacks[s]._depth == depth
+			&& memcmp(stacks[s]._frames, frames, depth * sizeof(void*)) == 0)
+			break;
+		s = (s + 1) & (HEAP_MAX_STACKS - 1);
+	}
+	if (stacks[s]._depth == 0)
+	{
+		if (nstacks >= HEAP_MAX_STACKS / 4 * 3)
+			return;
+		stacks[s]._hash = hash;
+		stacks[s]._depth = depth;
+		memcpy(stacks[s]._frames, frames, depth * sizeof(void*));
+		++nstacks;
+	}
+	++stacks[s]._allocs;
+	stacks[s]._allocbytes += size;
+
+	// 同一地址上还有记录，说明旧对象没有经过分析器释放(例如私有堆销毁)，直接覆盖
+	size_t i = SampleSlot(ptr);
+	while (samples[i]._ptr != nullptr && samples[i]._ptr != ptr)
+		i = (i + 1) & (HEAP_MAX_SAMPLES - 1);
+	if (samples[i]._ptr == nullptr)
+		++nsamples;
+	samples[i] = HeapSample{ ptr, size, (uint32_t)s };
+	span->_nheapsampled.fetch_add(1, std::memory_order_relaxed);
+}
+
+void HeapProfilerForget(void* ptr, Span* span)
+{
+	// span中没有采样的对象时不加锁，绝大多数释放在这里返回
+	if (span->_nheapsampled.load(std::memory_order_relaxed) == 0)
+		return;
+
+	std::unique_lock<std::mutex> lock(profiler_mutex);
+	if (samples == nullptr)
+		return;
+	size_t i = SampleSlot(ptr);
+	while (samples[i]._ptr != ptr)
+	{
+		if (samples[i]._ptr == nullptr)
+			return;
+		i = (i + 1) & (HEAP_MAX_SAMPLES - 1);
+	}
+	span->_nheapsampled.fetch_sub(1, std::memory_order_relaxed);
+	--nsamples;
+
+	// 和 LifetimeProfilerForget 一样，把同一探测序列上后面的元素往前移
+	size_t hole = i;
+	for (size_t j = (i + 1) & (HEAP_MAX_SAMPLES - 1); samples[j]._ptr != nullptr; j = (j + 1) & (HEAP_MAX_SAMPLES - 1))
+	{
+		size_t home = SampleSlot(samples[j]._ptr);
+		if (((j - home) & (HEAP_MAX_SAMPLES - 1)) >= ((j - hole) & (HEAP_MAX_SAMPLES - 1)))
+		{
+			samples[hole] = samples[j];
+			hole = j;
+		}
+	}
+	samples[hole]._ptr = nullptr;
+}
+
+void HeapProfilerLive(size_t* live, size_t* livestacks)
+{
+	std::unique_lock<std::mutex> lock(profiler_mutex);
+	*live = nsamples;
+	*livestacks = 0;
+	if (samples == nullptr)
+		return;
+	bool seen[HEAP_MAX_STACKS] = {};
+	for (size_t i = 0; i < HEAP_MAX_SAMPLES; ++i)
+	{
+		if (samples[i]._ptr != nullptr && !seen[samples[i]._stack])
+		{
+			seen[samples[i]._stack] = true;
+			++*livestacks;
+		}
+	}
+}
+
+// 在锁内把有过采样的调用栈复制到 reports(HEAP_MAX_STACKS 个)，返回个数
+// 输出时要查找符号、写文件，这些可能申请内存，不能持有锁
+static size_t Snapshot(StackReport* reports, size_t* interval)
+{
+	std::unique_lock<std::mutex> lock(profiler_mutex);
+	*interval = profiler_interval.load(std::memory_order_relaxed);
+	if (samples == nullptr)
+		return 0;
+
+	uint32_t index[HEAP_MAX_STACKS];
+	size_t n = 0;
+	for (size_t s = 0; s < HEAP_MAX_STACKS; ++s)
+	{
+		if (stacks[s]._depth == 0)
+			continue;
+		StackReport& r = reports[n];
+		r._depth = stacks[s]._depth;
+		memcpy(r._frames, stacks[s]._frames, r._depth * sizeof(void*));
+		r._live = r._livebytes = 0;
+		r._allocs = stacks[s]._allocs;
+		r._allocbytes = stacks[s]._allocbytes;
+		r._estimate = 0;
+		index[s] = (uint32_t)n++;
+	}
+	double mean = (double)*interval;
+	for (size_t i = 0; i < HEAP_MAX_SAMPLES; ++i)
+	{
+		if (samples[i]._ptr == nullptr)
+			continue;
+		StackReport& r = reports[index[samples[i]._stack]];
+		double size = (double)samples[i]._size;
+		++r._live;
+		r._livebytes += samples[i]._size;
+		// 大小为 size 的对象被采样的概率是 1-exp(-size/mean)
+		r._estimate += size / (1.0 - std::exp(-size / mean));
+	}
+	return n;
+}
+
+// 输出用的缓冲区直接向系统申请
+static StackReport* NewReports()
+{
+	StackReport* reports = static_cast<StackReport*>(SystemAlloc(sizeof(StackReport) * HEAP_MAX_STACKS));
+	if (reports == nullptr)
+		throw std::bad_alloc();
+	return reports;
+}
+
+static void DeleteReports(StackReport* reports)
+{
+	SystemFree(reports, sizeof(StackReport) * HEAP_MAX_STACKS);
+}
+
+void HeapProfilerDumpPprof(FILE* out)
+{
+	StackReport* reports = NewReports();
+	size_t interval = 0;
+	size_t n = Snapshot(reports, &interval);
+
+	uint64_t live = 0, livebytes = 0, allocs = 0, allocbytes = 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		live += reports[i]._live;
+		livebytes += reports[i]._livebytes;
+		allocs += reports[i]._allocs;
+		allocbytes += reports[i]._allocbytes;
+	}
+	fprintf(out, "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%zu\n",
+		(unsigned long long)live, (unsigned long long)livebytes,
+		(unsigned long long)allocs, (unsigned long long)allocbytes, interval);
+	for (size_t i = 0; i < n; ++i)
+	{
+		const StackReport& r = reports[i];
+		fprintf(out, "%llu: %llu [%llu: %llu] @", (unsigned long long)r._live, (unsigned long long)r._livebytes,
+			(unsigned long long)r._allocs, (unsigned long long)r._allocbytes);
+		for (size_t k = 0; k < r._depth; ++k)
+			fprintf(out, " %p", r._frames[k]);
+		fprintf(out, "\n");
+	}
+	DeleteReports(reports);
+
+#ifdef __linux__
+	// pprof 用模块的加载地址把栈中的地址换算成符号
+	fprintf(out, "\nMAPPED_LIBRARIES:\n");
+	FILE* maps = fopen("/proc/self/maps", "r");
+	if (maps != nullptr)
+	{
+		char buf[4096];
+		size_t len;
+		while ((len = fread(buf, 1, sizeof(buf), maps)) > 0)
+			fwrite(buf, 1, len, out);
+		fclose(maps);
+	}
+#endif
+}
+
+// 一层调用栈的名字：函数名，查不到时用 模块+偏移，再查不到用地址
+static void PrintFrame(FILE* out, void* pc)
+{
+#ifdef _WIN32
+	fprintf(out, "%p", pc);
+#else
+	Dl_info info;
+	// 返回地址指向调用指令的下一条，减一落在调用指令所在的函数中
+	void* addr = (char*)pc - 1;
+	if (dladdr(addr, &info) == 0)
+	{
+		fprintf(out, "%p", pc);
+		return;
+	}
+	if (info.dli_sname != nullptr)
+	{
+		int status = 0;
+		char* name = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+		fputs(status == 0 && name != nullptr ? name : info.dli_sname, out);
+		free(name);
+		return;
+	}
+	const char* module = info.dli_fname != nullptr ? strrchr(info.dli_fname, '/') : nullptr;
+	module = module != nullptr ? module + 1 : (info.dli_fname != nullptr ? info.dli_fname : "?");
+	fprintf(out, "%s+0x%zx", module, (size_t)((char*)addr - (char*)info.dli_fbase));
+#endif
+}
+
+void HeapProfilerDumpCollapsed(FILE* out)
+{
+	StackReport* reports = NewReports();
+	size_t interval = 0;
+	size_t n = Snapshot(reports, &interval);
+	for (size_t i = 0; i < n; ++i)
+	{
+		const StackReport& r = reports[i];
+		if (r._live == 0)
+			continue;
+		// 折叠栈从根开始
+		for (size_t k = r._depth; k-- > 0;)
+		{
+			PrintFrame(out, r._frames[k]);
+			if (k != 0)
+				fputc(';', out);
+		}
+		fprintf(out, " %llu\n", (unsigned long long)(r._estimate + 0.5));
+	}
+	DeleteReports(reports);
+}
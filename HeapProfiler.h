@@ -0,0 +1,55 @@
+#pragma once
+
+#include "Common.h"
+
+#include <atomic>
+#include <cstdio>
+
+// 采样堆分析器：按申请的字节数采样，记录被采样对象的调用栈和大小，直到对象被释放
+// 输出还没有释放的采样对象(活跃的堆)，按调用栈汇总：
+//     HeapProfilerStart();
+//     ... 运行一段负载 ...
+//     HeapProfilerDumpPprof(fp);       // pprof 可以读取的 heap profile(heap_v2 文本格式)
+//     HeapProfilerDumpCollapsed(fp);   // flamegraph.pl 可以读取的折叠栈，值是估算的字节数
+//     HeapProfilerStop();
+// 替换 malloc 的动态库可以用环境变量 CONCURRENTALLOC_HEAP_PROFILE 开启，退出时写出(见 MallocOverride.cpp)
+// 采样点和生命周期分析器共用ThreadCache中的字节计数(见 LifetimeProfiler.h)，快速路径上只有一次减法和比较
+// 采样间隔服从均值为 interval 的指数分布，大小为 s 的样本代表 1/(1-exp(-s/interval)) 个对象
+// 只分析全局内存池(所有arena)，包括大对象；ObjectPool<T>的快速路径和私有堆不会被采样
+
+// 默认平均每申请 512KB 采样一次
+const size_t HEAP_SAMPLE_INTERVAL = 512 * 1024;
+// 同时记录的采样对象个数上限，超过之后新的采样被丢弃
+const size_t HEAP_MAX_SAMPLES = 16384;
+// 不同调用栈的个数上限
+const size_t HEAP_MAX_STACKS = 4096;
+// 每个调用栈最多记录的层数
+const size_t HEAP_MAX_DEPTH = 32;
+
+// 是否正在分析
+inline std::atomic<bool> heap_profiling{ false };
+
+// 开始分析，已经开始时清空之前的记录重新开始；记录用的表第一次开始时向系统申请
+void HeapProfilerStart(size_t interval = HEAP_SAMPLE_INTERVAL);
+void HeapProfilerStop();
+
+// 活跃的采样对象：个数、按调用栈汇总之后的栈个数
+void HeapProfilerLive(size_t* nsamples, size_t* nstacks);
+
+// pprof 的 heap_v2 格式：每行是一个调用栈的 活跃个数: 字节数 [累计个数: 累计字节数] @ 地址...
+// 数字是没有换算的样本，pprof 会按采样间隔换算；最后附上 /proc/self/maps 用来解析符号
+void HeapProfilerDumpPprof(FILE* out);
+// 每行是 根;...;叶子 估算的活跃字节数，函数名用 dladdr 查找，查不到时输出地址
+void HeapProfilerDumpCollapsed(FILE* out);
+
+// fork 前后调用(见 MallocOverride.cpp)
+void HeapProfilerLock();
+void HeapProfilerUnlock();
+
+// 以下由ThreadCache调用
+// 下一个采样点之前的字节数，rng 是线程自己的随机数状态
+intptr_t HeapProfilerNextInterval(uint64_t* rng);
+// 每次开始分析时加一，ThreadCache据此丢掉开始之前按旧间隔算的剩余字节数
+uint32_t HeapProfilerEpoch();
+void HeapProfilerRecord(void* ptr, size_t size, Span* span);
+void HeapProfilerForget(void* ptr, Span* span);
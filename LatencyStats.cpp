@@ -0,0 +1,81 @@
+#include "LatencyStats.h"
+#include "ThreadCache.h"
+
+static const char* const latency_tier_names[LATENCY_TIERS] = {
+	"thread-cache hit",
+	"central refill",
+	"page span",
+	"system map",
+};
+
+void ConcurrentAllocLatency(ConcurrentLatencyStats* stats)
+{
+	*stats = ConcurrentLatencyStats();
+	ThreadCache::CollectLatency(stats);
+}
+
+void ConcurrentAllocLatencyReset()
+{
+	ThreadCache::ResetLatency();
+}
+
+// 桶 b 的上界(不包含)，最后一个桶用下界代替
+static uint64_t BucketHigh(size_t b)
+{
+	if (b + 1 == LATENCY_BUCKETS)
+		return LatencyHistogram::BucketLow(b);
+	return LatencyHistogram::BucketLow(b + 1);
+}
+
+uint64_t LatencyPercentile(const uint64_t* counts, double p)
+{
+	uint64_t total = 0;
+	for (size_t b = 0; b < LATENCY_BUCKETS; ++b)
+		total += counts[b];
+	if (total == 0)
+		return 0;
+
+	// 第 rank 个(从1开始)记录所在的桶
+	uint64_t rank = (uint64_t)(p * total);
+	if (rank < 1)
+		rank = 1;
+	if (rank > total)
+		rank = total;
+	uint64_t seen = 0;
+	for (size_t b = 0; b < LATENCY_BUCKETS; ++b)
+	{
+		seen += counts[b];
+		if (seen >= rank)
+			return BucketHigh(b);
+	}
+	return BucketHigh(LATENCY_BUCKETS - 1);
+}
+
+void ConcurrentAllocLatencyPrint(FILE* out)
+{
+	ConcurrentLatencyStats stats;
+	ConcurrentAllocLatency(&stats);
+
+	fprintf(out, "%-18s %12s %9s %9s %9s %9s %9s %9s %11s\n", "tier(ns)", "count", "mean",
+		"p50", "p90", "p99", "p99.9", "p99.99", "max");
+	for (size_t t = 0; t < LATENCY_TIERS; ++t)
+	{
+		const uint64_t* counts = stats._counts[t];
+		// 平均值按每个桶的中点估算
+		uint64_t total = 0, max = 0;
+		double sum = 0;
+		for (size_t b = 0; b < LATENCY_BUCKETS; ++b)
+		{
+			if (counts[b] == 0)
+				continue;
+			total += counts[b];
+			sum += counts[b] * (LatencyHistogram::BucketLow(b) + BucketHigh(b)) / 2.0;
+			max = BucketHigh(b);
+		}
+		fprintf(out, "%-18s %12llu %9.0f %9llu %9llu %9llu %9llu %9llu %11llu\n", latency_tier_names[t],
+			(unsigned long long)total, total == 0 ? 0.0 : sum / total,
+			(unsigned long long)LatencyPercentile(counts, 0.5), (unsigned long long)LatencyPercentile(counts, 0.9),
+			(unsigned long long)LatencyPercentile(counts, 0.99), (unsigned long long)LatencyPercentile(counts, 0.999),
+			(unsigned long long)LatencyPercentile(counts, 0.9999), (unsigned long long)max);
+	}
+}
@@ -0,0 +1,165 @@
+#pragma once
+
+// 定义后按层记录申请内存的耗时分布，通过 ConcurrentAllocLatency 读取；不定义时下面的计时和记录都是空操作
+// #define LATENCY_STATS
+
+#include "Common.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+
+// 申请内存经过的各层，外层的耗时包括内层：
+//     ThreadCacheHit  ThreadCache::Allocate 自由链表不为空，直接取出
+//     CentralRefill   ThreadCache::Allocate 自由链表为空，到CentralCache取一批(可能再到PageCache)
+//     PageSpan        PageCache::NewSpan，包括等页锁的时间，没有空闲span时向系统申请
+//     SystemMap       向系统申请页(sbrk/mmap/段)，包括超过128页的大对象
+// 每个线程记录到自己的ThreadCache中，只有本线程修改，读取时才把所有线程的直方图加起来
+// 还没有ThreadCache的线程(只申请过大对象)记录到一个共享的直方图中
+// 和 AllocStats.h 一样只统计全局内存池(所有arena)，私有堆的耗时不记录
+// ObjectPool<T> 的快速路径不经过 Allocate，不计时；计时本身(两次读时钟)也算在耗时里
+enum class LatencyTier
+{
+	ThreadCacheHit,
+	CentralRefill,
+	PageSpan,
+	SystemMap,
+};
+
+const size_t LATENCY_TIERS = 4;
+
+// HDR 风格的对数分桶(单位纳秒)：[0, 16) 每纳秒一个桶，之后每个2的幂区间等分成16个子桶，
+// 桶的宽度不超过下界的 1/16；超过 2^32 纳秒(约4.3秒)的都记在最后一个桶
+const size_t LATENCY_SUB_BITS = 4;
+const size_t LATENCY_SUB_BUCKETS = (size_t)1 << LATENCY_SUB_BITS;
+const size_t LATENCY_MAX_SHIFT = 32;
+const size_t LATENCY_BUCKETS = LATENCY_SUB_BUCKETS * (LATENCY_MAX_SHIFT - LATENCY_SUB_BITS + 1);
+
+// x 的最高位是第几位，x 不为0
+static inline size_t HighestBit(uint64_t x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return 63 - (size_t)__builtin_clzll(x);
+#else
+	size_t n = 0;
+	while (x >>= 1)
+		++n;
+	return n;
+#endif
+}
+
+// 一个直方图，Record 只能由一个线程调用，RecordShared 可以多个线程同时调用
+class LatencyHistogram
+{
+public:
+	constexpr LatencyHistogram() {}
+
+	static size_t Bucket(uint64_t ns)
+	{
+		if (ns < LATENCY_SUB_BUCKETS)
+			return (size_t)ns;
+		if (ns >= ((uint64_t)1 << LATENCY_MAX_SHIFT))
+			return LATENCY_BUCKETS - 1;
+		size_t shift = HighestBit(ns);//>= LATENCY_SUB_BITS
+		size_t sub = (size_t)(ns >> (shift - LATENCY_SUB_BITS)) & (LATENCY_SUB_BUCKETS - 1);
+		return ((shift - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) + sub;
+	}
+
+	// 桶 b 包含的最小值，最后一个桶没有上界
+	static uint64_t BucketLow(size_t b)
+	{
+		if (b < LATENCY_SUB_BUCKETS)
+			return b;
+		size_t shift = (b >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+		uint64_t sub = b & (LATENCY_SUB_BUCKETS - 1);
+		return ((uint64_t)1 << shift) + (sub << (shift - LATENCY_SUB_BITS));
+	}
+
+	void Record(uint64_t ns)
+	{
+		std::atomic<uint64_t>& c = _count[Bucket(ns)];
+		c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+
+	void RecordShared(uint64_t ns)
+	{
+		_count[Bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// 加到 counts[LATENCY_BUCKETS] 上
+	void AddTo(uint64_t* counts) const
+	{
+		for (size_t b = 0; b < LATENCY_BUCKETS; ++b)
+			counts[b] += _count[b].load(std::memory_order_relaxed);
+	}
+
+	void Add(const LatencyHistogram& other)
+	{
+		for (size_t b = 0; b < LATENCY_BUCKETS; ++b)
+			_count[b].fetch_add(other._count[b].load(std::memory_order_relaxed), std::memory_order_relaxed);
+	}
+
+	// 其他线程正在记录时清零，可能丢掉几次记录
+	void Reset()
+	{
+		for (size_t b = 0; b < LATENCY_BUCKETS; ++b)
+			_count[b].store(0, std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<uint64_t> _count[LATENCY_BUCKETS] = {};
+};
+
+// 一个线程每层一个直方图，放在ThreadCache中
+struct ThreadLatency
+{
+	LatencyHistogram _tiers[LATENCY_TIERS];
+
+	void Record(LatencyTier tier, uint64_t ns)
+	{
+		_tiers[(size_t)tier].Record(ns);
+	}
+};
+
+static inline uint64_t LatencyNow()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 构造时读一次时钟，不统计时是空的
+class LatencyTimer
+{
+public:
+#ifdef LATENCY_STATS
+	uint64_t Elapsed() const
+	{
+		return LatencyNow() - _begin;
+	}
+
+private:
+	uint64_t _begin = LatencyNow();
+#else
+	uint64_t Elapsed() const
+	{
+		return 0;
+	}
+#endif
+};
+
+// 记录到当前线程的ThreadCache中，没有ThreadCache时记录到共享的直方图(见 ThreadCache.cpp)
+void LatencyRecord(LatencyTier tier, uint64_t ns);
+
+// 所有线程(包括已经退出的)合并之后的直方图
+struct ConcurrentLatencyStats
+{
+	uint64_t _counts[LATENCY_TIERS][LATENCY_BUCKETS] = {};
+};
+
+// 没有定义 LATENCY_STATS 时全是0
+void ConcurrentAllocLatency(ConcurrentLatencyStats* stats);
+void ConcurrentAllocLatencyReset();
+// counts 中第 p(0~1) 分位的耗时，取所在桶的上界(最后一个桶取下界)，没有记录时返回0
+uint64_t LatencyPercentile(const uint64_t* counts, double p);
+// 每层一行：次数、平均、p50/p90/p99/p99.9/p99.99、最大值
+void ConcurrentAllocLatencyPrint(FILE* out);
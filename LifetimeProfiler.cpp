@@ -0,0 +1,192 @@
+#include "LifetimeProfiler.h"
+
+#include <chrono>
+#include <cstring>
+
+namespace
+{
+	struct Sample
+	{
+		void* _ptr;
+		size_t _index;
+		uint64_t _time;//申请时间
+	};
+
+	struct ClassCounter
+	{
+		size_t _samples;
+		size_t _short;
+		size_t _long;
+		uint64_t _totalns;//已经释放的对象存活时间之和
+	};
+}
+
+// 所有状态都是静态的，不需要动态初始化，也不会申请内存
+static std::mutex profiler_mutex;
+static std::atomic<intptr_t> profiler_interval{ (intptr_t)LIFETIME_SAMPLE_INTERVAL };
+static uint64_t profiler_longns = LIFETIME_LONG_NS;
+// 以对象地址为键的开放寻址哈希表(线性探测)，_ptr为空表示空位
+static Sample samples[LIFETIME_MAX_SAMPLES];
+static size_t nsamples = 0;
+static ClassCounter counters[NLISTS];
+
+static uint64_t NowNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static size_t Slot(void* ptr)
+{
+	return (size_t)(((uint64_t)ptr >> 3) * 0x9E3779B97F4A7C15ull >> 32) & (LIFETIME_MAX_SAMPLES - 1);
+}
+
+void LifetimeProfilerStart(size_t interval, uint64_t longns)
+{
+	assert(interval > 0);
+	std::unique_lock<std::mutex> lock(profiler_mutex);
+	memset(samples, 0, sizeof(samples));
+	memset(counters, 0, sizeof(counters));
+	nsamples = 0;
+	profiler_interval = (intptr_t)interval;
+	profiler_longns = longns;
+	lifetime_profiling.store(true, std::memory_order_relaxed);
+}
+
+void LifetimeProfilerStop()
+{
+	std::unique_lock<std::mutex> lock(profiler_mutex);
+	lifetime_profiling.store(false, std::memory_order_relaxed);
+	profiler_interval = (intptr_t)LIFETIME_SAMPLE_INTERVAL;
+	// span中的_nsampled只是一个提示，不去修改，span重新分给CentralCache时会清零
+	memset(samples, 0, sizeof(samples));
+	nsamples = 0;
+}
+
+intptr_t LifetimeProfilerInterval()
+{
+	return profiler_interval.load(std::memory_order_relaxed);
+}
+
+void LifetimeProfilerRecord(void* ptr, size_t index, Span* span)
+{
+	uint64_t now = NowNs();
+	std::unique_lock<std::mutex> lock(profiler_mutex);
+	// 表最多用到一半，保证探测序列足够短
+	if (!lifetime_profiling.load(std::memory_order_relaxed) || nsamples >= LIFETIME_MAX_SAMPLES / 2)
+		return;
+
+	size_t i = Slot(ptr);
+	while (samples[i]._ptr != nullptr)
+		i = (i + 1) & (LIFETIME_MAX_SAMPLES - 1);
+	samples[i] = Sample{ ptr, index, now };
+	++nsamples;
+	++counters[index]._samples;
+	span->_nsampled.fetch_add(1, std::memory_order_relaxed);
+}
+
+void LifetimeProfilerForget(void* ptr, Span* span)
+{
+	// span中没有采样的对象时不加锁，绝大多数释放在这里返回
+	if (span->_nsampled.load(std::memory_order_relaxed) == 0)
+		return;
+
+	uint64_t now = NowNs();
+	std::unique_lock<std::mutex> lock(profiler_mutex);
+	size_t i = Slot(ptr);
+	while (samples[i]._ptr != ptr)
+	{
+		if (samples[i]._ptr == nullptr)
+			return;
+		i = (i + 1) & (LIFETIME_MAX_SAMPLES - 1);
+	}
+
+	uint64_t lifetime = now - samples[i]._time;
+	ClassCounter& counter = counters[samples[i]._index];
+	if (lifetime >= profiler_longns)
+		++counter._long;
+	else
+		++counter._short;
+	counter._totalns += lifetime;
+	span->_nsampled.fetch_sub(1, std::memory_order_relaxed);
+	--nsamples;
+
+	// 删除之后把后面同一探测序列上的元素往前移，保持查找的正确性
+	size_t hole = i;
+	for (size_t j = (i + 1) & (LIFETIME_MAX_SAMPLES - 1); samples[j]._ptr != nullptr; j = (j + 1) & (LIFETIME_MAX_SAMPLES - 1))
+	{
+		size_t home = Slot(samples[j]._ptr);
+		// home 不在 (hole, j] 之间时，j 上的元素可以移到 hole
+		if (((j - home) & (LIFETIME_MAX_SAMPLES - 1)) >= ((j - hole) & (LIFETIME_MAX_SAMPLES - 1)))
+		{
+			samples[hole] = samples[j];
+			hole = j;
+		}
+	}
+	samples[hole]._ptr = nullptr;
+}
+
+size_t LifetimeProfilerReport(LifetimeClassStats* stats, size_t n)
+{
+	uint64_t now = NowNs();
+	std::unique_lock<std::mutex> lock(profiler_mutex);
+
+	size_t live[NLISTS] = {};
+	size_t livelong[NLISTS] = {};
+	for (size_t i = 0; i < LIFETIME_MAX_SAMPLES; ++i)
+	{
+		if (samples[i]._ptr == nullptr)
+			continue;
+		++live[samples[i]._index];
+		if (now - samples[i]._time >= profiler_longns)
+			++livelong[samples[i]._index];
+	}
+
+	size_t count = 0;
+	for (size_t index = 0; index < NLISTS && count < n; ++index)
+	{
+		const ClassCounter& counter = counters[index];
+		if (counter._samples == 0)
+			continue;
+
+		LifetimeClassStats& s = stats[count++];
+		s._size = SizeClass::Size(index);
+		s._samples = counter._samples;
+		s._short = counter._short;
+		s._long = counter._long + livelong[index];
+		s._live = live[index];
+		size_t freed = counter._short + counter._long;
+		s._avgns = freed == 0 ? 0 : counter._totalns / freed;
+		// 已经有结论的样本(释放了的和已经超过阈值的)中长期对象占多数
+		size_t decided = s._short + s._long;
+		s._suggest = decided >= 8 && s._long * 2 > decided ? LifetimeHint::LongLived : LifetimeHint::ShortLived;
+	}
+	return count;
+}
+
+void LifetimeProfilerPrint(FILE* out)
+{
+	LifetimeClassStats stats[NLISTS];
+	size_t n = LifetimeProfilerReport(stats, NLISTS);
+	fprintf(out, "%8s %8s %8s %8s %8s %12s  %s\n", "size", "samples", "short", "long", "live", "avg(us)", "hint");
+	for (size_t i = 0; i < n; ++i)
+	{
+		fprintf(out, "%8zu %8zu %8zu %8zu %8zu %12.1f  %s\n", stats[i]._size, stats[i]._samples,
+			stats[i]._short, stats[i]._long, stats[i]._live, stats[i]._avgns / 1000.0,
+			stats[i]._suggest == LifetimeHint::LongLived ? "LongLived" : "ShortLived");
+	}
+}
+
+LifetimeHint LifetimeProfilerSuggest(size_t size)
+{
+	assert(size <= MAX_BYTES);
+	size_t target = SizeClass::Size(SizeClass::Index(size));
+	LifetimeClassStats stats[NLISTS];
+	size_t n = LifetimeProfilerReport(stats, NLISTS);
+	for (size_t i = 0; i < n; ++i)
+	{
+		if (stats[i]._size == target)
+			return stats[i]._suggest;
+	}
+	return LifetimeHint::ShortLived;
+}
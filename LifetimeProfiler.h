@@ -0,0 +1,53 @@
+#pragma once
+
+#include "Common.h"
+
+#include <atomic>
+#include <cstdio>
+
+// 生命周期分析器：每申请一定字节数采样一个小对象，记录它从申请到释放经过的时间
+// 按大小类统计，存活时间超过阈值的对象占多数时，建议这个大小的申请使用 LifetimeHint::LongLived
+//     LifetimeProfilerStart();
+//     ... 运行一段有代表性的负载 ...
+//     LifetimeProfilerPrint(stdout);
+//     LifetimeProfilerStop();
+// 只分析全局内存池中经过ThreadCache::Allocate的申请(ObjectPool<T>的快速路径不会被采样)
+
+// 默认每申请 256KB 采样一次
+const size_t LIFETIME_SAMPLE_INTERVAL = 256 * 1024;
+// 默认存活超过 1 秒算长期对象
+const uint64_t LIFETIME_LONG_NS = 1000 * 1000 * 1000;
+// 同时记录的采样对象个数上限，超过之后新的采样被丢弃
+const size_t LIFETIME_MAX_SAMPLES = 4096;
+
+// 是否正在分析，ThreadCache的释放路径上只检查这一个变量
+inline std::atomic<bool> lifetime_profiling{ false };
+
+// 一个大小类的统计结果
+struct LifetimeClassStats
+{
+	size_t _size = 0;//大小类的对象大小
+	size_t _samples = 0;//采样的对象个数
+	size_t _short = 0;//存活时间没有超过阈值就释放了
+	size_t _long = 0;//存活时间超过阈值(包括还没有释放的)
+	size_t _live = 0;//还没有释放
+	uint64_t _avgns = 0;//已经释放的对象的平均存活时间
+	LifetimeHint _suggest = LifetimeHint::ShortLived;
+};
+
+// 开始分析，已经开始时重新统计
+void LifetimeProfilerStart(size_t interval = LIFETIME_SAMPLE_INTERVAL, uint64_t longns = LIFETIME_LONG_NS);
+void LifetimeProfilerStop();
+
+// 按大小类从小到大输出有采样的类，返回输出的个数(最多n个)
+size_t LifetimeProfilerReport(LifetimeClassStats* stats, size_t n);
+void LifetimeProfilerPrint(FILE* out);
+
+// size 大小的申请建议使用的 hint，样本太少时返回 ShortLived
+LifetimeHint LifetimeProfilerSuggest(size_t size);
+
+// 以下由ThreadCache调用
+// 采样间隔，没有开启分析时返回 LIFETIME_SAMPLE_INTERVAL，到时只检查一下是否开启了分析
+intptr_t LifetimeProfilerInterval();
+void LifetimeProfilerRecord(void* ptr, size_t index, Span* span);
+void LifetimeProfilerForget(void* ptr, Span* span);
@@ -0,0 +1,328 @@
+#pragma once
+
+// 内存池内部的锁(CentralCache 的桶锁、PageCache 的页锁)使用哪种实现，都不定义时使用 std::mutex
+// 先自旋一段时间，再用 futex 睡眠(非 Linux 系统上睡眠改为 yield)
+// #define USE_SPIN_FUTEX_LOCK
+// 排队自旋锁，先到先得
+// #define USE_TICKET_LOCK
+// MCS 队列锁，每个等待者在自己的节点上自旋(K42 变种，unlock 不需要传入节点)
+// #define USE_MCS_LOCK
+// 每个锁记录获取次数、竞争次数和等待时间，通过 ConcurrentAllocLockStats 读取(见 CacheArena.h)
+// #define LOCK_STATS
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CPU_RELAX() _mm_pause()
+#elif defined(__aarch64__)
+#define CPU_RELAX() __asm__ __volatile__("yield")
+#else
+#define CPU_RELAX() ((void)0)
+#endif
+
+// 自旋等待：先 pause，次数多了就让出CPU(线程数超过核数时，持有锁的线程可能没有在运行)
+class SpinBackoff
+{
+public:
+	void Pause()
+	{
+		if (++_count < SPIN_LIMIT)
+			CPU_RELAX();
+		else
+			std::this_thread::yield();
+	}
+
+private:
+	static const int SPIN_LIMIT = 64;
+	int _count = 0;
+};
+
+// 所有锁都提供 lock/try_lock/unlock，可以和 std::unique_lock 一起使用；构造函数都是 constexpr 的
+
+// 先自旋再睡眠：0 未加锁，1 加锁没有等待者，2 加锁可能有等待者
+class SpinFutexLock
+{
+public:
+	constexpr SpinFutexLock() {}
+
+	bool try_lock()
+	{
+		int expected = 0;
+		return _state.compare_exchange_strong(expected, 1, std::memory_order_acquire, std::memory_order_relaxed);
+	}
+
+	void lock()
+	{
+		for (int i = 0; i < SPIN_COUNT; ++i)
+		{
+			if (_state.load(std::memory_order_relaxed) == 0 && try_lock())
+				return;
+			CPU_RELAX();
+		}
+		// 标记为有等待者再睡眠，拿到锁时也保持2，unlock 时会唤醒一个
+		while (_state.exchange(2, std::memory_order_acquire) != 0)
+			Wait();
+	}
+
+	void unlock()
+	{
+		if (_state.exchange(0, std::memory_order_release) == 2)
+			Wake();
+	}
+
+private:
+	static const int SPIN_COUNT = 100;
+
+	void Wait()
+	{
+#ifdef __linux__
+		syscall(SYS_futex, reinterpret_cast<int*>(&_state), FUTEX_WAIT_PRIVATE, 2, nullptr, nullptr, 0);
+#else
+		std::this_thread::yield();
+#endif
+	}
+
+	void Wake()
+	{
+#ifdef __linux__
+		syscall(SYS_futex, reinterpret_cast<int*>(&_state), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#endif
+	}
+
+	std::atomic<int> _state{ 0 };
+};
+
+// 排队自旋锁：取号，等叫到自己的号
+class TicketLock
+{
+public:
+	constexpr TicketLock() {}
+
+	bool try_lock()
+	{
+		// unlock 对 _serving 做 release，这里要 acquire 才能看到上一个持有者的修改
+		uint32_t serving = _serving.load(std::memory_order_acquire);
+		uint32_t expected = serving;
+		return _next.compare_exchange_strong(expected, serving + 1, std::memory_order_acquire, std::memory_order_relaxed);
+	}
+
+	void lock()
+	{
+		uint32_t ticket = _next.fetch_add(1, std::memory_order_relaxed);
+		SpinBackoff backoff;
+		while (_serving.load(std::memory_order_acquire) != ticket)
+			backoff.Pause();
+	}
+
+	void unlock()
+	{
+		_serving.store(_serving.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+private:
+	std::atomic<uint32_t> _next{ 0 };
+	std::atomic<uint32_t> _serving{ 0 };
+};
+
+// MCS 队列锁的 K42 变种：锁本身也是一个节点，持有锁的线程不需要保留自己的节点，
+// 所以 unlock 不用传参数，一个线程可以同时持有很多个锁(fork 时的 LockAll)
+//     _tail == nullptr      没有加锁
+//     _tail == &_self       加锁，没有等待者
+//     _tail == 等待者的节点  加锁，有等待者排队，_next 是第一个等待者
+class McsLock
+{
+public:
+	constexpr McsLock() {}
+
+	bool try_lock()
+	{
+		Node* expected = nullptr;
+		return _tail.compare_exchange_strong(expected, &_self, std::memory_order_acquire, std::memory_order_relaxed);
+	}
+
+	void lock()
+	{
+		while (true)
+		{
+			Node* prev = _tail.load(std::memory_order_relaxed);
+			if (prev == nullptr)
+			{
+				if (try_lock())
+					return;
+				continue;
+			}
+
+			// 节点在栈上，只在排队期间使用
+			Node node;
+			node._waiting.store(true, std::memory_order_relaxed);
+			node._next.store(nullptr, std::memory_order_relaxed);
+			if (!_tail.compare_exchange_weak(prev, &node, std::memory_order_acq_rel, std::memory_order_relaxed))
+				continue;
+
+			// prev 是锁自己(没有别的等待者)或者前一个等待者
+			prev->_next.store(&node, std::memory_order_release);
+			SpinBackoff backoff;
+			while (node._waiting.load(std::memory_order_acquire))
+				backoff.Pause();
+
+			// 拿到锁，把后继记到锁里，之后 node 就不再使用了
+			Node* succ = node._next.load(std::memory_order_acquire);
+			if (succ == nullptr)
+			{
+				_self._next.store(nullptr, std::memory_order_relaxed);
+				Node* expected = &node;
+				if (!_tail.compare_exchange_strong(expected, &_self, std::memory_order_acq_rel, std::memory_order_acquire))
+				{
+					// 有新的等待者正在链接到 node 后面
+					SpinBackoff wait;
+					while ((succ = node._next.load(std::memory_order_acquire)) == nullptr)
+						wait.Pause();
+					_self._next.store(succ, std::memory_order_relaxed);
+				}
+			}
+			else
+			{
+				_self._next.store(succ, std::memory_order_relaxed);
+			}
+			return;
+		}
+	}
+
+	void unlock()
+	{
+		Node* succ = _self._next.load(std::memory_order_acquire);
+		if (succ == nullptr)
+		{
+			Node* expected = &_self;
+			if (_tail.compare_exchange_strong(expected, nullptr, std::memory_order_release, std::memory_order_relaxed))
+				return;
+			// 有等待者刚加入队列，等它链接到锁上
+			SpinBackoff backoff;
+			while ((succ = _self._next.load(std::memory_order_acquire)) == nullptr)
+				backoff.Pause();
+		}
+		succ->_waiting.store(false, std::memory_order_release);
+	}
+
+private:
+	struct Node
+	{
+		std::atomic<bool> _waiting{ false };
+		std::atomic<Node*> _next{ nullptr };
+	};
+
+	std::atomic<Node*> _tail{ nullptr };
+	Node _self;
+};
+
+// 一个锁(或者一组锁合计)的统计
+struct LockStats
+{
+	uint64_t _acquire = 0;//获取次数
+	uint64_t _contended = 0;//第一次 try_lock 失败、需要等待的次数
+	uint64_t _waitns = 0;//等待的总时间
+
+	void Add(const LockStats& other)
+	{
+		_acquire += other._acquire;
+		_contended += other._contended;
+		_waitns += other._waitns;
+	}
+};
+
+// 带统计的锁：先 try_lock，失败时才计时
+// 计数在拿到锁之后修改，由锁自己保护；读取时不加锁，只是近似值
+template<class L>
+class CountedLock
+{
+public:
+	constexpr CountedLock() {}
+
+	bool try_lock()
+	{
+		if (!_lock.try_lock())
+			return false;
+		++_stats._acquire;
+		return true;
+	}
+
+	void lock()
+	{
+		if (_lock.try_lock())
+		{
+			++_stats._acquire;
+			return;
+		}
+		auto begin = std::chrono::steady_clock::now();
+		_lock.lock();
+		auto end = std::chrono::steady_clock::now();
+		++_stats._acquire;
+		++_stats._contended;
+		_stats._waitns += std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+	}
+
+	void unlock()
+	{
+		_lock.unlock();
+	}
+
+	LockStats Stats() const
+	{
+		return _stats;
+	}
+
+	void ResetStats()
+	{
+		_lock.lock();
+		_stats = LockStats();
+		_lock.unlock();
+	}
+
+private:
+	L _lock;
+	LockStats _stats;
+};
+
+// 不统计时 Stats 返回全0
+template<class L>
+class PlainLock : public L
+{
+public:
+	constexpr PlainLock() {}
+
+	LockStats Stats() const
+	{
+		return LockStats();
+	}
+
+	void ResetStats()
+	{
+	}
+};
+
+#if defined(USE_SPIN_FUTEX_LOCK)
+typedef SpinFutexLock PoolLockBase;
+#elif defined(USE_TICKET_LOCK)
+typedef TicketLock PoolLockBase;
+#elif defined(USE_MCS_LOCK)
+typedef McsLock PoolLockBase;
+#else
+typedef std::mutex PoolLockBase;
+#endif
+
+#ifdef LOCK_STATS
+typedef CountedLock<PoolLockBase> PoolLock;
+#else
+typedef PlainLock<PoolLockBase> PoolLock;
+#endif
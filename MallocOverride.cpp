@@ -0,0 +1,419 @@
+// 用内存池替换 malloc/free 和 operator new/delete
+// 编译成 libconcurrentalloc.so，通过 LD_PRELOAD 加载到已有程序中，不需要修改代码：
+//     LD_PRELOAD=./libconcurrentalloc.so ./a.out
+
+#include "ConcurrentAlloc.h"
+#include "CentralCache.h"
+#include "Reserve.h"
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+#ifdef __GLIBC__
+// 不属于内存池的指针交还给 glibc 处理(例如加载动态库之前由 glibc 申请的内存)
+extern "C" void __libc_free(void* ptr) __attribute__((weak));
+extern "C" void* __libc_realloc(void* ptr, size_t size) __attribute__((weak));
+#endif
+
+// 和 glibc 一样保证 16 字节对齐
+const size_t MALLOC_ALIGNMENT = 16;
+
+static inline void* DoMalloc(size_t size)
+{
+	if (size == 0)
+		size = 1;
+	else if (size > 8)
+		size = (size + MALLOC_ALIGNMENT - 1) & ~(MALLOC_ALIGNMENT - 1);
+
+	try
+	{
+		return ConcurrentAlloc(size);
+	}
+	catch (const std::bad_alloc&)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+}
+
+static inline void* DoMemalign(size_t align, size_t size)
+{
+	if (align <= MALLOC_ALIGNMENT)
+		return DoMalloc(size);
+
+	if (size == 0)
+		size = 1;
+
+	try
+	{
+		return ConcurrentAllocAligned(size, align);
+	}
+	catch (const std::bad_alloc&)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+}
+
+static inline void DoFree(void* ptr)
+{
+	if (ptr == nullptr)
+		return;
+
+	if (LIKELY(ConcurrentFreeSmall(ptr)))
+		return;
+
+	Span* span = PageCache::GetInstence()->LookupSpan(ptr);
+	if (span == nullptr)
+	{
+#ifdef __GLIBC__
+		if (__libc_free)
+			__libc_free(ptr);
+#endif
+		// 不认识的指针直接忽略
+		return;
+	}
+	// Arena的内存由Arena自己回收，free传进来的指针同样忽略
+	if (UNLIKELY(span->_objsize == 0))
+		return;
+	ConcurrentFree(ptr, span);
+}
+
+static inline bool IsPowerOf2(size_t n)
+{
+	return n != 0 && (n & (n - 1)) == 0;
+}
+
+extern "C" {
+
+void* malloc(size_t size)
+{
+	return DoMalloc(size);
+}
+
+void free(void* ptr)
+{
+	DoFree(ptr);
+}
+
+void* calloc(size_t n, size_t size)
+{
+	size_t bytes = n * size;
+	if (size != 0 && bytes / size != n)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+
+	void* ptr = DoMalloc(bytes);
+	if (ptr != nullptr)
+		memset(ptr, 0, bytes);
+	return ptr;
+}
+
+void* realloc(void* ptr, size_t size)
+{
+	if (ptr == nullptr)
+		return DoMalloc(size);
+
+	if (size == 0)
+	{
+		DoFree(ptr);
+		return nullptr;
+	}
+
+	Span* span = PageCache::GetInstence()->LookupSpan(ptr);
+	if (span == nullptr)
+	{
+#ifdef __GLIBC__
+		if (__libc_realloc)
+			return __libc_realloc(ptr, size);
+#endif
+		errno = ENOMEM;
+		return nullptr;
+	}
+
+	// 原来的空间够用，而且不会浪费一半以上时原地返回
+	size_t oldsize = ConcurrentUsableSize(ptr);
+	if (size <= oldsize && size >= oldsize / 2)
+		return ptr;
+
+	void* newptr = DoMalloc(size);
+	if (newptr == nullptr)
+		return nullptr;
+	memcpy(newptr, ptr, size < oldsize ? size : oldsize);
+	ConcurrentFree(ptr, span);
+	return newptr;
+}
+
+void* memalign(size_t align, size_t size)
+{
+	if (!IsPowerOf2(align))
+	{
+		errno = EINVAL;
+		return nullptr;
+	}
+	return DoMemalign(align, size);
+}
+
+void* aligned_alloc(size_t align, size_t size)
+{
+	return memalign(align, size);
+}
+
+int posix_memalign(void** memptr, size_t align, size_t size)
+{
+	if (!IsPowerOf2(align) || align % sizeof(void*) != 0)
+		return EINVAL;
+
+	void* ptr = DoMemalign(align, size);
+	if (ptr == nullptr)
+		return ENOMEM;
+	*memptr = ptr;
+	return 0;
+}
+
+void* valloc(size_t size)
+{
+	return DoMemalign((size_t)1 << PAGE_SHIFT, size);
+}
+
+void* pvalloc(size_t size)
+{
+	size = SizeClass::_Roundup(size == 0 ? 1 : size, PAGE_SHIFT);
+	return DoMemalign((size_t)1 << PAGE_SHIFT, size);
+}
+
+size_t malloc_usable_size(void* ptr)
+{
+	if (ptr == nullptr || PageCache::GetInstence()->LookupSpan(ptr) == nullptr)
+		return 0;
+	return ConcurrentUsableSize(ptr);
+}
+
+} // extern "C"
+
+// operator new/delete
+// 申请失败时 ConcurrentAlloc 会抛出 std::bad_alloc
+
+void* operator new(size_t size)
+{
+	return ConcurrentAlloc(size == 0 ? 1 : size);
+}
+
+void* operator new[](size_t size)
+{
+	return ConcurrentAlloc(size == 0 ? 1 : size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+	return DoMalloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+	return DoMalloc(size);
+}
+
+void* operator new(size_t size, std::align_val_t align)
+{
+	return ConcurrentAllocAligned(size == 0 ? 1 : size, (size_t)align);
+}
+
+void* operator new[](size_t size, std::align_val_t align)
+{
+	return ConcurrentAllocAligned(size == 0 ? 1 : size, (size_t)align);
+}
+
+void* operator new(size_t size, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+	return DoMemalign((size_t)align, size);
+}
+
+void* operator new[](size_t size, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+	return DoMemalign((size_t)align, size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+	DoFree(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+	DoFree(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+	DoFree(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+	DoFree(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+	DoFree(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept
+{
+	DoFree(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept
+{
+	DoFree(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept
+{
+	DoFree(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	DoFree(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	DoFree(ptr);
+}
+
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept
+{
+	DoFree(ptr);
+}
+
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept
+{
+	DoFree(ptr);
+}
+
+#ifdef __linux__
+// fork 时其他线程可能正持有内存池的锁，子进程中这些锁永远不会被释放
+// fork 之前把所有锁拿到手，fork 之后在父子进程中分别释放
+static void PrepareFork()
+{
+	HeapProfilerLock();
+	ArenaLockAll();
+	ThreadCache::LockPool();
+}
+
+static void AfterFork()
+{
+	ThreadCache::UnlockPool();
+	ArenaUnlockAll();
+	HeapProfilerUnlock();
+}
+
+static void AfterForkChild()
+{
+	AfterFork();
+	TraceAfterForkChild();
+}
+
+__attribute__((constructor)) static void RegisterForkHandlers()
+{
+	pthread_atfork(PrepareFork, AfterFork, AfterForkChild);
+}
+
+// 设置环境变量 CONCURRENTALLOC_HEAP_PROFILE=文件名 时，加载时开始堆分析，进程退出时写出
+//     文件名          pprof 格式(pprof 可执行文件 文件名)
+//     文件名.folded   折叠栈(flamegraph.pl 文件名.folded)
+// CONCURRENTALLOC_HEAP_SAMPLE 可以设置平均采样间隔(字节)，默认 HEAP_SAMPLE_INTERVAL
+static char heap_profile_path[4096];
+
+static void DumpHeapProfile()
+{
+	char path[sizeof(heap_profile_path) + 8];
+	snprintf(path, sizeof(path), "%s", heap_profile_path);
+	if (FILE* out = fopen(path, "w"))
+	{
+		HeapProfilerDumpPprof(out);
+		fclose(out);
+	}
+	snprintf(path, sizeof(path), "%s.folded", heap_profile_path);
+	if (FILE* out = fopen(path, "w"))
+	{
+		HeapProfilerDumpCollapsed(out);
+		fclose(out);
+	}
+}
+
+__attribute__((constructor)) static void StartHeapProfile()
+{
+	const char* path = getenv("CONCURRENTALLOC_HEAP_PROFILE");
+	if (path == nullptr || *path == '\0' || strlen(path) >= sizeof(heap_profile_path))
+		return;
+	strcpy(heap_profile_path, path);
+	const char* sample = getenv("CONCURRENTALLOC_HEAP_SAMPLE");
+	size_t interval = sample != nullptr ? strtoul(sample, nullptr, 10) : 0;
+	HeapProfilerStart(interval != 0 ? interval : HEAP_SAMPLE_INTERVAL);
+	atexit(DumpHeapProfile);
+}
+
+// 设置环境变量 CONCURRENTALLOC_SPAN_POLICY=address 时 PageCache 使用地址优先的最佳适配策略，lifo 是默认的策略(见 PageCache.h)
+__attribute__((constructor)) static void SetSpanPolicy()
+{
+	const char* policy = getenv("CONCURRENTALLOC_SPAN_POLICY");
+	if (policy == nullptr)
+		return;
+	if (strcmp(policy, "address") == 0)
+		ConcurrentAllocSetSpanPolicy(SpanPolicy::AddressOrdered);
+	else if (strcmp(policy, "lifo") == 0)
+		ConcurrentAllocSetSpanPolicy(SpanPolicy::Lifo);
+}
+
+// 设置环境变量 CONCURRENTALLOC_RESERVE=大小(可以带 K、M、G)时，加载时预留这么多空闲页(见 Reserve.h)
+// CONCURRENTALLOC_RESERVE_MODE=prefault 预先建立物理页，lock 用 mlock 锁住
+__attribute__((constructor)) static void ReserveHeap()
+{
+	const char* size = getenv("CONCURRENTALLOC_RESERVE");
+	if (size == nullptr)
+		return;
+	char* unit = nullptr;
+	size_t bytes = strtoull(size, &unit, 10);
+	if (*unit == 'K' || *unit == 'k')
+		bytes <<= 10;
+	else if (*unit == 'M' || *unit == 'm')
+		bytes <<= 20;
+	else if (*unit == 'G' || *unit == 'g')
+		bytes <<= 30;
+	const char* mode = getenv("CONCURRENTALLOC_RESERVE_MODE");
+	ReserveOptions options;
+	options._prefault = mode != nullptr && strcmp(mode, "prefault") == 0;
+	options._lock = mode != nullptr && strcmp(mode, "lock") == 0;
+	// 预留失败不影响程序运行，之后照常按需申请
+	try
+	{
+		if (bytes != 0)
+			ConcurrentAllocReserve(bytes, options);
+	}
+	catch (const std::bad_alloc&)
+	{
+	}
+}
+
+#ifdef ALLOC_TRACE
+// libconcurrentalloc_trace.so 设置环境变量 CONCURRENTALLOC_TRACE=文件名 时，加载时开始记录申请释放，进程退出时写出
+//     trace_replay 文件名
+__attribute__((constructor)) static void StartTrace()
+{
+	const char* path = getenv("CONCURRENTALLOC_TRACE");
+	if (path == nullptr || *path == '\0' || !TraceStart(path))
+		return;
+	atexit(TraceStop);
+}
+#endif
+#endif
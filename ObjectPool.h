@@ -0,0 +1,95 @@
+#pragma once
+
+#include "ConcurrentAlloc.h"
+
+#include <utility>
+
+// 类型已知的对象池：对象大小在编译期确定，自由链表的位置和批量大小也都在编译期算出
+// 快速路径只有取 tlslist、判空、弹出链表头几条指令，其余情况走 ThreadCache::AllocateSlow
+//     Message* msg = ConcurrentNew<Message>(id, body);
+//     ConcurrentDelete(msg);
+// ConcurrentDelete 的类型必须和 ConcurrentNew 相同，不能通过基类指针释放
+// 定义 ALLOC_TRACE 时和 ConcurrentAlloc 一样记录申请释放(见 TraceRecorder.h)，大小记为 sizeof(T)
+template<class T>
+class ObjectPool
+{
+public:
+	// 对象大小按 alignof(T) 取整，span 起始地址按页对齐，所以每个对象都满足对齐要求
+	static constexpr size_t SIZE = SizeClass::Roundup(
+		((sizeof(T) < sizeof(void*) ? sizeof(void*) : sizeof(T)) + alignof(T) - 1) & ~(alignof(T) - 1));
+	static constexpr size_t INDEX = SizeClass::Index(SIZE);
+	static constexpr size_t BATCH = SizeClass::NumMoveSize(SIZE);
+
+	static_assert(sizeof(T) <= MAX_BYTES, "ObjectPool only supports objects no larger than MAX_BYTES");
+	static_assert(alignof(T) <= ((size_t)1 << PAGE_SHIFT), "ObjectPool does not support alignment over a page");
+
+	static inline void* Alloc()
+	{
+		ThreadCache* tc = tlslist;
+		if (LIKELY(tc != nullptr))
+		{
+			Freelist* freelist = tc->GetFreelist(INDEX);
+			if (LIKELY(!freelist->Empty()))
+			{
+				tc->CountAlloc(INDEX);
+				void* ptr = freelist->Pop();
+				TraceAllocHook(ptr, sizeof(T));
+				return ptr;
+			}
+		}
+		void* ptr = ThreadCache::AllocateSlow(INDEX, SIZE, BATCH);
+		TraceAllocHook(ptr, sizeof(T));
+		return ptr;
+	}
+
+	static inline void Free(void* ptr)
+	{
+		ThreadCache* tc = tlslist;
+		if (LIKELY(tc != nullptr))
+		{
+			TraceFreeHook(ptr);
+			tc->CountFree(INDEX);
+			Freelist* freelist = tc->GetFreelist(INDEX);
+			freelist->Push(ptr);
+			if (UNLIKELY(freelist->Size() >= freelist->MaxSize()))
+				tc->ListTooLong(freelist, SIZE);
+			return;
+		}
+		ConcurrentFreeSized(ptr, SIZE);
+	}
+
+	template<class... Args>
+	static inline T* New(Args&&... args)
+	{
+		void* ptr = Alloc();
+		try
+		{
+			return new (ptr) T(std::forward<Args>(args)...);
+		}
+		catch (...)
+		{
+			Free(ptr);
+			throw;
+		}
+	}
+
+	static inline void Delete(T* obj)
+	{
+		if (obj == nullptr)
+			return;
+		obj->~T();
+		Free(obj);
+	}
+};
+
+template<class T, class... Args>
+static inline T* ConcurrentNew(Args&&... args)
+{
+	return ObjectPool<T>::New(std::forward<Args>(args)...);
+}
+
+template<class T>
+static inline void ConcurrentDelete(T* obj)
+{
+	ObjectPool<T>::Delete(obj);
+}
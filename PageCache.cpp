@@ -1,108 +1,275 @@
 #include "PageCache.h"
 
-constexpr int SIZEOF_PAGE_ID = sizeof(PageID);
+PageCache PageCache::_inst;
 
-// help function
-// 将 PageID 类型按照每4位保存在一个uint8_t类型中，组成一个数组
-// 例如 0x000000000000000F == 0000,0000,0000,0000,0000,0000,0000,0000,0000,0000,0000,0000,0000,0000,0000,1111 --> {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,15}
-static std::vector<uint8_t> PageId2Arr(const PageID id)
+// 向系统申请 npage 页内存，起始地址按页对齐
+// Linux 下优先用 sbrk 扩展堆，失败(例如堆顶被别的映射挡住)时改用 mmap
+// 私有堆的内存要能单独释放，只用 mmap，并记录在 _regions 中
+// 定义 USE_SEGMENT 时从对齐的段中申请
+void* PageCache::SystemAllocPage(size_t npage)
 {
-	std::vector<uint8_t> ret(SIZEOF_PAGE_ID * 2, 0);
-	PageID mask = static_cast<PageID>(0xFF) << ((SIZEOF_PAGE_ID - 1) * 8);
-	for(int i=0;i<SIZEOF_PAGE_ID;++i)
+	// 调用者持有页锁
+	_mappedpages += npage;
+#ifdef USE_SEGMENT
+	// 段头之后的第一页开始
+	void* ptr = (char*)SegmentAlloc(npage, this, !_private) + (SEGMENT_HEADER_PAGES << PAGE_SHIFT);
+	if (_private)
+	{
+		Span* region = this->newSpan();
+		region->_pageid = (PageID)ptr >> PAGE_SHIFT;
+		region->_npage = npage;
+		_regions.PushFront(region);
+	}
+	return ptr;
+#else
+	size_t bytes = npage << PAGE_SHIFT;
+	if (_private)
+	{
+		void* ptr = SystemAlloc(bytes);
+		if (ptr == nullptr)
+			throw std::bad_alloc();
+		Span* region = this->newSpan();
+		region->_pageid = (PageID)ptr >> PAGE_SHIFT;
+		region->_npage = npage;
+		_regions.PushFront(region);
+		return ptr;
+	}
+#ifdef __linux__
+	// 多个 PageCache 可能同时调用 sbrk，sbrk 本身不是线程安全的
+	static std::mutex brk_mutex;
 	{
-		uint8_t tempA = static_cast<uint8_t>((id & mask) >> (8 * (SIZEOF_PAGE_ID - i -1))); // 每次截取8位
-		uint8_t tempB = (tempA & 0xF0) >> 4; // 取 tempA 前4位
-		uint8_t tempC = tempA & 0x0F; // 取 tempA 后4位
-		ret[i*2] = tempB;
-		ret[i*2 + 1] = tempC;
-		mask >>= 8;
+		std::unique_lock<std::mutex> lock(brk_mutex);
+		// 堆顶不一定是页对齐的，先补齐
+		size_t pad = (size_t)(-(intptr_t)sbrk(0)) & ((1 << PAGE_SHIFT) - 1);
+		void* ptr = sbrk(pad + bytes);
+		if (ptr != (void*)-1)
+			return (char*)ptr + pad;
 	}
-	return ret;
+#endif
+	void* ptr = SystemAlloc(bytes);
+	if (ptr == nullptr)
+		throw std::bad_alloc();
+	return ptr;
+#endif // USE_SEGMENT
 }
 
-PageCache PageCache::_inst;
+void PageCache::SystemFreePage(void* ptr, size_t npage)
+{
+#ifdef USE_SEGMENT
+	// 段头中记录了段的大小
+	(void)npage;
+	SegmentFree(SegmentOf((PageID)ptr >> PAGE_SHIFT));
+#else
+	SystemFree(ptr, npage << PAGE_SHIFT);
+#endif
+}
+
+#ifdef USE_SEGMENT
+void* PageCache::AddSegment()
+{
+	size_t npage = SEGMENT_PAGES - SEGMENT_HEADER_PAGES;
+	LatencyTimer timer;
+	void* ptr = SystemAllocPage(npage);
+	RecordLatency(LatencyTier::SystemMap, timer);
+	PageID pageid = (PageID)ptr >> PAGE_SHIFT;
+	// 段头所在的页没有映射，合并时不会越过段的边界
+	while (npage > 0)
+	{
+		Span* span = this->newSpan();
+		span->_pageid = pageid;
+		span->_npage = npage < NPAGES - 1 ? npage : NPAGES - 1;
+		span->_stalemap = true;
+		IdMap().set(span->_pageid, span);
+		IdMap().set(span->_pageid + span->_npage - 1, span);
+		PushFreeSpan(span);
+		pageid += span->_npage;
+		npage -= span->_npage;
+	}
+	return ptr;
+}
+#endif
+
+void* PageCache::GrowHeap(size_t* npage)
+{
+#ifdef USE_SEGMENT
+	*npage = SEGMENT_PAGES - SEGMENT_HEADER_PAGES;
+	return AddSegment();
+#else
+	// Span* span = new Span;
+	Span* span = this->newSpan();
+
+	LatencyTimer timer;
+	void* ptr = SystemAllocPage(NPAGES - 1);
+	RecordLatency(LatencyTier::SystemMap, timer);
+
+	span->_pageid = (PageID)ptr >> PAGE_SHIFT;
+	span->_npage = NPAGES - 1;
+	span->_stalemap = true;
+
+	IdMap().set(span->_pageid, span);
+	IdMap().set(span->_pageid + span->_npage - 1, span);
+
+	PushFreeSpan(span);
+	*npage = span->_npage;
+	return ptr;
+#endif
+}
+
+size_t PageCache::Reserve(size_t npage, bool prefault, bool lock, bool* locked)
+{
+	std::unique_lock<PoolLock> guard(_mutex);
+	SyncSpanPolicy();
+	*locked = lock;
+	size_t reserved = 0;
+	while (reserved < npage)
+	{
+		size_t n = 0;
+		void* ptr = GrowHeap(&n);
+		// mlock 本身也会建立物理页
+		bool chunklocked = lock && SystemLock(ptr, n << PAGE_SHIFT);
+		if (lock && !chunklocked)
+			*locked = false;
+		if (prefault && !chunklocked)
+			SystemPrefault(ptr, n << PAGE_SHIFT);
+		reserved += n;
+	}
+	return reserved;
+}
 
 
 //大对象申请，直接从系统
-Span* PageCache::AllocBigPageObj(size_t size)
+Span* PageCache::AllocBigPageObj(size_t size, size_t align)
 {
 	assert(size > MAX_BYTES);//只有申请64K以上内存时才需要调用此函数
+#ifdef USE_SEGMENT
+	// 段头在段的开头，按 SEGMENT_SIZE 以上对齐的地址一定落在后面的 SEGMENT_SIZE 中，从地址找不到段头
+	if (align >= SEGMENT_SIZE)
+		throw std::bad_alloc();
+#endif
 
 	size = SizeClass::_Roundup(size, PAGE_SHIFT); //对齐
 	size_t npage = size >> PAGE_SHIFT;
-	if (npage < NPAGES)
+	// 对齐要求超过一页时多申请一些页，从中找到对齐的地址
+	size_t extra = align > ((size_t)1 << PAGE_SHIFT) ? (align >> PAGE_SHIFT) - 1 : 0;
+	if (npage + extra < NPAGES)
 	{
-		Span* span = NewSpan(npage);
-		span->_objsize = size;
+		Span* span = NewSpan(npage + extra);
+		span->_objsize = (npage + extra) << PAGE_SHIFT;
 		span->_usecount = 1;
+		span->_nheapsampled.store(0, std::memory_order_relaxed);
+		_nbig.fetch_add(1, std::memory_order_relaxed);
+		_bigbytes.fetch_add(span->_objsize, std::memory_order_relaxed);
 		return span;
 	}
 	else//超过128页，向系统申请
 	{
-#ifdef _WIN32
-		void* ptr = VirtualAlloc(0, npage << PAGE_SHIFT, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
-#else 
-		void* ptr = mmap(nullptr,npage << PAGE_SHIFT,PROT_WRITE | PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS,0,0);
-#endif
+		size_t bytes = npage << PAGE_SHIFT;
+		LatencyTimer timer;
+#ifdef USE_SEGMENT
+		// 大对象单独放在一个段中，段不能释放一部分，多申请的页保留在span中
+		char* ptr = (char*)SegmentAlloc(npage + extra, this, !_private) + (SEGMENT_HEADER_PAGES << PAGE_SHIFT);
+		bytes += extra << PAGE_SHIFT;
+		npage += extra;
+#else
+		char* ptr = static_cast<char*>(SystemAlloc(bytes + (extra << PAGE_SHIFT)));
 		if (ptr == nullptr)
 			throw std::bad_alloc();
+#ifndef _WIN32
+		// 去掉多申请的头尾，使起始地址对齐
+		if (extra != 0)
+		{
+			size_t head = (size_t)(-(intptr_t)ptr) & (align - 1);
+			if (head != 0)
+				SystemFree(ptr, head);
+			SystemFree(ptr + head + bytes, (extra << PAGE_SHIFT) - head);
+			ptr += head;
+		}
+#else
+		// Windows 不能释放一部分，起始地址不对齐，由调用者在span内部找到对齐的地址
+		bytes += extra << PAGE_SHIFT;
+		npage += extra;
+#endif
+#endif // USE_SEGMENT
+		RecordLatency(LatencyTier::SystemMap, timer);
 
+		std::unique_lock<PoolLock> lock(_mutex);
 		//Span* span = new Span;
 		Span* span = this->newSpan();
 		span->_npage = npage;
 		span->_pageid = (PageID)ptr >> PAGE_SHIFT;
-		span->_objsize = npage << PAGE_SHIFT;
-#ifdef USE_RADIX_TREE
-	#ifdef USE_STRING
-		_idspanmap[std::to_string(span->_pageid)] = span;
-	#else
-		_idspanmap[PageId2Arr(span->_pageid)] = span;
-	#endif
-#else
-		_idspanmap[span->_pageid] = span;
-#endif
+		span->_objsize = bytes;
+		span->_usecount = 1;
+		span->_isuse = true;
+		_mappedpages += npage;
+		_nbig.fetch_add(1, std::memory_order_relaxed);
+		_bigbytes.fetch_add(bytes, std::memory_order_relaxed);
+		// 每一页都建立映射，对齐之后的地址不一定在第一页
+		for (size_t i = 0; i < npage; ++i)
+			IdMap().set(span->_pageid + i, span);
+		if (_private)
+		{
+			// 大对象的span不在任何链表中，_list 用来指向记录这块内存的region
+			Span* region = this->newSpan();
+			region->_pageid = span->_pageid;
+			region->_npage = npage;
+			_regions.PushFront(region);
+			span->_list = region;
+		}
 		return span;
 	}
 }
 
 void PageCache::FreeBigPageObj(void* ptr, Span* span)
 {
-	size_t npage = span->_objsize >> PAGE_SHIFT;
+	size_t npage = span->_npage;
+	_nbig.fetch_sub(1, std::memory_order_relaxed);
+	// 按页数计算，Arena申请的大span会把 _objsize 清零(见 Arena::GetSpan)
+	_bigbytes.fetch_sub(npage << PAGE_SHIFT, std::memory_order_relaxed);
 	if (npage < NPAGES) //相当于还是小于128页
 	{
 		ReleaseSpanToPageCache(span);
 	}
 	else
 	{
-#ifdef USE_RADIX_TREE
-	#ifdef USE_STRING
-		_idspanmap.erase(_idspanmap.find(std::to_string(npage)));
-	#else
-		_idspanmap.erase(_idspanmap.find(PageId2Arr(npage)));
-	#endif
-#else
-		_idspanmap.erase(npage);
-#endif
-		//void* ptr = (void*)(span->_pageid << PAGE_SHIFT);//是否可以这样做然后少传递一个参数
-		delete span;
-#ifdef _WIN32
-		VirtualFree(ptr, 0, MEM_RELEASE);
-		this->_ptr_record.emplace_back(ptr);
-#elif __linux__
-		munmap(ptr,npage << PAGE_SHIFT);
-#endif
+		// 对齐申请时ptr不一定是起始地址，以span为准
+		ptr = (void*)(span->_pageid << PAGE_SHIFT);
+		{
+			std::unique_lock<PoolLock> lock(_mutex);
+			_mappedpages -= npage;
+			_releasedpages += npage;
+			for (size_t i = 0; i < npage; ++i)
+				IdMap().erase(span->_pageid + i);
+			if (_private)
+			{
+				Span* region = static_cast<Span*>(span->_list);
+				_regions.Erase(region);
+				this->deleteSpan(region);
+			}
+			this->deleteSpan(span);
+		}
+		SystemFreePage(ptr, npage);
 	}
 }
 
-Span* PageCache::NewSpan(size_t n)
+Span* PageCache::NewSpan(size_t n, size_t sizeclass)
 {
 	// 加锁，防止多个线程同时到PageCache中申请span
 	// 这里必须是给全局加锁，不能单独的给每个桶加锁
 	// 如果对应桶没有span,是需要向系统申请的
 	// 可能存在多个线程同时向系统申请内存的可能
-	std::unique_lock<std::mutex> lock(_mutex);
-	return _NewSpan(n);
+	LatencyTimer timer;
+	std::unique_lock<PoolLock> lock(_mutex);
+	SyncSpanPolicy();
+	Span* span = _NewSpan(n);
+	span->_isuse = true;
+	// 放回时不清除 _classmap，不切分成小对象的span是0
+	if (sizeclass != 0 || span->_hasclass)
+	{
+		for (size_t i = 0; i < span->_npage; ++i)
+			ClassMap().set(span->_pageid + i, (uint8_t)sizeclass);
+	}
+	RecordLatency(LatencyTier::PageSpan, timer);
+	return span;
 }
 
 
@@ -110,20 +277,29 @@ Span* PageCache::NewSpan(size_t n)
 Span* PageCache::_NewSpan(size_t n)
 {
 	assert(n < NPAGES);
-	if (!_spanlist[n].Empty())
+	Span* fit = PopFreeSpan(n);
+	if (fit != nullptr)
 	{
-		Span* span =_spanlist[n].PopFront();
-		span->_usecount = 1;
-		return span;
+		// 还没有合并的span正好合适时直接用，不再合并
+		if (fit->_uncoalesced)
+			ErasePending(fit);
+		if (fit->_stalemap)
+		{
+			for (size_t j = 0; j < n; ++j)
+				IdMap().set(fit->_pageid + j, fit);
+			fit->_stalemap = false;
+		}
+		fit->_usecount = 1;
+		return fit;
 	}
-		
+
 
 	for (size_t i = n + 1; i < NPAGES; ++i)
 	{
-		if (!_spanlist[i].Empty())
+		Span* span = PopFreeSpan(i);
+		if (span != nullptr)
 		{
 			//大内存对象拆分
-			Span* span = _spanlist[i].PopFront();
 			// Span* splist = new Span;
 			Span* splist = this->newSpan();
 
@@ -131,6 +307,7 @@ Span* PageCache::_NewSpan(size_t n)
 			splist->_npage = n;
 			splist->_objsize = splist->_npage << PAGE_SHIFT;
 			splist->_usecount = 1;//一次使用
+			splist->_hasclass = span->_hasclass;
 
 			span->_pageid = span->_pageid + n;
 			span->_npage = span->_npage - n;
@@ -138,133 +315,124 @@ Span* PageCache::_NewSpan(size_t n)
 
 
 			for (size_t j = 0; j < n; ++j)
-#ifdef USE_RADIX_TREE
-	#ifdef USE_STRING
-				_idspanmap[std::to_string(splist->_pageid + j)] = splist;
-	#else
-				_idspanmap[PageId2Arr(splist->_pageid + j)] = splist;
-	#endif
-#else
-				_idspanmap[splist->_pageid + j] = splist;
-#endif
-			_spanlist[span->_npage].PushFront(span);
+				IdMap().set(splist->_pageid + j, splist);
+			// 剩下的span的尾页没有变
+			IdMap().set(span->_pageid, span);
+			PushFreeSpan(span);
 			return splist;
 		}
 	}
 
-	// Span* span = new Span;
-	Span* span = this->newSpan();
-
-	// 到这里说明SpanList中没有合适的span,只能向系统申请128页的内存
-#ifdef _WIN32
-	void* ptr = VirtualAlloc(0, (NPAGES - 1)*(1 << PAGE_SHIFT), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
-	this->_ptr_record.push_back(ptr);
-#elif __linux__
-	void *ptr = sbrk((NPAGES - 1)*(1 << PAGE_SHIFT));
-#endif
-
-
-	span->_pageid = (PageID)ptr >> PAGE_SHIFT;
-	span->_npage = NPAGES - 1;
-
-	for (size_t i = 0; i < span->_npage; ++i)
-#ifdef USE_RADIX_TREE
-	#ifdef USE_STRING
-		_idspanmap[std::to_string(span->_pageid + i)] = span;
-	#else
-		_idspanmap[PageId2Arr(span->_pageid + i)] = span;
-	#endif
-#else
-		_idspanmap[span->_pageid + i] = span;
-#endif
+	// 没有正好合适的也没有能切分的，合并之后可能有了
+	if (_pendinghead != nullptr)
+	{
+		CoalescePending();
+		return _NewSpan(n);
+	}
 
-	_spanlist[span->_npage].PushFront(span);  //Span->_next  Span->_prev 
+	// 到这里说明SpanList中没有合适的span,只能向系统申请128页的内存(或者一个段)
+	size_t npage = 0;
+	GrowHeap(&npage);
 	return _NewSpan(n);
 }
 
 // 获取从对象到span的映射
 Span* PageCache::MapObjectToSpan(void* obj)
 {
-	//计算页号
-	PageID id = (PageID)obj >> PAGE_SHIFT;
-
-#ifdef USE_RADIX_TREE
-	#ifdef USE_STRING
-	auto it = _idspanmap.find(std::to_string(id));
-	#else
-	auto it = _idspanmap.find(PageId2Arr(id));
-	#endif
-#else
-	auto it = _idspanmap.find(id);
-#endif
-
-	if (it != _idspanmap.end())
-	{
-		return it->second;
-	}
-	else
-	{
-		assert(false);
-		return nullptr;
-	}
+	Span* span = LookupSpan(obj);
+	assert(span != nullptr);
+	return span;
 }
 
 void PageCache::ReleaseSpanToPageCache(Span* cur)
 {
 	// 必须上全局锁,可能多个线程一起从ThreadCache中归还数据
-	std::unique_lock<std::mutex> lock(_mutex);
+	// 这里不合并也不修改映射，加锁的时间和span的页数无关(地址优先时放入树中是 O(log n))
+	std::unique_lock<PoolLock> lock(_mutex);
 	cur->_objsize = 0;
 	cur->_usecount = 0;
+	cur->_isuse = false;
+	cur->_list = nullptr;
+	// 使用中的span每一页都有映射，大小类也都相同
+	cur->_stalemap = false;
+	cur->_hasclass = ClassMap().get(cur->_pageid) != 0;
+	PushPending(cur);
+	PushFreeSpan(cur);
+}
+
+void PageCache::CoalescePending()
+{
+	// 先放回的先合并，LIFO 时最后放回的仍然在链表的最前面
+	while (_pendinghead != nullptr)
+	{
+		Span* span = _pendinghead;
+		ErasePending(span);
+		EraseFreeSpan(span);
+		PushFreeSpan(Coalesce(span));
+	}
+}
 
+void PageCache::PushPending(Span* span)
+{
+	span->_uncoalesced = true;
+	span->_pendprev = _pendingtail;
+	span->_pendnext = nullptr;
+	if (_pendingtail != nullptr)
+		_pendingtail->_pendnext = span;
+	else
+		_pendinghead = span;
+	_pendingtail = span;
+}
+
+void PageCache::ErasePending(Span* span)
+{
+	if (span->_pendprev != nullptr)
+		span->_pendprev->_pendnext = span->_pendnext;
+	else
+		_pendinghead = span->_pendnext;
+	if (span->_pendnext != nullptr)
+		span->_pendnext->_pendprev = span->_pendprev;
+	else
+		_pendingtail = span->_pendprev;
+	span->_pendprev = nullptr;
+	span->_pendnext = nullptr;
+	span->_uncoalesced = false;
+}
+
+Span* PageCache::Coalesce(Span* cur)
+{
 	// 向前合并
 	while (1)
 	{
 		PageID curid = cur->_pageid;
 		PageID previd = curid - 1;
 
-#ifdef USE_RADIX_TREE
-	#ifdef USE_STRING
-		auto it = _idspanmap.find(std::to_string(previd));
-	#else
-		auto it = _idspanmap.find(PageId2Arr(previd));
-	#endif
-#else
-		auto it = _idspanmap.find(previd);
-#endif
+		// 前一页是使用中的span的任意一页，或者是空闲span的尾页，映射都是对的
+		Span* prev = IdMap().get(previd);
 
-		// 没有找到
-		if (it == _idspanmap.end())
+		// 没有找到，或者是别的arena的页(共用映射，相邻的内存可能属于别的arena)
+		// span对象不会在arena之间转移，_arena 可以在不加对方的锁时读取；
+		// 别的arena的span的其余成员由对方的锁保护，确认是自己的span之后才能读 _isuse
+		if (prev == nullptr || prev->_arena.load(std::memory_order_relaxed) != _arena)
 			break;
 
 		// 前一个span不空闲
-		if (it->second->_usecount != 0)
+		if (prev->_isuse)
 			break;
 
-		Span* prev = it->second;
-
 		//超过128页则不合并
 		if (cur->_npage + prev->_npage > NPAGES - 1)
 			break;
 
-		// 先把prev从链表中移除
-		_spanlist[prev->_npage].Erase(prev);
+		// 先把prev从空闲span中移除
+		RemoveFreeSpan(prev);
 
-		// 合并
+		// 合并，只需要修正尾页的映射，cur 的其余页成为中间的页
 		prev->_npage += cur->_npage;
-		//修正id->span的映射关系
-		for (PageID i = 0; i < cur->_npage; ++i)
-		{
-#ifdef USE_RADIX_TREE
-	#ifdef USE_STRING
-			_idspanmap[std::to_string(cur->_pageid + 1)] = prev;
-	#else
-			_idspanmap[PageId2Arr(cur->_pageid + i)] = prev;
-	#endif
-#else
-			_idspanmap[cur->_pageid + i] = prev;
-#endif
-		}
-		// delete cur;
+		prev->_stalemap = true;
+		prev->_hasclass = prev->_hasclass || cur->_hasclass;
+		IdMap().set(prev->_pageid + prev->_npage - 1, prev);
+		this->deleteSpan(cur);
 
 		// 继续向前合并
 		cur = prev;
@@ -274,67 +442,113 @@ void PageCache::ReleaseSpanToPageCache(Span* cur)
 	//向后合并
 	while (1)
 	{
-		////超过128页则不合并
-
 		PageID curid = cur->_pageid;
 		PageID nextid = curid + cur->_npage;
 
-#ifdef USE_RADIX_TREE
-	#ifdef USE_STRING
-		auto it = _idspanmap.find(std::to_string(nextid));
-	#else
-		auto it = _idspanmap.find(PageId2Arr(nextid));
-	#endif
-#else
-		auto it = _idspanmap.find(nextid);
-#endif
+		// 后一页是使用中的span的任意一页，或者是空闲span的首页
+		Span* next = IdMap().get(nextid);
 
-		if (it == _idspanmap.end())
+		if (next == nullptr || next->_arena.load(std::memory_order_relaxed) != _arena)
 			break;
 
-		if (it->second->_usecount != 0)
+		if (next->_isuse)
 			break;
 
-		Span* next = it->second;
-
 		//超过128页则不合并
 		if (cur->_npage + next->_npage >= NPAGES - 1)
 			break;
 
-		_spanlist[next->_npage].Erase(next);
-
+		RemoveFreeSpan(next);
 
 		cur->_npage += next->_npage;
-		//修正id->Span的映射关系
-		for (PageID i = 0; i < next->_npage; ++i)
-		{
-#ifdef USE_RADIX_TREE
-	#ifdef USE_STRING
-			_idspanmap[std::to_string(next->_pageid + i)] = cur;
-	#else
-			_idspanmap[PageId2Arr(next->_pageid + i)] = cur;
-	#endif
-#else
-			_idspanmap[next->_pageid + i] = cur;
-#endif
-		}
+		cur->_stalemap = true;
+		cur->_hasclass = cur->_hasclass || next->_hasclass;
+		IdMap().set(cur->_pageid + cur->_npage - 1, cur);
 
-		// delete next;
+		this->deleteSpan(next);
 	}
+	return cur;
+}
 
-	// 最后将合并好的span插入到span链中
-	_spanlist[cur->_npage].PushFront(cur);
+void PageCache::RemoveFreeSpan(Span* span)
+{
+	EraseFreeSpan(span);
+	if (span->_uncoalesced)
+		ErasePending(span);
 }
 
-	//析构函数
-	PageCache::~PageCache()
+void PageCache::PushFreeSpan(Span* span)
+{
+	if (_policy == SpanPolicy::AddressOrdered)
+		_spantree[span->_npage].Insert(span);
+	else
+		_spanlist[span->_npage].PushFront(span);
+}
+
+Span* PageCache::PopFreeSpan(size_t npage)
+{
+	if (_policy == SpanPolicy::AddressOrdered)
+		return _spantree[npage].Empty() ? nullptr : _spantree[npage].PopLowest();
+	return _spanlist[npage].Empty() ? nullptr : _spanlist[npage].PopFront();
+}
+
+void PageCache::EraseFreeSpan(Span* span)
+{
+	if (_policy == SpanPolicy::AddressOrdered)
+		_spantree[span->_npage].Erase(span);
+	else
+		_spanlist[span->_npage].Erase(span);
+}
+
+void PageCache::ChangeSpanPolicy()
+{
+	SpanPolicy policy = span_policy.load(std::memory_order_relaxed);
+	for (size_t i = 1; i < NPAGES; ++i)
 	{
-#ifdef _WIN32
-		for(void *ptr:this->_ptr_record)
+		if (policy == SpanPolicy::AddressOrdered)
 		{
-			VirtualFree(ptr, 0, MEM_RELEASE);
+			while (!_spanlist[i].Empty())
+				_spantree[i].Insert(_spanlist[i].PopFront());
 		}
-#elif __linux__
-		brk(this->_origin_brk);
-#endif
-	}
\ No newline at end of file
+		else
+		{
+			// 按地址从低到高排在链表中
+			while (!_spantree[i].Empty())
+				_spanlist[i].PushBack(_spantree[i].PopLowest());
+		}
+	}
+	_policy = policy;
+}
+
+void PageCache::CollectStats(PageCacheStats* stats)
+{
+	{
+		std::unique_lock<PoolLock> lock(_mutex);
+		for (size_t i = 1; i < NPAGES; ++i)
+		{
+			size_t n = _spantree[i].Size();
+			for (Span* span = _spanlist[i].Begin(); span != _spanlist[i].End(); span = span->_next)
+				++n;
+			stats->_freespans[i] += n;
+			stats->_freepages += n * i;
+		}
+		stats->_mappedpages += _mappedpages;
+		stats->_releasedpages += _releasedpages;
+	}
+	stats->_spans += _spanpool.used();
+	stats->_metadata += _spanpool.reserved();
+	stats->_bigobjs += _nbig.load(std::memory_order_relaxed);
+	stats->_bigbytes += _bigbytes.load(std::memory_order_relaxed);
+}
+
+void PageCache::ReleaseAllMemory()
+{
+	assert(_private);
+	std::unique_lock<PoolLock> lock(_mutex);
+	for (Span* region = _regions.Begin(); region != _regions.End(); region = region->_next)
+		SystemFreePage((void*)(region->_pageid << PAGE_SHIFT), region->_npage);
+	IdMap().clear();
+	ClassMap().clear();
+	// 所有的Span(包括记录region的Span)都在_spanpool中，一起释放
+	_spanpool.releaseAll();
+}
@@ -4,69 +4,280 @@
 // #define USE_RADIX_TREE
 // 使用 string 作为 radix_tree 的键
 #define USE_STRING
+// 使用页号本身作为 radix_tree 的键(自适应基数树，见 radix_tree.hpp)，优先于 USE_STRING
+// #define USE_INTEGER_KEY
+// 是否使用 std::unordered_map 作为映射结构
+// #define USE_UNORDERED_MAP
+// 按 4MB 对齐的段申请内存，用地址运算找到段头中的映射(见 Segment.h)，优先于上面两种
+// #define USE_SEGMENT
+// 都不定义时使用三层基数树 TreePageMap
+// CentralCache 中每个大小类使用无锁的对象批量栈，只在栈空或满时才加桶锁(见 CentralCache.h)
+// #define USE_LOCKFREE_CENTRAL
+// PageCache 默认使用地址优先的最佳适配策略(SpanPolicy::AddressOrdered)，运行时仍然可以切换
+// #define USE_ADDRESS_ORDERED
 
 #include "Common.h"
-#ifdef USE_RADIX_TREE
-#include "radix_tree.hpp"
+#include "PageMap.h"
+#include "LatencyStats.h"
+
+#include <atomic>
+
+// PageCache 选择空闲span的策略
+enum class SpanPolicy
+{
+	Lifo,//每种页数一个链表，取最近放回的span；没有时从更大的span的头部切出
+	// 每种页数一棵按地址排序的树(SpanTree)，在够大的最小页数中取地址最低的span，切分时从头部切出
+	// 使用中的span集中在低地址，高地址的空闲span更容易合并成整块，堆的高水位更低；每次取放多 O(log n)
+	AddressOrdered,
+};
+
+#ifdef USE_ADDRESS_ORDERED
+inline std::atomic<SpanPolicy> span_policy{ SpanPolicy::AddressOrdered };
+#else
+inline std::atomic<SpanPolicy> span_policy{ SpanPolicy::Lifo };
 #endif
 
+// 设置所有PageCache(包括各arena和私有堆)的策略；每个PageCache下次申请span时把已有的空闲span移到新的结构中
+inline void ConcurrentAllocSetSpanPolicy(SpanPolicy policy)
+{
+	span_policy.store(policy, std::memory_order_relaxed);
+}
+
+// 一个PageCache的统计，汇总见 AllocStats.h
+struct PageCacheStats
+{
+	size_t _freespans[NPAGES] = {};//每种页数的空闲span个数
+	size_t _freepages = 0;
+	size_t _mappedpages = 0;//向系统申请、还没有归还的页数
+	size_t _releasedpages = 0;//累计还给系统的页数(USE_SEGMENT 时可能留在段缓存中)
+	size_t _spans = 0;//正在使用的Span对象个数
+	size_t _metadata = 0;//Span对象池向系统申请的字节数
+	size_t _bigobjs = 0;//正在使用的大对象个数
+	size_t _bigbytes = 0;
+};
+
 //对于Page Cache也要设置为单例，对于Central Cache获取span的时候
 //每次都是从同一个page数组中获取span
-//单例模式
+//单例模式；私有堆(ConcurrentHeap)各自构造自己的PageCache
 class PageCache
 {
 public:
-	static PageCache* GetInstence()
+	static constexpr PageCache* GetInstence()
 	{
 		return &_inst;
 	}
 
-	Span* AllocBigPageObj(size_t size);
+	// 私有堆使用：内存全部用 mmap 申请并记录下来，ReleaseAllMemory 时一次性归还
+	// arena 是全局内存池中的arena编号(见 CacheArena.h)，私有堆为0
+	explicit PageCache(bool isprivate, uint8_t arena = 0) : _private(isprivate), _arena(arena) {}
+
+	bool IsPrivate() const
+	{
+		return _private;
+	}
+
+	uint8_t ArenaIndex() const
+	{
+		return _arena;
+	}
+
+	// align 大于一页时，返回的span起始地址不一定对齐，由调用者在span内部找到对齐的地址
+	// 定义 USE_SEGMENT 时 align 不能达到 SEGMENT_SIZE，否则抛出 std::bad_alloc
+	Span* AllocBigPageObj(size_t size, size_t align = (size_t)1 << PAGE_SHIFT);
 	void FreeBigPageObj(void* ptr, Span* span);
 
 	Span* _NewSpan(size_t n);
-	Span* NewSpan(size_t n);//获取的是以页为单位
+	//获取的是以页为单位；sizeclass 是span切分的对象的 SizeClass::Index + 1，记录在 _classmap 中
+	Span* NewSpan(size_t n, size_t sizeclass = 0);
 
 	//获取从对象到span的映射
 	Span* MapObjectToSpan(void* obj);
 
-	//释放空间span回到PageCache，并合并相邻的span
-	void ReleaseSpanToPageCache(Span* span);
+	// 批量查找页号所在的span，先预取再读取
+	void MapPagesToSpans(const PageID* ids, Span** spans, size_t n)
+	{
+		IdMap().getMany(ids, spans, n);
+	}
 
-	// 获取一个新的span
-	Span* newSpan()
+	// 和 MapObjectToSpan 一样，但是 obj 不属于内存池时返回 nullptr
+	Span* LookupSpan(void* obj)
 	{
-		return _spanPool->getOneSpan();
+#ifdef USE_SEGMENT
+		Segment* seg = LookupSegment((PageID)obj >> PAGE_SHIFT);
+		if (seg == nullptr)
+			return nullptr;
+		return seg->_spans[((PageID)obj >> PAGE_SHIFT) & (SEGMENT_PAGES - 1)];
+#else
+		return IdMap().get((PageID)obj >> PAGE_SHIFT);
+#endif
 	}
 
-	//析构函数
-	~PageCache();
-private:
-	SpanPool *_spanPool;
-	SpanList _spanlist[NPAGES];
-#ifdef USE_RADIX_TREE
-	#ifdef USE_STRING
-	radix_tree<std::string,Span*> _idspanmap;
-	#else
-	radix_tree<std::vector<uint8_t>,Span*> _idspanmap;
-	#endif
+	// obj 所在页的大小类(SizeClass::Index + 1)，不是普通小对象的span(大对象、长期对象、Arena、不属于内存池)时返回0
+	size_t LookupClass(void* obj) const
+	{
+#ifdef USE_SEGMENT
+		Segment* seg = LookupSegment((PageID)obj >> PAGE_SHIFT);
+		if (seg == nullptr)
+			return 0;
+		return seg->_classes[((PageID)obj >> PAGE_SHIFT) & (SEGMENT_PAGES - 1)];
 #else
-	std::unordered_map<PageID, Span*> _idspanmap;
+		return ClassMap().get((PageID)obj >> PAGE_SHIFT);
 #endif
-	std::mutex _mutex;
-#ifdef _WIN32
-	std::vector<void*> _ptr_record;
-#elif __linux__
-	void *_origin_brk;
+	}
+
+#ifdef USE_SEGMENT
+	// 页号所在的、属于这个PageCache的段
+	// 全局PageCache只需要查位图；私有堆的段还要比较段头中记录的PageCache
+	Segment* LookupSegment(PageID id) const
+	{
+		if (!_private)
+			return GlobalSegmentOf(id);
+		Segment* seg = SegmentOf(id);
+		return seg != nullptr && seg->_owner == this ? seg : nullptr;
+	}
 #endif
+
+	//释放空间span回到PageCache，放入空闲span中但是不合并，相邻的span等到申请时再合并
+	void ReleaseSpanToPageCache(Span* span);
+
+	// 获取一个新的span，span对象只在这个PageCache中循环使用，_arena 不会变
+	Span* newSpan()
+	{
+		Span* span = _spanpool.getOneSpan();
+		span->_arena.store(_arena, std::memory_order_relaxed);
+		return span;
+	}
+
+	// 归还合并掉的span
+	void deleteSpan(Span* span)
+	{
+		_spanpool.releaseSpan(span);
+	}
+
+	// 私有堆销毁时调用：不遍历span和对象，按向系统申请的内存块整体释放
+	void ReleaseAllMemory();
+
+	// 向系统申请至少 npage 页放入空闲span中(见 Reserve.h)，返回申请的页数
+	// prefault 时预先建立物理页，lock 时用 mlock 锁住；都在页锁内完成，这些页这时还没有分出去
+	// lock 失败(超过 RLIMIT_MEMLOCK 等)时不影响预留，*locked 返回是否全部锁住(没有要求 lock 时是false)
+	size_t Reserve(size_t npage, bool prefault, bool lock, bool* locked);
+
+	// fork 前后调用，保证子进程中的锁处于未加锁状态
+	void Lock()
+	{
+		_mutex.lock();
+	}
+
+	void Unlock()
+	{
+		_mutex.unlock();
+	}
+
+	// 加页锁遍历空闲span，读取计数
+	void CollectStats(PageCacheStats* stats);
+
+	// 页锁的统计(定义 LOCK_STATS 时才有数据)
+	LockStats GetLockStats() const
+	{
+		return _mutex.Stats();
+	}
+
+	void ResetLockStats()
+	{
+		_mutex.ResetStats();
+	}
+
 private:
-	PageCache()
+	// 以下由持有页锁的调用者使用：按当前策略放入、取出、移除空闲span
+	void PushFreeSpan(Span* span);
+	// 页数正好是 npage 的空闲span，没有时返回 nullptr
+	Span* PopFreeSpan(size_t npage);
+	void EraseFreeSpan(Span* span);
+	// span_policy 改变之后第一次申请span时，把空闲span移到新策略的结构中
+	void SyncSpanPolicy()
+	{
+		if (span_policy.load(std::memory_order_relaxed) != _policy)
+			ChangeSpanPolicy();
+	}
+	void ChangeSpanPolicy();
+	// 正好合适的span和能切分的span都没有时调用：按放回的顺序合并待合并链表中的span
+	void CoalescePending();
+	// 和前后相邻的空闲span合并，返回合并后的span
+	Span* Coalesce(Span* span);
+	// 从空闲span中移除，还没有合并的也从待合并链表中移除
+	void RemoveFreeSpan(Span* span);
+	// 待合并链表的放入和移除
+	void PushPending(Span* span);
+	void ErasePending(Span* span);
+
+	// 向系统申请 npage 页内存
+	void* SystemAllocPage(size_t npage);
+	// 释放 SystemAllocPage 申请的大对象内存
+	void SystemFreePage(void* ptr, size_t npage);
+	// 向系统申请一块新的内存放入空闲span中，返回起始地址，*npage 是页数
+	// 定义 USE_SEGMENT 时是一个普通段(AddSegment)，否则是 NPAGES-1 页
+	void* GrowHeap(size_t* npage);
+#ifdef USE_SEGMENT
+	// 申请一个普通段，段头之外的页切成span放入空闲span中，返回第一个可用页的地址
+	void* AddSegment();
+#endif
+	// 全局内存池的耗时记到当前线程上(见 LatencyStats.h)，私有堆不记录
+	void RecordLatency(LatencyTier tier, const LatencyTimer& timer)
 	{
-#ifdef __linux__
-	this->_origin_brk=sbrk(0);
+#ifdef LATENCY_STATS
+		if (!_private)
+			LatencyRecord(tier, timer.Elapsed());
+#else
+		(void)tier;
+		(void)timer;
 #endif
-	_spanPool = SpanPool::GetInstance();
 	}
+
+	// 全局PageCache和各arena共用全局PageCache的映射，任何一个arena的指针都能直接查到span
+	// 私有堆使用自己的映射
+	// 使用中的span每一页都有映射；空闲span只保证首尾两页(合并时查找的就是这两页)，中间的页可能指向已经合并掉的span
+	IdSpanMap& IdMap()
+	{
+		return _private ? _idspanmap : _inst._idspanmap;
+	}
+
+	PageClassMap& ClassMap()
+	{
+		return _private ? _classmap : _inst._classmap;
+	}
+
+	const PageClassMap& ClassMap() const
+	{
+		return _private ? _classmap : _inst._classmap;
+	}
+
+private:
+	// 空闲span，SpanPolicy::Lifo 时在 _spanlist 中，AddressOrdered 时在 _spantree 中
+	SpanList _spanlist[NPAGES];
+	SpanTree _spantree[NPAGES];
+	SpanPolicy _policy = SpanPolicy::Lifo;
+	// 放回之后还没有合并的span，按放回的顺序链接(_pendprev/_pendnext)，_pendinghead 是最早放回的
+	// 这些span同时在上面的空闲span中，可以直接分配或者切分
+	Span* _pendinghead = nullptr;
+	Span* _pendingtail = nullptr;
+	IdSpanMap _idspanmap;
+	PageClassMap _classmap;
+	PoolLock _mutex;
+	SpanPool _spanpool;
+	bool _private = false;
+	uint8_t _arena = 0;
+	// 私有堆向系统申请的内存块，每块用一个Span记录起始页和页数
+	SpanList _regions;
+	// 向系统申请和归还的页数，由页锁保护
+	size_t _mappedpages = 0;
+	size_t _releasedpages = 0;
+	// 大对象的申请释放有一部分不在页锁内
+	std::atomic<size_t> _nbig{ 0 };
+	std::atomic<size_t> _bigbytes{ 0 };
+
+private:
+	// 默认的 TreePageMap 可以常量初始化，第一次 malloc 可能发生在全局对象构造之前
+	PageCache() = default;
 	PageCache(const PageCache&) = delete;
 	static PageCache _inst;
-};
\ No newline at end of file
+};
@@ -0,0 +1,315 @@
+#pragma once
+
+#include "Common.h"
+
+#include <atomic>
+
+// 页号 -> Span* 的映射结构，PageCache 用它来做 MapObjectToSpan 和页合并
+// 所有实现都提供相同的接口：
+//     Span* get(PageID id);              没有映射时返回nullptr
+//     void set(PageID id, Span* span);
+//     void erase(PageID id);
+//     void clear();                      删除所有映射，释放占用的内存
+//     void getMany(const PageID* ids, Span** values, size_t n);   批量查找，能预取的实现先预取再读取
+// 写操作由 PageCache::_mutex 保护；多个arena的PageCache共用一个映射时，各自只写自己的页
+
+// 页号的有效位数，64位系统用户态地址为48位
+const size_t PAGE_ID_BITS = (sizeof(void*) == 8 ? 48 : 32) - PAGE_SHIFT;
+
+// 三层基数树(默认实现)
+// 节点按需直接向系统申请，不会调用 malloc；节点申请之后只在 clear 时释放，所以 get 不需要加锁
+// 节点用 CAS 挂到树上，多个arena同时写不同的页也是安全的
+// T 是每一页保存的值，没有设置过的页是 T() (新申请的节点内存都是0)
+template<class T>
+class BasicTreePageMap
+{
+private:
+	static const size_t INTERIOR_BITS = (PAGE_ID_BITS + 2) / 3;
+	static const size_t INTERIOR_LENGTH = (size_t)1 << INTERIOR_BITS;
+	static const size_t LEAF_BITS = PAGE_ID_BITS - 2 * INTERIOR_BITS;
+	static const size_t LEAF_LENGTH = (size_t)1 << LEAF_BITS;
+
+	struct Leaf
+	{
+		T values[LEAF_LENGTH];
+	};
+
+	struct Node
+	{
+		std::atomic<Leaf*> leafs[INTERIOR_LENGTH];
+	};
+
+	std::atomic<Node*> _root[INTERIOR_LENGTH] = {};
+
+	// slot 为空时申请一个新节点挂上去，别的线程先挂上了就释放自己申请的
+	template<class N>
+	static N* Ensure(std::atomic<N*>& slot)
+	{
+		N* node = slot.load(std::memory_order_acquire);
+		if (node != nullptr)
+			return node;
+		N* fresh = static_cast<N*>(SystemAlloc(sizeof(N)));
+		if (fresh == nullptr)
+			throw std::bad_alloc();
+		if (slot.compare_exchange_strong(node, fresh, std::memory_order_acq_rel, std::memory_order_acquire))
+			return fresh;
+		SystemFree(fresh, sizeof(N));
+		return node;
+	}
+
+public:
+	T get(PageID id) const
+	{
+		if ((id >> PAGE_ID_BITS) != 0)
+			return T();
+
+		const Node* node = _root[id >> (INTERIOR_BITS + LEAF_BITS)].load(std::memory_order_acquire);
+		if (node == nullptr)
+			return T();
+
+		const Leaf* leaf = node->leafs[(id >> LEAF_BITS) & (INTERIOR_LENGTH - 1)].load(std::memory_order_acquire);
+		if (leaf == nullptr)
+			return T();
+
+		return leaf->values[id & (LEAF_LENGTH - 1)];
+	}
+
+	// 第一遍找到每一项所在的叶子并预取，第二遍读取，多个cache miss可以同时进行
+	void getMany(const PageID* ids, T* values, size_t n) const
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			PageID id = ids[i];
+			if ((id >> PAGE_ID_BITS) != 0)
+				continue;
+			const Node* node = _root[id >> (INTERIOR_BITS + LEAF_BITS)].load(std::memory_order_acquire);
+			if (node == nullptr)
+				continue;
+			const Leaf* leaf = node->leafs[(id >> LEAF_BITS) & (INTERIOR_LENGTH - 1)].load(std::memory_order_acquire);
+			if (leaf != nullptr)
+				PREFETCH(&leaf->values[id & (LEAF_LENGTH - 1)]);
+		}
+		for (size_t i = 0; i < n; ++i)
+			values[i] = get(ids[i]);
+	}
+
+	void set(PageID id, T value)
+	{
+		assert((id >> PAGE_ID_BITS) == 0);
+
+		Node* node = Ensure(_root[id >> (INTERIOR_BITS + LEAF_BITS)]);
+		Leaf* leaf = Ensure(node->leafs[(id >> LEAF_BITS) & (INTERIOR_LENGTH - 1)]);
+		leaf->values[id & (LEAF_LENGTH - 1)] = value;
+	}
+
+	void erase(PageID id)
+	{
+		if (get(id) != T())
+			set(id, T());
+	}
+
+	void clear()
+	{
+		for (size_t i = 0; i < INTERIOR_LENGTH; ++i)
+		{
+			Node* node = _root[i].load(std::memory_order_relaxed);
+			if (node == nullptr)
+				continue;
+			for (size_t j = 0; j < INTERIOR_LENGTH; ++j)
+			{
+				Leaf* leaf = node->leafs[j].load(std::memory_order_relaxed);
+				if (leaf != nullptr)
+					SystemFree(leaf, sizeof(Leaf));
+			}
+			SystemFree(node, sizeof(Node));
+			_root[i].store(nullptr, std::memory_order_relaxed);
+		}
+	}
+};
+
+typedef BasicTreePageMap<Span*> TreePageMap;
+
+// 页号 -> 大小类的映射，每页一个字节，值是 SizeClass::Index + 1，0 表示不是普通小对象的span
+// 比 Span* 紧凑 8 倍，释放小对象时只读这个数组，不用访问 Span
+static_assert(NLISTS < 256, "size class index must fit in a byte");
+#ifdef USE_SEGMENT
+#include "Segment.h"
+typedef SegmentPageArray<uint8_t, &Segment::_classes> PageClassMap;
+#else
+typedef BasicTreePageMap<uint8_t> PageClassMap;
+#endif
+
+// 以下两种是原来的实现，内部会通过 new 申请内存，不能用于替换 malloc 的动态库(整数键的 radix_tree 除外)
+#ifdef USE_UNORDERED_MAP
+class HashPageMap
+{
+private:
+	std::unordered_map<PageID, Span*> _map;
+
+public:
+	Span* get(PageID id) const
+	{
+		auto it = _map.find(id);
+		return it == _map.end() ? nullptr : it->second;
+	}
+
+	void getMany(const PageID* ids, Span** values, size_t n) const
+	{
+		for (size_t i = 0; i < n; ++i)
+			values[i] = get(ids[i]);
+	}
+
+	void set(PageID id, Span* span)
+	{
+		_map[id] = span;
+	}
+
+	void erase(PageID id)
+	{
+		_map.erase(id);
+	}
+
+	void clear()
+	{
+		_map.clear();
+	}
+};
+#endif
+
+#ifdef USE_RADIX_TREE
+#include <string>
+#include "radix_tree.hpp"
+#include "concurrent_radix_tree.hpp"
+
+// 将 PageID 类型按照每4位保存在一个uint8_t类型中，组成一个数组
+// 例如 0x000000000000000F == 0000,0000,0000,0000,0000,0000,0000,0000,0000,0000,0000,0000,0000,0000,0000,1111 --> {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,15}
+inline std::vector<uint8_t> PageId2Arr(const PageID id)
+{
+	const int SIZEOF_PAGE_ID = sizeof(PageID);
+	std::vector<uint8_t> ret(SIZEOF_PAGE_ID * 2, 0);
+	PageID mask = static_cast<PageID>(0xFF) << ((SIZEOF_PAGE_ID - 1) * 8);
+	for(int i=0;i<SIZEOF_PAGE_ID;++i)
+	{
+		uint8_t tempA = static_cast<uint8_t>((id & mask) >> (8 * (SIZEOF_PAGE_ID - i -1))); // 每次截取8位
+		uint8_t tempB = (tempA & 0xF0) >> 4; // 取 tempA 前4位
+		uint8_t tempC = tempA & 0x0F; // 取 tempA 后4位
+		ret[i*2] = tempB;
+		ret[i*2 + 1] = tempC;
+		mask >>= 8;
+	}
+	return ret;
+}
+
+template<typename K>
+K PageId2Key(const PageID id);
+
+template<>
+inline std::string PageId2Key<std::string>(const PageID id)
+{
+	return std::to_string(id);
+}
+
+template<>
+inline std::vector<uint8_t> PageId2Key<std::vector<uint8_t>>(const PageID id)
+{
+	return PageId2Arr(id);
+}
+
+template<>
+inline PageID PageId2Key<PageID>(const PageID id)
+{
+	return id;
+}
+
+template<typename K>
+class RadixTreePageMap
+{
+private:
+	radix_tree<K, Span*> _tree;
+
+public:
+	Span* get(PageID id)
+	{
+		auto it = _tree.find(PageId2Key<K>(id));
+		return it == _tree.end() ? nullptr : it->second;
+	}
+
+	void getMany(const PageID* ids, Span** values, size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+			values[i] = get(ids[i]);
+	}
+
+	void set(PageID id, Span* span)
+	{
+		_tree[PageId2Key<K>(id)] = span;
+	}
+
+	void erase(PageID id)
+	{
+		_tree.erase(PageId2Key<K>(id));
+	}
+
+	void clear()
+	{
+		_tree.clear();
+	}
+};
+
+// 整数键的并发自适应基数树(concurrent_radix_tree.hpp)：节点从自己的池中申请，内存直接向系统要，可以用于替换 malloc 的动态库
+// 查找不加锁(乐观锁耦合 + 延迟回收)，MapObjectToSpan 在 PageCache 合并、切分span的同时查找是安全的；写只锁要修改的节点，多个arena可以同时写
+// 和 TreePageMap 一样可以常量初始化、不析构：退出时别的全局对象还会释放内存，仍然要能查到span；私有堆由 ReleaseAllMemory 调用 clear
+class IntRadixTreePageMap
+{
+private:
+	union
+	{
+		concurrent_radix_tree<PageID, Span*> _tree;
+	};
+
+public:
+	constexpr IntRadixTreePageMap() : _tree() {}
+	~IntRadixTreePageMap() {}
+
+	Span* get(PageID id) const
+	{
+		return _tree.get(id);
+	}
+
+	void getMany(const PageID* ids, Span** values, size_t n) const
+	{
+		_tree.get_many(ids, values, n);
+	}
+
+	void set(PageID id, Span* span)
+	{
+		_tree.set(id, span);
+	}
+
+	void erase(PageID id)
+	{
+		_tree.erase(id);
+	}
+
+	void clear()
+	{
+		_tree.clear();
+	}
+};
+#endif
+
+#if defined(USE_SEGMENT)
+	typedef SegmentPageArray<Span*, &Segment::_spans> IdSpanMap;
+#elif defined(USE_RADIX_TREE)
+	#if defined(USE_INTEGER_KEY)
+	typedef IntRadixTreePageMap IdSpanMap;
+	#elif defined(USE_STRING)
+	typedef RadixTreePageMap<std::string> IdSpanMap;
+	#else
+	typedef RadixTreePageMap<std::vector<uint8_t>> IdSpanMap;
+	#endif
+#elif defined(USE_UNORDERED_MAP)
+	typedef HashPageMap IdSpanMap;
+#else
+	typedef TreePageMap IdSpanMap;
+#endif
@@ -0,0 +1,365 @@
+// 所有页号映射的实现都编译进来，只用 PageMap.h，不和内存池的其他部分链接
+#define USE_UNORDERED_MAP
+#define USE_RADIX_TREE
+
+#include "PageMap.h"
+
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <shared_mutex>
+
+// PageMap.h 中各种页号 -> Span* 映射的微基准测试，给释放路径上的查找选择数据结构
+//     tree          三层基数树 TreePageMap(默认)
+//     hash          std::unordered_map(USE_UNORDERED_MAP)
+//     radix-string  radix_tree<std::string>，每次操作把页号转成十进制字符串(USE_RADIX_TREE + USE_STRING)
+//     radix-vector  radix_tree<std::vector<uint8_t>>，每4位一个字节(USE_RADIX_TREE)
+//     radix-int     concurrent_radix_tree<PageID>，整数键的并发自适应基数树(USE_RADIX_TREE + USE_INTEGER_KEY)
+//     radix-int-seq radix_tree<PageID>，不支持并发的整数键自适应基数树，并发测试时和 hash 一样加读写锁
+// USE_SEGMENT 的映射是段头中的数组，查找只是地址运算，需要真实的段，不在这里测
+// 每种映射对两种页号分布依次测：
+//     insert  按 span 映射所有页(NewSpan/向系统申请之后)
+//     lookup  随机查找已映射的页(MapObjectToSpan，释放路径)
+//     remap   相邻的两个 span 合并时把后一个的页改映射到前一个，再拆开改回去(ReleaseSpanToPageCache/NewSpan 的切分)
+//     erase   删除所有页
+//     并发    一个写线程加锁不停地 remap，同时多个读线程随机查找；tree 和 radix-int 的读不加锁(和 PageCache 相同)，
+//             其他实现本身不是线程安全的，读线程加读写锁的读锁、写线程加写锁
+//             读线程数从1开始翻倍直到给定的个数，最后另外输出一张表：每种读线程数下所有读线程的查找吞吐量
+// 页号分布：
+//     dense   span 紧挨着排在一块连续的地址空间中，像一个不断向上增长的堆
+//     sparse  span 分成64个区域，每个区域的起始地址在 47 位地址空间中随机(多个 arena、mmap 的地址随机化)
+// span 的页数大多是1到8页，少数到128页
+// 用法：pagemap_bench [总页数，默认262144(1GB)] [读线程数，默认是核数] [并发测试的毫秒数，默认500] [映射名|all]
+
+struct MapRandom
+{
+	uint64_t _state;
+
+	explicit MapRandom(uint64_t seed) : _state(seed * 0x9E3779B97F4A7C15ull + 1) {}
+
+	uint64_t Next()
+	{
+		_state ^= _state << 13;
+		_state ^= _state >> 7;
+		_state ^= _state << 17;
+		return _state;
+	}
+};
+
+// 测试用的 span 布局，同一个区域内相邻的 span 页号连续
+struct SpanLayout
+{
+	std::vector<Span> _spans;
+	std::vector<PageID> _pages;//所有映射的页，随机顺序，用于查找
+	std::vector<size_t> _pairs;//可以合并的相邻 span 对的前一个下标
+	size_t _npages = 0;
+};
+
+static size_t RandomSpanPages(MapRandom& rng)
+{
+	uint64_t r = rng.Next();
+	if (r % 16 != 0)
+		return 1 + (size_t)((r >> 8) % 8);
+	return 1 + (size_t)((r >> 8) % (NPAGES - 1));
+}
+
+static void BuildLayout(SpanLayout& layout, size_t totalpages, bool sparse)
+{
+	MapRandom rng(sparse ? 2 : 1);
+	const size_t nregions = sparse ? 64 : 1;
+	const size_t perregion = totalpages / nregions + 1;
+	// 用户态地址 0x10000000 到 47 位上限之间
+	const PageID low = (PageID)0x10000000 >> PAGE_SHIFT;
+	const PageID high = ((PageID)1 << (47 - PAGE_SHIFT)) - perregion - NPAGES;
+	const PageID densebase = (PageID)0x7f0000000000 >> PAGE_SHIFT;
+
+	// 先数出 span 个数，_spans 不会再扩容，指针保持有效
+	std::vector<std::pair<PageID, size_t>> ranges;
+	std::vector<bool> joined;//和前一个 span 属于同一个区域
+	for (size_t r = 0; r < nregions && layout._npages < totalpages; ++r)
+	{
+		PageID id = sparse ? low + (PageID)(rng.Next() % (high - low)) : densebase;
+		size_t used = 0;
+		bool first = true;
+		while (used < perregion && layout._npages < totalpages)
+		{
+			size_t n = RandomSpanPages(rng);
+			ranges.push_back({ id, n });
+			joined.push_back(!first);
+			first = false;
+			id += n;
+			used += n;
+			layout._npages += n;
+		}
+	}
+
+	// Span 有原子成员不能移动，不能 resize，直接按个数构造
+	layout._spans = std::vector<Span>(ranges.size());
+	layout._pages.reserve(layout._npages);
+	for (size_t i = 0; i < ranges.size(); ++i)
+	{
+		Span& span = layout._spans[i];
+		span._pageid = ranges[i].first;
+		span._npage = ranges[i].second;
+		for (size_t j = 0; j < span._npage; ++j)
+			layout._pages.push_back(span._pageid + j);
+		if (joined[i])
+			layout._pairs.push_back(i - 1);
+	}
+	for (size_t i = layout._pages.size(); i > 1; --i)
+		std::swap(layout._pages[i - 1], layout._pages[rng.Next() % i]);
+}
+
+template<class Map>
+static void MapAll(Map& map, SpanLayout& layout)
+{
+	for (Span& span : layout._spans)
+	{
+		for (size_t j = 0; j < span._npage; ++j)
+			map.set(span._pageid + j, &span);
+	}
+}
+
+// 合并 pair 和后一个 span，再拆开，返回改映射的页数
+template<class Map>
+static size_t RemapPair(Map& map, SpanLayout& layout, size_t pair)
+{
+	Span* prev = &layout._spans[pair];
+	Span* next = &layout._spans[pair + 1];
+	for (size_t j = 0; j < next->_npage; ++j)
+		map.set(next->_pageid + j, prev);
+	for (size_t j = 0; j < next->_npage; ++j)
+		map.set(next->_pageid + j, next);
+	return 2 * next->_npage;
+}
+
+// tree 和 radix-int 的读可以和写同时进行，其他实现要加锁
+template<class Map>
+struct LockFreeRead
+{
+	static const bool value = false;
+};
+
+template<>
+struct LockFreeRead<TreePageMap>
+{
+	static const bool value = true;
+};
+
+template<>
+struct LockFreeRead<IntRadixTreePageMap>
+{
+	static const bool value = true;
+};
+
+// 并发测试的读线程数：1, 2, 4, ... 最后一个是给定的个数
+const size_t MAX_READER_STEPS = 16;
+
+struct MapResult
+{
+	double _insert = 0;//ns/页
+	double _lookup = 0;//ns/次
+	double _remap = 0;//ns/页
+	double _erase = 0;//ns/页
+	size_t _steps = 0;
+	size_t _nreaders[MAX_READER_STEPS] = {};
+	double _readers[MAX_READER_STEPS] = {};//并发时所有读线程的 M 次/s
+	double _writer[MAX_READER_STEPS] = {};//并发时写线程的 M 页/s
+};
+
+static double NsSince(std::chrono::steady_clock::time_point begin, size_t n)
+{
+	double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+	return n == 0 ? 0.0 : ns / n;
+}
+
+static std::atomic<uintptr_t> bench_sink{ 0 };
+
+// 一个写线程不停地 remap，nreaders 个读线程同时随机查找，运行 millis 毫秒
+template<class Map>
+static void RunConcurrent(Map& map, SpanLayout& layout, size_t nreaders, size_t millis, double* readrate, double* writerate)
+{
+	std::shared_mutex rwlock;
+	std::atomic<bool> stop{ false };
+	std::atomic<uint64_t> lookups{ 0 };
+	std::vector<std::thread> readers;
+	for (size_t k = 0; k < nreaders; ++k)
+	{
+		readers.emplace_back([&, k]() {
+			MapRandom local(k + 10);
+			uint64_t n = 0;
+			uintptr_t s = 0;
+			const size_t npages = layout._pages.size();
+			while (!stop.load(std::memory_order_relaxed))
+			{
+				for (size_t i = 0; i < 256; ++i)
+				{
+					PageID id = layout._pages[local.Next() % npages];
+					if (LockFreeRead<Map>::value)
+						s += (uintptr_t)map.get(id);
+					else
+					{
+						std::shared_lock<std::shared_mutex> lock(rwlock);
+						s += (uintptr_t)map.get(id);
+					}
+				}
+				n += 256;
+			}
+			lookups.fetch_add(n);
+			bench_sink.fetch_add(s, std::memory_order_relaxed);
+		});
+	}
+	size_t written = 0;
+	std::thread writer([&]() {
+		MapRandom local(4);
+		std::mutex writelock;//PageCache::_mutex
+		while (!stop.load(std::memory_order_relaxed))
+		{
+			size_t pair = layout._pairs[local.Next() % layout._pairs.size()];
+			if (LockFreeRead<Map>::value)
+			{
+				std::unique_lock<std::mutex> lock(writelock);
+				written += RemapPair(map, layout, pair);
+			}
+			else
+			{
+				std::unique_lock<std::shared_mutex> lock(rwlock);
+				written += RemapPair(map, layout, pair);
+			}
+		}
+	});
+	auto begin = std::chrono::steady_clock::now();
+	std::this_thread::sleep_for(std::chrono::milliseconds(millis));
+	stop.store(true);
+	writer.join();
+	for (auto& t : readers)
+		t.join();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	*readrate = lookups.load() / seconds / 1e6;
+	*writerate = written / seconds / 1e6;
+}
+
+template<class Map>
+static MapResult RunMap(SpanLayout& layout, size_t nreaders, size_t millis)
+{
+	MapResult result;
+	std::unique_ptr<Map> map(new Map);
+	MapRandom rng(3);
+
+	auto begin = std::chrono::steady_clock::now();
+	MapAll(*map, layout);
+	result._insert = NsSince(begin, layout._npages);
+
+	uintptr_t sum = 0;
+	begin = std::chrono::steady_clock::now();
+	for (PageID id : layout._pages)
+		sum += (uintptr_t)map->get(id);
+	result._lookup = NsSince(begin, layout._pages.size());
+
+	size_t remapped = 0;
+	begin = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < layout._pairs.size(); ++i)
+		remapped += RemapPair(*map, layout, layout._pairs[rng.Next() % layout._pairs.size()]);
+	result._remap = NsSince(begin, remapped);
+
+	for (size_t k = 1; result._steps < MAX_READER_STEPS; k *= 2)
+	{
+		if (k > nreaders || result._steps == MAX_READER_STEPS - 1)
+			k = nreaders;
+		result._nreaders[result._steps] = k;
+		RunConcurrent(*map, layout, k, millis, &result._readers[result._steps], &result._writer[result._steps]);
+		++result._steps;
+		if (k == nreaders)
+			break;
+	}
+
+	begin = std::chrono::steady_clock::now();
+	for (const Span& span : layout._spans)
+	{
+		for (size_t j = 0; j < span._npage; ++j)
+			map->erase(span._pageid + j);
+	}
+	result._erase = NsSince(begin, layout._npages);
+	map->clear();
+	bench_sink.fetch_add(sum, std::memory_order_relaxed);
+	return result;
+}
+
+struct MapEntry
+{
+	const char* _name;
+	MapResult (*_run)(SpanLayout& layout, size_t nreaders, size_t millis);
+};
+
+static const MapEntry maps[] = {
+	{ "tree", RunMap<TreePageMap> },
+	{ "hash", RunMap<HashPageMap> },
+	{ "radix-string", RunMap<RadixTreePageMap<std::string>> },
+	{ "radix-vector", RunMap<RadixTreePageMap<std::vector<uint8_t>>> },
+	{ "radix-int", RunMap<IntRadixTreePageMap> },
+	{ "radix-int-seq", RunMap<RadixTreePageMap<PageID>> },
+};
+
+int main(int argc, char* argv[])
+{
+	size_t totalpages = argc > 1 ? strtoul(argv[1], nullptr, 10) : 262144;
+	size_t nreaders = argc > 2 ? strtoul(argv[2], nullptr, 10) : std::thread::hardware_concurrency();
+	size_t millis = argc > 3 ? strtoul(argv[3], nullptr, 10) : 500;
+	const char* which = argc > 4 ? argv[4] : "all";
+	if (totalpages < 2 * NPAGES)
+		totalpages = 2 * NPAGES;
+	if (nreaders == 0)
+		nreaders = 1;
+
+	bool found = strcmp(which, "all") == 0;
+	for (const MapEntry& m : maps)
+		found = found || strcmp(which, m._name) == 0;
+	if (!found)
+	{
+		fprintf(stderr, "unknown map %s\n", which);
+		return 1;
+	}
+
+	SpanLayout layouts[2];
+	const char* const distnames[2] = { "dense", "sparse" };
+	for (size_t d = 0; d < 2; ++d)
+		BuildLayout(layouts[d], totalpages, d == 1);
+
+	printf("pages: %zu  spans: %zu/%zu  readers: %zu  concurrent: %zu ms\n",
+		layouts[0]._npages, layouts[0]._spans.size(), layouts[1]._spans.size(), nreaders, millis);
+	printf("%-13s %-6s | %9s %9s %9s %9s | %13s %13s\n", "map", "dist",
+		"insert", "lookup", "remap", "erase", "lookup(M/s)", "remap(Mpg/s)");
+	printf("%-13s %-6s | %9s %9s %9s %9s | %13s %13s\n", "", "",
+		"ns/page", "ns", "ns/page", "ns/page", "readers", "writer");
+	std::vector<std::pair<const char*, MapResult>> results;
+	for (const MapEntry& m : maps)
+	{
+		if (strcmp(which, "all") != 0 && strcmp(which, m._name) != 0)
+			continue;
+		for (size_t d = 0; d < 2; ++d)
+		{
+			MapResult r = m._run(layouts[d], nreaders, millis);
+			size_t last = r._steps - 1;
+			printf("%-13s %-6s | %9.1f %9.1f %9.1f %9.1f | %13.2f %13.2f\n", m._name, distnames[d],
+				r._insert, r._lookup, r._remap, r._erase, r._readers[last], r._writer[last]);
+			fflush(stdout);
+			results.emplace_back(m._name, r);
+		}
+	}
+
+	// 读线程数增加时的查找吞吐量(M 次/s)，括号中是写线程的 M 页/s
+	printf("\nreader scaling: lookup M/s (writer Mpg/s)\n%-13s %-6s |", "map", "dist");
+	const MapResult& first = results.front().second;
+	for (size_t i = 0; i < first._steps; ++i)
+		printf(" %12zu r", first._nreaders[i]);
+	printf("\n");
+	for (size_t k = 0; k < results.size(); ++k)
+	{
+		const MapResult& r = results[k].second;
+		printf("%-13s %-6s |", results[k].first, distnames[k % 2]);
+		for (size_t i = 0; i < r._steps; ++i)
+			printf(" %7.2f(%5.2f)", r._readers[i], r._writer[i]);
+		printf("\n");
+	}
+	return bench_sink.load() == 1 ? 1 : 0;
+}
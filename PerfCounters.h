@@ -0,0 +1,184 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// 基准测试用的硬件性能计数器(Linux perf_event_open)，只统计用户态
+// 在创建工作线程之前 Open，之后创建的线程继承计数器，线程退出时计数并入；用两次 Read 的差值得到一段负载的计数
+//     PerfCounters perf;
+//     perf.Open();
+//     PerfSnapshot before = perf.Read();
+//     ... 创建线程运行负载，join ...
+//     PerfSnapshot after = perf.Read();
+//     after.Delta(before, PerfEvent::Instructions, &value);
+// 打不开的计数器(虚拟机、容器、perf_event_paranoid 限制)跳过；一个都打不开时 Open 返回 false，调用者照常运行
+// 计数器多于硬件寄存器时内核轮流计数，按启用时间和实际计数时间的比例换算
+
+enum class PerfEvent
+{
+	Instructions,
+	Cycles,
+	L1dMisses,//L1 数据缓存读缺失
+	LlcMisses,//最后一级缓存读缺失
+	DtlbMisses,//数据 TLB 读缺失
+	BranchMisses,
+};
+
+const size_t PERF_EVENTS = 6;
+
+// 一次读取：每个计数器的计数、启用时间、实际计数时间
+struct PerfSnapshot
+{
+	bool _valid[PERF_EVENTS] = {};
+	uint64_t _value[PERF_EVENTS] = {};
+	uint64_t _enabled[PERF_EVENTS] = {};
+	uint64_t _running[PERF_EVENTS] = {};
+
+	// this 减去 before，按多路复用换算；计数器不可用或者这段时间没有计数时返回 false
+	bool Delta(const PerfSnapshot& before, PerfEvent event, double* value) const
+	{
+		size_t i = (size_t)event;
+		if (!_valid[i] || !before._valid[i])
+			return false;
+		uint64_t running = _running[i] - before._running[i];
+		if (running == 0)
+			return false;
+		double scale = (double)(_enabled[i] - before._enabled[i]) / running;
+		*value = (double)(_value[i] - before._value[i]) * scale;
+		return true;
+	}
+};
+
+class PerfCounters
+{
+public:
+	PerfCounters()
+	{
+		for (size_t i = 0; i < PERF_EVENTS; ++i)
+			_fd[i] = -1;
+	}
+
+	~PerfCounters()
+	{
+		Close();
+	}
+
+	PerfCounters(const PerfCounters&) = delete;
+	PerfCounters& operator=(const PerfCounters&) = delete;
+
+	static const char* Name(PerfEvent event)
+	{
+		static const char* const names[PERF_EVENTS] = { "instructions", "cycles", "L1d-misses", "LLC-misses", "dTLB-misses", "branch-misses" };
+		return names[(size_t)event];
+	}
+
+	// 打开所有计数器，返回是否至少打开了一个；失败的原因用 Error() 取(errno)
+	bool Open()
+	{
+		bool any = false;
+#ifdef __linux__
+		for (size_t i = 0; i < PERF_EVENTS; ++i)
+		{
+			struct perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			Config((PerfEvent)i, &attr);
+			attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+			attr.inherit = 1;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			_fd[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+			if (_fd[i] < 0)
+				_error = errno;
+			else
+				any = true;
+		}
+#else
+		_error = -1;
+#endif
+		return any;
+	}
+
+	void Close()
+	{
+#ifdef __linux__
+		for (size_t i = 0; i < PERF_EVENTS; ++i)
+		{
+			if (_fd[i] >= 0)
+				close(_fd[i]);
+			_fd[i] = -1;
+		}
+#endif
+	}
+
+	int Error() const
+	{
+		return _error;
+	}
+
+	// 读取当前的累计值，包括已经退出的子线程
+	PerfSnapshot Read() const
+	{
+		PerfSnapshot snap;
+#ifdef __linux__
+		for (size_t i = 0; i < PERF_EVENTS; ++i)
+		{
+			uint64_t buf[3];
+			if (_fd[i] >= 0 && read(_fd[i], buf, sizeof(buf)) == (ssize_t)sizeof(buf))
+			{
+				snap._valid[i] = true;
+				snap._value[i] = buf[0];
+				snap._enabled[i] = buf[1];
+				snap._running[i] = buf[2];
+			}
+		}
+#endif
+		return snap;
+	}
+
+private:
+#ifdef __linux__
+	static void Config(PerfEvent event, struct perf_event_attr* attr)
+	{
+		const uint64_t read_miss = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		switch (event)
+		{
+		case PerfEvent::Instructions:
+			attr->type = PERF_TYPE_HARDWARE;
+			attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+			break;
+		case PerfEvent::Cycles:
+			attr->type = PERF_TYPE_HARDWARE;
+			attr->config = PERF_COUNT_HW_CPU_CYCLES;
+			break;
+		case PerfEvent::L1dMisses:
+			attr->type = PERF_TYPE_HW_CACHE;
+			attr->config = PERF_COUNT_HW_CACHE_L1D | read_miss;
+			break;
+		case PerfEvent::LlcMisses:
+			attr->type = PERF_TYPE_HW_CACHE;
+			attr->config = PERF_COUNT_HW_CACHE_LL | read_miss;
+			break;
+		case PerfEvent::DtlbMisses:
+			attr->type = PERF_TYPE_HW_CACHE;
+			attr->config = PERF_COUNT_HW_CACHE_DTLB | read_miss;
+			break;
+		case PerfEvent::BranchMisses:
+			attr->type = PERF_TYPE_HARDWARE;
+			attr->config = PERF_COUNT_HW_BRANCH_MISSES;
+			break;
+		}
+	}
+#endif
+
+	int _fd[PERF_EVENTS];
+	int _error = 0;
+};
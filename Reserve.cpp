@@ -0,0 +1,45 @@
+#include "Reserve.h"
+#include "CacheArena.h"
+#include "ThreadCache.h"
+
+ReserveResult ConcurrentAllocReserve(size_t bytes, const ReserveOptions& options)
+{
+	ReserveResult result;
+	result._locked = options._lock;
+	size_t narena = ConcurrentAllocArenas();
+	size_t npage = (bytes + ((size_t)1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+	size_t perarena = (npage + narena - 1) / narena;
+	for (size_t i = 0; i < narena && perarena != 0; ++i)
+	{
+		bool locked = false;
+		result._reserved += ArenaPageCache(i)->Reserve(perarena, options._prefault, options._lock, &locked) << PAGE_SHIFT;
+		result._locked = result._locked && locked;
+	}
+
+	// 调用线程先取走自己的，CentralCache 再补到 _count 个，留给别的线程
+	if (options._warmthread)
+		ConcurrentAllocWarmThread(options._classes, options._nclasses);
+	for (size_t i = 0; i < narena; ++i)
+	{
+		for (size_t k = 0; k < options._nclasses; ++k)
+		{
+			const ReserveClass& cls = options._classes[k];
+			if (cls._size == 0 || cls._size > MAX_BYTES || cls._count == 0)
+				continue;
+			ArenaCentralCache(i)->Prefill(SizeClass::Roundup(cls._size), cls._count);
+		}
+	}
+	return result;
+}
+
+void ConcurrentAllocWarmThread(const ReserveClass* classes, size_t n)
+{
+	if (tlslist == nullptr)
+		tlslist = ThreadCache::Create();
+	for (size_t k = 0; k < n; ++k)
+	{
+		if (classes[k]._size == 0 || classes[k]._size > MAX_BYTES || classes[k]._count == 0)
+			continue;
+		tlslist->Warm(classes[k]._size, classes[k]._count);
+	}
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "Common.h"
+
+// 启动时预留和预热：服务刚启动时的申请要向系统申请内存、缺页，各层的自由链表都是空的，尾部延迟集中在这里
+// 在开始处理请求之前调用，把这些开销提前做掉：
+//     ReserveClass classes[] = { { 64, 4096 }, { 1024, 512 } };
+//     ReserveOptions options;
+//     options._prefault = true;
+//     options._classes = classes;
+//     options._nclasses = 2;
+//     options._warmthread = true;
+//     ConcurrentAllocReserve(256 << 20, options);
+//     // 每个工作线程开始时
+//     ConcurrentAllocWarmThread(classes, 2);
+// 预留的页和其他空闲页一样放在PageCache中，以后也可能合并、切分，不会单独还给系统
+// 只作用于全局内存池，多个arena时在 ConcurrentAllocSetArenas 之后调用，每个arena各预留一份
+// 替换 malloc 的动态库可以用环境变量 CONCURRENTALLOC_RESERVE 预留(见 MallocOverride.cpp)
+
+// 一个大小类的预热数量
+struct ReserveClass
+{
+	size_t _size = 0;//对象大小，超过 MAX_BYTES 的大对象忽略
+	size_t _count = 0;//对象个数
+};
+
+struct ReserveOptions
+{
+	bool _prefault = false;//预先建立物理页，第一次访问时不再缺页
+	bool _lock = false;//mlock 锁住预留的页，不会被换出，需要足够的 RLIMIT_MEMLOCK
+	// 每个arena的CentralCache中，这些大小类预先切好至少 _count 个空闲对象(按span取整)
+	const ReserveClass* _classes = nullptr;
+	size_t _nclasses = 0;
+	bool _warmthread = false;//调用线程的ThreadCache也按 _classes 预热(见 ConcurrentAllocWarmThread)
+};
+
+struct ReserveResult
+{
+	size_t _reserved = 0;//向系统申请的字节数(按 NPAGES-1 页或者段取整)
+	bool _locked = false;//要求 _lock 时是否全部锁住
+};
+
+// 平均分给各个arena，每个arena向系统申请至少 bytes/arena个数 字节放入PageCache，然后按 _classes 切好span
+// 切分的span也从预留的页中取；内存不够时抛出 std::bad_alloc
+ReserveResult ConcurrentAllocReserve(size_t bytes, const ReserveOptions& options = ReserveOptions());
+
+// 当前线程的ThreadCache中每个大小类至少有 _count 个对象，慢启动的上限也提高到 _count 以上
+// 每个工作线程开始处理请求之前各自调用一次
+void ConcurrentAllocWarmThread(const ReserveClass* classes, size_t n);
@@ -0,0 +1,111 @@
+#include "PageCache.h"
+
+#include <cstring>
+
+#ifdef USE_SEGMENT
+
+// 没有用到的部分不会占用物理内存
+std::atomic<uint64_t> segment_bitmap[SEGMENT_BITMAP_WORDS];
+
+// 释放的段缓存起来，申请同样大小的段时直接使用，避免反复 mmap/munmap
+const size_t SEGMENT_CACHE_BYTES = 64 * 1024 * 1024;
+static std::mutex segment_mutex;
+static Segment* segment_cache = nullptr;
+static size_t segment_cache_bytes = 0;
+
+static void MarkSegment(Segment* seg, uint64_t bits)
+{
+	size_t chunk = (size_t)seg >> SEGMENT_SHIFT;
+	size_t shift = chunk % 32 * 2;
+	if (bits != 0)
+		segment_bitmap[chunk / 32].fetch_or(bits << shift, std::memory_order_release);
+	else
+		segment_bitmap[chunk / 32].fetch_and(~((uint64_t)3 << shift), std::memory_order_release);
+}
+
+// 向系统申请 bytes 字节，起始地址按 SEGMENT_SIZE 对齐
+static void* SystemAllocAligned(size_t bytes)
+{
+#ifdef _WIN32
+	// Windows 不能释放一部分，先保留一块更大的地址空间找到对齐的地址，释放之后在这个地址上重新申请
+	while (true)
+	{
+		void* ptr = VirtualAlloc(0, bytes + SEGMENT_SIZE, MEM_RESERVE, PAGE_NOACCESS);
+		if (ptr == nullptr)
+			return nullptr;
+		size_t aligned = ((size_t)ptr + SEGMENT_SIZE - 1) & ~(SEGMENT_SIZE - 1);
+		VirtualFree(ptr, 0, MEM_RELEASE);
+		ptr = VirtualAlloc((void*)aligned, bytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		if (ptr != nullptr)
+			return ptr;
+	}
+#else
+	// 多申请一个段的大小，去掉头尾
+	char* ptr = static_cast<char*>(SystemAlloc(bytes + SEGMENT_SIZE));
+	if (ptr == nullptr)
+		return nullptr;
+	size_t head = (size_t)(-(intptr_t)ptr) & (SEGMENT_SIZE - 1);
+	if (head != 0)
+		SystemFree(ptr, head);
+	SystemFree(ptr + head + bytes, SEGMENT_SIZE - head);
+	return ptr + head;
+#endif
+}
+
+Segment* SegmentAlloc(size_t npage, const void* owner, bool isglobal)
+{
+	size_t nchunk = (npage + SEGMENT_HEADER_PAGES + SEGMENT_PAGES - 1) / SEGMENT_PAGES;
+	Segment* seg = nullptr;
+	{
+		std::unique_lock<std::mutex> lock(segment_mutex);
+		for (Segment** prev = &segment_cache; *prev != nullptr; prev = &(*prev)->_next)
+		{
+			if ((*prev)->_nchunk == nchunk)
+			{
+				seg = *prev;
+				*prev = seg->_next;
+				segment_cache_bytes -= nchunk << SEGMENT_SHIFT;
+				break;
+			}
+		}
+	}
+
+	if (seg != nullptr)
+	{
+		// 缓存的段中可能还有以前的数据
+		memset(seg->_spans, 0, sizeof(seg->_spans));
+		memset(seg->_classes, 0, sizeof(seg->_classes));
+	}
+	else
+	{
+		seg = static_cast<Segment*>(SystemAllocAligned(nchunk << SEGMENT_SHIFT));
+		if (seg == nullptr)
+			throw std::bad_alloc();
+		seg->_nchunk = nchunk;
+	}
+
+	seg->_owner = owner;
+	seg->_next = nullptr;
+	MarkSegment(seg, isglobal ? SEGMENT_USED | SEGMENT_GLOBAL : SEGMENT_USED);
+	return seg;
+}
+
+void SegmentFree(Segment* seg)
+{
+	MarkSegment(seg, 0);
+	size_t bytes = seg->_nchunk << SEGMENT_SHIFT;
+	{
+		std::unique_lock<std::mutex> lock(segment_mutex);
+		if (segment_cache_bytes + bytes <= SEGMENT_CACHE_BYTES)
+		{
+			seg->_owner = nullptr;
+			seg->_next = segment_cache;
+			segment_cache = seg;
+			segment_cache_bytes += bytes;
+			return;
+		}
+	}
+	SystemFree(seg, bytes);
+}
+
+#endif // USE_SEGMENT
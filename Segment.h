@@ -0,0 +1,114 @@
+#pragma once
+
+#include "Common.h"
+
+#include <atomic>
+
+// 按段对齐的页堆布局(定义 USE_SEGMENT 时使用)
+// PageCache 的内存按 SEGMENT_SIZE 对齐的段向系统申请，段的开头几页是段头，记录段内每一页的 Span* 和大小类
+// 对象的元数据 = 段头(ptr & ~(SEGMENT_SIZE - 1)) 中下标为页号低位的一项，不需要全局的映射结构，也不需要加锁
+//
+//     | 段头 | 页 | 页 | ... | 页 |      普通段：SEGMENT_SIZE，段头之外的页切成不超过128页的span
+//     | 段头 | 大对象 ........................ |   大对象段：SEGMENT_SIZE 的整数倍，只有第一个 SEGMENT_SIZE 有段头
+//
+// 每 SEGMENT_SIZE 地址空间在位图中有两位：这里是不是一个段的开头、这个段是不是属于全局的PageCache
+// 不属于内存池的指针(或者大对象中间的地址)查不到段头；全局内存池只用位图就能排除私有堆的段，不用读段头
+
+const size_t SEGMENT_SHIFT = 22;
+const size_t SEGMENT_SIZE = (size_t)1 << SEGMENT_SHIFT; //4MB
+const size_t SEGMENT_PAGES = SEGMENT_SIZE >> PAGE_SHIFT;
+
+struct Segment
+{
+	const void* _owner;//申请这个段的PageCache
+	size_t _nchunk;//段的大小是多少个 SEGMENT_SIZE
+	Segment* _next;//段缓存中的链表
+	Span* _spans[SEGMENT_PAGES];//每一页所属的span，段头所在的页为空
+	uint8_t _classes[SEGMENT_PAGES];//每一页的大小类(SizeClass::Index + 1)，见 PageClassMap
+};
+
+// 段头占用的页数
+const size_t SEGMENT_HEADER_PAGES = (sizeof(Segment) + ((size_t)1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+
+// 段起始位置的位图，每个 SEGMENT_SIZE 两位
+const size_t SEGMENT_ADDRESS_BITS = sizeof(void*) == 8 ? 48 : 32;
+const size_t SEGMENT_CHUNKS = (size_t)1 << (SEGMENT_ADDRESS_BITS - SEGMENT_SHIFT);
+const size_t SEGMENT_BITMAP_WORDS = SEGMENT_CHUNKS * 2 / 64;
+const uint64_t SEGMENT_USED = 1;
+const uint64_t SEGMENT_GLOBAL = 2;
+extern std::atomic<uint64_t> segment_bitmap[SEGMENT_BITMAP_WORDS];
+
+// 页号所在的 SEGMENT_SIZE 在位图中的两位
+inline uint64_t SegmentBits(PageID id)
+{
+	size_t chunk = (size_t)id >> (SEGMENT_SHIFT - PAGE_SHIFT);
+	if (chunk >= SEGMENT_CHUNKS)
+		return 0;
+	return (segment_bitmap[chunk / 32].load(std::memory_order_acquire) >> (chunk % 32 * 2)) & 3;
+}
+
+// 页号所在的段，这个 SEGMENT_SIZE 不是段的开头时返回nullptr
+inline Segment* SegmentOf(PageID id)
+{
+	if ((SegmentBits(id) & SEGMENT_USED) == 0)
+		return nullptr;
+	return (Segment*)(((size_t)id >> (SEGMENT_SHIFT - PAGE_SHIFT)) << SEGMENT_SHIFT);
+}
+
+// 和 SegmentOf 一样，但是只返回全局PageCache的段
+inline Segment* GlobalSegmentOf(PageID id)
+{
+	if ((SegmentBits(id) & SEGMENT_GLOBAL) == 0)
+		return nullptr;
+	return (Segment*)(((size_t)id >> (SEGMENT_SHIFT - PAGE_SHIFT)) << SEGMENT_SHIFT);
+}
+
+// 申请一个段，除段头之外至少有 npage 页；优先从段缓存中取
+// 段头中 _owner 设置为 owner，_spans 和 _classes 都是空的；isglobal 表示 owner 是全局的PageCache
+Segment* SegmentAlloc(size_t npage, const void* owner, bool isglobal);
+// 释放一个段，段缓存没有满时留着下次使用
+void SegmentFree(Segment* seg);
+
+// 页号 -> 段头中一项的映射，和 TreePageMap 接口相同
+// 只记录有段头的页(大对象第一个 SEGMENT_SIZE 之后的页不记录，只能用起始地址查找)
+template<class T, T (Segment::*Array)[SEGMENT_PAGES]>
+class SegmentPageArray
+{
+public:
+	T get(PageID id) const
+	{
+		Segment* seg = SegmentOf(id);
+		if (seg == nullptr)
+			return T();
+		return (seg->*Array)[id & (SEGMENT_PAGES - 1)];
+	}
+
+	void getMany(const PageID* ids, T* values, size_t n) const
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			Segment* seg = SegmentOf(ids[i]);
+			if (seg != nullptr)
+				PREFETCH(&(seg->*Array)[ids[i] & (SEGMENT_PAGES - 1)]);
+		}
+		for (size_t i = 0; i < n; ++i)
+			values[i] = get(ids[i]);
+	}
+
+	void set(PageID id, T value)
+	{
+		Segment* seg = SegmentOf(id);
+		if (seg != nullptr)
+			(seg->*Array)[id & (SEGMENT_PAGES - 1)] = value;
+	}
+
+	void erase(PageID id)
+	{
+		set(id, T());
+	}
+
+	// 数据都在段头中，随段一起释放
+	void clear()
+	{
+	}
+};
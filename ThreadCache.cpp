@@ -1,20 +1,235 @@
 #include "ThreadCache.h"
 #include "CentralCache.h"
+#include "PageCache.h"
+#include "CacheArena.h"
+#include "TraceRecorder.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+// ThreadCache 不能用 new 创建，替换 malloc 之后 new 会再调用到这里
+static MetaPool<ThreadCache, 16>* ThreadCachePool()
+{
+	static MetaPool<ThreadCache, 16> pool;
+	return &pool;
+}
+
+// 全局内存池的ThreadCache链表，退出的线程的计数累加到 tc_retired 中
+static std::mutex tc_list_mutex;
+static ThreadCache* tc_list = nullptr;
+static ThreadCacheStats tc_retired;
+#ifdef LATENCY_STATS
+// 退出的线程的耗时直方图，和没有ThreadCache的线程共享的直方图
+static ThreadLatency latency_retired;
+static ThreadLatency latency_shared;
+#endif
+
+static void AddCounters(StatCounter* to, const StatCounter* from)
+{
+	for (size_t i = 0; i < NLISTS; ++i)
+		to[i].Add(from[i].Get());
+}
+
+#ifdef __linux__
+// 用 pthread_key 的析构函数在线程退出时回收 ThreadCache
+// thread_local 对象的析构注册(__cxa_thread_atexit)会调用 calloc，这里不能用
+static pthread_key_t tc_key;
+static pthread_once_t tc_key_once = PTHREAD_ONCE_INIT;
+
+static void ThreadCacheKeyDestructor(void* tc)
+{
+	ThreadCache::Destroy(static_cast<ThreadCache*>(tc));
+}
+
+static void CreateThreadCacheKey()
+{
+	pthread_key_create(&tc_key, ThreadCacheKeyDestructor);
+}
+#endif
+
+ThreadCache::ThreadCache() : _central(CentralCache::Getinstence())
+{
+}
+
+ThreadCache* ThreadCache::Create()
+{
+	ThreadCache* tc = ThreadCachePool()->getOne();
+	tc->SetCentralCache(ArenaAttach());
+	{
+		std::unique_lock<std::mutex> lock(tc_list_mutex);
+		tc->_nexttc = tc_list;
+		if (tc_list != nullptr)
+			tc_list->_prevtc = tc;
+		tc_list = tc;
+	}
+	// 先设置tlslist，下面的调用如果申请内存会直接使用这个ThreadCache
+	tlslist = tc;
+#ifdef __linux__
+	pthread_once(&tc_key_once, CreateThreadCacheKey);
+	pthread_setspecific(tc_key, tc);
+#endif
+	return tc;
+}
+
+void ThreadCache::Destroy(ThreadCache* tc)
+{
+	tc->ReleaseAll();
+	ArenaDetach(tc->_central);
+	{
+		std::unique_lock<std::mutex> lock(tc_list_mutex);
+		if (tc->_prevtc != nullptr)
+			tc->_prevtc->_nexttc = tc->_nexttc;
+		else
+			tc_list = tc->_nexttc;
+		if (tc->_nexttc != nullptr)
+			tc->_nexttc->_prevtc = tc->_prevtc;
+		AddCounters(tc_retired._alloc, tc->_stats._alloc);
+		AddCounters(tc_retired._free, tc->_stats._free);
+		AddCounters(tc_retired._fetch, tc->_stats._fetch);
+		AddCounters(tc_retired._release, tc->_stats._release);
+#ifdef LATENCY_STATS
+		for (size_t t = 0; t < LATENCY_TIERS; ++t)
+			latency_retired._tiers[t].Add(tc->_latency._tiers[t]);
+#endif
+	}
+	if (tlslist == tc)
+	{
+		TraceThreadExit();
+		tlslist = nullptr;
+	}
+	ThreadCachePool()->release(tc);
+}
+
+size_t ThreadCache::CollectStats(AllocClassStats* classes)
+{
+	std::unique_lock<std::mutex> lock(tc_list_mutex);
+	size_t nthread = 0;
+	// 缓存的个数每个线程单独计算，各项不是同时读到的，差值可能暂时是负数
+	int64_t cached[NLISTS] = {};
+	auto add = [&](const ThreadCacheStats& stats) {
+		for (size_t i = 0; i < NLISTS; ++i)
+		{
+			uint64_t alloc = stats._alloc[i].Get();
+			uint64_t free = stats._free[i].Get();
+			classes[i]._alloc += alloc;
+			classes[i]._free += free;
+			cached[i] += (int64_t)(stats._fetch[i].Get() + free - alloc - stats._release[i].Get());
+		}
+	};
+	add(tc_retired);
+	for (ThreadCache* tc = tc_list; tc != nullptr; tc = tc->_nexttc)
+	{
+		add(tc->_stats);
+		++nthread;
+	}
+	for (size_t i = 0; i < NLISTS; ++i)
+		classes[i]._threadcached += cached[i] > 0 ? (size_t)cached[i] : 0;
+	return nthread;
+}
+
+void ThreadCache::CollectLatency(ConcurrentLatencyStats* stats)
+{
+#ifdef LATENCY_STATS
+	std::unique_lock<std::mutex> lock(tc_list_mutex);
+	auto add = [&](const ThreadLatency& latency) {
+		for (size_t t = 0; t < LATENCY_TIERS; ++t)
+			latency._tiers[t].AddTo(stats->_counts[t]);
+	};
+	add(latency_retired);
+	add(latency_shared);
+	for (ThreadCache* tc = tc_list; tc != nullptr; tc = tc->_nexttc)
+		add(tc->_latency);
+#else
+	(void)stats;
+#endif
+}
+
+void ThreadCache::ResetLatency()
+{
+#ifdef LATENCY_STATS
+	std::unique_lock<std::mutex> lock(tc_list_mutex);
+	for (size_t t = 0; t < LATENCY_TIERS; ++t)
+	{
+		latency_retired._tiers[t].Reset();
+		latency_shared._tiers[t].Reset();
+		for (ThreadCache* tc = tc_list; tc != nullptr; tc = tc->_nexttc)
+			tc->_latency._tiers[t].Reset();
+	}
+#endif
+}
+
+void ThreadCache::RecordLatency(LatencyTier tier, uint64_t ns)
+{
+#ifdef LATENCY_STATS
+	if (tlslist != nullptr)
+		tlslist->_latency.Record(tier, ns);
+	else
+		latency_shared._tiers[(size_t)tier].RecordShared(ns);
+#else
+	(void)tier;
+	(void)ns;
+#endif
+}
+
+void LatencyRecord(LatencyTier tier, uint64_t ns)
+{
+	ThreadCache::RecordLatency(tier, ns);
+}
+
+size_t ThreadCache::PoolBytes()
+{
+	return ThreadCachePool()->reserved();
+}
+
+void ThreadCache::LockPool()
+{
+	tc_list_mutex.lock();
+	ThreadCachePool()->Lock();
+}
+
+void ThreadCache::UnlockPool()
+{
+	ThreadCachePool()->Unlock();
+	tc_list_mutex.unlock();
+}
+
+void ThreadCache::ReleaseAll()
+{
+	for (size_t i = 0; i < NLISTS; ++i)
+	{
+		if (!_freelist[i].Empty())
+			ListTooLong(&_freelist[i], SizeClass::Size(i));
+		if (!_longlived[i].Empty())
+			ListTooLong(&_longlived[i], SizeClass::Size(i));
+	}
+
+	// Arena的span都来自全局的PageCache
+	while (Span* span = PopArenaSpan())
+		PageCache::GetInstence()->ReleaseSpanToPageCache(span);
+}
 
 
 //从中心缓存获取对象
 // 每一次取批量的数据，因为每次到CentralCache申请内存的时候是需要加锁的
 // 所以一次就多申请一些内存块，防止每次到CentralCache去内存块的时候,多次加锁造成效率问题
-void* ThreadCache::FetchFromCentralCache(size_t index, size_t size)
+void* ThreadCache::FetchFromCentralCache(size_t index, size_t size, size_t nummove, LifetimeHint hint)
 {
-	Freelist* freelist = &_freelist[index];
+	Freelist* freelist = hint == LifetimeHint::LongLived ? &_longlived[index] : &_freelist[index];
+	// 全局内存池的线程定期检查是否要换到别的arena
+	if (UNLIKELY(++_nfetch == ARENA_CHECK_INTERVAL))
+	{
+		_nfetch = 0;
+		if (!_central->GetPageCache()->IsPrivate())
+			_central = ArenaRebalance(_central);
+	}
 	// 不是每次申请10个，而是进行慢增长的过程
 	// 单个对象越小，申请内存块的数量越多
 	// 单个对象越大，申请内存块的数量越小
 	// 申请次数越多，数量多
 	// 次数少,数量少--->动态计算的结果
 	size_t maxsize = freelist->MaxSize();
-	size_t numtomove = SizeClass::NumMoveSize(size) < maxsize ? SizeClass::NumMoveSize(size) : maxsize;
+	size_t numtomove = nummove < maxsize ? nummove : maxsize;
 
 	void* start = nullptr, *end = nullptr;
 	// start，end分别表示取出来的内存的开始地址和结束地址
@@ -22,7 +237,8 @@ void* ThreadCache::FetchFromCentralCache(size_t index, size_t size)
 
 	// batchsize表示实际取出来的内存的个数
 	// batchsize有可能小于num，表示中心缓存没有那么多大小的内存块
-	size_t batchsize = CentralCache::Getinstence()->FetchRangeObj(start, end, numtomove, size);
+	size_t batchsize = _central->FetchRangeObj(start, end, numtomove, size, hint);
+	_stats._fetch[index].Add(batchsize);
 
 	if (batchsize > 1)
 	{
@@ -37,21 +253,88 @@ void* ThreadCache::FetchFromCentralCache(size_t index, size_t size)
 	return start;
 }
 
+void ThreadCache::Warm(size_t size, size_t count)
+{
+	size_t index = SizeClass::Index(size);
+	size_t bytes = SizeClass::Roundup(size);
+	Freelist* freelist = &_freelist[index];
+	if (freelist->MaxSize() <= count)
+		freelist->SetMaxSize(count + 1);
+	while (freelist->Size() < count)
+		freelist->Push(FetchFromCentralCache(index, bytes, SizeClass::NumMoveSize(bytes)));
+	// 按批量取可能多取了一些，释放回原来的个数时也不能到上限
+	if (freelist->MaxSize() <= freelist->Size())
+		freelist->SetMaxSize(freelist->Size() + 1);
+}
+
 //释放对象时，链表过长时，回收内存回到中心缓存
 void ThreadCache::ListTooLong(Freelist* freelist, size_t size)
 {
+	size_t n = freelist->Size();
+	LifetimeHint hint = freelist >= _longlived && freelist < _longlived + NLISTS ? LifetimeHint::LongLived : LifetimeHint::ShortLived;
 	void* start = freelist->PopRange();
-	CentralCache::Getinstence()->ReleaseListToSpans(start, size);
+	_stats._release[SizeClass::Index(size)].Add(n);
+	_central->ReleaseListToSpans(start, size, n, hint);
+}
+
+intptr_t ThreadCache::NextSampleInterval()
+{
+	// 两个分析器同时运行时，生命周期分析器使用堆分析器的采样点
+	if (heap_profiling.load(std::memory_order_relaxed))
+	{
+		_heapepoch = HeapProfilerEpoch();
+		return HeapProfilerNextInterval(&_samplerng);
+	}
+	return LifetimeProfilerInterval();
+}
+
+void ThreadCache::SampleAllocation(void* ptr, size_t size)
+{
+	_sampleleft = NextSampleInterval();
+	// 只分析全局内存池(所有arena)，私有堆销毁时不会通知分析器
+	bool lifetime = lifetime_profiling.load(std::memory_order_relaxed) && size <= MAX_BYTES;
+	bool heap = heap_profiling.load(std::memory_order_relaxed);
+	if ((!lifetime && !heap) || _central->GetPageCache()->IsPrivate())
+		return;
+	Span* span = _central->GetPageCache()->MapObjectToSpan(ptr);
+	if (lifetime)
+		LifetimeProfilerRecord(ptr, SizeClass::Index(size), span);
+	if (heap)
+		HeapProfilerRecord(ptr, size, span);
+}
+
+void ThreadCache::ProfileDeallocation(void* ptr, Span* span)
+{
+	if (lifetime_profiling.load(std::memory_order_relaxed))
+	{
+		LifetimeProfilerForget(ptr, span);
+		// 分析刚开始时，剩余的字节数可能还是按默认间隔算的
+		if (_sampleleft > LifetimeProfilerInterval())
+			_sampleleft = LifetimeProfilerInterval();
+	}
+	if (heap_profiling.load(std::memory_order_relaxed))
+	{
+		HeapProfilerForget(ptr, span);
+		if (_heapepoch != HeapProfilerEpoch())
+			_sampleleft = NextSampleInterval();
+	}
 }
 
 //申请和释放内存对象
-void* ThreadCache::Allocate(size_t size)
+void* ThreadCache::Allocate(size_t size, LifetimeHint hint)
 {
+#ifdef LATENCY_STATS
+	LatencyTimer timer;
+#endif
 	size_t index = SizeClass::Index(size);//获取到相对应的位置
-	Freelist* freelist = &_freelist[index];
+	Freelist* freelist = hint == LifetimeHint::LongLived ? &_longlived[index] : &_freelist[index];
+	void* ptr;
 	if (!freelist->Empty())//在ThreadCache处不为空的话，直接取
 	{
-		return freelist->Pop();
+		ptr = freelist->Pop();
+#ifdef LATENCY_STATS
+		_latency.Record(LatencyTier::ThreadCacheHit, timer.Elapsed());
+#endif
 	}
 	// 自由链表为空的要去中心缓存中拿取内存对象，一次取多个防止多次去取而加锁带来的开销 
 	// 均衡策略:每次中心堆分配给ThreadCache对象的个数是个慢启动策略
@@ -60,20 +343,47 @@ void* ThreadCache::Allocate(size_t size)
 	else
 	{
 		// 否则的话，从中心缓存处获取
-		return FetchFromCentralCache(index, SizeClass::Roundup(size));
+		size_t bytes = SizeClass::Roundup(size);
+		ptr = FetchFromCentralCache(index, bytes, SizeClass::NumMoveSize(bytes), hint);
+#ifdef LATENCY_STATS
+		_latency.Record(LatencyTier::CentralRefill, timer.Elapsed());
+#endif
 	}
+
+	_stats._alloc[index].Add(1);
+	_sampleleft -= (intptr_t)size;
+	if (UNLIKELY(_sampleleft < 0))
+		SampleAllocation(ptr, size);
+	return ptr;
 }
 
-void ThreadCache::Deallocate(void* ptr, size_t size)
+void* ThreadCache::AllocateSlow(size_t index, size_t size, size_t nummove)
 {
-	size_t index = SizeClass::Index(size);
-	Freelist* freelist = &_freelist[index];
+	ThreadCache* tc = tlslist;
+	if (tc == nullptr)
+		tc = Create();
+
+	tc->_stats._alloc[index].Add(1);
+	Freelist* freelist = &tc->_freelist[index];
+	if (!freelist->Empty())
+		return freelist->Pop();
+	return tc->FetchFromCentralCache(index, size, nummove);
+}
+
+void ThreadCache::DeallocateIndex(void* ptr, size_t index, LifetimeHint hint)
+{
+	// 两个标志一起检查，没有分析时只多一次读
+	if (UNLIKELY(lifetime_profiling.load(std::memory_order_relaxed) | heap_profiling.load(std::memory_order_relaxed)))
+		ProfileDeallocation(ptr, _central->GetPageCache()->MapObjectToSpan(ptr));
+
+	_stats._free[index].Add(1);
+	Freelist* freelist = hint == LifetimeHint::LongLived ? &_longlived[index] : &_freelist[index];
 	freelist->Push(ptr);
 
 	//满足某个条件时(释放回一个批量的对象)，释放回中心缓存
 	if (freelist->Size() >= freelist->MaxSize())
 	{
-		ListTooLong(freelist, size);
+		ListTooLong(freelist, SizeClass::Size(index));
 	}
 }
 
@@ -1,25 +1,146 @@
 #pragma once
 
 #include "Common.h"
+#include "LifetimeProfiler.h"
+#include "HeapProfiler.h"
+#include "AllocStats.h"
+#include "LatencyStats.h"
+
+class CentralCache;
+
+// 每个线程缓存的Arena span个数
+const size_t ARENA_SPAN_CACHE = 8;
 
 class ThreadCache
 {
 private:
 	Freelist _freelist[NLISTS];//自由链表
+	Freelist _longlived[NLISTS];//LifetimeHint::LongLived 的对象，来自CentralCache中单独的span
+
+	//还可以申请多少字节就要采样一次(生命周期分析器、堆分析器)，没有开启分析时到0也只是检查一下
+	intptr_t _sampleleft = LIFETIME_SAMPLE_INTERVAL;
+	uint64_t _samplerng = 0;//堆分析器随机采样间隔的状态
+	uint32_t _heapepoch = 0;//计算 _sampleleft 时堆分析器的 HeapProfilerEpoch
+
+	//Arena释放的标准大小的span缓存在线程内，下一个Arena直接复用，不用每次都去PageCache加锁
+	Span* _arenaspans[ARENA_SPAN_CACHE] = {};
+	size_t _narenaspans = 0;
+
+	CentralCache* _central;//对象从这里获取、归还到这里，私有堆的ThreadCache指向堆自己的CentralCache
+	size_t _nfetch = 0;//到CentralCache取的次数，每 ARENA_CHECK_INTERVAL 次检查一次arena
+
+	ThreadCacheStats _stats;//申请释放的计数，读取统计时汇总(见 AllocStats.h)
+#ifdef LATENCY_STATS
+	ThreadLatency _latency;//各层申请的耗时分布(见 LatencyStats.h)
+#endif
+	//全局内存池的ThreadCache链在一起，汇总统计时遍历；私有堆的ThreadCache不在链表中
+	ThreadCache* _prevtc = nullptr;
+	ThreadCache* _nexttc = nullptr;
 
 public:
-	//申请和释放内存对象
-	void* Allocate(size_t size);
-	void Deallocate(void* ptr, size_t size);
+	ThreadCache();
+
+	void SetCentralCache(CentralCache* central)
+	{
+		_central = central;
+	}
+
+	CentralCache* GetCentralCache()
+	{
+		return _central;
+	}
+
+	//申请和释放内存对象，释放时的hint应该和对象所在span的_longlived一致
+	void* Allocate(size_t size, LifetimeHint hint = LifetimeHint::ShortLived);
+	void Deallocate(void* ptr, size_t size, LifetimeHint hint = LifetimeHint::ShortLived)
+	{
+		DeallocateIndex(ptr, SizeClass::Index(size), hint);
+	}
+
+	//已经知道大小类的下标时(PageCache::LookupClass)直接释放
+	void DeallocateIndex(void* ptr, size_t index, LifetimeHint hint = LifetimeHint::ShortLived);
+
+	//从中心缓存获取对象，nummove是一次最多获取的个数(SizeClass::NumMoveSize)
+	void* FetchFromCentralCache(size_t index, size_t size, size_t nummove, LifetimeHint hint = LifetimeHint::ShortLived);
+
+	//预热(见 Reserve.h)：大小为 size 的自由链表中至少有 count 个对象
+	//慢启动的上限也提高到 count 以上，释放几个对象之后不会马上整串还给中心缓存
+	void Warm(size_t size, size_t count);
 
-	//从中心缓存获取对象
-	void* FetchFromCentralCache(size_t index, size_t size);
+	//位置在编译期已知时(ObjectPool<T>)直接操作对应的自由链表
+	Freelist* GetFreelist(size_t index)
+	{
+		return &_freelist[index];
+	}
+
+	//ObjectPool<T>的快速路径不经过 Allocate/DeallocateIndex，自己计数
+	void CountAlloc(size_t index)
+	{
+		_stats._alloc[index].Add(1);
+	}
+
+	void CountFree(size_t index)
+	{
+		_stats._free[index].Add(1);
+	}
+
+	//ObjectPool<T>的慢速路径：当前线程还没有ThreadCache，或者自由链表为空
+	static void* AllocateSlow(size_t index, size_t size, size_t nummove);
 
 	//释放对象时，链表过长时，回收内存回到中心堆
 	void ListTooLong(Freelist* list, size_t size);
+
+	//申请的字节数达到采样间隔时，把ptr交给正在运行的分析器，size 是申请时传入的大小
+	void SampleAllocation(void* ptr, size_t size);
+	//下一个采样点之前的字节数，堆分析器在运行时用它的随机间隔
+	intptr_t NextSampleInterval();
+	//有分析器在运行时，释放的对象要通知分析器
+	void ProfileDeallocation(void* ptr, Span* span);
+
+	//大对象不经过 Allocate，堆分析器运行时由 ConcurrentAlloc 调用
+	void SampleBigAllocation(void* ptr, size_t size)
+	{
+		_sampleleft -= (intptr_t)size;
+		if (_sampleleft < 0)
+			SampleAllocation(ptr, size);
+	}
+
+	//取出/放入一个缓存的Arena span，缓存满时返回false
+	Span* PopArenaSpan()
+	{
+		return _narenaspans == 0 ? nullptr : _arenaspans[--_narenaspans];
+	}
+
+	bool PushArenaSpan(Span* span)
+	{
+		if (_narenaspans == ARENA_SPAN_CACHE)
+			return false;
+		_arenaspans[_narenaspans++] = span;
+		return true;
+	}
+
+	//把所有自由链表中的对象都还给中心缓存，缓存的Arena span还给PageCache
+	void ReleaseAll();
+
+	//为当前线程创建ThreadCache，线程退出时自动调用Destroy
+	static ThreadCache* Create();
+	static void Destroy(ThreadCache* tc);
+
+	//所有线程(包括已经退出的)的计数按大小类加到 classes 上，返回现有的ThreadCache个数
+	static size_t CollectStats(AllocClassStats* classes);
+	//所有线程(包括已经退出的、没有ThreadCache的)的耗时直方图加到 stats 上
+	static void CollectLatency(ConcurrentLatencyStats* stats);
+	static void ResetLatency();
+	//记录到当前线程的ThreadCache，由 LatencyRecord 调用
+	static void RecordLatency(LatencyTier tier, uint64_t ns);
+	//存放ThreadCache的对象池向系统申请的字节数
+	static size_t PoolBytes();
+
+	// fork 前后调用，锁住/解锁存放ThreadCache的对象池
+	static void LockPool();
+	static void UnlockPool();
 };
 
-//静态的，不是所有可见
 //每个线程有个自己的指针, 用(_declspec (thread))，我们在使用时，每次来都是自己的，就不用加锁了
-//每个线程都有自己的tlslist
-thread_local static ThreadCache* tlslist = nullptr;
\ No newline at end of file
+//每个线程都有自己的tlslist，inline保证所有编译单元看到的是同一个变量
+inline thread_local ThreadCache* tlslist = nullptr;
@@ -0,0 +1,241 @@
+#include "TraceRecorder.h"
+#include "ThreadCache.h"
+#include "LatencyStats.h"
+
+#include <cstring>
+#include <mutex>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// 一个线程的缓冲区，向系统申请之后不再释放，线程退出后让给新的线程
+// _busy 由所有者在修改缓冲区期间设置，TraceStop 等它清零之后才写出，两边都用 seq_cst
+struct TraceBuffer
+{
+	TraceBuffer* _next = nullptr;//所有缓冲区链在一起，只增加
+	std::atomic<bool> _owned{ true };
+	std::atomic<bool> _busy{ false };
+	uint32_t _thread = 0;
+	uint32_t _nrecords = 0;
+	uint64_t _basetime = 0;
+	uint64_t _lasttime = 0;
+	uintptr_t _lastptr = 0;
+	size_t _used = 0;
+	uint8_t _data[TRACE_BUFFER_BYTES];
+};
+
+// 一条记录最多的字节数
+static const size_t TRACE_MAX_RECORD = 30;
+
+static std::mutex trace_mutex;//TraceStart/TraceStop
+static std::atomic<TraceBuffer*> trace_buffers{ nullptr };
+static std::atomic<uint32_t> trace_nthreads{ 0 };
+static std::atomic<uint64_t> trace_offset{ 0 };//下一块写到文件的位置
+#ifdef _WIN32
+static HANDLE trace_file = INVALID_HANDLE_VALUE;
+#else
+static int trace_fd = -1;
+#endif
+static thread_local TraceBuffer* tls_trace = nullptr;
+
+// 写到文件的指定位置，多个线程可以同时写不同的位置
+static void TraceWriteAt(uint64_t offset, const void* data, size_t bytes)
+{
+#ifdef _WIN32
+	OVERLAPPED ov = {};
+	ov.Offset = (DWORD)offset;
+	ov.OffsetHigh = (DWORD)(offset >> 32);
+	DWORD written = 0;
+	WriteFile(trace_file, data, (DWORD)bytes, &written, &ov);
+#else
+	const char* p = static_cast<const char*>(data);
+	while (bytes > 0)
+	{
+		ssize_t n = pwrite(trace_fd, p, bytes, (off_t)offset);
+		if (n <= 0)
+			return;
+		p += n;
+		offset += n;
+		bytes -= n;
+	}
+#endif
+}
+
+// 把缓冲区中的记录作为一块写出，调用者是缓冲区的所有者(设置了 _busy)或者 TraceStop
+static void FlushBuffer(TraceBuffer* buf)
+{
+	if (buf->_nrecords == 0)
+		return;
+	TraceBlockHeader header = {};
+	header._thread = buf->_thread;
+	header._nrecords = buf->_nrecords;
+	header._bytes = (uint32_t)buf->_used;
+	header._basetime = buf->_basetime;
+	uint64_t offset = trace_offset.fetch_add(sizeof(header) + buf->_used, std::memory_order_relaxed);
+	TraceWriteAt(offset, &header, sizeof(header));
+	TraceWriteAt(offset + sizeof(header), buf->_data, buf->_used);
+	buf->_nrecords = 0;
+	buf->_used = 0;
+}
+
+// 当前线程的缓冲区：先找已经退出的线程留下的，没有再向系统申请
+static TraceBuffer* ThreadBuffer()
+{
+	if (tls_trace != nullptr)
+		return tls_trace;
+
+	TraceBuffer* buf = nullptr;
+	for (TraceBuffer* b = trace_buffers.load(std::memory_order_acquire); b != nullptr; b = b->_next)
+	{
+		bool expected = false;
+		if (!b->_owned.load(std::memory_order_relaxed) && b->_owned.compare_exchange_strong(expected, true))
+		{
+			buf = b;
+			break;
+		}
+	}
+	if (buf == nullptr)
+	{
+		void* mem = SystemAlloc(sizeof(TraceBuffer));
+		if (mem == nullptr)
+			return nullptr;
+		buf = new (mem) TraceBuffer;
+		buf->_next = trace_buffers.load(std::memory_order_relaxed);
+		while (!trace_buffers.compare_exchange_weak(buf->_next, buf, std::memory_order_release, std::memory_order_relaxed))
+			;
+	}
+	buf->_thread = trace_nthreads.fetch_add(1, std::memory_order_relaxed);
+	tls_trace = buf;
+
+	// 线程退出时(ThreadCache::Destroy)写出剩下的记录
+	if (tlslist == nullptr)
+		tlslist = ThreadCache::Create();
+	return buf;
+}
+
+static void Record(TraceOp op, void* ptr, size_t size)
+{
+	TraceBuffer* buf = ThreadBuffer();
+	if (buf == nullptr)
+		return;
+	buf->_busy.store(true);
+	if (!alloc_tracing.load())
+	{
+		buf->_busy.store(false);
+		return;
+	}
+
+	uint64_t now = LatencyNow();
+	if (buf->_used + TRACE_MAX_RECORD > TRACE_BUFFER_BYTES)
+		FlushBuffer(buf);
+	if (buf->_nrecords == 0)
+	{
+		buf->_basetime = now;
+		buf->_lasttime = now;
+		buf->_lastptr = 0;
+	}
+	// 别的线程的时钟读数可能稍早，同一个线程内时间不会倒退
+	uint64_t delta = now > buf->_lasttime ? now - buf->_lasttime : 0;
+	uint8_t* out = buf->_data + buf->_used;
+	size_t n = TraceWriteVarint(out, delta);
+	n += TraceWriteVarint(out + n, ((uint64_t)size << 1) | (uint64_t)op);
+	n += TraceWriteVarint(out + n, TraceZigzag((int64_t)((uintptr_t)ptr - buf->_lastptr)));
+	buf->_used += n;
+	buf->_lasttime += delta;
+	buf->_lastptr = (uintptr_t)ptr;
+	++buf->_nrecords;
+
+	buf->_busy.store(false);
+}
+
+void TraceAlloc(void* ptr, size_t size)
+{
+	Record(TraceOp::Alloc, ptr, size);
+}
+
+void TraceFree(void* ptr)
+{
+	Record(TraceOp::Free, ptr, 0);
+}
+
+void TraceThreadExit()
+{
+	TraceBuffer* buf = tls_trace;
+	if (buf == nullptr)
+		return;
+	buf->_busy.store(true);
+	if (alloc_tracing.load())
+		FlushBuffer(buf);
+	buf->_busy.store(false);
+	tls_trace = nullptr;
+	buf->_owned.store(false, std::memory_order_release);
+}
+
+void TraceAfterForkChild()
+{
+	alloc_tracing.store(false);
+#ifndef _WIN32
+	trace_fd = -1;
+#endif
+	// 父进程的记录由父进程写出
+	for (TraceBuffer* b = trace_buffers.load(std::memory_order_acquire); b != nullptr; b = b->_next)
+	{
+		b->_busy.store(false);
+		b->_nrecords = 0;
+		b->_used = 0;
+	}
+}
+
+// 调用者持有 trace_mutex
+static void StopLocked()
+{
+	if (!alloc_tracing.load())
+		return;
+	alloc_tracing.store(false);
+	for (TraceBuffer* b = trace_buffers.load(std::memory_order_acquire); b != nullptr; b = b->_next)
+	{
+		// 所有者可能正在写入，等它发现记录已经停止
+		while (b->_busy.load())
+			std::this_thread::yield();
+		FlushBuffer(b);
+	}
+#ifdef _WIN32
+	CloseHandle(trace_file);
+	trace_file = INVALID_HANDLE_VALUE;
+#else
+	close(trace_fd);
+	trace_fd = -1;
+#endif
+}
+
+bool TraceStart(const char* path)
+{
+	std::unique_lock<std::mutex> lock(trace_mutex);
+	StopLocked();
+#ifdef _WIN32
+	trace_file = CreateFileA(path, GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (trace_file == INVALID_HANDLE_VALUE)
+		return false;
+#else
+	trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (trace_fd < 0)
+		return false;
+#endif
+	TraceFileHeader header = {};
+	memcpy(header._magic, TRACE_MAGIC, sizeof(header._magic));
+	header._starttime = LatencyNow();
+	TraceWriteAt(0, &header, sizeof(header));
+	trace_offset.store(sizeof(header), std::memory_order_relaxed);
+	alloc_tracing.store(true);
+	return true;
+}
+
+void TraceStop()
+{
+	std::unique_lock<std::mutex> lock(trace_mutex);
+	StopLocked();
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+// 定义后 ConcurrentAlloc/ConcurrentFree 在记录开启时把每次申请释放写入跟踪文件，不定义时没有任何开销
+// #define ALLOC_TRACE
+
+#include "Common.h"
+
+#include <atomic>
+
+// 申请/释放跟踪：记录每次申请释放的线程、大小、指针和时间，用 trace_replay 离线重放(见 TraceReplay.cpp)
+//     TraceStart("app.trace");
+//     ... 运行负载 ...
+//     TraceStop();
+// 替换 malloc 的动态库 libconcurrentalloc_trace.so 用环境变量 CONCURRENTALLOC_TRACE=文件名 开启(见 MallocOverride.cpp)
+// 每个线程写自己的缓冲区，不加锁；缓冲区满时编码好的整块用 pwrite 写到原子地分配的文件偏移处，
+// 线程退出和 TraceStop 时写出剩下的记录；fork 出的子进程不记录
+// 只记录全局内存池的 ConcurrentAlloc/ConcurrentAllocAligned/ConcurrentFree* 和 ObjectPool<T>，私有堆不记录
+//
+// 文件格式(小端)：TraceFileHeader，之后是任意多个块，每块是 TraceBlockHeader 加 _bytes 字节的记录
+// 每条记录是三个变长整数(每字节7位，最高位表示后面还有)：
+//     和上一条记录的时间差(纳秒，块内第一条相对 _basetime)
+//     (size << 1) | op，op 0 是申请，1 是释放(释放时 size 为0)
+//     指针和上一条记录的指针之差，zigzag 编码(块内第一条相对0)
+// 一个块内的记录来自同一个线程、按时间排序；不同块之间没有顺序，重放时按时间合并
+// 释放记录在真正释放之前、申请记录在申请返回之后取时间，同一个地址的释放总是早于它被再次申请
+
+const char TRACE_MAGIC[8] = { 'C', 'A', 'T', 'R', 'A', 'C', 'E', '1' };
+
+struct TraceFileHeader
+{
+	char _magic[8];
+	uint64_t _starttime;//开始记录的时间(纳秒，steady_clock)
+};
+
+struct TraceBlockHeader
+{
+	uint32_t _thread;//线程编号，按线程第一次记录的顺序从0开始
+	uint32_t _nrecords;
+	uint32_t _bytes;
+	uint32_t _reserved;
+	uint64_t _basetime;
+};
+
+enum class TraceOp : uint8_t
+{
+	Alloc = 0,
+	Free = 1,
+};
+
+// 每个线程的缓冲区大小，一条记录最多30字节
+const size_t TRACE_BUFFER_BYTES = 64 * 1024;
+
+// 是否正在记录
+inline std::atomic<bool> alloc_tracing{ false };
+
+// 开始记录，写到 path(覆盖原有内容)，已经在记录时先结束之前的记录；打不开文件时返回 false
+bool TraceStart(const char* path);
+// 写出所有线程缓冲区中的记录，关闭文件
+void TraceStop();
+
+// 以下由 ConcurrentAlloc.h / ThreadCache / fork 处理函数调用
+void TraceAlloc(void* ptr, size_t size);
+void TraceFree(void* ptr);
+// 线程退出时写出自己的缓冲区，让给以后的线程使用
+void TraceThreadExit();
+// fork 出的子进程丢掉从父进程复制来的缓冲区，停止记录
+void TraceAfterForkChild();
+
+static inline void TraceAllocHook(void* ptr, size_t size)
+{
+#ifdef ALLOC_TRACE
+	if (UNLIKELY(alloc_tracing.load(std::memory_order_relaxed)))
+		TraceAlloc(ptr, size);
+#else
+	(void)ptr;
+	(void)size;
+#endif
+}
+
+static inline void TraceFreeHook(void* ptr)
+{
+#ifdef ALLOC_TRACE
+	if (UNLIKELY(alloc_tracing.load(std::memory_order_relaxed)))
+		TraceFree(ptr);
+#else
+	(void)ptr;
+#endif
+}
+
+// 变长整数，返回写入的字节数
+static inline size_t TraceWriteVarint(uint8_t* out, uint64_t value)
+{
+	size_t n = 0;
+	while (value >= 0x80)
+	{
+		out[n++] = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	out[n++] = (uint8_t)value;
+	return n;
+}
+
+// 从 [*in, end) 读一个变长整数，数据不完整时返回 false
+static inline bool TraceReadVarint(const uint8_t** in, const uint8_t* end, uint64_t* value)
+{
+	uint64_t result = 0;
+	for (size_t shift = 0; *in < end && shift < 64; shift += 7)
+	{
+		uint8_t byte = *(*in)++;
+		result |= (uint64_t)(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0)
+		{
+			*value = result;
+			return true;
+		}
+	}
+	return false;
+}
+
+static inline uint64_t TraceZigzag(int64_t value)
+{
+	return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t TraceUnzigzag(uint64_t value)
+{
+	return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
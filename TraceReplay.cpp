@@ -0,0 +1,316 @@
+#include "ConcurrentAlloc.h"
+#include "TraceRecorder.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <unordered_map>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// 离线重放 TraceStart 记录的申请释放(文件格式见 TraceRecorder.h)
+// 用法：trace_replay 文件名 [concurrent|glibc] [重放线程数，默认为记录到的线程数]
+// 所有记录按时间合并，记录的第 t 个线程的操作交给重放线程 t % 线程数，按原来的顺序尽快执行(不按记录的时间间隔等待)
+// 释放别的线程申请的对象时，等那个线程申请之后再释放；每个线程内按时间排序，不会互相等待成环
+// 申请之后每页写一个字节，RSS 接近真实程序；另一个线程每毫秒读一次 RSS，得到重放期间的峰值
+// 碎片率 = RSS 峰值的增量 / 申请的字节数之和的峰值；两个分配器的对比要分两次运行，互不影响
+
+struct TraceEvent
+{
+	uint64_t _time;
+	uint64_t _ptr;
+	uint64_t _size;
+	uint32_t _thread;
+	TraceOp _op;
+};
+
+// 重放时的一次操作，对象按第一次申请的顺序编号
+struct ReplayOp
+{
+	uint32_t _id;
+	TraceOp _op;
+	uint64_t _size;
+};
+
+struct ReplayAllocator
+{
+	const char* _name;
+	void* (*_alloc)(size_t size);
+	void (*_free)(void* ptr);
+};
+
+static void* PoolAlloc(size_t size)
+{
+	return ConcurrentAlloc(size);
+}
+
+static void PoolFree(void* ptr)
+{
+	ConcurrentFree(ptr);
+}
+
+static void* LibcAlloc(size_t size)
+{
+	return malloc(size);
+}
+
+static void LibcFree(void* ptr)
+{
+	free(ptr);
+}
+
+// 只读映射整个文件
+static const uint8_t* MapFile(const char* path, size_t* size)
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return nullptr;
+	LARGE_INTEGER len;
+	GetFileSizeEx(file, &len);
+	*size = (size_t)len.QuadPart;
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (mapping == nullptr)
+		return nullptr;
+	const uint8_t* data = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+	CloseHandle(mapping);
+	return data;
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return nullptr;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close(fd);
+		return nullptr;
+	}
+	*size = (size_t)st.st_size;
+	void* data = mmap(nullptr, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	return data == MAP_FAILED ? nullptr : static_cast<const uint8_t*>(data);
+#endif
+}
+
+// 解码所有块，文件末尾不完整的块丢掉；返回记录到的线程数
+static uint32_t LoadTrace(const uint8_t* data, size_t size, std::vector<TraceEvent>& events)
+{
+	uint32_t nthreads = 0;
+	size_t offset = sizeof(TraceFileHeader);
+	while (offset + sizeof(TraceBlockHeader) <= size)
+	{
+		TraceBlockHeader header;
+		memcpy(&header, data + offset, sizeof(header));
+		offset += sizeof(header);
+		if (header._bytes > size - offset)
+			break;
+		const uint8_t* in = data + offset;
+		const uint8_t* end = in + header._bytes;
+		offset += header._bytes;
+
+		uint64_t time = header._basetime;
+		uint64_t ptr = 0;
+		for (uint32_t i = 0; i < header._nrecords; ++i)
+		{
+			uint64_t delta, head, diff;
+			if (!TraceReadVarint(&in, end, &delta) || !TraceReadVarint(&in, end, &head) || !TraceReadVarint(&in, end, &diff))
+				break;
+			time += delta;
+			ptr += (uint64_t)TraceUnzigzag(diff);
+			events.push_back({ time, ptr, head >> 1, header._thread, (TraceOp)(head & 1) });
+		}
+		if (header._thread + 1 > nthreads)
+			nthreads = header._thread + 1;
+	}
+	return nthreads;
+}
+
+// 按时间合并，给对象编号，分给各个重放线程；返回对象个数，peaklive 是申请的字节数之和的峰值
+static size_t PrepareReplay(std::vector<TraceEvent>& events, size_t nthreads,
+	std::vector<std::vector<ReplayOp>>& lists, size_t* peaklive, size_t* unmatched)
+{
+	// 时间相同时先释放：释放记录在释放之前取时间，申请记录在申请之后取时间
+	std::stable_sort(events.begin(), events.end(), [](const TraceEvent& a, const TraceEvent& b) {
+		if (a._time != b._time)
+			return a._time < b._time;
+		return a._op == TraceOp::Free && b._op == TraceOp::Alloc;
+	});
+
+	std::unordered_map<uint64_t, uint32_t> live;
+	std::vector<uint64_t> sizes;
+	size_t livebytes = 0;
+	*peaklive = 0;
+	*unmatched = 0;
+	lists.assign(nthreads, std::vector<ReplayOp>());
+	for (const TraceEvent& ev : events)
+	{
+		std::vector<ReplayOp>& list = lists[ev._thread % nthreads];
+		if (ev._op == TraceOp::Alloc)
+		{
+			// 同一个地址没有释放记录就又被申请(例如经过不记录的路径释放)，旧对象保留到最后
+			uint32_t id = (uint32_t)sizes.size();
+			sizes.push_back(ev._size);
+			live[ev._ptr] = id;
+			livebytes += ev._size;
+			if (livebytes > *peaklive)
+				*peaklive = livebytes;
+			list.push_back({ id, TraceOp::Alloc, ev._size });
+		}
+		else
+		{
+			auto it = live.find(ev._ptr);
+			if (it == live.end())
+			{
+				// 开始记录之前申请的
+				++*unmatched;
+				continue;
+			}
+			livebytes -= sizes[it->second];
+			list.push_back({ it->second, TraceOp::Free, 0 });
+			live.erase(it);
+		}
+	}
+	return sizes.size();
+}
+
+static size_t CurrentRss()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+		return pmc.WorkingSetSize;
+	return 0;
+#else
+	size_t pages = 0, resident = 0;
+	if (FILE* fp = fopen("/proc/self/statm", "r"))
+	{
+		if (fscanf(fp, "%zu %zu", &pages, &resident) != 2)
+			resident = 0;
+		fclose(fp);
+	}
+	return resident * (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s trace [concurrent|glibc] [threads]\n", argv[0]);
+		return 1;
+	}
+	ReplayAllocator allocator = { "concurrent", PoolAlloc, PoolFree };
+	if (argc > 2 && strcmp(argv[2], "glibc") == 0)
+		allocator = { "glibc", LibcAlloc, LibcFree };
+	else if (argc > 2 && strcmp(argv[2], "concurrent") != 0)
+	{
+		fprintf(stderr, "unknown allocator %s\n", argv[2]);
+		return 1;
+	}
+
+	size_t filesize = 0;
+	const uint8_t* data = MapFile(argv[1], &filesize);
+	if (data == nullptr || filesize < sizeof(TraceFileHeader) || memcmp(data, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0)
+	{
+		fprintf(stderr, "%s: not a trace file\n", argv[1]);
+		return 1;
+	}
+
+	std::vector<TraceEvent> events;
+	uint32_t recorded = LoadTrace(data, filesize, events);
+	if (events.empty())
+	{
+		fprintf(stderr, "%s: no records\n", argv[1]);
+		return 1;
+	}
+	size_t nthreads = argc > 3 ? strtoul(argv[3], nullptr, 10) : recorded;
+	if (nthreads == 0)
+		nthreads = 1;
+
+	std::vector<std::vector<ReplayOp>> lists;
+	size_t peaklive = 0, unmatched = 0;
+	size_t nobjects = PrepareReplay(events, nthreads, lists, &peaklive, &unmatched);
+	uint64_t span = events.back()._time - events.front()._time;
+	printf("trace: %zu records, %u threads, %zu objects, %zu frees of untraced objects, %.3f s recorded\n",
+		events.size(), recorded, nobjects, unmatched, span / 1e9);
+	std::vector<TraceEvent>().swap(events);
+
+	std::vector<std::atomic<void*>> objects(nobjects);
+	size_t baserss = CurrentRss();
+	std::atomic<size_t> peakrss{ baserss };
+	std::atomic<bool> done{ false };
+	std::thread monitor([&]() {
+		while (!done.load(std::memory_order_relaxed))
+		{
+			size_t rss = CurrentRss();
+			if (rss > peakrss.load(std::memory_order_relaxed))
+				peakrss.store(rss, std::memory_order_relaxed);
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	});
+
+	const size_t page = (size_t)1 << PAGE_SHIFT;
+	std::vector<std::thread> threads;
+	auto begin = std::chrono::steady_clock::now();
+	for (size_t k = 0; k < nthreads; ++k)
+	{
+		threads.emplace_back([&, k]() {
+			for (const ReplayOp& op : lists[k])
+			{
+				if (op._op == TraceOp::Alloc)
+				{
+					size_t size = op._size != 0 ? (size_t)op._size : 1;
+					char* ptr = static_cast<char*>(allocator._alloc(size));
+					for (size_t off = 0; off < size; off += page)
+						ptr[off] = 1;
+					objects[op._id].store(ptr, std::memory_order_release);
+				}
+				else
+				{
+					void* ptr;
+					while ((ptr = objects[op._id].load(std::memory_order_acquire)) == nullptr)
+						std::this_thread::yield();
+					allocator._free(ptr);
+					objects[op._id].store(nullptr, std::memory_order_relaxed);
+				}
+			}
+		});
+	}
+	for (auto& t : threads)
+		t.join();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	done.store(true);
+	monitor.join();
+	size_t endrss = CurrentRss();
+	if (endrss > peakrss.load())
+		peakrss.store(endrss);
+
+	size_t nops = 0, nleft = 0;
+	for (const auto& list : lists)
+		nops += list.size();
+	for (auto& obj : objects)
+	{
+		if (void* ptr = obj.load(std::memory_order_relaxed))
+		{
+			allocator._free(ptr);
+			++nleft;
+		}
+	}
+
+	const double MB = 1024.0 * 1024.0;
+	double rssgrowth = (double)(peakrss.load() - baserss);
+	printf("replay: %s, %zu threads, %.3f s, %.2f Mops/s\n", allocator._name, nthreads, seconds, nops / seconds / 1e6);
+	printf("peak live %.2f MB, peak rss +%.2f MB, fragmentation %.2f, rss at end +%.2f MB (%zu objects never freed)\n",
+		peaklive / MB, rssgrowth / MB, peaklive == 0 ? 0.0 : rssgrowth / peaklive,
+		(double)(endrss > baserss ? endrss - baserss : 0) / MB, nleft);
+	return 0;
+}
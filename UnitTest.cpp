@@ -1,6 +1,23 @@
 #include "Common.h"
 #include "PageCache.h"
 #include "ConcurrentAlloc.h"
+#include "ConcurrentAllocator.h"
+#include "ObjectPool.h"
+#include "Arena.h"
+#include "ConcurrentHeap.h"
+#include "LifetimeProfiler.h"
+#include "CacheArena.h"
+#include "AllocStats.h"
+#include "HeapProfiler.h"
+#include "LatencyStats.h"
+#include "TraceRecorder.h"
+#include "radix_tree.hpp"
+#include "concurrent_radix_tree.hpp"
+#include "Reserve.h"
+
+#include <map>
+#include <set>
+#include <cstring>
 
 #define TESTALLOCSIZE 10
 
@@ -142,6 +159,792 @@ void static AllocBig()
 	ConcurrentFree(ptr2);
 }
 
+void static TestConcurrentAllocator()
+{
+	std::vector<size_t, ConcurrentAllocator<size_t>> v;
+	for (size_t i = 0; i < 100000; ++i)
+		v.push_back(i);
+	EXPECT_RET_SIZE_T((size_t)99999, v.back());
+
+	std::map<int, int, std::less<int>, ConcurrentAllocator<std::pair<const int, int>>> m;
+	for (int i = 0; i < 1000; ++i)
+		m[i] = i;
+	EXPECT_RET_SIZE_T((size_t)1000, m.size());
+
+	std::pmr::memory_resource* mr = ConcurrentMemoryResource::GetInstance();
+	size_t aligns[] = { 8, 64, 4096, 64 * 1024 };
+	for (size_t align : aligns)
+	{
+		void* ptr = mr->allocate(100, align);
+		EXPECT_RET_SIZE_T((size_t)0, (size_t)ptr % align);
+		mr->deallocate(ptr, 100, align);
+	}
+}
+
+struct TestMessage
+{
+	size_t _id;
+	std::string _body;
+	TestMessage(size_t id, const std::string& body) : _id(id), _body(body) {}
+};
+
+struct alignas(64) TestAligned
+{
+	char _data[100];
+};
+
+void static TestObjectPool()
+{
+	static_assert(ObjectPool<TestMessage>::INDEX == SizeClass::Index(sizeof(TestMessage)), "index must be resolved at compile time");
+	static_assert(ObjectPool<TestAligned>::SIZE % 64 == 0, "size must keep alignment");
+
+	std::vector<TestMessage*> v;
+	for (size_t i = 0; i < 1000; ++i)
+		v.push_back(ConcurrentNew<TestMessage>(i, "message"));
+	EXPECT_RET_SIZE_T((size_t)999, v.back()->_id);
+	for (TestMessage* msg : v)
+		ConcurrentDelete(msg);
+
+	TestAligned* obj = ConcurrentNew<TestAligned>();
+	EXPECT_RET_SIZE_T((size_t)0, (size_t)obj % 64);
+	ConcurrentDelete(obj);
+}
+
+void static TestArena()
+{
+	Arena arena;
+	for (size_t i = 0; i < 10000; ++i)
+	{
+		size_t* ptr = arena.New<size_t>(i);
+		EXPECT_RET_SIZE_T(i, *ptr);
+	}
+	size_t nspans = arena.SpanCount();
+
+	// 嵌套的mark按后进先出的顺序回退
+	Arena::Mark outer = arena.GetMark();
+	arena.Alloc(ARENA_SPAN_PAGES << PAGE_SHIFT);
+	Arena::Mark inner = arena.GetMark();
+	arena.Alloc(200 << PAGE_SHIFT);
+	EXPECT_RET_SIZE_T(nspans + 2, arena.SpanCount());
+	arena.Rewind(inner);
+	EXPECT_RET_SIZE_T(nspans + 1, arena.SpanCount());
+	arena.Rewind(outer);
+	EXPECT_RET_SIZE_T(nspans, arena.SpanCount());
+
+	void* ptr = arena.Alloc(10, 64 * 1024);
+	EXPECT_RET_SIZE_T((size_t)0, (size_t)ptr % (64 * 1024));
+
+	arena.Reset();
+	EXPECT_RET_SIZE_T((size_t)0, arena.SpanCount());
+}
+
+void static TestConcurrentHeap()
+{
+	ConcurrentHeap* heap = ConcurrentHeapCreate();
+	std::vector<void*> v;
+	for (size_t i = 1; i <= 2000; ++i)
+	{
+		size_t* ptr = (size_t*)ConcurrentHeapAlloc(heap, i * 8);
+		*ptr = i;
+		v.push_back(ptr);
+	}
+	// 私有堆的内存不在全局内存池中
+	EXPECT_RET_SIZE_T((size_t)0, (size_t)PageCache::GetInstence()->LookupSpan(v[0]));
+
+	// 另一个线程在同一个堆上申请释放，线程退出时ThreadCache还给堆
+	std::thread t([heap]() {
+		for (size_t i = 0; i < 1000; ++i)
+			ConcurrentHeapFree(heap, ConcurrentHeapAlloc(heap, 100));
+	});
+	t.join();
+
+	for (size_t i = 0; i < v.size(); i += 2)
+	{
+		EXPECT_RET_SIZE_T(i + 1, *(size_t*)v[i]);
+		ConcurrentHeapFree(heap, v[i]);
+	}
+	// 剩下的一半不释放，销毁时一起回收
+	ConcurrentHeapDestroy(heap);
+
+	// 销毁之后位置被复用，线程中原来的ThreadCache不能再使用
+	heap = ConcurrentHeapCreate();
+	void* ptr = ConcurrentHeapAlloc(heap, 100);
+	void* big = ConcurrentHeapAlloc(heap, 1024 * 1024);
+	EXPECT_RET_SIZE_T((size_t)1024 * 1024, heap->_pagecache.MapObjectToSpan(big)->_objsize);
+	ConcurrentHeapFree(heap, ptr);
+	ConcurrentHeapDestroy(heap);
+}
+
+void static TestCacheArena()
+{
+	size_t narena = ConcurrentAllocSetArenas(4);
+	EXPECT_RET_SIZE_T((size_t)4, narena);
+
+	// 主线程在0号arena，3个线程同时存在，分到另外3个arena；对象交给主线程释放
+	const size_t nthread = 3;
+	std::vector<void*> v[nthread];
+	size_t arenas[nthread] = {};
+	std::atomic<size_t> ready{ 0 };
+	std::vector<std::thread> threads;
+	for (size_t k = 0; k < nthread; ++k)
+	{
+		threads.emplace_back([&, k]() {
+			for (size_t i = 0; i < 1000; ++i)
+				v[k].push_back(ConcurrentAlloc(64));
+			v[k].push_back(ConcurrentAlloc(256 * 1024));
+			arenas[k] = PageCache::GetInstence()->MapObjectToSpan(v[k][0])->_arena.load();
+			++ready;
+			while (ready < nthread)
+				std::this_thread::yield();
+		});
+	}
+	for (auto& t : threads)
+		t.join();
+
+	size_t distinct = 0;
+	for (size_t k = 0; k < nthread; ++k)
+	{
+		bool seen = false;
+		for (size_t j = 0; j < k; ++j)
+			seen = seen || arenas[j] == arenas[k];
+		distinct += seen ? 0 : 1;
+		// 大对象和小对象来自同一个arena
+		EXPECT_RET_SIZE_T(arenas[k], (size_t)PageCache::GetInstence()->MapObjectToSpan(v[k].back())->_arena.load());
+	}
+	EXPECT_RET_SIZE_T(nthread, distinct);
+
+	// 跨arena释放，按span还给原来的arena
+	for (size_t k = 0; k < nthread; ++k)
+	{
+		for (void* ptr : v[k])
+			ConcurrentFree(ptr);
+	}
+	tlslist->ReleaseAll();
+	Span* span = ArenaPageCache(arenas[1])->NewSpan(1);
+	EXPECT_RET_SIZE_T(arenas[1], (size_t)span->_arena.load());
+	ArenaPageCache(arenas[1])->ReleaseSpanToPageCache(span);
+
+	ConcurrentAllocSetArenas(1);
+}
+
+void static TestHeapProfiler()
+{
+	// 平均每个字节采样一次，每次申请都会被采样；先释放一次，丢掉开始之前按旧间隔算的剩余字节数
+	HeapProfilerStart(1);
+	ConcurrentFree(ConcurrentAlloc(8));
+	std::vector<void*> v;
+	for (size_t i = 0; i < 100; ++i)
+		v.push_back(ConcurrentAlloc(100));
+	v.push_back(ConcurrentAlloc(256 * 1024));
+
+	size_t live = 0, nstacks = 0;
+	HeapProfilerLive(&live, &nstacks);
+	EXPECT_RET_SIZE_T((size_t)101, live);
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)(nstacks >= 2));
+
+	FILE* fp = tmpfile();
+	HeapProfilerDumpPprof(fp);
+	rewind(fp);
+	char line[256] = {};
+	fgets(line, sizeof(line), fp);
+	fclose(fp);
+	EXPECT_RET_SIZE_T((size_t)0, (size_t)strncmp(line, "heap profile: 101:", 18));
+
+	for (void* ptr : v)
+		ConcurrentFree(ptr);
+	HeapProfilerLive(&live, &nstacks);
+	EXPECT_RET_SIZE_T((size_t)0, live);
+	HeapProfilerStop();
+}
+
+void static TestLatencyStats()
+{
+	// 每个值都落在下界不超过它、上界大于它的桶里
+	for (uint64_t ns : { 0ull, 1ull, 15ull, 16ull, 17ull, 31ull, 32ull, 1000ull, 123456789ull, (1ull << 32) - 1 })
+	{
+		size_t b = LatencyHistogram::Bucket(ns);
+		EXPECT_RET_SIZE_T((size_t)1, (size_t)(LatencyHistogram::BucketLow(b) <= ns));
+		EXPECT_RET_SIZE_T((size_t)1, (size_t)(b + 1 == LATENCY_BUCKETS || LatencyHistogram::BucketLow(b + 1) > ns));
+	}
+	EXPECT_RET_SIZE_T(LATENCY_BUCKETS - 1, LatencyHistogram::Bucket(1ull << 40));
+
+	// 1~1000 各一次，p50 在 500 附近，误差不超过一个桶的宽度
+	uint64_t counts[LATENCY_BUCKETS] = {};
+	for (uint64_t ns = 1; ns <= 1000; ++ns)
+		++counts[LatencyHistogram::Bucket(ns)];
+	uint64_t p50 = LatencyPercentile(counts, 0.5);
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)(p50 >= 500 && p50 <= 500 + 500 / LATENCY_SUB_BUCKETS));
+	EXPECT_RET_SIZE_T((size_t)1024, (size_t)LatencyPercentile(counts, 1.0));
+
+#ifdef LATENCY_STATS
+	ConcurrentAllocLatencyReset();
+	std::vector<void*> v;
+	for (size_t i = 0; i < 1000; ++i)
+		v.push_back(ConcurrentAlloc(100));
+	ConcurrentLatencyStats stats;
+	ConcurrentAllocLatency(&stats);
+	uint64_t hit = 0, refill = 0;
+	for (size_t b = 0; b < LATENCY_BUCKETS; ++b)
+	{
+		hit += stats._counts[(size_t)LatencyTier::ThreadCacheHit][b];
+		refill += stats._counts[(size_t)LatencyTier::CentralRefill][b];
+	}
+	EXPECT_RET_SIZE_T((size_t)1000, (size_t)(hit + refill));
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)(refill >= 1));
+	for (void* ptr : v)
+		ConcurrentFree(ptr);
+#endif
+}
+
+void static TestTraceRecorder()
+{
+	uint8_t buf[10];
+	const uint8_t* in = buf;
+	uint64_t value = 0;
+	size_t n = TraceWriteVarint(buf, 300);
+	EXPECT_RET_SIZE_T((size_t)2, n);
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)TraceReadVarint(&in, buf + n, &value));
+	EXPECT_RET_SIZE_T((size_t)300, (size_t)value);
+	EXPECT_RET_SIZE_T((size_t)0, (size_t)TraceReadVarint(&in, buf + n, &value));
+	EXPECT_RET_SIZE_T((size_t)(-5 + 10), (size_t)(TraceUnzigzag(TraceZigzag(-5)) + 10));
+
+	// 记录一次申请释放，读回文件检查
+	const char* path = "trace_test.bin";
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)TraceStart(path));
+	void* ptr = ConcurrentAlloc(100);
+#ifndef ALLOC_TRACE
+	// 没有定义 ALLOC_TRACE 时 ConcurrentAlloc 中的钩子是空的，直接调用记录函数
+	TraceAlloc(ptr, 100);
+	TraceFree(ptr);
+#endif
+	ConcurrentFree(ptr);
+	TraceStop();
+
+	FILE* fp = fopen(path, "rb");
+	TraceFileHeader header;
+	TraceBlockHeader block;
+	uint8_t data[64] = {};
+	EXPECT_RET_SIZE_T((size_t)1, fread(&header, sizeof(header), 1, fp));
+	EXPECT_RET_SIZE_T((size_t)1, fread(&block, sizeof(block), 1, fp));
+	EXPECT_RET_SIZE_T((size_t)2, (size_t)block._nrecords);
+	EXPECT_RET_SIZE_T((size_t)block._bytes, fread(data, 1, block._bytes, fp));
+	fclose(fp);
+	remove(path);
+
+	uint64_t delta, head, diff;
+	in = data;
+	const uint8_t* end = data + block._bytes;
+	TraceReadVarint(&in, end, &delta);
+	TraceReadVarint(&in, end, &head);
+	TraceReadVarint(&in, end, &diff);
+	EXPECT_RET_SIZE_T((size_t)(100 << 1), (size_t)head);
+	EXPECT_RET_SIZE_T((size_t)ptr, (size_t)TraceUnzigzag(diff));
+	TraceReadVarint(&in, end, &delta);
+	TraceReadVarint(&in, end, &head);
+	TraceReadVarint(&in, end, &diff);
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)head);
+	EXPECT_RET_SIZE_T((size_t)0, (size_t)diff);
+}
+
+void static TestAllocStats()
+{
+	ConcurrentStats before;
+	ConcurrentAllocStats(&before);
+	size_t index = SizeClass::Index(100);
+
+	std::vector<void*> v;
+	for (size_t i = 0; i < 1000; ++i)
+		v.push_back(ConcurrentAlloc(100));
+	void* big = ConcurrentAlloc(256 * 1024);
+
+	ConcurrentStats stats;
+	ConcurrentAllocStats(&stats);
+	EXPECT_RET_SIZE_T(before._classes[index]._inuse + 1000, stats._classes[index]._inuse);
+	EXPECT_RET_SIZE_T(before._biginuse + 256 * 1024, stats._biginuse);
+	EXPECT_RET_SIZE_T(before._bigobjs + 1, stats._bigobjs);
+	// 没有被申请的对象都在ThreadCache或者CentralCache中
+	AllocClassStats& c = stats._classes[index];
+	EXPECT_RET_SIZE_T(c._spanpages * 4096 / c._size, c._inuse + c._threadcached + c._centralfree);
+
+	for (void* ptr : v)
+		ConcurrentFree(ptr);
+	ConcurrentFree(big);
+	ConcurrentAllocStats(&stats);
+	EXPECT_RET_SIZE_T(before._classes[index]._inuse, stats._classes[index]._inuse);
+	EXPECT_RET_SIZE_T(before._biginuse, stats._biginuse);
+
+	// Arena的大span释放之后也不再计入
+	{
+		Arena arena;
+		arena.Alloc(200 << PAGE_SHIFT);
+	}
+	ConcurrentAllocStats(&stats);
+	EXPECT_RET_SIZE_T(before._biginuse, stats._biginuse);
+	EXPECT_RET_SIZE_T(before._bigobjs, stats._bigobjs);
+}
+
+// 几个线程用同一把锁保护一个计数器，计数不能丢
+template<class L>
+void static TestLock()
+{
+	CountedLock<L> lock;
+	size_t count = 0;
+	const size_t nthread = 4, ops = 10000;
+	std::vector<std::thread> threads;
+	for (size_t k = 0; k < nthread; ++k)
+	{
+		threads.emplace_back([&]() {
+			for (size_t i = 0; i < ops; ++i)
+			{
+				std::unique_lock<CountedLock<L>> guard(lock);
+				++count;
+			}
+		});
+	}
+	for (auto& t : threads)
+		t.join();
+	EXPECT_RET_SIZE_T(nthread * ops, count);
+	EXPECT_RET_SIZE_T(nthread * ops, (size_t)lock.Stats()._acquire);
+
+	// 一个线程同时持有(fork 时的 LockAll)
+	L locks[4];
+	for (auto& l : locks)
+		l.lock();
+	EXPECT_RET_SIZE_T((size_t)0, (size_t)locks[2].try_lock());
+	for (auto& l : locks)
+		l.unlock();
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)locks[2].try_lock());
+	locks[2].unlock();
+}
+
+void static TestLifetimeHint()
+{
+	// 长期对象和短期对象不在同一个span中
+	void* shortptr = ConcurrentAlloc(48);
+	void* longptr = ConcurrentAlloc(48, LifetimeHint::LongLived);
+	Span* shortspan = PageCache::GetInstence()->MapObjectToSpan(shortptr);
+	Span* longspan = PageCache::GetInstence()->MapObjectToSpan(longptr);
+	EXPECT_RET_SIZE_T((size_t)0, (size_t)shortspan->_longlived);
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)longspan->_longlived);
+	ConcurrentFree(shortptr);
+	ConcurrentFree(longptr);
+
+	// 阈值为0时所有采样都算长期对象；每次申请都采样
+	LifetimeProfilerStart(1, 0);
+	ConcurrentFree(ConcurrentAlloc(8));//释放时当前线程开始按新的间隔采样
+	std::vector<void*> v;
+	for (size_t i = 0; i < 1000; ++i)
+		v.push_back(ConcurrentAlloc(200));
+	for (void* ptr : v)
+		ConcurrentFree(ptr);
+	EXPECT_RET_SIZE_T((size_t)LifetimeHint::LongLived, (size_t)LifetimeProfilerSuggest(200));
+	EXPECT_RET_SIZE_T((size_t)LifetimeHint::ShortLived, (size_t)LifetimeProfilerSuggest(8));
+	LifetimeProfilerStop();
+}
+
+// 整数键的 radix_tree 和 std::map 做同样的操作，结果相同；节点在 4/16/48/256 之间伸缩，前缀分裂、合并
+void static TestRadixTreeInt()
+{
+	radix_tree<PageID, size_t> tree;
+	std::map<PageID, size_t> expect;
+	size_t state = 12345;
+	for (size_t i = 0; i < 200000; ++i)
+	{
+		state = state * 6364136223846793005ull + 1442695040888963407ull;
+		// 一半是相邻的页号，一半在整个地址空间中分散
+		PageID id = (state >> 40) & 1 ? ((PageID)0x7f0000000 + (state >> 20) % 4096) : (PageID)(state >> 16);
+		switch ((state >> 8) % 3)
+		{
+		case 0:
+			tree[id] = i;
+			expect[id] = i;
+			break;
+		case 1:
+			EXPECT_RET_SIZE_T(expect.erase(id), (size_t)tree.erase(id));
+			break;
+		default:
+		{
+			auto it = tree.find(id);
+			auto e = expect.find(id);
+			EXPECT_RET_SIZE_T((size_t)(e == expect.end()), (size_t)(it == tree.end()));
+			if (e != expect.end() && it != tree.end())
+				EXPECT_RET_SIZE_T(e->second, it->second);
+			break;
+		}
+		}
+	}
+	EXPECT_RET_SIZE_T(expect.size(), tree.size());
+
+	// 按键从小到大遍历，lower_bound/upper_bound 和 std::map 相同
+	auto e = expect.begin();
+	size_t n = 0;
+	for (auto it = tree.begin(); it != tree.end() && e != expect.end(); ++it, ++e, ++n)
+		EXPECT_RET_SIZE_T((size_t)e->first, (size_t)it->first);
+	EXPECT_RET_SIZE_T(expect.size(), n);
+	PageID probe = (PageID)0x7f0000000 + 100;
+	auto lb = tree.lower_bound(probe);
+	auto elb = expect.lower_bound(probe);
+	EXPECT_RET_SIZE_T((size_t)elb->first, (size_t)lb->first);
+	auto ub = tree.upper_bound(elb->first);
+	auto eub = expect.upper_bound(elb->first);
+	EXPECT_RET_SIZE_T((size_t)eub->first, (size_t)ub->first);
+
+	tree.clear();
+	EXPECT_RET_SIZE_T((size_t)0, tree.size());
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)(tree.find(probe) == tree.end()));
+}
+
+// 并发的整数键基数树：写线程在各自的区域中不停地合并、切分相邻的 span(改映射)，并在区域末尾增删页(节点伸缩、前缀分裂)，
+// 读线程同时查找：合并、切分中的页总是映射到一个覆盖它的 span，末尾的页要么没有，要么映射正确
+// 值是 span 的起始页 << 8 | 页数
+void static TestConcurrentRadixTree()
+{
+	static concurrent_radix_tree<PageID, size_t> tree;
+	const size_t WRITERS = 2;
+	const size_t READERS = 4;
+	const size_t SPANS = 512;//每个区域中的 span 对数
+	const size_t TAIL = 4096;//每个区域末尾增删的页数
+	auto region = [](size_t w) { return ((PageID)0x7f0000000 + (PageID)w * 0x1000000) << 4; };
+	auto encode = [](PageID start, size_t npage) { return (size_t)(start << 8 | npage); };
+
+	// 每一对 span 是 [a, a+n1) 和 [a+n1, a+n1+n2)
+	for (size_t w = 0; w < WRITERS; ++w)
+	{
+		for (size_t i = 0; i < SPANS; ++i)
+		{
+			PageID a = region(w) + i * 16;
+			size_t n1 = 1 + i % 7, n2 = 1 + i % 5;
+			for (size_t j = 0; j < n1; ++j)
+				tree.set(a + j, encode(a, n1));
+			for (size_t j = 0; j < n2; ++j)
+				tree.set(a + n1 + j, encode(a + n1, n2));
+		}
+	}
+
+	std::atomic<bool> stop{ false };
+	std::atomic<size_t> bad{ 0 };
+	std::atomic<size_t> lookups{ 0 };
+	std::vector<std::thread> threads;
+	for (size_t w = 0; w < WRITERS; ++w)
+	{
+		threads.emplace_back([&, w]() {
+			size_t state = w + 1;
+			for (size_t round = 0; round < 20000; ++round)
+			{
+				state = state * 6364136223846793005ull + 1442695040888963407ull;
+				size_t i = (state >> 33) % SPANS;
+				PageID a = region(w) + i * 16;
+				size_t n1 = 1 + i % 7, n2 = 1 + i % 5;
+				// 合并：两个 span 的页都改映射到合并后的 span，再切分回去
+				for (size_t j = 0; j < n1 + n2; ++j)
+					tree.set(a + j, encode(a, n1 + n2));
+				for (size_t j = 0; j < n1; ++j)
+					tree.set(a + j, encode(a, n1));
+				for (size_t j = 0; j < n2; ++j)
+					tree.set(a + n1 + j, encode(a + n1, n2));
+
+				PageID t = region(w) + SPANS * 16 + (state >> 20) % TAIL;
+				if ((state >> 12) & 1)
+					tree.set(t, encode(t, 1));
+				else
+					tree.erase(t);
+			}
+		});
+	}
+	for (size_t r = 0; r < READERS; ++r)
+	{
+		threads.emplace_back([&, r]() {
+			size_t state = r + 100;
+			size_t n = 0;
+			while (!stop.load(std::memory_order_relaxed))
+			{
+				state = state * 6364136223846793005ull + 1442695040888963407ull;
+				size_t w = (state >> 40) % WRITERS;
+				PageID id = region(w) + (state >> 16) % (SPANS * 16);
+				size_t v = tree.get(id);
+				size_t i = (size_t)(id - region(w)) / 16;
+				PageID start = v >> 8;
+				if ((id - region(w)) % 16 < 2 + i % 7 + i % 5 && (v == 0 || id < start || id >= start + (v & 0xFF)))
+					bad.fetch_add(1);
+				PageID t = region(w) + SPANS * 16 + (state >> 20) % TAIL;
+				v = tree.get(t);
+				if (v != 0 && v != encode(t, 1))
+					bad.fetch_add(1);
+				n += 2;
+			}
+			lookups.fetch_add(n);
+		});
+	}
+	for (size_t w = 0; w < WRITERS; ++w)
+		threads[w].join();
+	stop.store(true);
+	for (size_t k = WRITERS; k < threads.size(); ++k)
+		threads[k].join();
+	EXPECT_RET_SIZE_T((size_t)0, bad.load());
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)(lookups.load() > 0));
+
+	// 结束后每一对 span 都是切分开的
+	size_t tail = 0;
+	for (size_t w = 0; w < WRITERS; ++w)
+	{
+		for (size_t i = 0; i < SPANS; ++i)
+		{
+			PageID a = region(w) + i * 16;
+			size_t n1 = 1 + i % 7, n2 = 1 + i % 5;
+			EXPECT_RET_SIZE_T(encode(a, n1), tree.get(a + n1 - 1));
+			EXPECT_RET_SIZE_T(encode(a + n1, n2), tree.get(a + n1));
+		}
+		for (size_t k = 0; k < TAIL; ++k)
+			tail += tree.get(region(w) + SPANS * 16 + k) != 0;
+	}
+	size_t mapped = 0;
+	for (size_t i = 0; i < SPANS; ++i)
+		mapped += 1 + i % 7 + 1 + i % 5;
+	EXPECT_RET_SIZE_T(WRITERS * mapped + tail, tree.size());
+
+	tree.clear();
+	EXPECT_RET_SIZE_T((size_t)0, tree.size());
+	EXPECT_RET_SIZE_T((size_t)0, tree.get(region(0)));
+}
+
+void static TestSpanPolicy()
+{
+	// SpanTree 总是给出地址最低的span
+	std::vector<Span> spans(1000);
+	std::map<PageID, Span*> expect;
+	SpanTree tree;
+	uint64_t x = 88172645463325252ull;
+	for (size_t i = 0; i < 20000; ++i)
+	{
+		x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+		Span* span = &spans[x % spans.size()];
+		span->_pageid = (PageID)(span - &spans[0]) * 7 + 100;
+		if (expect.count(span->_pageid))
+		{
+			tree.Erase(span);
+			expect.erase(span->_pageid);
+		}
+		else
+		{
+			tree.Insert(span);
+			expect[span->_pageid] = span;
+		}
+		EXPECT_RET_SIZE_T(expect.size(), tree.Size());
+		EXPECT_RET_SIZE_T(expect.empty() ? 0 : (size_t)expect.begin()->second, (size_t)tree.Lowest());
+	}
+	while (!tree.Empty())
+	{
+		EXPECT_RET_SIZE_T((size_t)expect.begin()->second, (size_t)tree.PopLowest());
+		expect.erase(expect.begin());
+	}
+
+	// 地址优先时从最低地址的空闲span分配，LIFO 时取最近放回的
+	PageCache* pc = new PageCache(true);
+	ConcurrentAllocSetSpanPolicy(SpanPolicy::AddressOrdered);
+	Span* s[8];
+	for (size_t i = 0; i < 8; ++i)
+		s[i] = pc->NewSpan(1);
+	PageID low = s[2]->_pageid, high = s[5]->_pageid;
+	pc->ReleaseSpanToPageCache(s[2]);
+	pc->ReleaseSpanToPageCache(s[5]);
+	s[2] = pc->NewSpan(1);
+	EXPECT_RET_SIZE_T(low, s[2]->_pageid);
+	pc->ReleaseSpanToPageCache(s[2]);
+
+	// 切换策略时已有的空闲span移到链表中，仍然能分配到
+	ConcurrentAllocSetSpanPolicy(SpanPolicy::Lifo);
+	s[2] = pc->NewSpan(1);
+	s[5] = pc->NewSpan(1);
+	EXPECT_RET_SIZE_T(low + high, s[2]->_pageid + s[5]->_pageid);
+	PageID last = s[5]->_pageid;
+	pc->ReleaseSpanToPageCache(s[2]);
+	pc->ReleaseSpanToPageCache(s[5]);
+	s[2] = pc->NewSpan(1);
+	EXPECT_RET_SIZE_T(last, s[2]->_pageid);
+	pc->ReleaseSpanToPageCache(s[2]);
+	for (size_t i = 0; i < 8; ++i)
+	{
+		if (i != 2 && i != 5)
+			pc->ReleaseSpanToPageCache(s[i]);
+	}
+	pc->ReleaseAllMemory();
+	delete pc;
+}
+
+void static TestReserve()
+{
+	ConcurrentStats before;
+	ConcurrentAllocStats(&before);
+	ReserveClass classes[] = { { 64, 2000 }, { 1000, 100 }, { 256 * 1024, 10 } };
+	ReserveOptions options;
+	options._prefault = true;
+	options._classes = classes;
+	options._nclasses = 3;
+	options._warmthread = true;
+	ReserveResult result = ConcurrentAllocReserve(4 << 20, options);
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)(result._reserved >= (4 << 20)));
+	EXPECT_RET_SIZE_T((size_t)0, (size_t)result._locked);
+
+	// 预留的页在PageCache中，当前线程和CentralCache中都有切好的对象
+	ConcurrentStats after;
+	ConcurrentAllocStats(&after);
+	size_t index = SizeClass::Index(64);
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)(after._mapped - before._mapped >= result._reserved));
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)(tlslist->GetFreelist(index)->Size() >= 2000));
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)(after._classes[index]._centralfree >= 2000));
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)(after._classes[SizeClass::Index(1000)]._centralfree >= 100));
+
+	// 预热过的对象直接从ThreadCache取，不再到CentralCache，全部释放之后也留在ThreadCache中
+	std::vector<void*> v;
+	for (size_t i = 0; i < 2000; ++i)
+		v.push_back(ConcurrentAlloc(64));
+	for (void* ptr : v)
+		ConcurrentFree(ptr);
+	ConcurrentStats used;
+	ConcurrentAllocStats(&used);
+	EXPECT_RET_SIZE_T(after._classes[index]._centralfree, used._classes[index]._centralfree);
+	EXPECT_RET_SIZE_T(after._classes[index]._threadcached, used._classes[index]._threadcached);
+	EXPECT_RET_SIZE_T(after._mapped, used._mapped);
+	tlslist->ReleaseAll();
+}
+
+#ifdef USE_SEGMENT
+void static TestSegment()
+{
+	// 对象的span可以直接从段头找到
+	void* ptr = ConcurrentAlloc(100);
+	Segment* seg = (Segment*)((size_t)ptr & ~(SEGMENT_SIZE - 1));
+	PageID id = (PageID)ptr >> PAGE_SHIFT;
+	EXPECT_RET_SIZE_T((size_t)PageCache::GetInstence()->MapObjectToSpan(ptr), (size_t)seg->_spans[id & (SEGMENT_PAGES - 1)]);
+	EXPECT_RET_SIZE_T((size_t)SizeClass::Index(100) + 1, (size_t)seg->_classes[id & (SEGMENT_PAGES - 1)]);
+	ConcurrentFree(ptr);
+
+	// 大对象单独一个段，释放之后查不到
+	void* big = ConcurrentAlloc(3 * SEGMENT_SIZE);
+	EXPECT_RET_SIZE_T((size_t)0, (size_t)big & (SEGMENT_SIZE - 1) & ~(SEGMENT_HEADER_PAGES << PAGE_SHIFT));
+	ConcurrentFree(big);
+	EXPECT_RET_SIZE_T((size_t)0, (size_t)PageCache::GetInstence()->LookupSpan(big));
+
+	// 对齐到半个段时地址还在第一个 SEGMENT_SIZE 中；按整个段对齐时从地址找不到段头，拒绝申请
+	void* aligned = ConcurrentAllocAligned(100, SEGMENT_SIZE / 2);
+	EXPECT_RET_SIZE_T((size_t)0, (size_t)aligned & (SEGMENT_SIZE / 2 - 1));
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)(PageCache::GetInstence()->LookupSpan(aligned) != nullptr));
+	ConcurrentFree(aligned);
+	bool thrown = false;
+	try
+	{
+		ConcurrentAllocAligned(100, SEGMENT_SIZE);
+	}
+	catch (const std::bad_alloc&)
+	{
+		thrown = true;
+	}
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)thrown);
+}
+#endif
+
+#ifdef USE_LOCKFREE_CENTRAL
+// 无锁模式下CentralCache的对象批量栈，用私有的PageCache和CentralCache，不影响全局内存池
+void static TestTransferBatch()
+{
+	// 版本号溢出之后栈仍然正确
+	BatchStack stack;
+	TransferBatch a, b;
+	size_t wrong = 0;
+	for (size_t i = 0; i < 70000; ++i)
+	{
+		stack.Push(&a);
+		wrong += stack.Pop() != &a;
+	}
+	stack.Push(&a);
+	stack.Push(&b);
+	EXPECT_RET_SIZE_T((size_t)0, wrong);
+	EXPECT_RET_SIZE_T((size_t)&b, (size_t)stack.Pop());
+	EXPECT_RET_SIZE_T((size_t)&a, (size_t)stack.Pop());
+	EXPECT_RET_SIZE_T((size_t)0, (size_t)stack.Pop());
+
+	PageCache* pc = new PageCache(true);
+	CentralCache* cc = new CentralCache(pc);
+	const size_t size = 64, batch = 32;
+	size_t index = SizeClass::Index(size);
+	auto fetch = [&](std::vector<void*>& v, size_t n) {
+		while (n > 0)
+		{
+			void* start;
+			void* end;
+			size_t got = cc->FetchRangeObj(start, end, n, size);
+			for (size_t i = 0; i < got; ++i, start = NEXT_OBJ(start))
+				v.push_back(start);
+			n -= got;
+		}
+	};
+	auto release = [&](std::vector<void*>& v, size_t begin, size_t n) {
+		for (size_t i = begin; i + 1 < begin + n; ++i)
+			NEXT_OBJ(v[i]) = v[i + 1];
+		NEXT_OBJ(v[begin + n - 1]) = nullptr;
+		cc->ReleaseListToSpans(v[begin], size, n);
+	};
+	// 栈中的对象在span看来还在使用中
+	auto inuse = [&](const std::vector<void*>& v) {
+		std::set<Span*> spans;
+		for (void* ptr : v)
+			spans.insert(pc->MapObjectToSpan(ptr));
+		size_t n = 0;
+		for (Span* span : spans)
+			n += span->_usecount;
+		return n;
+	};
+	auto stats = [&]() {
+		AllocClassStats classes[NLISTS];
+		cc->CollectStats(classes);
+		return classes[index];
+	};
+
+	// 整串压栈；取的比批量少时切下前面的，剩下的压回去
+	std::vector<void*> v;
+	fetch(v, batch);
+	release(v, 0, batch);
+	EXPECT_RET_SIZE_T(batch, inuse(v));
+	void* start;
+	void* end;
+	EXPECT_RET_SIZE_T((size_t)10, cc->FetchRangeObj(start, end, 10, size));
+	EXPECT_RET_SIZE_T((size_t)v[0], (size_t)start);
+	EXPECT_RET_SIZE_T((size_t)v[9], (size_t)end);
+	EXPECT_RET_SIZE_T(batch - 10, cc->FetchRangeObj(start, end, 100, size));
+	EXPECT_RET_SIZE_T((size_t)v[10], (size_t)start);
+	EXPECT_RET_SIZE_T((size_t)v[batch - 1], (size_t)end);
+	EXPECT_RET_SIZE_T(batch, inuse(v));
+
+	// 超过容量的批量直接还给span
+	size_t capacity = TRANSFER_MAX_BYTES / size > 2 * SizeClass::NumMoveSize(size) ? TRANSFER_MAX_BYTES / size : 2 * SizeClass::NumMoveSize(size);
+	size_t nbatch = capacity / batch + 1;
+	fetch(v, nbatch * batch - v.size());
+	for (size_t k = 0; k < nbatch; ++k)
+		release(v, k * batch, batch);
+	EXPECT_RET_SIZE_T(capacity / batch * batch, inuse(v));
+
+	// FlushTransfer 之后对象全部回到span，span都还给PageCache
+	EXPECT_RET_SIZE_T((size_t)1, (size_t)(stats()._spans != 0));
+	cc->FlushTransfer();
+	EXPECT_RET_SIZE_T((size_t)0, stats()._spans);
+	EXPECT_RET_SIZE_T((size_t)0, stats()._centralfree);
+
+	// DropTransfer 只丢掉描述符，对象留在span的使用计数中
+	v.clear();
+	fetch(v, batch);
+	release(v, 0, batch);
+	AllocClassStats before = stats();
+	cc->DropTransfer();
+	EXPECT_RET_SIZE_T(before._centralfree - batch, stats()._centralfree);
+	EXPECT_RET_SIZE_T(before._spans, stats()._spans);
+	EXPECT_RET_SIZE_T(batch, inuse(v));
+
+	pc->ReleaseAllMemory();
+	delete cc;
+	delete pc;
+}
+#endif
+
 void static test()
 {
 	TestSize();
@@ -151,6 +954,29 @@ void static test()
 	//TestPageCache();
 	//TestConcurrentAllocFree();
 	//AllocBig();
+	//TestConcurrentAllocator();
+	//TestObjectPool();
+	//TestArena();
+	//TestConcurrentHeap();
+	//TestCacheArena();
+	//TestLifetimeHint();
+	//TestLock<SpinFutexLock>();
+	TestLock<TicketLock>();
+	//TestLock<McsLock>();
+	//TestAllocStats();
+	//TestHeapProfiler();
+	//TestLatencyStats();
+	//TestTraceRecorder();
+	//TestRadixTreeInt();
+	//TestConcurrentRadixTree();
+	//TestSpanPolicy();
+	//TestReserve();
+#ifdef USE_SEGMENT
+	//TestSegment();
+#endif
+#ifdef USE_LOCKFREE_CENTRAL
+	//TestTransferBatch();
+#endif
 
 }
 
@@ -0,0 +1,846 @@
+#ifndef CONCURRENT_RADIX_TREE_HPP
+#define CONCURRENT_RADIX_TREE_HPP
+
+#include "radix_tree.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+// --------------------------------------------------------------------------------------------------
+// 并发的整数键自适应基数树
+// --------------------------------------------------------------------------------------------------
+// 节点结构和 radix_int_tree 相同(Node4/16/48/256、路径压缩、惰性展开)，读不加锁，写只锁要修改的节点
+// 乐观锁耦合(optimistic lock coupling)：每个节点有一个版本号，最低位表示已废弃，第二位表示写锁
+//     读：记下版本号，读节点内容，再检查版本号没变，变了就从根重新开始；读者不写节点，不会阻塞写者
+//     写：把读时记下的版本号用 CAS 升级成写锁，成功说明读到的内容还有效；解锁时版本号增加
+//     节点换成大一号/小一号、和唯一的孩子合并时，旧节点标记为已废弃，还停在它上面的读写者会重新开始
+// 延迟回收：被替换的节点和删除的叶子先放进待回收链表，确认没有操作还能访问时才放回节点池
+//     每个操作在64个计数器之一上登记当前纪元(epoch)的奇偶，计数器按线程分散在不同的缓存行
+//     纪元 E 中摘下的节点在纪元推进到 E+1、登记在 E 上的操作都结束之后回收
+// 根节点是内嵌的 Node256，不会被替换；值用 std::atomic<T> 保存，T 是指针、整数这类可以原子读写的类型
+// 节点内存和 radix_int_tree 一样从向系统申请的池中分配，不调用 new/malloc
+//     concurrent_radix_tree<PageID, Span*> map;
+//     map.set(id, span);
+//     Span* span = map.get(id);     没有时返回 T()
+//     map.erase(id);
+// clear 和析构要求没有并发的操作
+
+template <typename K, typename T>
+class concurrent_radix_tree {
+    static_assert(std::is_integral<K>::value && std::is_unsigned<K>::value, "concurrent_radix_tree needs an unsigned integer key");
+    static_assert(std::is_trivially_copyable<T>::value, "concurrent_radix_tree values are read and written atomically");
+    static_assert(sizeof(std::atomic<uint8_t>) == 1, "Node16 keys are compared as a byte array");
+
+public:
+    typedef K key_type;
+    typedef T mapped_type;
+    typedef std::size_t size_type;
+
+private:
+    static const int KEY_BYTES = sizeof(K);
+    static const uint64_t OBSOLETE = 1;
+    static const uint64_t LOCKED = 2;
+    static const int EPOCH_STRIPES = 64;
+
+    enum node_type { NODE4, NODE16, NODE48, NODE256 };
+
+    // 除了版本号，读者不加锁读到的字段都是原子变量，读完之后靠版本号判断是否有效
+    struct node {
+        std::atomic<uint64_t> m_version;
+        uint8_t m_type;
+        std::atomic<uint8_t> m_prefixlen;
+        std::atomic<uint16_t> m_count;
+        std::atomic<K> m_prefixkey; // 子树中的任意一个键，压缩掉的各层就是它在这些层的字节
+        node* m_next; // 待回收链表
+
+        constexpr explicit node(uint8_t type) : m_version(0), m_type(type), m_prefixlen(0), m_count(0), m_prefixkey(0), m_next(NULL) { }
+    };
+
+    struct node4 : node {
+        std::atomic<uint8_t> m_keys[4];
+        std::atomic<node*> m_children[4];
+        node4() : node(NODE4), m_keys{}, m_children{} { }
+    };
+
+    struct node16 : node {
+        std::atomic<uint8_t> m_keys[16];
+        std::atomic<node*> m_children[16];
+        node16() : node(NODE16), m_keys{}, m_children{} { }
+    };
+
+    struct node48 : node {
+        std::atomic<uint8_t> m_index[256];
+        std::atomic<node*> m_children[48];
+        node48() : node(NODE48), m_index{}, m_children{} { }
+    };
+
+    struct node256 : node {
+        std::atomic<node*> m_children[256];
+        constexpr node256() : node(NODE256), m_children{} { }
+    };
+
+    struct leaf {
+        K m_key;
+        std::atomic<T> m_value;
+        leaf* m_next; // 待回收链表
+        leaf(K key, T value) : m_key(key), m_value(value), m_next(NULL) { }
+    };
+
+    // 一个缓存行，两个计数器分别登记奇数和偶数纪元中的操作
+    struct epoch_stripe {
+        std::atomic<uint64_t> m_active[2];
+        char m_pad[64 - 2 * sizeof(std::atomic<uint64_t>)];
+        constexpr epoch_stripe() : m_active{}, m_pad{} { }
+    };
+
+    // 操作期间登记在当前纪元上
+    class epoch_guard {
+    public:
+        explicit epoch_guard(const concurrent_radix_tree* tree) : m_stripe(&tree->m_stripes[thread_stripe()]) {
+            while (true) {
+                uint64_t e = tree->m_epoch.load();
+                m_stripe->m_active[e & 1].fetch_add(1);
+                // 登记之后纪元没变，回收者要么看到这次登记，要么这次操作能看到之前所有的摘除
+                if (tree->m_epoch.load() == e) {
+                    m_parity = (int)(e & 1);
+                    return;
+                }
+                m_stripe->m_active[e & 1].fetch_sub(1, std::memory_order_release);
+            }
+        }
+        ~epoch_guard() {
+            m_stripe->m_active[m_parity].fetch_sub(1, std::memory_order_release);
+        }
+
+    private:
+        epoch_stripe* m_stripe;
+        int m_parity;
+    };
+
+public:
+    constexpr concurrent_radix_tree() : m_root(), m_size(0), m_stripes{}, m_epoch(1), m_retired_nodes(NULL), m_retired_leaves(NULL),
+        m_waiting_nodes(NULL), m_waiting_leaves(NULL), m_nretired(0) { }
+    ~concurrent_radix_tree() {
+        clear();
+    }
+
+    size_type size() const {
+        return m_size.load(std::memory_order_relaxed);
+    }
+    bool empty() const {
+        return size() == 0;
+    }
+
+    T get(K key) const {
+        epoch_guard guard(this);
+        T value;
+        for (int restarts = 0; !lookup(key, value); ++restarts)
+            backoff(restarts);
+        return value;
+    }
+
+    // 批量查找，只登记一次纪元
+    void get_many(const K* keys, T* values, std::size_t n) const {
+        epoch_guard guard(this);
+        for (std::size_t i = 0; i < n; ++i) {
+            for (int restarts = 0; !lookup(keys[i], values[i]); ++restarts)
+                backoff(restarts);
+        }
+    }
+
+    // 插入或者修改
+    void set(K key, T value) {
+        epoch_guard guard(this);
+        leaf* spare = NULL; // 重新开始时复用已经申请的叶子
+        for (int restarts = 0; !try_set(key, value, spare); ++restarts)
+            backoff(restarts);
+        if (spare != NULL) {
+            std::lock_guard<std::mutex> lock(m_pool_mutex);
+            m_leaves.deallocate(spare);
+        }
+    }
+
+    bool erase(K key) {
+        epoch_guard guard(this);
+        int ret;
+        for (int restarts = 0; (ret = try_erase(key)) < 0; ++restarts)
+            backoff(restarts);
+        return ret != 0;
+    }
+
+    // 尝试回收已经没有操作能访问的节点
+    void reclaim() {
+        std::lock_guard<std::mutex> lock(m_pool_mutex);
+        try_reclaim();
+    }
+
+    void clear() {
+        for (int b = 0; b < 256; ++b)
+            m_root.m_children[b].store(NULL, std::memory_order_relaxed);
+        m_root.m_count.store(0, std::memory_order_relaxed);
+        m_size.store(0, std::memory_order_relaxed);
+        m_retired_nodes = m_waiting_nodes = NULL;
+        m_retired_leaves = m_waiting_leaves = NULL;
+        m_nretired = 0;
+        m_leaves.clear();
+        m_node4s.clear();
+        m_node16s.clear();
+        m_node48s.clear();
+        m_node256s.clear();
+    }
+
+private:
+    // 线程第一次用到时按顺序分配；thread_local 要能常量初始化，动态初始化在替换 malloc 的动态库中不能用
+    static unsigned thread_stripe() {
+        static std::atomic<unsigned> next(0);
+        static thread_local unsigned stripe = 0; // 分配之后是序号 + 1
+        if (stripe == 0)
+            stripe = next.fetch_add(1, std::memory_order_relaxed) % EPOCH_STRIPES + 1;
+        return stripe - 1;
+    }
+
+    static void backoff(int restarts) {
+        if (restarts > 16)
+            std::this_thread::yield();
+    }
+
+    static uint8_t key_byte(K key, int depth) {
+        return (uint8_t)(key >> (8 * (KEY_BYTES - 1 - depth)));
+    }
+
+    static bool is_leaf(const node* n) {
+        return ((uintptr_t)n & 1) != 0;
+    }
+    static leaf* as_leaf(const node* n) {
+        return reinterpret_cast<leaf*>((uintptr_t)n & ~(uintptr_t)1);
+    }
+    static node* leaf_ref(leaf* l) {
+        return reinterpret_cast<node*>((uintptr_t)l | 1);
+    }
+
+    static int prefix_match(K prefixkey, int prefixlen, K key, int depth) {
+        int i = 0;
+        while (i < prefixlen && key_byte(prefixkey, depth + i) == key_byte(key, depth + i))
+            ++i;
+        return i;
+    }
+
+    // 版本号：读锁只是记下版本号，节点已经加了写锁或者废弃时失败
+    static bool read_lock(const node* n, uint64_t& version) {
+        version = n->m_version.load(std::memory_order_acquire);
+        return (version & (LOCKED | OBSOLETE)) == 0;
+    }
+    // 记下版本号之后读到的内容仍然有效
+    static bool validate(const node* n, uint64_t version) {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return n->m_version.load(std::memory_order_relaxed) == version;
+    }
+    static bool upgrade(node* n, uint64_t version) {
+        if (!n->m_version.compare_exchange_strong(version, version + LOCKED, std::memory_order_acquire))
+            return false;
+        std::atomic_thread_fence(std::memory_order_release);
+        return true;
+    }
+    static void write_unlock(node* n) {
+        n->m_version.fetch_add(LOCKED, std::memory_order_release);
+    }
+    static void write_unlock_obsolete(node* n) {
+        n->m_version.fetch_add(LOCKED | OBSOLETE, std::memory_order_release);
+    }
+
+    static bool is_full(const node* n) {
+        uint16_t count = n->m_count.load(std::memory_order_relaxed);
+        switch (n->m_type) {
+        case NODE4:
+            return count == 4;
+        case NODE16:
+            return count == 16;
+        case NODE48:
+            return count == 48;
+        default:
+            return false;
+        }
+    }
+
+    // 删除一个孩子之后要换成小一号的节点(Node4 是和唯一的孩子合并)
+    static bool is_underfull(const node* n) {
+        uint16_t count = n->m_count.load(std::memory_order_relaxed);
+        switch (n->m_type) {
+        case NODE4:
+            return count == 2;
+        case NODE16:
+            return count == 4;
+        case NODE48:
+            return count == 13;
+        default:
+            return count == 38;
+        }
+    }
+
+    static node* find_child(const node* n, uint8_t byte) {
+        switch (n->m_type) {
+        case NODE4: {
+            const node4* p = static_cast<const node4*>(n);
+            int count = p->m_count.load(std::memory_order_relaxed);
+            for (int i = 0; i < count && i < 4; ++i) {
+                if (p->m_keys[i].load(std::memory_order_relaxed) == byte)
+                    return p->m_children[i].load(std::memory_order_acquire);
+            }
+            return NULL;
+        }
+        case NODE16: {
+            const node16* p = static_cast<const node16*>(n);
+            int count = p->m_count.load(std::memory_order_relaxed);
+#if defined(RADIX_TREE_SSE2) && !defined(__SANITIZE_THREAD__)
+            // 写者可能同时在移动键，读到的结果由版本号检查(ThreadSanitizer 会把这次整体读取报告为数据竞争)
+            __m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8((char)byte), _mm_loadu_si128(reinterpret_cast<const __m128i*>(p->m_keys)));
+            unsigned mask = (unsigned)_mm_movemask_epi8(cmp) & ((1u << (count & 31)) - 1) & 0xFFFF;
+            return mask != 0 ? p->m_children[radix_ctz(mask)].load(std::memory_order_acquire) : NULL;
+#else
+            for (int i = 0; i < count && i < 16; ++i) {
+                if (p->m_keys[i].load(std::memory_order_relaxed) == byte)
+                    return p->m_children[i].load(std::memory_order_acquire);
+            }
+            return NULL;
+#endif
+        }
+        case NODE48: {
+            const node48* p = static_cast<const node48*>(n);
+            uint8_t index = p->m_index[byte].load(std::memory_order_relaxed);
+            return index != 0 && index <= 48 ? p->m_children[index - 1].load(std::memory_order_acquire) : NULL;
+        }
+        default:
+            return static_cast<const node256*>(n)->m_children[byte].load(std::memory_order_acquire);
+        }
+    }
+
+    // 以下修改节点的函数都由持有 n 的写锁(或者 n 还没有发布)的写者调用
+    static void replace_child(node* n, uint8_t byte, node* child) {
+        switch (n->m_type) {
+        case NODE4: {
+            node4* p = static_cast<node4*>(n);
+            for (int i = 0; i < p->m_count.load(std::memory_order_relaxed); ++i) {
+                if (p->m_keys[i].load(std::memory_order_relaxed) == byte)
+                    p->m_children[i].store(child, std::memory_order_release);
+            }
+            return;
+        }
+        case NODE16: {
+            node16* p = static_cast<node16*>(n);
+            for (int i = 0; i < p->m_count.load(std::memory_order_relaxed); ++i) {
+                if (p->m_keys[i].load(std::memory_order_relaxed) == byte)
+                    p->m_children[i].store(child, std::memory_order_release);
+            }
+            return;
+        }
+        case NODE48: {
+            node48* p = static_cast<node48*>(n);
+            p->m_children[p->m_index[byte].load(std::memory_order_relaxed) - 1].store(child, std::memory_order_release);
+            return;
+        }
+        default:
+            static_cast<node256*>(n)->m_children[byte].store(child, std::memory_order_release);
+            return;
+        }
+    }
+
+    // n 没有满
+    template <class N>
+    static void insert_sorted(N* p, uint8_t byte, node* child) {
+        int count = p->m_count.load(std::memory_order_relaxed);
+        int i = count;
+        while (i > 0 && p->m_keys[i - 1].load(std::memory_order_relaxed) > byte) {
+            p->m_keys[i].store(p->m_keys[i - 1].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            p->m_children[i].store(p->m_children[i - 1].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            --i;
+        }
+        p->m_keys[i].store(byte, std::memory_order_relaxed);
+        p->m_children[i].store(child, std::memory_order_release);
+        p->m_count.store((uint16_t)(count + 1), std::memory_order_relaxed);
+    }
+
+    static void add_child(node* n, uint8_t byte, node* child) {
+        switch (n->m_type) {
+        case NODE4:
+            insert_sorted(static_cast<node4*>(n), byte, child);
+            return;
+        case NODE16:
+            insert_sorted(static_cast<node16*>(n), byte, child);
+            return;
+        case NODE48: {
+            node48* p = static_cast<node48*>(n);
+            int i = 0;
+            while (p->m_children[i].load(std::memory_order_relaxed) != NULL)
+                ++i;
+            p->m_children[i].store(child, std::memory_order_release);
+            p->m_index[byte].store((uint8_t)(i + 1), std::memory_order_release);
+            p->m_count.store((uint16_t)(p->m_count.load(std::memory_order_relaxed) + 1), std::memory_order_relaxed);
+            return;
+        }
+        default: {
+            node256* p = static_cast<node256*>(n);
+            p->m_children[byte].store(child, std::memory_order_release);
+            p->m_count.store((uint16_t)(p->m_count.load(std::memory_order_relaxed) + 1), std::memory_order_relaxed);
+            return;
+        }
+        }
+    }
+
+    template <class N>
+    static void remove_sorted(N* p, uint8_t byte) {
+        int count = p->m_count.load(std::memory_order_relaxed);
+        int i = 0;
+        while (p->m_keys[i].load(std::memory_order_relaxed) != byte)
+            ++i;
+        for (; i + 1 < count; ++i) {
+            p->m_keys[i].store(p->m_keys[i + 1].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            p->m_children[i].store(p->m_children[i + 1].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        p->m_count.store((uint16_t)(count - 1), std::memory_order_relaxed);
+    }
+
+    static void remove_child(node* n, uint8_t byte) {
+        switch (n->m_type) {
+        case NODE4:
+            remove_sorted(static_cast<node4*>(n), byte);
+            return;
+        case NODE16:
+            remove_sorted(static_cast<node16*>(n), byte);
+            return;
+        case NODE48: {
+            node48* p = static_cast<node48*>(n);
+            p->m_children[p->m_index[byte].load(std::memory_order_relaxed) - 1].store(NULL, std::memory_order_relaxed);
+            p->m_index[byte].store(0, std::memory_order_relaxed);
+            p->m_count.store((uint16_t)(p->m_count.load(std::memory_order_relaxed) - 1), std::memory_order_relaxed);
+            return;
+        }
+        default: {
+            node256* p = static_cast<node256*>(n);
+            p->m_children[byte].store(NULL, std::memory_order_relaxed);
+            p->m_count.store((uint16_t)(p->m_count.load(std::memory_order_relaxed) - 1), std::memory_order_relaxed);
+            return;
+        }
+        }
+    }
+
+    // 按键字节从小到大依次交给 fn(byte, child)
+    template <class F>
+    static void for_each_child(const node* n, F fn) {
+        switch (n->m_type) {
+        case NODE4: {
+            const node4* p = static_cast<const node4*>(n);
+            for (int i = 0; i < p->m_count.load(std::memory_order_relaxed); ++i)
+                fn(p->m_keys[i].load(std::memory_order_relaxed), p->m_children[i].load(std::memory_order_relaxed));
+            return;
+        }
+        case NODE16: {
+            const node16* p = static_cast<const node16*>(n);
+            for (int i = 0; i < p->m_count.load(std::memory_order_relaxed); ++i)
+                fn(p->m_keys[i].load(std::memory_order_relaxed), p->m_children[i].load(std::memory_order_relaxed));
+            return;
+        }
+        case NODE48: {
+            const node48* p = static_cast<const node48*>(n);
+            for (int b = 0; b < 256; ++b) {
+                uint8_t index = p->m_index[b].load(std::memory_order_relaxed);
+                if (index != 0)
+                    fn((uint8_t)b, p->m_children[index - 1].load(std::memory_order_relaxed));
+            }
+            return;
+        }
+        default: {
+            const node256* p = static_cast<const node256*>(n);
+            for (int b = 0; b < 256; ++b) {
+                node* child = p->m_children[b].load(std::memory_order_relaxed);
+                if (child != NULL)
+                    fn((uint8_t)b, child);
+            }
+            return;
+        }
+        }
+    }
+
+    // 复制加了写锁的 n 的前缀和孩子(除了 skip)；不加锁时读到的孩子个数可能超过 copy 的容量
+    static void copy_node(node* copy, const node* n, int skip) {
+        copy->m_prefixlen.store(n->m_prefixlen.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        copy->m_prefixkey.store(n->m_prefixkey.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        for_each_child(n, [&](uint8_t byte, node* child) {
+            if (byte != skip)
+                add_child(copy, byte, child);
+        });
+    }
+
+    node* new_node(node_type type) {
+        std::lock_guard<std::mutex> lock(m_pool_mutex);
+        switch (type) {
+        case NODE4:
+            return new (m_node4s.allocate()) node4();
+        case NODE16:
+            return new (m_node16s.allocate()) node16();
+        case NODE48:
+            return new (m_node48s.allocate()) node48();
+        default:
+            return new (m_node256s.allocate()) node256();
+        }
+    }
+
+    // 没有发布过的节点直接放回池中
+    void free_node(node* n) {
+        switch (n->m_type) {
+        case NODE4:
+            m_node4s.deallocate(n);
+            break;
+        case NODE16:
+            m_node16s.deallocate(n);
+            break;
+        case NODE48:
+            m_node48s.deallocate(n);
+            break;
+        default:
+            m_node256s.deallocate(n);
+            break;
+        }
+    }
+
+    void free_unpublished(node* n) {
+        std::lock_guard<std::mutex> lock(m_pool_mutex);
+        free_node(n);
+    }
+
+    void retire(node* n, leaf* l) {
+        std::lock_guard<std::mutex> lock(m_pool_mutex);
+        if (n != NULL) {
+            n->m_next = m_retired_nodes;
+            m_retired_nodes = n;
+            ++m_nretired;
+        }
+        if (l != NULL) {
+            l->m_next = m_retired_leaves;
+            m_retired_leaves = l;
+            ++m_nretired;
+        }
+        if (m_nretired >= 64)
+            try_reclaim();
+    }
+
+    // 持有 m_pool_mutex；纪元为 E 时，E-1 中摘下的节点在登记在 E-1 上的操作都结束之后回收，
+    // 同时才能推进到 E+1，这样登记在 E+1 的奇偶上的操作一定是推进之后开始的
+    void try_reclaim() {
+        uint64_t e = m_epoch.load(std::memory_order_relaxed);
+        int prev = (int)((e - 1) & 1);
+        for (int i = 0; i < EPOCH_STRIPES; ++i) {
+            if (m_stripes[i].m_active[prev].load() != 0)
+                return;
+        }
+        while (m_waiting_nodes != NULL) {
+            node* next = m_waiting_nodes->m_next;
+            free_node(m_waiting_nodes);
+            m_waiting_nodes = next;
+        }
+        while (m_waiting_leaves != NULL) {
+            leaf* next = m_waiting_leaves->m_next;
+            m_leaves.deallocate(m_waiting_leaves);
+            m_waiting_leaves = next;
+        }
+        if (m_retired_nodes != NULL || m_retired_leaves != NULL) {
+            m_waiting_nodes = m_retired_nodes;
+            m_waiting_leaves = m_retired_leaves;
+            m_retired_nodes = NULL;
+            m_retired_leaves = NULL;
+            m_nretired = 0;
+            m_epoch.store(e + 1);
+        }
+    }
+
+    // 返回 false 表示读到的内容不一致，要从根重新开始
+    bool lookup(K key, T& value) const {
+        const node* n = &m_root;
+        uint64_t v;
+        if (!read_lock(n, v))
+            return false;
+        int depth = 0;
+        while (true) {
+            int plen = n->m_prefixlen.load(std::memory_order_relaxed);
+            if (plen != 0) {
+                if (depth + plen >= KEY_BYTES)
+                    return false;
+                K pkey = n->m_prefixkey.load(std::memory_order_relaxed);
+                if (((key ^ pkey) >> (8 * (KEY_BYTES - depth - plen))) != 0) {
+                    value = T();
+                    return validate(n, v);
+                }
+                depth += plen;
+            }
+            node* child = find_child(n, key_byte(key, depth));
+            if (!validate(n, v))
+                return false;
+            if (child == NULL) {
+                value = T();
+                return true;
+            }
+            if (is_leaf(child)) {
+                // 叶子的键不会变，值是原子变量；叶子被删除后在回收之前仍然可以读
+                leaf* l = as_leaf(child);
+                value = l->m_key == key ? l->m_value.load(std::memory_order_acquire) : T();
+                return true;
+            }
+            const node* parent = n;
+            uint64_t pv = v;
+            n = child;
+            ++depth;
+            if (depth >= KEY_BYTES || !read_lock(n, v) || !validate(parent, pv))
+                return false;
+        }
+    }
+
+    bool try_set(K key, T value, leaf*& spare) {
+        if (spare == NULL) {
+            std::lock_guard<std::mutex> lock(m_pool_mutex);
+            spare = new (m_leaves.allocate()) leaf(key, value);
+        }
+        node* n = &m_root;
+        uint64_t v;
+        if (!read_lock(n, v))
+            return false;
+        node* parent = NULL;
+        uint64_t pv = 0;
+        uint8_t pbyte = 0;
+        int depth = 0;
+        while (true) {
+            int plen = n->m_prefixlen.load(std::memory_order_relaxed);
+            if (plen != 0) {
+                if (depth + plen >= KEY_BYTES)
+                    return false;
+                K pkey = n->m_prefixkey.load(std::memory_order_relaxed);
+                int p = prefix_match(pkey, plen, key, depth);
+                if (p != plen) {
+                    // 在前缀中间分叉：新的 Node4 取前面相同的部分，n 保留分叉之后的部分
+                    if (!validate(n, v))
+                        return false;
+                    node* split = new_node(NODE4);
+                    split->m_prefixlen.store((uint8_t)p, std::memory_order_relaxed);
+                    split->m_prefixkey.store(key, std::memory_order_relaxed);
+                    add_child(split, key_byte(pkey, depth + p), n);
+                    add_child(split, key_byte(key, depth + p), leaf_ref(spare));
+                    if (!upgrade(parent, pv)) {
+                        free_unpublished(split);
+                        return false;
+                    }
+                    if (!upgrade(n, v)) {
+                        write_unlock(parent);
+                        free_unpublished(split);
+                        return false;
+                    }
+                    n->m_prefixlen.store((uint8_t)(plen - p - 1), std::memory_order_relaxed);
+                    replace_child(parent, pbyte, split);
+                    write_unlock(n);
+                    write_unlock(parent);
+                    spare = NULL;
+                    m_size.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                }
+                depth += plen;
+            }
+
+            uint8_t byte = key_byte(key, depth);
+            node* child = find_child(n, byte);
+            if (!validate(n, v))
+                return false;
+
+            if (child == NULL) {
+                if (!is_full(n)) {
+                    if (!upgrade(n, v))
+                        return false;
+                    add_child(n, byte, leaf_ref(spare));
+                    write_unlock(n);
+                } else {
+                    // 换成大一号的节点，旧节点废弃；先申请，加锁之后再复制
+                    node* grown = new_node(n->m_type == NODE4 ? NODE16 : n->m_type == NODE16 ? NODE48 : NODE256);
+                    if (!upgrade(parent, pv)) {
+                        free_unpublished(grown);
+                        return false;
+                    }
+                    if (!upgrade(n, v)) {
+                        write_unlock(parent);
+                        free_unpublished(grown);
+                        return false;
+                    }
+                    copy_node(grown, n, -1);
+                    add_child(grown, byte, leaf_ref(spare));
+                    replace_child(parent, pbyte, grown);
+                    write_unlock(parent);
+                    write_unlock_obsolete(n);
+                    retire(n, NULL);
+                }
+                spare = NULL;
+                m_size.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+
+            if (is_leaf(child)) {
+                leaf* l = as_leaf(child);
+                if (l->m_key == key) {
+                    // 加锁和删除互斥，修改之后叶子仍在树上
+                    if (!upgrade(n, v))
+                        return false;
+                    l->m_value.store(value, std::memory_order_release);
+                    write_unlock(n);
+                    return true;
+                }
+                // 两个键在下一层之后第一个不同的字节处分叉
+                K other = l->m_key;
+                int p = 0;
+                while (depth + 1 + p < KEY_BYTES - 1 && key_byte(key, depth + 1 + p) == key_byte(other, depth + 1 + p))
+                    ++p;
+                node* split = new_node(NODE4);
+                split->m_prefixlen.store((uint8_t)p, std::memory_order_relaxed);
+                split->m_prefixkey.store(key, std::memory_order_relaxed);
+                add_child(split, key_byte(other, depth + 1 + p), child);
+                add_child(split, key_byte(key, depth + 1 + p), leaf_ref(spare));
+                if (!upgrade(n, v)) {
+                    free_unpublished(split);
+                    return false;
+                }
+                replace_child(n, byte, split);
+                write_unlock(n);
+                spare = NULL;
+                m_size.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+
+            parent = n;
+            pv = v;
+            pbyte = byte;
+            n = child;
+            ++depth;
+            if (depth >= KEY_BYTES || !read_lock(n, v) || !validate(parent, pv))
+                return false;
+        }
+    }
+
+    // 返回 1 删除了，0 没有这个键，-1 要重新开始
+    int try_erase(K key) {
+        node* n = &m_root;
+        uint64_t v;
+        if (!read_lock(n, v))
+            return -1;
+        node* parent = NULL;
+        uint64_t pv = 0;
+        uint8_t pbyte = 0;
+        int depth = 0;
+        while (true) {
+            int plen = n->m_prefixlen.load(std::memory_order_relaxed);
+            if (plen != 0) {
+                if (depth + plen >= KEY_BYTES)
+                    return -1;
+                K pkey = n->m_prefixkey.load(std::memory_order_relaxed);
+                if (((key ^ pkey) >> (8 * (KEY_BYTES - depth - plen))) != 0)
+                    return validate(n, v) ? 0 : -1;
+                depth += plen;
+            }
+
+            uint8_t byte = key_byte(key, depth);
+            node* child = find_child(n, byte);
+            if (!validate(n, v))
+                return -1;
+            if (child == NULL)
+                return 0;
+
+            if (is_leaf(child)) {
+                leaf* l = as_leaf(child);
+                if (l->m_key != key)
+                    return 0;
+
+                if (parent == NULL || !is_underfull(n)) {
+                    if (!upgrade(n, v))
+                        return -1;
+                    remove_child(n, byte);
+                    write_unlock(n);
+                    retire(NULL, l);
+                } else if (n->m_type == NODE4) {
+                    // 只剩一个孩子：孩子直接挂到父节点上，孩子的前缀 = n 的前缀 + 键字节 + 孩子原来的前缀
+                    if (!upgrade(parent, pv))
+                        return -1;
+                    if (!upgrade(n, v)) {
+                        write_unlock(parent);
+                        return -1;
+                    }
+                    node* other = NULL;
+                    uint8_t otherbyte = 0;
+                    for_each_child(n, [&](uint8_t b, node* c) {
+                        if (b != byte) {
+                            other = c;
+                            otherbyte = b;
+                        }
+                    });
+                    (void)otherbyte;
+                    if (!is_leaf(other)) {
+                        uint64_t ov;
+                        if (!read_lock(other, ov) || !upgrade(other, ov)) {
+                            write_unlock(n);
+                            write_unlock(parent);
+                            return -1;
+                        }
+                        other->m_prefixlen.store((uint8_t)(n->m_prefixlen.load(std::memory_order_relaxed) + 1 + other->m_prefixlen.load(std::memory_order_relaxed)), std::memory_order_relaxed);
+                        write_unlock(other);
+                    }
+                    replace_child(parent, pbyte, other);
+                    write_unlock(parent);
+                    write_unlock_obsolete(n);
+                    retire(n, l);
+                } else {
+                    // 换成小一号的节点
+                    node* shrunk = new_node(n->m_type == NODE16 ? NODE4 : n->m_type == NODE48 ? NODE16 : NODE48);
+                    if (!upgrade(parent, pv)) {
+                        free_unpublished(shrunk);
+                        return -1;
+                    }
+                    if (!upgrade(n, v)) {
+                        write_unlock(parent);
+                        free_unpublished(shrunk);
+                        return -1;
+                    }
+                    copy_node(shrunk, n, byte);
+                    replace_child(parent, pbyte, shrunk);
+                    write_unlock(parent);
+                    write_unlock_obsolete(n);
+                    retire(n, l);
+                }
+                m_size.fetch_sub(1, std::memory_order_relaxed);
+                return 1;
+            }
+
+            parent = n;
+            pv = v;
+            pbyte = byte;
+            n = child;
+            ++depth;
+            if (depth >= KEY_BYTES || !read_lock(n, v) || !validate(parent, pv))
+                return -1;
+        }
+    }
+
+    node256 m_root;
+    std::atomic<size_type> m_size;
+    mutable epoch_stripe m_stripes[EPOCH_STRIPES];
+    std::atomic<uint64_t> m_epoch;
+
+    // 以下由 m_pool_mutex 保护
+    std::mutex m_pool_mutex;
+    node* m_retired_nodes; // 当前纪元中摘下的
+    leaf* m_retired_leaves;
+    node* m_waiting_nodes; // 上一个纪元中摘下的，等登记在上一个纪元的操作结束
+    leaf* m_waiting_leaves;
+    std::size_t m_nretired;
+    radix_node_pool<sizeof(leaf)> m_leaves;
+    radix_node_pool<sizeof(node4)> m_node4s;
+    radix_node_pool<sizeof(node16)> m_node16s;
+    radix_node_pool<sizeof(node48)> m_node48s;
+    radix_node_pool<sizeof(node256)> m_node256s;
+
+    concurrent_radix_tree(const concurrent_radix_tree&); // delete
+    concurrent_radix_tree& operator=(const concurrent_radix_tree&); // delete
+};
+
+#endif // CONCURRENT_RADIX_TREE_HPP
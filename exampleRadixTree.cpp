@@ -1,114 +1,209 @@
-#include <string>
-#include <iostream>
-#include <cstdlib>
+// 使用 PageMap.h 中页号到键的转换(PageId2Key)
+#define USE_RADIX_TREE
 
+#include "PageMap.h"
 #include "radix_tree.hpp"
 
-radix_tree<std::string, int> tree;
-radix_tree<std::vector<uint8_t>,int> tree1;
-
-
-void insert() {
-    tree["apache"]    = 0;
-    tree["afford"]    = 1;
-    tree["available"] = 2;
-    tree["affair"]    = 3;
-    tree["avenger"]   = 4;
-    tree["binary"]    = 5;
-    tree["bind"]      = 6;
-    tree["brother"]   = 7;
-    tree["brace"]     = 8;
-    tree["blind"]     = 9;
-    tree["bro"]       = 10;
-
-    tree1[{0,0,0,0}]      = 1;
-    tree1[{1,1,1,1}]      = 2;
-    tree1[{2,2,2,2}]      = 3;
-    tree1[{3,3,3,3}]      = 4;
-    tree1[{4,4,4,4}]      = 5;
-    tree1[{5,5,5,5}]      = 6;
-}
-
-void longest_match(std::string key)
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <string>
+#include <unordered_map>
+
+// radix_tree 和 std::map、std::unordered_map 的对比
+// 键集合：
+//     page    页号转成的十进制字符串(RadixTreePageMap<std::string> 的键)，页号分布和 pagemap_bench 的 dense 相同
+//     nibble  页号每4位一个字节的数组(RadixTreePageMap<std::vector<uint8_t>> 的键)
+//     int     页号本身，radix_tree 使用整数键的自适应基数树(IntRadixTreePageMap)
+//     word    随机的小写单词，长度4到16，前缀从几百个公共前缀中选取
+// 每种容器测：插入、查找存在的键、查找不存在的键、删除，输出每次操作的纳秒数；radix_tree 再测 prefix_match 和 longest_match
+// 用法：radix_tree_bench [键的个数，默认100000]
+
+struct KeyRandom
 {
-    radix_tree<std::string, int>::iterator it;
+	uint64_t _state;
 
-    it = tree.longest_match(key);
+	explicit KeyRandom(uint64_t seed) : _state(seed * 0x9E3779B97F4A7C15ull + 1) {}
 
-    std::cout << "longest_match(\"" << key << "\"):" << std::endl;
+	uint64_t Next()
+	{
+		_state ^= _state << 13;
+		_state ^= _state >> 7;
+		_state ^= _state << 17;
+		return _state;
+	}
+};
 
-    if (it != tree.end()) {
-        std::cout << "    " << it->first << ", " << it->second << std::endl;
-    } else {
-        std::cout << "    failed" << std::endl;
-    }
+// std::unordered_map 的 std::vector<uint8_t> 键
+struct NibbleHash
+{
+	size_t operator()(const std::vector<uint8_t>& key) const
+	{
+		uint64_t h = 14695981039346656037ull;
+		for (uint8_t c : key)
+			h = (h ^ c) * 1099511628211ull;
+		return (size_t)h;
+	}
+};
+
+// 连续增长的堆中的页号，keys 是前 n 个，misses 是紧接着的 n 个(不在容器中，前缀大多相同)
+static void PageIds(size_t n, std::vector<PageID>& keys, std::vector<PageID>& misses)
+{
+	KeyRandom rng(1);
+	PageID id = (PageID)0x7f0000000000 >> PAGE_SHIFT;
+	for (size_t i = 0; i < 2 * n; ++i)
+	{
+		(i < n ? keys : misses).push_back(id);
+		id += 1 + rng.Next() % 4;
+	}
+	for (size_t i = keys.size(); i > 1; --i)
+		std::swap(keys[i - 1], keys[rng.Next() % i]);
 }
 
-void prefix_match(std::string key)
+static void Words(size_t n, std::vector<std::string>& keys, std::vector<std::string>& misses)
 {
-    std::vector<radix_tree<std::string, int>::iterator> vec;
-    std::vector<radix_tree<std::string, int>::iterator>::iterator it;
-
-    tree.prefix_match(key, vec);
-
-    std::cout << "prefix_match(\"" << key << "\"):" << std::endl;
-
-    for (it = vec.begin(); it != vec.end(); ++it) {
-        std::cout << "    " << (*it)->first << ", " << (*it)->second << std::endl;
-    }
+	KeyRandom rng(2);
+	std::vector<std::string> prefixes(256);
+	for (std::string& p : prefixes)
+	{
+		size_t len = 2 + rng.Next() % 4;
+		for (size_t i = 0; i < len; ++i)
+			p.push_back((char)('a' + rng.Next() % 26));
+	}
+	std::unordered_map<std::string, bool> seen;
+	while (keys.size() + misses.size() < 2 * n)
+	{
+		std::string word = prefixes[rng.Next() % prefixes.size()];
+		size_t len = 4 + rng.Next() % 13;
+		while (word.size() < len)
+			word.push_back((char)('a' + rng.Next() % 26));
+		if (seen.emplace(word, true).second)
+			(keys.size() < n ? keys : misses).push_back(word);
+	}
 }
 
-void greedy_match(std::string key)
+struct ContainerResult
 {
-    std::vector<radix_tree<std::string, int>::iterator> vec;
-    std::vector<radix_tree<std::string, int>::iterator>::iterator it;
+	double _insert = 0;
+	double _hit = 0;
+	double _miss = 0;
+	double _erase = 0;
+};
 
-    tree.greedy_match(key, vec);
+static double NsSince(std::chrono::steady_clock::time_point begin, size_t n)
+{
+	double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+	return n == 0 ? 0.0 : ns / n;
+}
 
-    std::cout << "greedy_match(\"" << key << "\"):" << std::endl;
+static size_t bench_sink = 0;
 
-    for (it = vec.begin(); it != vec.end(); ++it) {
-        std::cout << "    " << (*it)->first << ", " << (*it)->second << std::endl;
-    }
+template<class Container, class K>
+static ContainerResult RunContainer(const std::vector<K>& keys, const std::vector<K>& misses)
+{
+	ContainerResult result;
+	Container c;
+
+	auto begin = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < keys.size(); ++i)
+		c[keys[i]] = (int)i;
+	result._insert = NsSince(begin, keys.size());
+
+	size_t found = 0;
+	begin = std::chrono::steady_clock::now();
+	for (const K& key : keys)
+		found += c.find(key) != c.end();
+	result._hit = NsSince(begin, keys.size());
+
+	begin = std::chrono::steady_clock::now();
+	for (const K& key : misses)
+		found += c.find(key) != c.end();
+	result._miss = NsSince(begin, misses.size());
+
+	begin = std::chrono::steady_clock::now();
+	for (const K& key : keys)
+		c.erase(key);
+	result._erase = NsSince(begin, keys.size());
+
+	bench_sink += found + c.size();
+	return result;
 }
 
-void traverse() {
-    radix_tree<std::string, int>::iterator it;
-
-    std::cout << "traverse:" << std::endl;
-    for (it = tree.begin(); it != tree.end(); ++it) {
-        std::cout << "    " << it->first << ", " << it->second << std::endl;
-    }
-    radix_tree<std::vector<uint8_t>,int>::iterator it1;
-    for(it1 = tree1.begin(); it1 != tree1.end(); ++it1)
-    {
-        for(uint8_t elem:it1->first) 
-            std::cout<<static_cast<int>(elem)<<' ';
-        std::cout<<"\t\t\t\t\t\t, "<<it1->second<<std::endl;
-    }
+static void PrintRow(const char* keyset, const char* container, const ContainerResult& r)
+{
+	printf("%-7s %-15s | %9.1f %9.1f %9.1f %9.1f\n", keyset, container, r._insert, r._hit, r._miss, r._erase);
+	fflush(stdout);
 }
 
-int main()
+// radix_tree 特有的前缀查找，每个键取前一半作为前缀
+static void RunMatches(const std::vector<std::string>& keys)
 {
-    insert();
-
-    longest_match("binder");
-    longest_match("bracelet");
-    longest_match("apple");
-
-    prefix_match("aff");
-    prefix_match("bi");
-    prefix_match("a");
-
-    greedy_match("avoid");
-    greedy_match("bring");
-    greedy_match("attack");
-
-    traverse();
-
-    //tree.erase("bro");
-    prefix_match("bro");
-
+	radix_tree<std::string, int> tree;
+	for (size_t i = 0; i < keys.size(); ++i)
+		tree[keys[i]] = (int)i;
+
+	size_t nquery = keys.size() < 10000 ? keys.size() : 10000;
+	std::vector<radix_tree<std::string, int>::iterator> vec;
+	size_t matched = 0;
+	auto begin = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < nquery; ++i)
+	{
+		tree.prefix_match(keys[i].substr(0, keys[i].size() / 2 + 1), vec);
+		matched += vec.size();
+	}
+	double prefix = NsSince(begin, nquery);
+	double results = nquery == 0 ? 0.0 : (double)matched / nquery;
+
+	begin = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < nquery; ++i)
+		matched += tree.longest_match(keys[i] + "zz") != tree.end();
+	double longest = NsSince(begin, nquery);
+
+	printf("word    radix_tree      | prefix_match %.1f ns (%.1f results)  longest_match %.1f ns\n",
+		prefix, results, longest);
+	bench_sink += matched;
+}
 
-    return EXIT_SUCCESS;
+int main(int argc, char* argv[])
+{
+	size_t n = argc > 1 ? strtoul(argv[1], nullptr, 10) : 100000;
+	if (n == 0)
+		n = 1;
+
+	std::vector<PageID> pagekeys, pagemisses;
+	PageIds(n, pagekeys, pagemisses);
+	std::vector<std::string> strkeys, strmisses;
+	for (PageID id : pagekeys)
+		strkeys.push_back(PageId2Key<std::string>(id));
+	for (PageID id : pagemisses)
+		strmisses.push_back(PageId2Key<std::string>(id));
+	std::vector<std::vector<uint8_t>> nibkeys, nibmisses;
+	for (PageID id : pagekeys)
+		nibkeys.push_back(PageId2Key<std::vector<uint8_t>>(id));
+	for (PageID id : pagemisses)
+		nibmisses.push_back(PageId2Key<std::vector<uint8_t>>(id));
+	std::vector<std::string> words, wordmisses;
+	Words(n, words, wordmisses);
+
+	printf("keys: %zu\n", n);
+	printf("%-7s %-15s | %9s %9s %9s %9s\n", "keys", "container", "insert", "hit", "miss", "erase");
+
+	PrintRow("page", "radix_tree", RunContainer<radix_tree<std::string, int>>(strkeys, strmisses));
+	PrintRow("page", "map", RunContainer<std::map<std::string, int>>(strkeys, strmisses));
+	PrintRow("page", "unordered_map", RunContainer<std::unordered_map<std::string, int>>(strkeys, strmisses));
+
+	PrintRow("nibble", "radix_tree", RunContainer<radix_tree<std::vector<uint8_t>, int>>(nibkeys, nibmisses));
+	PrintRow("nibble", "map", RunContainer<std::map<std::vector<uint8_t>, int>>(nibkeys, nibmisses));
+	PrintRow("nibble", "unordered_map", RunContainer<std::unordered_map<std::vector<uint8_t>, int, NibbleHash>>(nibkeys, nibmisses));
+
+	PrintRow("int", "radix_tree", RunContainer<radix_tree<PageID, int>>(pagekeys, pagemisses));
+	PrintRow("int", "map", RunContainer<std::map<PageID, int>>(pagekeys, pagemisses));
+	PrintRow("int", "unordered_map", RunContainer<std::unordered_map<PageID, int>>(pagekeys, pagemisses));
+
+	PrintRow("word", "radix_tree", RunContainer<radix_tree<std::string, int>>(words, wordmisses));
+	PrintRow("word", "map", RunContainer<std::map<std::string, int>>(words, wordmisses));
+	PrintRow("word", "unordered_map", RunContainer<std::unordered_map<std::string, int>>(words, wordmisses));
+	RunMatches(words);
+
+	return bench_sink == 1 ? 1 : 0;
 }
@@ -8,6 +8,22 @@
 #include <vector>
 #include <iterator>
 #include <functional>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <type_traits>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <intrin.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define RADIX_TREE_SSE2
+#endif
 
 // -------------------------------------------------
 // help function
@@ -743,6 +759,796 @@ radix_tree_node<K, T, Compare>* radix_tree<K, T, Compare>::find_node(const K &ke
     return node; 
 }
 
+// --------------------------------------------------------------------------------------------------
+// 整数键的自适应基数树(ART)
+// --------------------------------------------------------------------------------------------------
+// radix_tree<无符号整数, T> 使用下面的 radix_int_tree：键按大端字节逐层查找，每层一个字节
+// 内部节点按孩子个数在 Node4/Node16/Node48/Node256 之间伸缩，Node16 用 SSE2 一次比较16个键字节
+// 路径压缩：只有一个孩子的各层合并到节点中，节点只记录压缩的层数和子树中任意一个键，前缀就是这个键在对应层的字节，
+// 查找时一次异或、移位比较整个前缀；节点分裂、合并只改层数，不复制键
+// 惰性展开：只有一个键的子树直接是叶子，叶子保存完整的键值对
+// 节点和叶子从 radix_node_pool 申请，内存直接向系统要(mmap/VirtualAlloc)，不调用 new/malloc，可以用在内存池内部
+// 查找不申请内存，只读路径上的几个节点；键按从小到大的顺序遍历
+
+inline void* radix_system_alloc(std::size_t bytes)
+{
+#ifdef _WIN32
+    return VirtualAlloc(0, bytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+    void* ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return ptr == MAP_FAILED ? NULL : ptr;
+#endif
+}
+
+inline void radix_system_free(void* ptr, std::size_t bytes)
+{
+#ifdef _WIN32
+    (void)bytes;
+    VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+    munmap(ptr, bytes);
+#endif
+}
+
+// 最低的1位的位置，x 不为0
+inline int radix_ctz(unsigned x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(x);
+#elif defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, x);
+    return (int)index;
+#else
+    int n = 0;
+    while ((x & 1) == 0) {
+        x >>= 1;
+        ++n;
+    }
+    return n;
+#endif
+}
+
+// 定长对象池：按 64KB 的块向系统申请，释放的对象挂在空闲链表上，clear 时整块归还
+template <std::size_t SIZE>
+class radix_node_pool {
+public:
+    constexpr radix_node_pool() : m_free(NULL), m_chunks(NULL), m_cur(NULL), m_left(0) { }
+    ~radix_node_pool() {
+        clear();
+    }
+
+    void* allocate() {
+        if (m_free != NULL) {
+            void* ptr = m_free;
+            m_free = *static_cast<void**>(ptr);
+            return ptr;
+        }
+        if (m_left == 0) {
+            char* chunk = static_cast<char*>(radix_system_alloc(CHUNK_BYTES));
+            if (chunk == NULL)
+                throw std::bad_alloc();
+            *reinterpret_cast<char**>(chunk) = m_chunks; // 块的开头链接所有块
+            m_chunks = chunk;
+            m_cur = chunk + CHUNK_HEADER;
+            m_left = (CHUNK_BYTES - CHUNK_HEADER) / OBJECT_BYTES;
+        }
+        void* ptr = m_cur;
+        m_cur += OBJECT_BYTES;
+        --m_left;
+        return ptr;
+    }
+
+    void deallocate(void* ptr) {
+        *static_cast<void**>(ptr) = m_free;
+        m_free = ptr;
+    }
+
+    void clear() {
+        while (m_chunks != NULL) {
+            char* next = *reinterpret_cast<char**>(m_chunks);
+            radix_system_free(m_chunks, CHUNK_BYTES);
+            m_chunks = next;
+        }
+        m_free = NULL;
+        m_cur = NULL;
+        m_left = 0;
+    }
+
+private:
+    static const std::size_t OBJECT_BYTES = (SIZE + 15) & ~(std::size_t)15; // 16字节对齐，最低位可以做标记
+    static const std::size_t CHUNK_HEADER = 64;
+    static const std::size_t CHUNK_BYTES = OBJECT_BYTES * 8 + CHUNK_HEADER > 64 * 1024 ? OBJECT_BYTES * 8 + CHUNK_HEADER : 64 * 1024;
+
+    void* m_free;
+    char* m_chunks;
+    char* m_cur;
+    std::size_t m_left; // 当前块中还没有用过的对象个数
+
+    radix_node_pool(const radix_node_pool&); // delete
+    radix_node_pool& operator=(const radix_node_pool&); // delete
+};
+
+template <typename K, typename T>
+class radix_int_tree {
+    static_assert(std::is_integral<K>::value && std::is_unsigned<K>::value, "radix_int_tree needs an unsigned integer key");
+    static_assert(alignof(T) <= 16, "radix_int_tree leaves are 16-byte aligned");
+
+public:
+    typedef K key_type;
+    typedef T mapped_type;
+    typedef std::pair<const K, T> value_type;
+    typedef std::size_t size_type;
+
+private:
+    static const int KEY_BYTES = sizeof(K);
+
+    enum node_type { NODE4, NODE16, NODE48, NODE256 };
+
+    // 孩子指针的最低位为1时指向叶子
+    struct node {
+        uint8_t m_type;
+        uint8_t m_prefixlen; // 压缩掉的层数
+        uint16_t m_count; // 孩子个数
+        K m_prefixkey; // 子树中的任意一个键，压缩掉的各层就是它在这些层的字节
+    };
+
+    // Node4/Node16 的键字节有序，孩子和键一一对应
+    struct node4 : node {
+        uint8_t m_keys[4];
+        node* m_children[4];
+    };
+
+    struct node16 : node {
+        uint8_t m_keys[16];
+        node* m_children[16];
+    };
+
+    // m_index[键字节] 是孩子的下标加1，0表示没有
+    struct node48 : node {
+        uint8_t m_index[256];
+        node* m_children[48];
+    };
+
+    struct node256 : node {
+        node* m_children[256];
+    };
+
+    struct leaf {
+        value_type m_value;
+    };
+
+public:
+    // 前向迭代器，按键从小到大；++ 从根重新查找下一个键，不保存路径
+    class iterator {
+        friend class radix_int_tree<K, T>;
+    public:
+        iterator() : m_tree(NULL), m_leaf(NULL) { }
+
+        value_type& operator* () const {
+            return m_leaf->m_value;
+        }
+        value_type* operator-> () const {
+            return &m_leaf->m_value;
+        }
+        iterator& operator++ () {
+            m_leaf = m_tree->bound(m_tree->m_root, m_leaf->m_value.first, 0, true);
+            return *this;
+        }
+        iterator operator++ (int) {
+            iterator copy(*this);
+            ++*this;
+            return copy;
+        }
+        bool operator== (const iterator& rhs) const {
+            return m_leaf == rhs.m_leaf;
+        }
+        bool operator!= (const iterator& rhs) const {
+            return m_leaf != rhs.m_leaf;
+        }
+
+    private:
+        iterator(const radix_int_tree* tree, leaf* l) : m_tree(tree), m_leaf(l) { }
+
+        const radix_int_tree* m_tree;
+        leaf* m_leaf;
+    };
+
+    constexpr radix_int_tree() : m_root(NULL), m_size(0) { }
+    ~radix_int_tree() {
+        clear();
+    }
+
+    size_type size() const {
+        return m_size;
+    }
+    bool empty() const {
+        return m_size == 0;
+    }
+
+    void clear() {
+        if (!std::is_trivially_destructible<T>::value && m_root != NULL)
+            destroy_values(m_root);
+        m_root = NULL;
+        m_size = 0;
+        m_leaves.clear();
+        m_node4s.clear();
+        m_node16s.clear();
+        m_node48s.clear();
+        m_node256s.clear();
+    }
+
+    iterator find(K key) const {
+        return iterator(this, find_leaf(key));
+    }
+    // 第一个不小于 key 的键
+    iterator lower_bound(K key) const {
+        return iterator(this, m_root == NULL ? NULL : bound(m_root, key, 0, false));
+    }
+    // 第一个大于 key 的键
+    iterator upper_bound(K key) const {
+        return iterator(this, m_root == NULL ? NULL : bound(m_root, key, 0, true));
+    }
+    iterator begin() const {
+        return iterator(this, m_root == NULL ? NULL : minimum(m_root));
+    }
+    iterator end() const {
+        return iterator(this, NULL);
+    }
+
+    std::pair<iterator, bool> insert(const value_type& val);
+    bool erase(K key);
+    void erase(iterator it) {
+        erase(it->first);
+    }
+
+    T& operator[] (K key) {
+        leaf* l = find_leaf(key);
+        if (l == NULL)
+            l = insert(value_type(key, T())).first.m_leaf;
+        return l->m_value.second;
+    }
+
+private:
+    static uint8_t key_byte(K key, int depth) {
+        return (uint8_t)(key >> (8 * (KEY_BYTES - 1 - depth)));
+    }
+
+    static bool is_leaf(const node* n) {
+        return ((uintptr_t)n & 1) != 0;
+    }
+    static leaf* as_leaf(const node* n) {
+        return reinterpret_cast<leaf*>((uintptr_t)n & ~(uintptr_t)1);
+    }
+    static node* leaf_ref(leaf* l) {
+        return reinterpret_cast<node*>((uintptr_t)l | 1);
+    }
+
+    // 节点从 depth 层开始，前缀和键从 depth 开始的字节有几个相同
+    static int prefix_match(const node* n, K key, int depth) {
+        int i = 0;
+        while (i < n->m_prefixlen && key_byte(n->m_prefixkey, depth + i) == key_byte(key, depth + i))
+            ++i;
+        return i;
+    }
+    // 键和整个前缀相同；depth 之前的字节已经比较过，前缀不为空
+    static bool prefix_equal(const node* n, K key, int depth) {
+        return ((key ^ n->m_prefixkey) >> (8 * (KEY_BYTES - depth - n->m_prefixlen))) == 0;
+    }
+
+    leaf* find_leaf(K key) const;
+    leaf* minimum(const node* n) const;
+    leaf* bound(const node* n, K key, int depth, bool strict) const;
+    static node* const* find_child(const node* n, uint8_t byte);
+    static node* next_child(const node* n, int from, int* byte);
+
+    node* new_node(node_type type);
+    void free_node(node* n);
+    void add_child(node** ref, node* n, uint8_t byte, node* child);
+    void remove_child(node** ref, node* n, uint8_t byte);
+    void destroy_values(node* n);
+
+    node* m_root;
+    size_type m_size;
+    radix_node_pool<sizeof(leaf)> m_leaves;
+    radix_node_pool<sizeof(node4)> m_node4s;
+    radix_node_pool<sizeof(node16)> m_node16s;
+    radix_node_pool<sizeof(node48)> m_node48s;
+    radix_node_pool<sizeof(node256)> m_node256s;
+
+    radix_int_tree(const radix_int_tree&); // delete
+    radix_int_tree& operator=(const radix_int_tree&); // delete
+};
+
+template <typename K, typename T>
+typename radix_int_tree<K, T>::node* const* radix_int_tree<K, T>::find_child(const node* n, uint8_t byte)
+{
+    switch (n->m_type) {
+    case NODE4: {
+        const node4* p = static_cast<const node4*>(n);
+        for (int i = 0; i < p->m_count; ++i) {
+            if (p->m_keys[i] == byte)
+                return &p->m_children[i];
+        }
+        return NULL;
+    }
+    case NODE16: {
+        const node16* p = static_cast<const node16*>(n);
+#ifdef RADIX_TREE_SSE2
+        __m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8((char)byte), _mm_loadu_si128(reinterpret_cast<const __m128i*>(p->m_keys)));
+        unsigned mask = (unsigned)_mm_movemask_epi8(cmp) & ((1u << p->m_count) - 1);
+        return mask != 0 ? &p->m_children[radix_ctz(mask)] : NULL;
+#else
+        for (int i = 0; i < p->m_count; ++i) {
+            if (p->m_keys[i] == byte)
+                return &p->m_children[i];
+        }
+        return NULL;
+#endif
+    }
+    case NODE48: {
+        const node48* p = static_cast<const node48*>(n);
+        return p->m_index[byte] != 0 ? &p->m_children[p->m_index[byte] - 1] : NULL;
+    }
+    default: {
+        const node256* p = static_cast<const node256*>(n);
+        return p->m_children[byte] != NULL ? &p->m_children[byte] : NULL;
+    }
+    }
+}
+
+// 键字节不小于 from 的第一个孩子，键字节写到 *byte；没有时返回 NULL
+template <typename K, typename T>
+typename radix_int_tree<K, T>::node* radix_int_tree<K, T>::next_child(const node* n, int from, int* byte)
+{
+    switch (n->m_type) {
+    case NODE4: {
+        const node4* p = static_cast<const node4*>(n);
+        for (int i = 0; i < p->m_count; ++i) {
+            if (p->m_keys[i] >= from) {
+                *byte = p->m_keys[i];
+                return p->m_children[i];
+            }
+        }
+        return NULL;
+    }
+    case NODE16: {
+        const node16* p = static_cast<const node16*>(n);
+        for (int i = 0; i < p->m_count; ++i) {
+            if (p->m_keys[i] >= from) {
+                *byte = p->m_keys[i];
+                return p->m_children[i];
+            }
+        }
+        return NULL;
+    }
+    case NODE48: {
+        const node48* p = static_cast<const node48*>(n);
+        for (int b = from; b < 256; ++b) {
+            if (p->m_index[b] != 0) {
+                *byte = b;
+                return p->m_children[p->m_index[b] - 1];
+            }
+        }
+        return NULL;
+    }
+    default: {
+        const node256* p = static_cast<const node256*>(n);
+        for (int b = from; b < 256; ++b) {
+            if (p->m_children[b] != NULL) {
+                *byte = b;
+                return p->m_children[b];
+            }
+        }
+        return NULL;
+    }
+    }
+}
+
+template <typename K, typename T>
+typename radix_int_tree<K, T>::leaf* radix_int_tree<K, T>::find_leaf(K key) const
+{
+    const node* n = m_root;
+    int depth = 0;
+    while (n != NULL) {
+        if (is_leaf(n)) {
+            leaf* l = as_leaf(n);
+            return l->m_value.first == key ? l : NULL;
+        }
+        if (n->m_prefixlen != 0) {
+            if (!prefix_equal(n, key, depth))
+                return NULL;
+            depth += n->m_prefixlen;
+        }
+        node* const* child = find_child(n, key_byte(key, depth));
+        if (child == NULL)
+            return NULL;
+        n = *child;
+        ++depth;
+    }
+    return NULL;
+}
+
+template <typename K, typename T>
+typename radix_int_tree<K, T>::leaf* radix_int_tree<K, T>::minimum(const node* n) const
+{
+    int byte;
+    while (!is_leaf(n))
+        n = next_child(n, 0, &byte);
+    return as_leaf(n);
+}
+
+// 子树 n 中键不小于(strict 时大于) key 的最小叶子，子树中所有键在 depth 之前的字节都和 key 相同
+template <typename K, typename T>
+typename radix_int_tree<K, T>::leaf* radix_int_tree<K, T>::bound(const node* n, K key, int depth, bool strict) const
+{
+    if (is_leaf(n)) {
+        leaf* l = as_leaf(n);
+        K k = l->m_value.first;
+        return k > key || (!strict && k == key) ? l : NULL;
+    }
+    for (int i = 0; i < n->m_prefixlen; ++i) {
+        uint8_t b = key_byte(key, depth + i);
+        uint8_t pb = key_byte(n->m_prefixkey, depth + i);
+        if (pb > b)
+            return minimum(n); // 整个子树都比 key 大
+        if (pb < b)
+            return NULL;
+    }
+    depth += n->m_prefixlen;
+
+    int from = key_byte(key, depth);
+    int byte;
+    for (node* child = next_child(n, from, &byte); child != NULL; child = byte < 255 ? next_child(n, byte + 1, &byte) : NULL) {
+        leaf* l = byte == from ? bound(child, key, depth + 1, strict) : minimum(child);
+        if (l != NULL)
+            return l;
+    }
+    return NULL;
+}
+
+template <typename K, typename T>
+typename radix_int_tree<K, T>::node* radix_int_tree<K, T>::new_node(node_type type)
+{
+    node* n;
+    switch (type) {
+    case NODE4:
+        n = new (m_node4s.allocate()) node4();
+        break;
+    case NODE16:
+        n = new (m_node16s.allocate()) node16();
+        break;
+    case NODE48:
+        n = new (m_node48s.allocate()) node48();
+        break;
+    default:
+        n = new (m_node256s.allocate()) node256();
+        break;
+    }
+    n->m_type = (uint8_t)type;
+    return n;
+}
+
+template <typename K, typename T>
+void radix_int_tree<K, T>::free_node(node* n)
+{
+    switch (n->m_type) {
+    case NODE4:
+        m_node4s.deallocate(n);
+        break;
+    case NODE16:
+        m_node16s.deallocate(n);
+        break;
+    case NODE48:
+        m_node48s.deallocate(n);
+        break;
+    default:
+        m_node256s.deallocate(n);
+        break;
+    }
+}
+
+// 给 n 添加孩子，n 满了就换成大一号的节点，*ref 指向新节点
+template <typename K, typename T>
+void radix_int_tree<K, T>::add_child(node** ref, node* n, uint8_t byte, node* child)
+{
+    switch (n->m_type) {
+    case NODE4: {
+        node4* p = static_cast<node4*>(n);
+        if (p->m_count < 4) {
+            int i = 0;
+            while (i < p->m_count && p->m_keys[i] < byte)
+                ++i;
+            memmove(p->m_keys + i + 1, p->m_keys + i, p->m_count - i);
+            memmove(p->m_children + i + 1, p->m_children + i, (p->m_count - i) * sizeof(node*));
+            p->m_keys[i] = byte;
+            p->m_children[i] = child;
+            ++p->m_count;
+            return;
+        }
+        node16* grown = static_cast<node16*>(new_node(NODE16));
+        grown->m_prefixlen = p->m_prefixlen;
+        grown->m_prefixkey = p->m_prefixkey;
+        grown->m_count = p->m_count;
+        memcpy(grown->m_keys, p->m_keys, p->m_count);
+        memcpy(grown->m_children, p->m_children, p->m_count * sizeof(node*));
+        *ref = grown;
+        free_node(p);
+        add_child(ref, grown, byte, child);
+        return;
+    }
+    case NODE16: {
+        node16* p = static_cast<node16*>(n);
+        if (p->m_count < 16) {
+            int i = 0;
+            while (i < p->m_count && p->m_keys[i] < byte)
+                ++i;
+            memmove(p->m_keys + i + 1, p->m_keys + i, p->m_count - i);
+            memmove(p->m_children + i + 1, p->m_children + i, (p->m_count - i) * sizeof(node*));
+            p->m_keys[i] = byte;
+            p->m_children[i] = child;
+            ++p->m_count;
+            return;
+        }
+        node48* grown = static_cast<node48*>(new_node(NODE48));
+        grown->m_prefixlen = p->m_prefixlen;
+        grown->m_prefixkey = p->m_prefixkey;
+        grown->m_count = p->m_count;
+        for (int i = 0; i < p->m_count; ++i) {
+            grown->m_index[p->m_keys[i]] = (uint8_t)(i + 1);
+            grown->m_children[i] = p->m_children[i];
+        }
+        *ref = grown;
+        free_node(p);
+        add_child(ref, grown, byte, child);
+        return;
+    }
+    case NODE48: {
+        node48* p = static_cast<node48*>(n);
+        if (p->m_count < 48) {
+            int i = 0;
+            while (p->m_children[i] != NULL)
+                ++i;
+            p->m_children[i] = child;
+            p->m_index[byte] = (uint8_t)(i + 1);
+            ++p->m_count;
+            return;
+        }
+        node256* grown = static_cast<node256*>(new_node(NODE256));
+        grown->m_prefixlen = p->m_prefixlen;
+        grown->m_prefixkey = p->m_prefixkey;
+        grown->m_count = p->m_count;
+        for (int b = 0; b < 256; ++b) {
+            if (p->m_index[b] != 0)
+                grown->m_children[b] = p->m_children[p->m_index[b] - 1];
+        }
+        *ref = grown;
+        free_node(p);
+        add_child(ref, grown, byte, child);
+        return;
+    }
+    default: {
+        node256* p = static_cast<node256*>(n);
+        p->m_children[byte] = child;
+        ++p->m_count;
+        return;
+    }
+    }
+}
+
+// 删除 n 中键字节为 byte 的孩子，孩子太少时换成小一号的节点；Node4 只剩一个孩子时和孩子合并
+template <typename K, typename T>
+void radix_int_tree<K, T>::remove_child(node** ref, node* n, uint8_t byte)
+{
+    switch (n->m_type) {
+    case NODE4: {
+        node4* p = static_cast<node4*>(n);
+        int i = 0;
+        while (p->m_keys[i] != byte)
+            ++i;
+        memmove(p->m_keys + i, p->m_keys + i + 1, p->m_count - i - 1);
+        memmove(p->m_children + i, p->m_children + i + 1, (p->m_count - i - 1) * sizeof(node*));
+        --p->m_count;
+        if (p->m_count == 1) {
+            node* child = p->m_children[0];
+            // 孩子的前缀 = 自己的前缀 + 孩子的键字节 + 孩子原来的前缀，这些字节都在孩子的 m_prefixkey 中
+            if (!is_leaf(child))
+                child->m_prefixlen = (uint8_t)(p->m_prefixlen + 1 + child->m_prefixlen);
+            *ref = child;
+            free_node(p);
+        }
+        return;
+    }
+    case NODE16: {
+        node16* p = static_cast<node16*>(n);
+        int i = 0;
+        while (p->m_keys[i] != byte)
+            ++i;
+        memmove(p->m_keys + i, p->m_keys + i + 1, p->m_count - i - 1);
+        memmove(p->m_children + i, p->m_children + i + 1, (p->m_count - i - 1) * sizeof(node*));
+        --p->m_count;
+        if (p->m_count == 3) {
+            node4* shrunk = static_cast<node4*>(new_node(NODE4));
+            shrunk->m_prefixlen = p->m_prefixlen;
+            shrunk->m_prefixkey = p->m_prefixkey;
+            shrunk->m_count = p->m_count;
+            memcpy(shrunk->m_keys, p->m_keys, p->m_count);
+            memcpy(shrunk->m_children, p->m_children, p->m_count * sizeof(node*));
+            *ref = shrunk;
+            free_node(p);
+        }
+        return;
+    }
+    case NODE48: {
+        node48* p = static_cast<node48*>(n);
+        p->m_children[p->m_index[byte] - 1] = NULL;
+        p->m_index[byte] = 0;
+        --p->m_count;
+        if (p->m_count == 12) {
+            node16* shrunk = static_cast<node16*>(new_node(NODE16));
+            shrunk->m_prefixlen = p->m_prefixlen;
+            shrunk->m_prefixkey = p->m_prefixkey;
+            for (int b = 0; b < 256; ++b) {
+                if (p->m_index[b] != 0) {
+                    shrunk->m_keys[shrunk->m_count] = (uint8_t)b;
+                    shrunk->m_children[shrunk->m_count++] = p->m_children[p->m_index[b] - 1];
+                }
+            }
+            *ref = shrunk;
+            free_node(p);
+        }
+        return;
+    }
+    default: {
+        node256* p = static_cast<node256*>(n);
+        p->m_children[byte] = NULL;
+        --p->m_count;
+        if (p->m_count == 37) {
+            node48* shrunk = static_cast<node48*>(new_node(NODE48));
+            shrunk->m_prefixlen = p->m_prefixlen;
+            shrunk->m_prefixkey = p->m_prefixkey;
+            for (int b = 0; b < 256; ++b) {
+                if (p->m_children[b] != NULL) {
+                    shrunk->m_children[shrunk->m_count] = p->m_children[b];
+                    shrunk->m_index[b] = (uint8_t)(++shrunk->m_count);
+                }
+            }
+            *ref = shrunk;
+            free_node(p);
+        }
+        return;
+    }
+    }
+}
+
+template <typename K, typename T>
+std::pair<typename radix_int_tree<K, T>::iterator, bool> radix_int_tree<K, T>::insert(const value_type& val)
+{
+    const K key = val.first;
+    node** ref = &m_root;
+    int depth = 0;
+    while (true) {
+        node* n = *ref;
+        if (n == NULL) {
+            leaf* l = new (m_leaves.allocate()) leaf{ val };
+            *ref = leaf_ref(l);
+            ++m_size;
+            return std::make_pair(iterator(this, l), true);
+        }
+
+        if (is_leaf(n)) {
+            leaf* old = as_leaf(n);
+            K other = old->m_value.first;
+            if (other == key)
+                return std::make_pair(iterator(this, old), false);
+            // 两个键在 depth 之后第一个不同的字节处分叉，相同的部分作为新节点的前缀
+            int p = 0;
+            while (key_byte(key, depth + p) == key_byte(other, depth + p))
+                ++p;
+            leaf* l = new (m_leaves.allocate()) leaf{ val };
+            node4* split = static_cast<node4*>(new_node(NODE4));
+            split->m_prefixlen = (uint8_t)p;
+            split->m_prefixkey = key;
+            add_child(NULL, split, key_byte(other, depth + p), n);
+            add_child(NULL, split, key_byte(key, depth + p), leaf_ref(l));
+            *ref = split;
+            ++m_size;
+            return std::make_pair(iterator(this, l), true);
+        }
+
+        if (n->m_prefixlen != 0) {
+            int p = prefix_match(n, key, depth);
+            if (p < n->m_prefixlen) {
+                // 在前缀中间分叉：新节点取前面相同的部分，n 保留分叉之后的部分
+                leaf* l = new (m_leaves.allocate()) leaf{ val };
+                node4* split = static_cast<node4*>(new_node(NODE4));
+                split->m_prefixlen = (uint8_t)p;
+                split->m_prefixkey = key;
+                uint8_t nbyte = key_byte(n->m_prefixkey, depth + p);
+                n->m_prefixlen = (uint8_t)(n->m_prefixlen - p - 1);
+                add_child(NULL, split, nbyte, n);
+                add_child(NULL, split, key_byte(key, depth + p), leaf_ref(l));
+                *ref = split;
+                ++m_size;
+                return std::make_pair(iterator(this, l), true);
+            }
+            depth += n->m_prefixlen;
+        }
+
+        uint8_t byte = key_byte(key, depth);
+        node* const* child = find_child(n, byte);
+        if (child == NULL) {
+            leaf* l = new (m_leaves.allocate()) leaf{ val };
+            add_child(ref, n, byte, leaf_ref(l));
+            ++m_size;
+            return std::make_pair(iterator(this, l), true);
+        }
+        ref = const_cast<node**>(child);
+        ++depth;
+    }
+}
+
+template <typename K, typename T>
+bool radix_int_tree<K, T>::erase(K key)
+{
+    node** ref = &m_root;
+    node** parentref = NULL;
+    uint8_t parentbyte = 0;
+    int depth = 0;
+    while (*ref != NULL) {
+        node* n = *ref;
+        if (is_leaf(n)) {
+            leaf* l = as_leaf(n);
+            if (l->m_value.first != key)
+                return false;
+            if (parentref == NULL)
+                m_root = NULL;
+            else
+                remove_child(parentref, *parentref, parentbyte);
+            l->~leaf();
+            m_leaves.deallocate(l);
+            --m_size;
+            return true;
+        }
+        if (n->m_prefixlen != 0) {
+            if (prefix_match(n, key, depth) != n->m_prefixlen)
+                return false;
+            depth += n->m_prefixlen;
+        }
+        uint8_t byte = key_byte(key, depth);
+        node* const* child = find_child(n, byte);
+        if (child == NULL)
+            return false;
+        parentref = ref;
+        parentbyte = byte;
+        ref = const_cast<node**>(child);
+        ++depth;
+    }
+    return false;
+}
+
+template <typename K, typename T>
+void radix_int_tree<K, T>::destroy_values(node* n)
+{
+    if (is_leaf(n)) {
+        as_leaf(n)->~leaf();
+        return;
+    }
+    int byte;
+    for (node* child = next_child(n, 0, &byte); child != NULL; child = byte < 255 ? next_child(n, byte + 1, &byte) : NULL)
+        destroy_values(child);
+}
+
+// 各种宽度的无符号整数键都使用 radix_int_tree，Compare 不起作用，总是按数值从小到大
+template <typename T, typename Compare>
+class radix_tree<unsigned int, T, Compare> : public radix_int_tree<unsigned int, T> { };
+
+template <typename T, typename Compare>
+class radix_tree<unsigned long, T, Compare> : public radix_int_tree<unsigned long, T> { };
+
+template <typename T, typename Compare>
+class radix_tree<unsigned long long, T, Compare> : public radix_int_tree<unsigned long long, T> { };
+
 /*
 
 (root)